@@ -1,15 +1,37 @@
 #include "raylib.h"
 #include "raymath.h"
+#include "rlgl.h"
 #include <algorithm>
+#include <atomic>
+#include <charconv>
 #include <cctype>
+#include <cerrno>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
 #include <fstream>
 #include <filesystem>
+#include <fcntl.h>
 #include <iomanip>
 #include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <set>
 #include <sstream>
 #include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
@@ -33,6 +55,8 @@ enum Mode {
   GROUP_MODE,
   TRIANGLE_MODE,
   DOTTEDTRIANGLE_MODE,
+  POINTS_MODE,
+  INSTANCE_MODE,
 };
 
 enum BackgroundType { BG_BLANK, BG_GRID, BG_DOTTED, BG_GRAPH };
@@ -60,6 +84,11 @@ struct AppConfig {
   string defaultExportDir;
   string defaultOpenDir;
   float exportRasterScale = 2.0f;
+  int exportTileSize = 4096;
+  int exportPngLevel = 6;
+  bool exportSvgCompact = false;
+  int exportSvgPrecision = 2;
+  bool exportSkipUnchanged = true;
   bool defaultDarkTheme = false;
   bool defaultShowTags = false;
   float defaultStrokeWidth = 2.0f;
@@ -83,6 +112,20 @@ struct AppConfig {
   float defaultHitTolerance = 2.0f;
   float statusDurationSeconds = 2.0f;
   float pasteOffsetStep = 20.0f;
+  int undoMaxEntries = 200;
+  long long undoMaxBytes = 256LL * 1024 * 1024;
+  int undoLiveEntries = 8;
+  bool journalEnabled = true;
+  float journalFlushSeconds = 1.0f;
+  float autosaveSeconds = 60.0f;
+  bool historyEnabled = true;
+  int timelapseFps = 12;
+  int timelapseMaxFrames = 600;
+  int streamCapacity = 262144;
+  float chunkTileSize = 2048.0f;
+  float worldRebaseDistance = 65536.0f;
+  int layerSupersample = 1;
+  long long chunkMaxBytes = 512LL * 1024 * 1024;
   BackgroundType defaultBgType = BG_BLANK;
   Color defaultDrawColor = BLACK;
   float triangleHeightRatio = 0.8660254f;
@@ -135,6 +178,10 @@ struct Element {
   vector<Element> children;
   string text;
   float textSize = 24.0f;
+  int layer = 0;
+  // Floating-origin frame of a stored copy; unset on live elements.
+  double frameX = 0.0;
+  double frameY = 0.0;
 
   Rectangle GetLocalBounds() const {
     float minX, minY, maxX, maxY;
@@ -151,7 +198,7 @@ struct Element {
         maxX = max(maxX, cb.x + cb.width);
         maxY = max(maxY, cb.y + cb.height);
       }
-    } else if (type == PEN_MODE && !path.empty()) {
+    } else if ((type == PEN_MODE || type == POINTS_MODE) && !path.empty()) {
       minX = maxX = path[0].x;
       minY = maxY = path[0].y;
       for (auto &p : path) {
@@ -211,6 +258,424 @@ struct Element {
   }
 };
 
+struct SymbolDef {
+  string name;
+  Rectangle frame = {0, 0, 1, 1};
+  vector<Element> elements;
+  unsigned int version = 0;
+};
+
+// Changed elements are in both lists, removed ones only in `before`.
+struct SceneDelta {
+  bool full = false;
+  vector<Element> before;
+  vector<Element> after;
+  vector<int> beforeOrder;
+  vector<int> afterOrder;
+};
+
+struct UndoEntry {
+  SceneDelta delta;
+  vector<unsigned char> packed;
+  long long spillOffset = -1;
+  int rawSize = 0;
+  int packedSize = 0;
+  size_t bytes = 0;
+};
+
+struct UndoStore {
+  int maxEntries = 200;
+  long long maxBytes = 256LL * 1024 * 1024;
+  int liveEntries = 8;
+  long long memoryBytes = 0;
+  long long diskBytes = 0;
+  string spillPath;
+  fstream spill;
+  long long spillSize = 0;
+  int spilledEntries = 0;
+  map<long long, long long> spillFree; // offset -> length of released ranges
+};
+
+struct UndoSymbols {
+  vector<SymbolDef> defs;
+  Element edit;
+};
+
+struct UndoNode {
+  int parent = -1;
+  vector<int> children;
+  int redoChild = -1;
+  double time = 0.0;
+  UndoEntry entry;
+  shared_ptr<const UndoSymbols> symbols;
+};
+
+// Each node stores the delta from its parent; `head` holds stored copies.
+struct UndoTree {
+  map<int, UndoNode> nodes;
+  int root = -1;
+  int current = -1;
+  int nextId = 0;
+  int pendingDrop = -1;
+  bool pendingEdit = false;
+  vector<shared_ptr<const Element>> head;
+  shared_ptr<const UndoSymbols> symbols;
+  map<string, int> checkpoints;
+};
+
+struct JournalJob {
+  enum Kind { APPEND, RESET, REMOVE } kind = APPEND;
+  string path;
+  string data;
+};
+
+struct Journal {
+  bool enabled = true;
+  float flushSeconds = 1.0f;
+  string path;
+  string pending;
+  // Batches since an autosave captured its scene, journaled again on rebase.
+  bool capturing = false;
+  string carry;
+  double lastFlush = 0.0;
+  int recovered = 0;
+  thread writer;
+  mutex lock;
+  condition_variable wake;
+  deque<JournalJob> jobs;
+  bool stop = false;
+  string error; // set by the writer, cleared by TickJournal
+};
+
+// Absolute world coordinates, untouched by origin moves.
+struct Artboard {
+  string name;
+  double x = 0.0;
+  double y = 0.0;
+  float width = 0.0f;
+  float height = 0.0f;
+};
+
+struct HistoryRecorder {
+  bool enabled = true;
+  string path;
+  bool unsaved = false;
+  FILE *file = nullptr;
+};
+
+struct GraphFunction {
+  string expr;
+  Color color = BLACK;
+  float strokeWidth = 2.0f;
+};
+
+struct Layer {
+  string name;
+  bool visible = true;
+  bool locked = false;
+  float opacity = 1.0f;
+};
+
+struct SceneSettings {
+  float textSize = 24.0f;
+  float strokeWidth = 2.0f;
+  Color drawColor = BLACK;
+  BackgroundType bgType = BG_BLANK;
+  float gridWidth = 24.0f;
+  double originX = 0.0;
+  double originY = 0.0;
+  vector<Artboard> artboards;
+  vector<GraphFunction> functions;
+  vector<SymbolDef> symbols;
+  vector<Layer> layers;
+};
+
+struct Autosave {
+  float intervalSeconds = 60.0f;
+  double lastCheck = 0.0;
+  int savedNode = -1;
+  SceneSettings settings;
+  thread worker;
+  atomic<bool> done{false};
+  bool ok = false;
+  string path;
+  vector<shared_ptr<const Element>> written;
+  double durationMs = 0.0;
+  time_t lastSaved = 0;
+  double lastDurationMs = 0.0;
+};
+
+struct SceneDocument {
+  SceneSettings settings;
+  vector<Element> elements;
+  vector<shared_ptr<const Element>> shared;
+  int nextId = 0;
+  bool ready = false;
+  string source;
+  int recovered = 0;
+};
+
+struct SceneOp {
+  enum Kind { CLEAR, ORIGIN, PUT, DEL, ORDER } kind = CLEAR;
+  Element el;
+  int id = 0;
+  double x = 0.0;
+  double y = 0.0;
+  vector<int> order;
+};
+
+// Deleted elements leave a gap, so PUT and DEL cost the same at any size.
+struct SceneReplay {
+  vector<Element> elements;
+  vector<char> live;
+  unordered_map<int, size_t> index;
+  size_t gaps = 0;
+};
+
+struct PendingOpen {
+  thread worker;
+  string path;
+  SceneDocument doc;
+  bool ok = false;
+  atomic<bool> done{false};
+  atomic<bool> cancel{false};
+  atomic<float> progress{0.0f};
+};
+
+struct ChunkTile {
+  Rectangle bounds = {0, 0, 0, 0};
+  int count = 0;
+  bool resident = false;
+  bool loading = false;
+  bool onDisk = false;
+  size_t bytes = 0;
+  long long lastUsed = 0;
+};
+
+struct ChunkJob {
+  enum Kind { READ, WRITE } kind = READ;
+  pair<int, int> key;
+  string path;
+  vector<pair<double, Element>> elements;
+  bool ok = false;
+};
+
+// The undo head wins over tile files: copies it replaced are in `stale`.
+struct ChunkStore {
+  bool active = false;
+  string dir;
+  float tileSize = 2048.0f;
+  long long maxBytes = 512LL * 1024 * 1024;
+  int nextId = 0;
+  map<pair<int, int>, ChunkTile> tiles;
+  unordered_map<int, pair<int, int>> owner;
+  unordered_map<int, double> rank;
+  unordered_set<int> stale;
+  set<pair<int, int>> wanted;
+  double topRank = -1.0;
+  bool rescan = false;
+  long long residentBytes = 0;
+  long long tick = 0;
+  double lastPage = 0.0;
+  thread worker;
+  mutex lock;
+  condition_variable wake;
+  deque<ChunkJob> jobs;
+  deque<ChunkJob> done;
+  bool stop = false;
+};
+
+const int kExportBandRows = 256;
+
+struct ExportBands {
+  mutex lock;
+  condition_variable ready;
+  deque<vector<unsigned char>> strips;
+  bool finished = false;
+  bool failed = false;
+};
+
+struct ExportJob {
+  string path;
+  bool svg = false;
+  Image image = {};
+  shared_ptr<ExportBands> bands;
+  vector<Element> elements;
+  vector<SymbolDef> symbols;
+  Camera2D camera = {};
+  int width = 0;
+  int height = 0;
+  Color background = WHITE;
+  string fontFamily;
+  float textSize = 24.0f;
+  int pngLevel = 6;
+  bool svgCompact = false;
+  int svgPrecision = 2;
+  string stamp;
+  bool frames = false;
+  bool sequence = false;
+  int fps = 12;
+  int frameCount = 0;
+};
+
+struct ExportResult {
+  string path;
+  bool ok = false;
+  double durationMs = 0.0;
+};
+
+struct ExportQueue {
+  thread worker;
+  mutex lock;
+  condition_variable wake;
+  deque<ExportJob> jobs;
+  vector<ExportResult> finished;
+  string active;
+  bool stop = false;
+};
+
+struct TiledExport {
+  shared_ptr<ExportBands> bands;
+  vector<Element> elements;
+  vector<Rectangle> pixelBounds;
+  Camera2D camera = {};
+  int width = 0;
+  int height = 0;
+  int nextRow = 0;
+  RenderTexture2D target = {};
+};
+
+struct TimelapseExport {
+  shared_ptr<ExportBands> bands;
+  ifstream history;
+  long long end = 0;
+  SceneReplay scene;
+  SceneSettings settings;
+  double left = 0.0;
+  double top = 0.0;
+  float scale = 1.0f;
+  int width = 0;
+  int height = 0;
+  int step = 1;
+  int frame = 0;
+  int frames = 0;
+};
+
+struct ArtboardExport {
+  vector<Element> elements;
+  vector<Rectangle> bounds;
+  vector<Artboard> boards;
+  vector<string> paths;
+  double originX = 0.0;
+  double originY = 0.0;
+  string type;
+  string dir;
+  bool force = false;
+  size_t next = 0;
+  unordered_set<string> queued;
+  int written = 0;
+  int skipped = 0;
+  int failed = 0;
+  double started = 0.0;
+};
+
+struct PlotPoint {
+  double x;
+  double y;
+};
+
+struct LiveStream {
+  bool active = false;
+  string source;
+  int fd = -1;
+  bool tail = false;
+  bool isSocket = false;
+  long long offset = 0;
+  vector<char> block;
+  string line;
+  vector<pair<size_t, size_t>> fields;
+  vector<PlotPoint> ring;
+  size_t head = 0;
+  size_t count = 0;
+  long long total = 0;
+  long long unordered = -1;
+  bool follow = true;
+  double followX = 0.0;
+  double followY = 0.0;
+  Color color = BLACK;
+  float strokeWidth = 2.0f;
+  double rateStart = 0.0;
+  long long rateSamples = 0;
+  float rate = 0.0f;
+  vector<PlotPoint> columns;
+  vector<Vector2> scratch;
+};
+
+enum FnOpCode { FN_CONST, FN_X, FN_ADD, FN_SUB, FN_MUL, FN_DIV, FN_POW,
+                FN_NEG, FN_CALL };
+
+struct FnOp {
+  FnOpCode code;
+  double value = 0.0;
+  double (*call)(double) = nullptr;
+};
+
+const int kFnMaxStack = 64;
+
+struct FnProgram {
+  vector<FnOp> ops;
+};
+
+struct FunctionPlot {
+  string expr;
+  bool valid = false;
+  FnProgram program;
+  double scale = 0.0;
+  double step = 0.0;
+  long long first = 0;
+  long long last = 0;
+  deque<PlotPoint> samples;
+  vector<PlotPoint> strip;
+};
+
+struct CloudPoint {
+  Vector2 p;
+  int index;
+};
+
+// `tree` is an implicit k-d tree: each range keeps its median in the middle.
+struct PointCloudCache {
+  size_t count = 0;
+  Vector2 first = {0, 0};
+  Vector2 middle = {0, 0};
+  Vector2 last = {0, 0};
+  float rotation = 0.0f;
+  vector<CloudPoint> tree;
+  float binSize = 0.0f;
+  int binX = 0;
+  int binY = 0;
+  int binW = 0;
+  int binH = 0;
+  vector<unsigned int> bins;
+  vector<unsigned int> spare;
+  vector<unsigned char> pixels;
+  bool dirty = false;
+  Texture2D texture = {};
+  vector<size_t> visible;
+};
+
+struct LayerCache {
+  unsigned long long key = 0;
+  RenderTexture2D target = {};
+  bool direct = true;
+};
+
+struct SymbolImpostor {
+  unsigned int version = 0;
+  RenderTexture2D target = {};
+  Rectangle area = {0, 0, 0, 0};
+};
+
 struct Canvas {
   Mode mode = SELECTION_MODE;
   float strokeWidth = 2.0f;
@@ -221,9 +686,19 @@ struct Canvas {
   const char *modeText = "SELECTION";
   Color modeColor = MAROON;
   vector<Element> elements;
-  vector<vector<Element>> undoStack;
+  UndoTree undoTree;
   vector<Element> clipboard;
-  vector<vector<Element>> redoStack;
+  UndoStore undoStore;
+  Journal journal;
+  HistoryRecorder recorder;
+  Autosave autosave;
+  PendingOpen pendingOpen;
+  ChunkStore chunks;
+  ExportQueue exports;
+  deque<TiledExport> tiledExports;
+  deque<TimelapseExport> timelapses;
+  deque<ArtboardExport> artboardExports;
+  LiveStream stream;
   vector<Vector2> currentPath;
   bool showTags = false;
   vector<int> selectedIndices;
@@ -248,6 +723,21 @@ struct Canvas {
   Vector2 lastClickPos = {0};
   int pasteOffsetIndex = 0;
   Camera2D camera = {};
+  // Element and camera coordinates are relative to this absolute position.
+  double originX = 0.0;
+  double originY = 0.0;
+  vector<Artboard> artboards;
+  vector<GraphFunction> functions;
+  vector<FunctionPlot> functionPlots;
+  unordered_map<int, PointCloudCache> pointClouds;
+  vector<SymbolDef> symbols;
+  unsigned int nextSymbolVersion = 1;
+  unordered_map<string, SymbolImpostor> impostors;
+  Element symbolEdit;
+  vector<Layer> layers;
+  int activeLayer = 0;
+  vector<LayerCache> layerCaches;
+  Camera2D layerCamera = {};
   bool commandMode = false;
   string commandBuffer;
   string statusMessage;
@@ -294,1271 +784,2461 @@ struct Canvas {
 };
 
 void RestoreZOrder(Canvas &canvas);
+void MoveElement(Element &el, Vector2 delta);
+void PublishSceneDelta(Canvas &canvas, const SceneDelta &delta, bool forward);
 bool ParseHexColor(string hex, Color &outColor);
 string ColorToHex(Color c);
 
-void SaveBackup(Canvas &canvas) {
-  canvas.undoStack.push_back(canvas.elements);
-  canvas.redoStack.clear();
+size_t EstimateElementBytes(const Element &el) {
+  size_t bytes = sizeof(Element) + el.text.capacity() +
+                 el.path.capacity() * sizeof(Vector2);
+  for (const auto &child : el.children)
+    bytes += EstimateElementBytes(child);
+  return bytes;
 }
 
-void EnsureUniqueIDRecursive(Element &el, Canvas &canvas) {
-  if (el.uniqueID < 0) {
-    el.uniqueID = canvas.nextElementId++;
-  }
-  if (el.type == GROUP_MODE) {
-    for (auto &c : el.children) {
-      if (c.uniqueID < 0) {
-        EnsureUniqueIDRecursive(c, canvas);
-      }
-    }
-  }
+size_t EstimateSceneBytes(const vector<Element> &elements) {
+  size_t bytes = elements.capacity() * sizeof(Element);
+  for (const auto &el : elements)
+    bytes += EstimateElementBytes(el) - sizeof(Element);
+  return bytes;
 }
 
-int FindElementIndexByID(const Canvas &canvas, int id) {
-  for (int i = 0; i < (int)canvas.elements.size(); ++i) {
-    if (canvas.elements[i].uniqueID == id)
-      return i;
-  }
-  return -1;
+template <typename T> void AppendPod(vector<unsigned char> &out, const T &v) {
+  const unsigned char *p = (const unsigned char *)&v;
+  out.insert(out.end(), p, p + sizeof(T));
 }
 
-void NormalizeElementIDs(Element &el, unordered_set<int> &used, int &nextId) {
-  if (el.uniqueID < 0 || used.count(el.uniqueID) > 0) {
-    while (used.count(nextId) > 0)
-      nextId++;
-    el.uniqueID = nextId++;
-  } else {
-    used.insert(el.uniqueID);
-    if (el.uniqueID >= nextId)
-      nextId = el.uniqueID + 1;
-  }
-
-  used.insert(el.uniqueID);
-  for (auto &child : el.children)
-    NormalizeElementIDs(child, used, nextId);
+template <typename T>
+bool ReadPod(const unsigned char *&p, const unsigned char *end, T &v) {
+  if ((size_t)(end - p) < sizeof(T))
+    return false;
+  memcpy(&v, p, sizeof(T));
+  p += sizeof(T);
+  return true;
 }
 
-void NormalizeCanvasIDs(Canvas &canvas) {
-  unordered_set<int> used;
-  int nextId = 0;
-  for (auto &el : canvas.elements)
-    NormalizeElementIDs(el, used, nextId);
-  canvas.nextElementId = nextId;
+void WriteElementBinary(vector<unsigned char> &out, const Element &el) {
+  AppendPod(out, (int)el.type);
+  AppendPod(out, el.uniqueID);
+  AppendPod(out, el.originalIndex);
+  AppendPod(out, el.strokeWidth);
+  AppendPod(out, el.color);
+  AppendPod(out, el.start);
+  AppendPod(out, el.end);
+  AppendPod(out, el.rotation);
+  AppendPod(out, el.textSize);
+  AppendPod(out, el.layer);
+  AppendPod(out, el.frameX);
+  AppendPod(out, el.frameY);
+  AppendPod(out, (unsigned int)el.text.size());
+  out.insert(out.end(), el.text.begin(), el.text.end());
+  AppendPod(out, (unsigned int)el.path.size());
+  const unsigned char *pathBytes = (const unsigned char *)el.path.data();
+  out.insert(out.end(), pathBytes, pathBytes + el.path.size() * sizeof(Vector2));
+  AppendPod(out, (unsigned int)el.children.size());
+  for (const auto &child : el.children)
+    WriteElementBinary(out, child);
 }
 
-Vector2 RotatePoint(Vector2 p, Vector2 center, float radians) {
-  float s = sinf(radians);
-  float c = cosf(radians);
-  Vector2 v = {p.x - center.x, p.y - center.y};
-  return {center.x + v.x * c - v.y * s, center.y + v.x * s + v.y * c};
+bool ReadElementBinary(const unsigned char *&p, const unsigned char *end,
+                       Element &el) {
+  int type = 0;
+  unsigned int textLen = 0, pathCount = 0, childCount = 0;
+  if (!ReadPod(p, end, type) || !ReadPod(p, end, el.uniqueID) ||
+      !ReadPod(p, end, el.originalIndex) || !ReadPod(p, end, el.strokeWidth) ||
+      !ReadPod(p, end, el.color) || !ReadPod(p, end, el.start) ||
+      !ReadPod(p, end, el.end) || !ReadPod(p, end, el.rotation) ||
+      !ReadPod(p, end, el.textSize) || !ReadPod(p, end, el.layer) ||
+      !ReadPod(p, end, el.frameX) || !ReadPod(p, end, el.frameY) ||
+      !ReadPod(p, end, textLen))
+    return false;
+  el.type = (Mode)type;
+  if ((size_t)(end - p) < textLen)
+    return false;
+  el.text.assign((const char *)p, textLen);
+  p += textLen;
+  if (!ReadPod(p, end, pathCount) ||
+      (size_t)(end - p) < (size_t)pathCount * sizeof(Vector2))
+    return false;
+  el.path.resize(pathCount);
+  memcpy(el.path.data(), p, (size_t)pathCount * sizeof(Vector2));
+  p += (size_t)pathCount * sizeof(Vector2);
+  if (!ReadPod(p, end, childCount))
+    return false;
+  el.children.clear();
+  el.children.resize(childCount);
+  for (auto &child : el.children) {
+    if (!ReadElementBinary(p, end, child))
+      return false;
+  }
+  return true;
 }
 
-void GetTriangleVerticesLocal(const Element &el, Vector2 &apex, Vector2 &left,
-                              Vector2 &right) {
-  float x0 = min(el.start.x, el.end.x);
-  float x1 = max(el.start.x, el.end.x);
-  float y0 = min(el.start.y, el.end.y);
-  float y1 = max(el.start.y, el.end.y);
-  apex = {(x0 + x1) * 0.5f, y0};
-  left = {x0, y1};
-  right = {x1, y1};
+bool SamePoints(const Vector2 *a, const Vector2 *b, size_t count,
+                Vector2 shift) {
+  if (shift.x == 0.0f && shift.y == 0.0f)
+    return count == 0 || memcmp(a, b, count * sizeof(Vector2)) == 0;
+  for (size_t i = 0; i < count; i++) {
+    Vector2 moved = Vector2Add(a[i], shift);
+    if (memcmp(&moved, &b[i], sizeof(Vector2)) != 0)
+      return false;
+  }
+  return true;
 }
 
-Vector2 ConstrainTriangleEnd(const AppConfig &cfg, Vector2 start,
-                             Vector2 rawEnd) {
-  float dx = rawEnd.x - start.x;
-  float dy = rawEnd.y - start.y;
-  if (fabsf(dx) < 0.001f && fabsf(dy) < 0.001f)
-    return rawEnd;
-  float ratio = max(0.05f, cfg.triangleHeightRatio);
-  float side = max(fabsf(dx), fabsf(dy) / ratio);
-  float sx = (dx >= 0.0f) ? 1.0f : -1.0f;
-  float sy = (dy >= 0.0f) ? 1.0f : -1.0f;
-  return {start.x + sx * side, start.y + sy * side * ratio};
+bool SameElementGeometry(const Element &a, const Element &b, Vector2 shift) {
+  if (a.path.size() != b.path.size() || a.children.size() != b.children.size() ||
+      !SamePoints(&a.start, &b.start, 1, shift) ||
+      !SamePoints(&a.end, &b.end, 1, shift) ||
+      !SamePoints(a.path.data(), b.path.data(), a.path.size(), shift))
+    return false;
+  for (size_t i = 0; i < a.children.size(); i++) {
+    if (!SameElementGeometry(a.children[i], b.children[i], shift))
+      return false;
+  }
+  return true;
 }
 
-Vector2 ElementCenterLocal(const Element &el) {
-  if (el.type == LINE_MODE || el.type == DOTTEDLINE_MODE ||
-      el.type == ARROWLINE_MODE) {
-    return {(el.start.x + el.end.x) * 0.5f, (el.start.y + el.end.y) * 0.5f};
+bool ElementsEqual(const Element &a, const Element &b,
+                   Vector2 shift = {0.0f, 0.0f}) {
+  if (a.type != b.type || a.uniqueID != b.uniqueID ||
+      a.originalIndex != b.originalIndex || a.strokeWidth != b.strokeWidth ||
+      memcmp(&a.color, &b.color, sizeof(Color)) != 0 ||
+      a.rotation != b.rotation || a.textSize != b.textSize ||
+      a.layer != b.layer || a.text != b.text ||
+      a.path.size() != b.path.size() || a.children.size() != b.children.size())
+    return false;
+  if (!SamePoints(&a.start, &b.start, 1, shift) ||
+      !SamePoints(&a.end, &b.end, 1, shift) ||
+      !SamePoints(a.path.data(), b.path.data(), a.path.size(), shift))
+    return false;
+  for (size_t i = 0; i < a.children.size(); i++) {
+    if (!ElementsEqual(a.children[i], b.children[i], shift))
+      return false;
   }
-  Rectangle b = el.GetLocalBounds();
-  return {b.x + b.width * 0.5f, b.y + b.height * 0.5f};
+  return true;
 }
 
-bool LineIntersectsRect(Vector2 a, Vector2 b, Rectangle r) {
-  Vector2 r1 = {r.x, r.y};
-  Vector2 r2 = {r.x + r.width, r.y};
-  Vector2 r3 = {r.x + r.width, r.y + r.height};
-  Vector2 r4 = {r.x, r.y + r.height};
-  if (CheckCollisionPointRec(a, r) || CheckCollisionPointRec(b, r))
-    return true;
-  if (CheckCollisionLines(a, b, r1, r2, nullptr))
-    return true;
-  if (CheckCollisionLines(a, b, r2, r3, nullptr))
-    return true;
-  if (CheckCollisionLines(a, b, r3, r4, nullptr))
-    return true;
-  if (CheckCollisionLines(a, b, r4, r1, nullptr))
-    return true;
-  return false;
+Vector2 FrameShift(const Element &el, double x, double y) {
+  return {(float)(el.frameX - x), (float)(el.frameY - y)};
 }
 
-bool PointInQuad(Vector2 p, Vector2 a, Vector2 b, Vector2 c, Vector2 d) {
-  auto cross = [](Vector2 u, Vector2 v) { return u.x * v.y - u.y * v.x; };
-  Vector2 ab = {b.x - a.x, b.y - a.y};
-  Vector2 bc = {c.x - b.x, c.y - b.y};
-  Vector2 cd = {d.x - c.x, d.y - c.y};
-  Vector2 da = {a.x - d.x, a.y - d.y};
-  Vector2 ap = {p.x - a.x, p.y - a.y};
-  Vector2 bp = {p.x - b.x, p.y - b.y};
-  Vector2 cp = {p.x - c.x, p.y - c.y};
-  Vector2 dp = {p.x - d.x, p.y - d.y};
-  float c1 = cross(ab, ap);
-  float c2 = cross(bc, bp);
-  float c3 = cross(cd, cp);
-  float c4 = cross(da, dp);
-  bool hasNeg = (c1 < 0) || (c2 < 0) || (c3 < 0) || (c4 < 0);
-  bool hasPos = (c1 > 0) || (c2 > 0) || (c3 > 0) || (c4 > 0);
-  return !(hasNeg && hasPos);
+// Always derived from the stored copy, so origin moves never add rounding.
+void RehomeElement(Element &el, double x, double y) {
+  Vector2 shift = FrameShift(el, x, y);
+  if (shift.x != 0.0f || shift.y != 0.0f)
+    MoveElement(el, shift);
+  el.frameX = x;
+  el.frameY = y;
 }
 
-bool PointInTriangle(Vector2 p, Vector2 a, Vector2 b, Vector2 c) {
-  auto cross = [](Vector2 u, Vector2 v) { return u.x * v.y - u.y * v.x; };
-  Vector2 ab = {b.x - a.x, b.y - a.y};
-  Vector2 bc = {c.x - b.x, c.y - b.y};
-  Vector2 ca = {a.x - c.x, a.y - c.y};
-  Vector2 ap = {p.x - a.x, p.y - a.y};
-  Vector2 bp = {p.x - b.x, p.y - b.y};
-  Vector2 cp = {p.x - c.x, p.y - c.y};
-  float c1 = cross(ab, ap);
-  float c2 = cross(bc, bp);
-  float c3 = cross(ca, cp);
-  bool hasNeg = (c1 < 0) || (c2 < 0) || (c3 < 0);
-  bool hasPos = (c1 > 0) || (c2 > 0) || (c3 > 0);
-  return !(hasNeg && hasPos);
+void CopyElementGeometry(Element &dst, const Element &src, Vector2 shift) {
+  bool moved = shift.x != 0.0f || shift.y != 0.0f;
+  dst.start = moved ? Vector2Add(src.start, shift) : src.start;
+  dst.end = moved ? Vector2Add(src.end, shift) : src.end;
+  dst.path.resize(src.path.size());
+  for (size_t i = 0; i < src.path.size(); i++)
+    dst.path[i] = moved ? Vector2Add(src.path[i], shift) : src.path[i];
+  for (size_t i = 0; i < dst.children.size() && i < src.children.size(); i++)
+    CopyElementGeometry(dst.children[i], src.children[i], shift);
 }
 
-bool IsPointInSelectionVisual(const Element &el, Vector2 p) {
-  const float rectPad = 5.0f;
-  const float linePad = 6.0f;
-  Color selColor = {70, 140, 160, 255};
-  (void)selColor;
+Element StoredElement(const Element &el, const Element *base, double x,
+                      double y) {
+  Element stored = el;
+  stored.frameX = x;
+  stored.frameY = y;
+  if (base && (base->frameX != x || base->frameY != y) &&
+      SameElementGeometry(*base, el, FrameShift(*base, x, y))) {
+    CopyElementGeometry(stored, *base, {0.0f, 0.0f});
+    stored.frameX = base->frameX;
+    stored.frameY = base->frameY;
+  }
+  return stored;
+}
 
-  if (el.type == LINE_MODE || el.type == DOTTEDLINE_MODE ||
-      el.type == ARROWLINE_MODE) {
-    Vector2 s = el.start;
-    Vector2 e = el.end;
-    if (el.rotation != 0.0f) {
-      Vector2 center = ElementCenterLocal(el);
-      s = RotatePoint(s, center, el.rotation);
-      e = RotatePoint(e, center, el.rotation);
+int SceneItemID(const Element &el) { return el.uniqueID; }
+int SceneItemID(const shared_ptr<const Element> &el) { return el->uniqueID; }
+void AssignSceneItem(Element &dst, const Element &src) { dst = src; }
+void AssignSceneItem(shared_ptr<const Element> &dst, const Element &src) {
+  dst = make_shared<const Element>(src);
+}
+
+bool DiffScene(const vector<shared_ptr<const Element>> &base,
+               const vector<Element> &live, SceneDelta &delta, double originX,
+               double originY) {
+  delta = SceneDelta();
+  unordered_map<int, size_t> baseIndex;
+  baseIndex.reserve(base.size());
+  bool unique = true;
+  for (size_t i = 0; i < base.size() && unique; i++)
+    unique = base[i]->uniqueID >= 0 &&
+             baseIndex.emplace(base[i]->uniqueID, i).second;
+  unordered_set<int> liveIds;
+  liveIds.reserve(live.size());
+  for (size_t i = 0; i < live.size() && unique; i++)
+    unique = live[i].uniqueID >= 0 && liveIds.insert(live[i].uniqueID).second;
+
+  if (!unique) {
+    bool same = base.size() == live.size();
+    for (size_t i = 0; same && i < live.size(); i++)
+      same = ElementsEqual(*base[i], live[i],
+                           FrameShift(*base[i], originX, originY));
+    if (same)
+      return false;
+    delta.full = true;
+    for (const auto &item : base)
+      delta.before.push_back(*item);
+    for (const auto &el : live)
+      delta.after.push_back(StoredElement(el, nullptr, originX, originY));
+    return true;
+  }
+
+  vector<char> seen(base.size(), 0);
+  vector<int> baseCommon;
+  vector<int> liveCommon;
+  bool addedAtEnd = true;
+  bool sawAdded = false;
+  for (const auto &el : live) {
+    auto it = baseIndex.find(el.uniqueID);
+    if (it == baseIndex.end()) {
+      delta.after.push_back(StoredElement(el, nullptr, originX, originY));
+      sawAdded = true;
+      continue;
     }
-    float length = Vector2Distance(s, e);
-    if (length < 0.01f) {
-      Rectangle b = el.GetBounds();
-      Rectangle expanded = {b.x - rectPad, b.y - rectPad, b.width + 2 * rectPad,
-                            b.height + 2 * rectPad};
-      return CheckCollisionPointRec(p, expanded);
+    if (sawAdded)
+      addedAtEnd = false;
+    seen[it->second] = 1;
+    liveCommon.push_back(el.uniqueID);
+    const Element &stored = *base[it->second];
+    if (!ElementsEqual(stored, el, FrameShift(stored, originX, originY))) {
+      delta.before.push_back(stored);
+      delta.after.push_back(StoredElement(el, &stored, originX, originY));
     }
-    float width = length + linePad * 2.0f;
-    float height = el.strokeWidth + linePad * 2.0f;
-    Vector2 center = {(s.x + e.x) * 0.5f, (s.y + e.y) * 0.5f};
-    float rad = atan2f(e.y - s.y, e.x - s.x);
-    Vector2 hx = {cosf(rad) * (width * 0.5f), sinf(rad) * (width * 0.5f)};
-    Vector2 hy = {-sinf(rad) * (height * 0.5f), cosf(rad) * (height * 0.5f)};
-    Vector2 c1 = Vector2Subtract(Vector2Subtract(center, hx), hy);
-    Vector2 c2 = Vector2Add(Vector2Subtract(center, hx), hy);
-    Vector2 c3 = Vector2Add(Vector2Add(center, hx), hy);
-    Vector2 c4 = Vector2Subtract(Vector2Add(center, hx), hy);
-    return PointInQuad(p, c1, c2, c3, c4);
   }
-
-  if (el.type == TRIANGLE_MODE || el.type == DOTTEDTRIANGLE_MODE) {
-    Vector2 localP = p;
-    if (el.rotation != 0.0f) {
-      Vector2 center = ElementCenterLocal(el);
-      localP = RotatePoint(p, center, -el.rotation);
+  bool removedAtEnd = true;
+  bool sawRemoved = false;
+  for (size_t i = 0; i < base.size(); i++) {
+    if (!seen[i]) {
+      delta.before.push_back(*base[i]);
+      sawRemoved = true;
+      continue;
     }
-    Vector2 apex, left, right;
-    GetTriangleVerticesLocal(el, apex, left, right);
-    float t = max(0.5f, el.strokeWidth * 0.5f + rectPad);
-    if (PointInTriangle(localP, apex, left, right))
-      return true;
-    return CheckCollisionPointLine(localP, apex, left, t) ||
-           CheckCollisionPointLine(localP, left, right, t) ||
-           CheckCollisionPointLine(localP, right, apex, t);
+    if (sawRemoved)
+      removedAtEnd = false;
+    baseCommon.push_back(base[i]->uniqueID);
   }
 
-  Rectangle b = el.GetLocalBounds();
-  Rectangle expanded = {b.x - rectPad, b.y - rectPad, b.width + 2 * rectPad,
-                        b.height + 2 * rectPad};
-  if (el.rotation == 0.0f ||
-      el.type == CIRCLE_MODE || el.type == DOTTEDCIRCLE_MODE ||
-      el.type == GROUP_MODE) {
-    return CheckCollisionPointRec(p, expanded);
+  bool orderKept = baseCommon == liveCommon;
+  if (!orderKept || !addedAtEnd) {
+    for (const auto &el : live)
+      delta.afterOrder.push_back(el.uniqueID);
   }
-
-  Vector2 center = ElementCenterLocal(el);
-  Vector2 tl = RotatePoint({expanded.x, expanded.y}, center, el.rotation);
-  Vector2 tr =
-      RotatePoint({expanded.x + expanded.width, expanded.y}, center, el.rotation);
-  Vector2 br = RotatePoint({expanded.x + expanded.width,
-                            expanded.y + expanded.height},
-                           center, el.rotation);
-  Vector2 bl =
-      RotatePoint({expanded.x, expanded.y + expanded.height}, center,
-                  el.rotation);
-  return PointInQuad(p, tl, tr, br, bl);
+  if (!orderKept || !removedAtEnd) {
+    for (const auto &item : base)
+      delta.beforeOrder.push_back(item->uniqueID);
+  }
+  return !delta.before.empty() || !delta.after.empty() ||
+         !delta.afterOrder.empty();
 }
 
-bool ElementIntersectsRect(const Element &el, Rectangle r, float tol) {
-  Rectangle expanded = {r.x - tol, r.y - tol, r.width + 2 * tol,
-                        r.height + 2 * tol};
-  if (el.type == GROUP_MODE) {
-    for (const auto &child : el.children) {
-      if (ElementIntersectsRect(child, r, tol))
-        return true;
-    }
-    return false;
+template <typename T>
+void ApplySceneDelta(vector<T> &scene, const vector<Element> &from,
+                     const vector<Element> &to, const vector<int> &toOrder,
+                     bool full) {
+  if (full) {
+    scene.clear();
+    scene.resize(to.size());
+    for (size_t i = 0; i < to.size(); i++)
+      AssignSceneItem(scene[i], to[i]);
+    return;
+  }
+  unordered_set<int> toIds;
+  toIds.reserve(to.size());
+  for (const auto &el : to)
+    toIds.insert(el.uniqueID);
+  unordered_set<int> removed;
+  for (const auto &el : from) {
+    if (toIds.count(el.uniqueID) == 0)
+      removed.insert(el.uniqueID);
   }
+  if (!removed.empty()) {
+    scene.erase(remove_if(scene.begin(), scene.end(),
+                          [&](const T &item) {
+                            return removed.count(SceneItemID(item)) > 0;
+                          }),
+                scene.end());
+  }
+  if (to.empty() && toOrder.empty())
+    return;
 
-  if (el.type == LINE_MODE || el.type == DOTTEDLINE_MODE ||
-      el.type == ARROWLINE_MODE) {
-    Vector2 s = el.start;
-    Vector2 e = el.end;
-    if (el.rotation != 0.0f) {
-      Vector2 center = ElementCenterLocal(el);
-      s = RotatePoint(s, center, el.rotation);
-      e = RotatePoint(e, center, el.rotation);
+  unordered_map<int, size_t> index;
+  index.reserve(scene.size() + to.size());
+  for (size_t i = 0; i < scene.size(); i++)
+    index[SceneItemID(scene[i])] = i;
+  for (const auto &el : to) {
+    auto it = index.find(el.uniqueID);
+    if (it != index.end()) {
+      AssignSceneItem(scene[it->second], el);
+    } else {
+      index[el.uniqueID] = scene.size();
+      scene.emplace_back();
+      AssignSceneItem(scene.back(), el);
     }
-    return LineIntersectsRect(s, e, expanded);
   }
+  if (!toOrder.empty()) {
+    vector<T> ordered;
+    ordered.reserve(scene.size());
+    for (int id : toOrder) {
+      auto it = index.find(id);
+      if (it != index.end())
+        ordered.push_back(std::move(scene[it->second]));
+    }
+    scene.swap(ordered);
+  }
+}
 
-  if (el.type == CIRCLE_MODE || el.type == DOTTEDCIRCLE_MODE) {
-    float rads = Vector2Distance(el.start, el.end) + el.strokeWidth * 0.5f + tol;
-    float cx = Clamp(el.start.x, expanded.x, expanded.x + expanded.width);
-    float cy = Clamp(el.start.y, expanded.y, expanded.y + expanded.height);
-    float dx = el.start.x - cx;
-    float dy = el.start.y - cy;
-    return (dx * dx + dy * dy) <= (rads * rads);
+template <typename T>
+void ApplySceneDelta(vector<T> &scene, const SceneDelta &delta, bool forward) {
+  if (forward)
+    ApplySceneDelta(scene, delta.before, delta.after, delta.afterOrder,
+                    delta.full);
+  else
+    ApplySceneDelta(scene, delta.after, delta.before, delta.beforeOrder,
+                    delta.full);
+}
+
+size_t EstimateDeltaBytes(const SceneDelta &delta) {
+  return EstimateSceneBytes(delta.before) + EstimateSceneBytes(delta.after) +
+         (delta.beforeOrder.capacity() + delta.afterOrder.capacity()) *
+             sizeof(int);
+}
+
+bool IsDeltaEmpty(const SceneDelta &delta) {
+  return !delta.full && delta.before.empty() && delta.after.empty() &&
+         delta.beforeOrder.empty() && delta.afterOrder.empty();
+}
+
+void WriteSceneDeltaBinary(vector<unsigned char> &out, const SceneDelta &delta) {
+  AppendPod(out, (unsigned char)(delta.full ? 1 : 0));
+  for (const vector<Element> *list : {&delta.before, &delta.after}) {
+    AppendPod(out, (unsigned int)list->size());
+    for (const auto &el : *list)
+      WriteElementBinary(out, el);
   }
+  for (const vector<int> *order : {&delta.beforeOrder, &delta.afterOrder}) {
+    AppendPod(out, (unsigned int)order->size());
+    const unsigned char *bytes = (const unsigned char *)order->data();
+    out.insert(out.end(), bytes, bytes + order->size() * sizeof(int));
+  }
+}
 
-  if (el.type == PEN_MODE) {
-    Vector2 center = ElementCenterLocal(el);
-    if (el.path.empty())
+bool ReadSceneDeltaBinary(const unsigned char *&p, const unsigned char *end,
+                          SceneDelta &delta) {
+  unsigned char full = 0;
+  if (!ReadPod(p, end, full))
+    return false;
+  delta.full = full != 0;
+  for (vector<Element> *list : {&delta.before, &delta.after}) {
+    unsigned int count = 0;
+    if (!ReadPod(p, end, count))
       return false;
-    Vector2 prev = el.path[0];
-    if (el.rotation != 0.0f)
-      prev = RotatePoint(prev, center, el.rotation);
-    if (CheckCollisionPointRec(prev, expanded))
-      return true;
-    for (size_t i = 1; i < el.path.size(); ++i) {
-      Vector2 cur = el.path[i];
-      if (el.rotation != 0.0f)
-        cur = RotatePoint(cur, center, el.rotation);
-      if (LineIntersectsRect(prev, cur, expanded))
-        return true;
-      prev = cur;
+    list->clear();
+    list->resize(count);
+    for (auto &el : *list) {
+      if (!ReadElementBinary(p, end, el))
+        return false;
     }
-    return false;
   }
+  for (vector<int> *order : {&delta.beforeOrder, &delta.afterOrder}) {
+    unsigned int count = 0;
+    if (!ReadPod(p, end, count) ||
+        (size_t)(end - p) < (size_t)count * sizeof(int))
+      return false;
+    order->resize(count);
+    memcpy(order->data(), p, (size_t)count * sizeof(int));
+    p += (size_t)count * sizeof(int);
+  }
+  return true;
+}
 
-  if (el.type == TRIANGLE_MODE || el.type == DOTTEDTRIANGLE_MODE) {
-    Vector2 apex, left, right;
-    GetTriangleVerticesLocal(el, apex, left, right);
-    if (el.rotation != 0.0f) {
-      Vector2 center = ElementCenterLocal(el);
-      apex = RotatePoint(apex, center, el.rotation);
-      left = RotatePoint(left, center, el.rotation);
-      right = RotatePoint(right, center, el.rotation);
-    }
-    if (CheckCollisionPointRec(apex, expanded) ||
-        CheckCollisionPointRec(left, expanded) ||
-        CheckCollisionPointRec(right, expanded))
-      return true;
-    Vector2 r1 = {expanded.x, expanded.y};
-    Vector2 r2 = {expanded.x + expanded.width, expanded.y};
-    Vector2 r3 = {expanded.x + expanded.width, expanded.y + expanded.height};
-    Vector2 r4 = {expanded.x, expanded.y + expanded.height};
-    if (PointInTriangle(r1, apex, left, right) ||
-        PointInTriangle(r2, apex, left, right) ||
-        PointInTriangle(r3, apex, left, right) ||
-        PointInTriangle(r4, apex, left, right))
-      return true;
-    if (LineIntersectsRect(apex, left, expanded) ||
-        LineIntersectsRect(left, right, expanded) ||
-        LineIntersectsRect(right, apex, expanded))
-      return true;
+bool CompressUndoEntry(UndoEntry &entry) {
+  vector<unsigned char> raw;
+  WriteSceneDeltaBinary(raw, entry.delta);
+  int compSize = 0;
+  unsigned char *comp = CompressData(raw.data(), (int)raw.size(), &compSize);
+  if (!comp)
     return false;
+  entry.packed.assign(comp, comp + compSize);
+  MemFree(comp);
+  entry.rawSize = (int)raw.size();
+  entry.packedSize = compSize;
+  entry.delta = SceneDelta();
+  return true;
+}
+
+bool OpenUndoSpill(UndoStore &store) {
+  if (store.spill.is_open())
+    return true;
+  if (store.spillPath.empty()) {
+    random_device rd;
+    error_code ec;
+    filesystem::path dir = filesystem::temp_directory_path(ec);
+    if (ec)
+      dir = ".";
+    store.spillPath =
+        (dir / ("toggle-undo-" + to_string(rd()) + ".bin")).string();
   }
+  store.spill.open(store.spillPath,
+                   ios::in | ios::out | ios::binary | ios::trunc);
+  store.spillSize = 0;
+  store.spillFree.clear();
+  return store.spill.is_open();
+}
 
-  Rectangle b = el.GetLocalBounds();
-  Vector2 center = ElementCenterLocal(el);
-  Vector2 tl = {b.x, b.y};
-  Vector2 tr = {b.x + b.width, b.y};
-  Vector2 br = {b.x + b.width, b.y + b.height};
-  Vector2 bl = {b.x, b.y + b.height};
-  if (el.rotation != 0.0f &&
-      (el.type == RECTANGLE_MODE || el.type == DOTTEDRECT_MODE ||
-       el.type == TEXT_MODE || el.type == TRIANGLE_MODE ||
-       el.type == DOTTEDTRIANGLE_MODE)) {
-    tl = RotatePoint(tl, center, el.rotation);
-    tr = RotatePoint(tr, center, el.rotation);
-    br = RotatePoint(br, center, el.rotation);
-    bl = RotatePoint(bl, center, el.rotation);
+void CloseUndoSpill(UndoStore &store) {
+  if (store.spill.is_open())
+    store.spill.close();
+  if (!store.spillPath.empty()) {
+    error_code ec;
+    filesystem::remove(store.spillPath, ec);
   }
+  store.spillSize = 0;
+  store.spilledEntries = 0;
+  store.diskBytes = 0;
+  store.spillFree.clear();
+}
 
-  if (PointInQuad({expanded.x, expanded.y}, tl, tr, br, bl) ||
-      PointInQuad({expanded.x + expanded.width, expanded.y}, tl, tr, br, bl) ||
-      PointInQuad({expanded.x + expanded.width, expanded.y + expanded.height}, tl,
-                  tr, br, bl) ||
-      PointInQuad({expanded.x, expanded.y + expanded.height}, tl, tr, br, bl))
-    return true;
-  if (CheckCollisionPointRec(tl, expanded) ||
-      CheckCollisionPointRec(tr, expanded) ||
-      CheckCollisionPointRec(br, expanded) ||
-      CheckCollisionPointRec(bl, expanded))
-    return true;
+bool SpillUndoEntry(UndoStore &store, UndoEntry &entry) {
+  if (entry.packed.empty() || !OpenUndoSpill(store))
+    return false;
+  long long offset = store.spillSize;
+  auto hole = store.spillFree.begin();
+  while (hole != store.spillFree.end() && hole->second < entry.packedSize)
+    ++hole;
+  if (hole != store.spillFree.end())
+    offset = hole->first;
+  store.spill.clear();
+  store.spill.seekp(offset);
+  store.spill.write((const char *)entry.packed.data(), entry.packedSize);
+  if (!store.spill)
+    return false;
+  if (hole != store.spillFree.end()) {
+    long long rest = hole->second - entry.packedSize;
+    store.spillFree.erase(hole);
+    if (rest > 0)
+      store.spillFree[offset + entry.packedSize] = rest;
+  } else {
+    store.spillSize += entry.packedSize;
+  }
+  entry.spillOffset = offset;
+  store.spilledEntries++;
+  vector<unsigned char>().swap(entry.packed);
+  return true;
+}
 
-  if (LineIntersectsRect(tl, tr, expanded) ||
-      LineIntersectsRect(tr, br, expanded) ||
-      LineIntersectsRect(br, bl, expanded) ||
-      LineIntersectsRect(bl, tl, expanded))
+bool ReadUndoDelta(UndoStore &store, const UndoEntry &entry, SceneDelta &scratch,
+                   const SceneDelta *&out) {
+  if (entry.spillOffset < 0 && entry.packed.empty()) {
+    out = &entry.delta;
     return true;
+  }
+  vector<unsigned char> spilled;
+  const unsigned char *packed = entry.packed.data();
+  if (entry.spillOffset >= 0) {
+    spilled.resize(entry.packedSize);
+    store.spill.clear();
+    store.spill.seekg(entry.spillOffset);
+    store.spill.read((char *)spilled.data(), entry.packedSize);
+    if (!store.spill)
+      return false;
+    packed = spilled.data();
+  }
+  int rawSize = 0;
+  unsigned char *raw = DecompressData(packed, entry.packedSize, &rawSize);
+  if (!raw)
+    return false;
+  const unsigned char *p = raw;
+  bool ok = ReadSceneDeltaBinary(p, raw + rawSize, scratch);
+  MemFree(raw);
+  out = &scratch;
+  return ok;
+}
 
-  return false;
+void UpdateUndoEntryBytes(UndoStore &store, UndoEntry &entry) {
+  store.memoryBytes -= (long long)entry.bytes;
+  if (entry.spillOffset >= 0)
+    entry.bytes = 0;
+  else if (!entry.packed.empty())
+    entry.bytes = entry.packed.capacity();
+  else
+    entry.bytes = EstimateDeltaBytes(entry.delta);
+  store.memoryBytes += (long long)entry.bytes;
 }
 
-bool IsPointOnElement(const Element &el, Vector2 p, float tolerance) {
-  Vector2 localP = p;
-  if (el.rotation != 0.0f && el.type != CIRCLE_MODE &&
-      el.type != DOTTEDCIRCLE_MODE) {
-    Vector2 center = ElementCenterLocal(el);
-    localP = RotatePoint(p, center, -el.rotation);
+void FreeUndoSpillRange(UndoStore &store, long long offset, long long size) {
+  auto next = store.spillFree.lower_bound(offset);
+  if (next != store.spillFree.end() && next->first == offset + size) {
+    size += next->second;
+    next = store.spillFree.erase(next);
   }
-  float tol = max(0.5f, tolerance);
-  if (el.type == LINE_MODE || el.type == DOTTEDLINE_MODE ||
-      el.type == ARROWLINE_MODE) {
-    if (Vector2Distance(el.start, el.end) < 0.001f) {
-      return Vector2Distance(localP, el.start) <= (el.strokeWidth * 0.5f + tol);
+  if (next != store.spillFree.begin()) {
+    auto prev = std::prev(next);
+    if (prev->first + prev->second == offset) {
+      offset = prev->first;
+      size += prev->second;
+      store.spillFree.erase(prev);
     }
-    return CheckCollisionPointLine(localP, el.start, el.end,
-                                   el.strokeWidth * 0.5f + tol);
   }
-  if (el.type == CIRCLE_MODE || el.type == DOTTEDCIRCLE_MODE) {
-    float r = Vector2Distance(el.start, el.end);
-    float d = Vector2Distance(localP, el.start);
-    return d <= (r + el.strokeWidth * 0.5f + tol);
+  if (offset + size < store.spillSize) {
+    store.spillFree[offset] = size;
+    return;
   }
-  if (el.type == RECTANGLE_MODE || el.type == DOTTEDRECT_MODE) {
-    float x0 = min(el.start.x, el.end.x);
-    float y0 = min(el.start.y, el.end.y);
-    float x1 = max(el.start.x, el.end.x);
-    float y1 = max(el.start.y, el.end.y);
-    Rectangle filled = {x0 - tol, y0 - tol, (x1 - x0) + 2 * tol,
-                        (y1 - y0) + 2 * tol};
-    if (CheckCollisionPointRec(localP, filled))
-      return true;
-    Vector2 a = {x0, y0};
-    Vector2 b = {x1, y0};
-    Vector2 c = {x1, y1};
-    Vector2 d = {x0, y1};
-    float t = el.strokeWidth * 0.5f + tol;
-    return CheckCollisionPointLine(localP, a, b, t) ||
-           CheckCollisionPointLine(localP, b, c, t) ||
-           CheckCollisionPointLine(localP, c, d, t) ||
-           CheckCollisionPointLine(localP, d, a, t);
+  store.spillSize = offset;
+  store.spill.flush();
+  error_code ec;
+  filesystem::resize_file(store.spillPath, (uintmax_t)offset, ec);
+}
+
+void ReleaseUndoEntry(UndoStore &store, UndoEntry &entry) {
+  store.memoryBytes -= (long long)entry.bytes;
+  entry.bytes = 0;
+  if (entry.spillOffset >= 0) {
+    store.diskBytes -= entry.packedSize;
+    long long offset = entry.spillOffset;
+    entry.spillOffset = -1;
+    if (--store.spilledEntries > 0 && store.spill.is_open()) {
+      FreeUndoSpillRange(store, offset, entry.packedSize);
+    } else if (store.spill.is_open()) {
+      store.spill.close();
+      store.spill.open(store.spillPath,
+                       ios::in | ios::out | ios::binary | ios::trunc);
+      store.spillSize = 0;
+      store.spilledEntries = 0;
+      store.spillFree.clear();
+    }
   }
-  if (el.type == TRIANGLE_MODE || el.type == DOTTEDTRIANGLE_MODE) {
-    Vector2 apex, left, right;
-    GetTriangleVerticesLocal(el, apex, left, right);
-    float t = el.strokeWidth * 0.5f + tol;
-    if (PointInTriangle(localP, apex, left, right))
+  entry.delta = SceneDelta();
+  vector<unsigned char>().swap(entry.packed);
+}
+
+void DeleteUndoSubtree(Canvas &canvas, int id) {
+  auto it = canvas.undoTree.nodes.find(id);
+  if (it == canvas.undoTree.nodes.end())
+    return;
+  vector<int> children = it->second.children;
+  ReleaseUndoEntry(canvas.undoStore, it->second.entry);
+  canvas.undoTree.nodes.erase(it);
+  for (int child : children)
+    DeleteUndoSubtree(canvas, child);
+}
+
+void DetachUndoChild(UndoNode &parent, int child) {
+  parent.children.erase(
+      remove(parent.children.begin(), parent.children.end(), child),
+      parent.children.end());
+  if (parent.redoChild == child)
+    parent.redoChild = parent.children.empty() ? -1 : parent.children.back();
+}
+
+bool PruneUndoTree(Canvas &canvas) {
+  UndoTree &tree = canvas.undoTree;
+  UndoNode &root = tree.nodes[tree.root];
+  int keep = -1;
+  for (int n = tree.current; n >= 0 && n != tree.root; n = tree.nodes[n].parent) {
+    if (tree.nodes[n].parent == tree.root)
+      keep = n;
+  }
+  if (root.children.size() > 1 || tree.current == tree.root) {
+    for (int child : root.children) {
+      if (child == keep)
+        continue;
+      DetachUndoChild(root, child);
+      DeleteUndoSubtree(canvas, child);
       return true;
-    return CheckCollisionPointLine(localP, apex, left, t) ||
-           CheckCollisionPointLine(localP, left, right, t) ||
-           CheckCollisionPointLine(localP, right, apex, t);
+    }
+    return false;
   }
-  if (el.type == PEN_MODE) {
-    if (el.path.empty())
-      return false;
-    if (el.path.size() == 1)
-      return Vector2Distance(localP, el.path[0]) <=
-             (el.strokeWidth * 0.5f + tol);
-    float t = el.strokeWidth * 0.5f + tol;
-    for (size_t i = 1; i < el.path.size(); i++) {
-      if (CheckCollisionPointLine(localP, el.path[i - 1], el.path[i], t))
-        return true;
-    }
+  if (root.children.empty())
     return false;
+  int child = root.children[0];
+  ReleaseUndoEntry(canvas.undoStore, root.entry);
+  tree.nodes.erase(tree.root);
+  tree.root = child;
+  tree.nodes[child].parent = -1;
+  ReleaseUndoEntry(canvas.undoStore, tree.nodes[child].entry);
+  return true;
+}
+
+void EnforceUndoBudget(Canvas &canvas) {
+  UndoStore &store = canvas.undoStore;
+  UndoTree &tree = canvas.undoTree;
+  if (tree.root < 0)
+    return;
+  bool pruned = false;
+  while ((int)tree.nodes.size() - 1 > max(1, store.maxEntries) &&
+         PruneUndoTree(canvas))
+    pruned = true;
+  if (pruned) {
+    for (auto it = tree.checkpoints.begin(); it != tree.checkpoints.end();) {
+      if (tree.nodes.count(it->second) == 0)
+        it = tree.checkpoints.erase(it);
+      else
+        ++it;
+    }
   }
-  if (el.type == GROUP_MODE) {
-    for (const auto &child : el.children) {
-      if (IsPointOnElement(child, p, tolerance))
-        return true;
+
+  int liveFrom = tree.nextId - max(0, store.liveEntries);
+  for (auto &kv : tree.nodes) {
+    UndoEntry &entry = kv.second.entry;
+    if (kv.first < liveFrom && entry.spillOffset < 0 && entry.packed.empty() &&
+        !IsDeltaEmpty(entry.delta) && CompressUndoEntry(entry))
+      UpdateUndoEntryBytes(store, entry);
+  }
+
+  for (auto &kv : tree.nodes) {
+    if (store.memoryBytes <= store.maxBytes)
+      return;
+    UndoEntry &entry = kv.second.entry;
+    if (entry.packed.empty() || entry.spillOffset >= 0)
+      continue;
+    int packedSize = entry.packedSize;
+    if (SpillUndoEntry(store, entry)) {
+      store.diskBytes += packedSize;
+      UpdateUndoEntryBytes(store, entry);
     }
-    return false;
   }
-  if (el.type == TEXT_MODE) {
-    return CheckCollisionPointRec(localP, el.GetLocalBounds());
+}
+
+shared_ptr<const UndoSymbols>
+CaptureUndoSymbols(const Canvas &canvas,
+                   const shared_ptr<const UndoSymbols> &last) {
+  if (last && last->defs.size() == canvas.symbols.size() &&
+      equal(last->defs.begin(), last->defs.end(), canvas.symbols.begin(),
+            [](const SymbolDef &a, const SymbolDef &b) {
+              return a.name == b.name && a.version == b.version;
+            }) &&
+      ElementsEqual(last->edit, canvas.symbolEdit))
+    return last;
+  auto symbols = make_shared<UndoSymbols>();
+  symbols->defs = canvas.symbols;
+  symbols->edit = canvas.symbolEdit;
+  return symbols;
+}
+
+// Bumping nextSymbolVersion invalidates the layer caches.
+void RestoreUndoSymbols(Canvas &canvas) {
+  UndoTree &tree = canvas.undoTree;
+  const shared_ptr<const UndoSymbols> &symbols = tree.nodes[tree.current].symbols;
+  if (!symbols || symbols == tree.symbols)
+    return;
+  canvas.symbols = symbols->defs;
+  canvas.symbolEdit = symbols->edit;
+  canvas.nextSymbolVersion++;
+  tree.symbols = symbols;
+}
+
+void ResetUndoTree(Canvas &canvas,
+                   vector<shared_ptr<const Element>> *head = nullptr) {
+  UndoTree &tree = canvas.undoTree;
+  for (auto &kv : tree.nodes)
+    ReleaseUndoEntry(canvas.undoStore, kv.second.entry);
+  tree.nodes.clear();
+  tree.checkpoints.clear();
+  tree.root = tree.current = tree.nextId++;
+  tree.nodes[tree.root].time = GetTime();
+  tree.pendingDrop = -1;
+  tree.pendingEdit = false;
+  tree.head.clear();
+  if (head && head->size() == canvas.elements.size()) {
+    tree.head.swap(*head);
+  } else {
+    tree.head.reserve(canvas.elements.size());
+    for (const auto &el : canvas.elements)
+      tree.head.push_back(make_shared<const Element>(
+          StoredElement(el, nullptr, canvas.originX, canvas.originY)));
   }
-  return false;
+  tree.symbols = CaptureUndoSymbols(canvas, nullptr);
+  tree.nodes[tree.root].symbols = tree.symbols;
 }
 
-bool IsPointOnSelectedBounds(const Canvas &canvas, Vector2 p) {
-  for (int i = (int)canvas.selectedIndices.size() - 1; i >= 0; --i) {
-    int idx = canvas.selectedIndices[i];
-    if (idx >= 0 && idx < (int)canvas.elements.size()) {
-      if (IsPointInSelectionVisual(canvas.elements[idx], p))
-        return true;
-    }
+int RecordUndoState(Canvas &canvas) {
+  UndoTree &tree = canvas.undoTree;
+  if (tree.current < 0)
+    ResetUndoTree(canvas);
+  SceneDelta delta;
+  bool changed = DiffScene(tree.head, canvas.elements, delta, canvas.originX,
+                           canvas.originY);
+  tree.pendingEdit = false;
+  shared_ptr<const UndoSymbols> symbols =
+      CaptureUndoSymbols(canvas, tree.symbols);
+  if (!changed && symbols == tree.symbols)
+    return -1;
+  if (changed) {
+    ApplySceneDelta(tree.head, delta, true);
+    PublishSceneDelta(canvas, delta, true);
   }
-  return false;
+  int id = tree.nextId++;
+  UndoNode &node = tree.nodes[id];
+  node.parent = tree.current;
+  node.time = GetTime();
+  node.entry.delta = std::move(delta);
+  node.symbols = symbols;
+  tree.symbols = symbols;
+  UndoNode &parent = tree.nodes[tree.current];
+  parent.children.push_back(id);
+  parent.redoChild = id;
+  tree.current = id;
+  UpdateUndoEntryBytes(canvas.undoStore, node.entry);
+  EnforceUndoBudget(canvas);
+  return id;
 }
 
-vector<int> GetSelectedIDs(const Canvas &canvas) {
-  vector<int> ids;
-  for (int idx : canvas.selectedIndices) {
-    if (idx >= 0 && idx < (int)canvas.elements.size()) {
-      int id = canvas.elements[idx].uniqueID;
-      if (id >= 0 && find(ids.begin(), ids.end(), id) == ids.end())
-        ids.push_back(id);
-    }
+const SceneDelta &LiveSceneDelta(const Canvas &canvas, const SceneDelta &delta,
+                                 SceneDelta &scratch) {
+  auto elsewhere = [&](const Element &el) {
+    return el.frameX != canvas.originX || el.frameY != canvas.originY;
+  };
+  if (none_of(delta.before.begin(), delta.before.end(), elsewhere) &&
+      none_of(delta.after.begin(), delta.after.end(), elsewhere))
+    return delta;
+  scratch = delta;
+  for (auto &el : scratch.before)
+    RehomeElement(el, canvas.originX, canvas.originY);
+  for (auto &el : scratch.after)
+    RehomeElement(el, canvas.originX, canvas.originY);
+  return scratch;
+}
+
+bool ApplyUndoNode(Canvas &canvas, int id, bool forward) {
+  SceneDelta scratch;
+  const SceneDelta *delta = nullptr;
+  if (!ReadUndoDelta(canvas.undoStore, canvas.undoTree.nodes[id].entry, scratch,
+                     delta))
+    return false;
+  SceneDelta live;
+  ApplySceneDelta(canvas.elements, LiveSceneDelta(canvas, *delta, live),
+                  forward);
+  ApplySceneDelta(canvas.undoTree.head, *delta, forward);
+  PublishSceneDelta(canvas, *delta, forward);
+  return true;
+}
+
+bool StepUndo(Canvas &canvas) {
+  RecordUndoState(canvas);
+  UndoTree &tree = canvas.undoTree;
+  tree.pendingDrop = -1;
+  int parent = tree.nodes[tree.current].parent;
+  if (parent < 0 || !ApplyUndoNode(canvas, tree.current, false))
+    return false;
+  tree.nodes[parent].redoChild = tree.current;
+  tree.current = parent;
+  RestoreUndoSymbols(canvas);
+  return true;
+}
+
+bool StepRedo(Canvas &canvas) {
+  RecordUndoState(canvas);
+  UndoTree &tree = canvas.undoTree;
+  tree.pendingDrop = -1;
+  int next = tree.nodes[tree.current].redoChild;
+  if (next < 0 || !ApplyUndoNode(canvas, next, true))
+    return false;
+  tree.current = next;
+  RestoreUndoSymbols(canvas);
+  return true;
+}
+
+int CommonUndoAncestor(UndoTree &tree, int a, int b) {
+  unordered_set<int> seenA = {a}, seenB = {b};
+  while (a != b) {
+    if (seenB.count(a))
+      return a;
+    if (seenA.count(b))
+      return b;
+    int pa = a >= 0 ? tree.nodes[a].parent : -1;
+    int pb = b >= 0 ? tree.nodes[b].parent : -1;
+    if (pa < 0 && pb < 0)
+      return -1;
+    if (pa >= 0)
+      seenA.insert(a = pa);
+    if (pb >= 0)
+      seenB.insert(b = pb);
   }
-  return ids;
+  return a;
 }
 
-void ReselectByIDs(Canvas &canvas, const vector<int> &ids) {
-  canvas.selectedIndices.clear();
-  for (int id : ids) {
-    int idx = FindElementIndexByID(canvas, id);
-    if (idx != -1)
-      canvas.selectedIndices.push_back(idx);
+bool JumpToUndoNode(Canvas &canvas, int target) {
+  UndoTree &tree = canvas.undoTree;
+  if (tree.nodes.count(target) == 0)
+    return false;
+  RecordUndoState(canvas);
+  tree.pendingDrop = -1;
+  int ancestor = CommonUndoAncestor(tree, tree.current, target);
+  if (ancestor < 0)
+    return false;
+  bool ok = true;
+  while (ok && tree.current != ancestor) {
+    int parent = tree.nodes[tree.current].parent;
+    ok = parent >= 0 && ApplyUndoNode(canvas, tree.current, false);
+    if (!ok)
+      break;
+    tree.nodes[parent].redoChild = tree.current;
+    tree.current = parent;
+  }
+  vector<int> down;
+  if (ok)
+    for (int n = target; n != tree.current; n = tree.nodes[n].parent)
+      down.push_back(n);
+  for (auto it = down.rbegin(); ok && it != down.rend(); ++it) {
+    ok = ApplyUndoNode(canvas, *it, true);
+    if (!ok)
+      break;
+    tree.nodes[tree.current].redoChild = *it;
+    tree.current = *it;
   }
+  RestoreUndoSymbols(canvas);
+  return ok;
 }
 
-void MoveSelectionZOrder(Canvas &canvas, bool forward) {
-  vector<int> selectedIDs = GetSelectedIDs(canvas);
-  if (selectedIDs.empty())
+void DiscardPendingUndoState(Canvas &canvas) {
+  UndoTree &tree = canvas.undoTree;
+  int id = tree.pendingDrop;
+  tree.pendingDrop = -1;
+  if (id < 0 || id != tree.current)
+    return;
+  UndoNode &node = tree.nodes[id];
+  if (!node.children.empty() || node.parent < 0)
+    return;
+  for (const auto &kv : tree.checkpoints) {
+    if (kv.second == id)
+      return;
+  }
+  SceneDelta scratch;
+  const SceneDelta *delta = nullptr;
+  if (!ReadUndoDelta(canvas.undoStore, node.entry, scratch, delta))
     return;
+  ApplySceneDelta(tree.head, *delta, false);
+  PublishSceneDelta(canvas, *delta, false);
+  int parent = node.parent;
+  DetachUndoChild(tree.nodes[parent], id);
+  ReleaseUndoEntry(canvas.undoStore, node.entry);
+  tree.nodes.erase(id);
+  tree.current = parent;
+  tree.symbols = tree.nodes[parent].symbols;
+}
 
-  SaveBackup(canvas);
-  RestoreZOrder(canvas);
+void SaveBackup(Canvas &canvas) {
+  canvas.undoTree.pendingDrop = RecordUndoState(canvas);
+  canvas.undoTree.pendingEdit = true;
+}
 
-  vector<bool> isSelected(canvas.elements.size(), false);
-  for (int id : selectedIDs) {
-    int idx = FindElementIndexByID(canvas, id);
-    if (idx != -1)
-      isSelected[idx] = true;
-  }
+bool EditInProgress(const Canvas &canvas) {
+  return canvas.isTextEditing || canvas.transformActive || canvas.isDragging ||
+         IsMouseButtonDown(MOUSE_BUTTON_LEFT) ||
+         IsMouseButtonDown(MOUSE_BUTTON_RIGHT) ||
+         IsMouseButtonDown(MOUSE_BUTTON_MIDDLE);
+}
 
-  if (forward) {
-    for (int i = (int)canvas.elements.size() - 2; i >= 0; --i) {
-      if (isSelected[i] && !isSelected[i + 1]) {
-        swap(canvas.elements[i], canvas.elements[i + 1]);
-        swap(isSelected[i], isSelected[i + 1]);
-      }
-    }
-  } else {
-    for (int i = 1; i < (int)canvas.elements.size(); ++i) {
-      if (isSelected[i] && !isSelected[i - 1]) {
-        swap(canvas.elements[i], canvas.elements[i - 1]);
-        swap(isSelected[i], isSelected[i - 1]);
+void CommitPendingEdit(Canvas &canvas) {
+  if (canvas.undoTree.pendingEdit && !EditInProgress(canvas))
+    RecordUndoState(canvas);
+}
+
+void EnsureUniqueIDRecursive(Element &el, Canvas &canvas) {
+  if (el.uniqueID < 0) {
+    el.uniqueID = canvas.nextElementId++;
+  }
+  if (el.type == GROUP_MODE) {
+    for (auto &c : el.children) {
+      if (c.uniqueID < 0) {
+        EnsureUniqueIDRecursive(c, canvas);
       }
     }
   }
+}
 
-  ReselectByIDs(canvas, selectedIDs);
+int FindElementIndexByID(const Canvas &canvas, int id) {
+  for (int i = 0; i < (int)canvas.elements.size(); ++i) {
+    if (canvas.elements[i].uniqueID == id)
+      return i;
+  }
+  return -1;
 }
 
-void DrawDashedLine(Vector2 start, Vector2 end, float width, Color color) {
-  float totalLen = Vector2Distance(start, end);
-  if (totalLen < 1.0f)
-    return;
-  Vector2 dir = Vector2Normalize(Vector2Subtract(end, start));
-  float dashLen = max(width * 2.0f, 6.0f);
-  float gapLen = max(width * 1.2f, 4.0f);
-  for (float i = 0.0f; i < totalLen; i += (dashLen + gapLen)) {
-    float endDist = min(i + dashLen, totalLen);
-    Vector2 s = Vector2Add(start, Vector2Scale(dir, i));
-    Vector2 e = Vector2Add(start, Vector2Scale(dir, endDist));
-    DrawLineEx(s, e, width, color);
+void NormalizeElementIDs(Element &el, unordered_set<int> &used, int &nextId) {
+  if (el.uniqueID < 0 || used.count(el.uniqueID) > 0) {
+    while (used.count(nextId) > 0)
+      nextId++;
+    el.uniqueID = nextId++;
+  } else {
+    used.insert(el.uniqueID);
+    if (el.uniqueID >= nextId)
+      nextId = el.uniqueID + 1;
   }
+
+  used.insert(el.uniqueID);
+  for (auto &child : el.children)
+    NormalizeElementIDs(child, used, nextId);
 }
 
-void DrawArrowLine(Vector2 start, Vector2 end, float width, Color color) {
-  DrawLineEx(start, end, width, color);
-  float angle = atan2f(end.y - start.y, end.x - start.x);
-  float headSize = max(15.0f, width * 3.0f);
-  float lineLen = Vector2Distance(start, end);
-  if (headSize > lineLen * 0.7f)
-    headSize = lineLen * 0.7f;
-  Vector2 p1 = {end.x - headSize * cosf(angle - PI / 6),
-                end.y - headSize * sinf(angle - PI / 6)};
-  Vector2 p2 = {end.x - headSize * cosf(angle + PI / 6),
-                end.y - headSize * sinf(angle + PI / 6)};
-  DrawLineEx(end, p1, width, color);
-  DrawLineEx(end, p2, width, color);
+void NormalizeCanvasIDs(Canvas &canvas) {
+  unordered_set<int> used;
+  // Paged-out chunk elements keep their ids, so fresh ids start above them.
+  int nextId = canvas.chunks.active ? canvas.chunks.nextId : 0;
+  for (auto &el : canvas.elements)
+    NormalizeElementIDs(el, used, nextId);
+  canvas.nextElementId = nextId;
+  if (canvas.chunks.active)
+    canvas.chunks.nextId = max(canvas.chunks.nextId, nextId);
 }
 
-void DrawDashedRing(Vector2 center, float radius, float width, Color color) {
-  if (radius <= 0.5f)
-    return;
+Vector2 RotatePoint(Vector2 p, Vector2 center, float radians) {
+  float s = sinf(radians);
+  float c = cosf(radians);
+  Vector2 v = {p.x - center.x, p.y - center.y};
+  return {center.x + v.x * c - v.y * s, center.y + v.x * s + v.y * c};
+}
 
-  float circumference = 2.0f * PI * radius;
-  float dashArcLen = max(width * 2.0f, 6.0f);
-  float gapArcLen = max(width * 1.2f, 4.0f);
-  float dashDeg = (dashArcLen / circumference) * 360.0f;
-  float gapDeg = (gapArcLen / circumference) * 360.0f;
+void GetTriangleVerticesLocal(const Element &el, Vector2 &apex, Vector2 &left,
+                              Vector2 &right) {
+  float x0 = min(el.start.x, el.end.x);
+  float x1 = max(el.start.x, el.end.x);
+  float y0 = min(el.start.y, el.end.y);
+  float y1 = max(el.start.y, el.end.y);
+  apex = {(x0 + x1) * 0.5f, y0};
+  left = {x0, y1};
+  right = {x1, y1};
+}
 
-  if (dashDeg <= 0.0f)
-    return;
+Vector2 ConstrainTriangleEnd(const AppConfig &cfg, Vector2 start,
+                             Vector2 rawEnd) {
+  float dx = rawEnd.x - start.x;
+  float dy = rawEnd.y - start.y;
+  if (fabsf(dx) < 0.001f && fabsf(dy) < 0.001f)
+    return rawEnd;
+  float ratio = max(0.05f, cfg.triangleHeightRatio);
+  float side = max(fabsf(dx), fabsf(dy) / ratio);
+  float sx = (dx >= 0.0f) ? 1.0f : -1.0f;
+  float sy = (dy >= 0.0f) ? 1.0f : -1.0f;
+  return {start.x + sx * side, start.y + sy * side * ratio};
+}
 
-  for (float a = 0.0f; a < 360.0f; a += (dashDeg + gapDeg)) {
-    float aEnd = min(a + dashDeg, 360.0f);
-    DrawRing(center, radius - width * 0.5f, radius + width * 0.5f, a, aEnd, 24,
-             color);
+Vector2 ElementCenterLocal(const Element &el) {
+  if (el.type == LINE_MODE || el.type == DOTTEDLINE_MODE ||
+      el.type == ARROWLINE_MODE) {
+    return {(el.start.x + el.end.x) * 0.5f, (el.start.y + el.end.y) * 0.5f};
   }
+  Rectangle b = el.GetLocalBounds();
+  return {b.x + b.width * 0.5f, b.y + b.height * 0.5f};
 }
 
-void DrawElement(const Element &el, const Font &font, float textSize) {
-  Vector2 s = el.start;
-  Vector2 e = el.end;
-  if (el.rotation != 0.0f &&
-      (el.type == LINE_MODE || el.type == DOTTEDLINE_MODE ||
-       el.type == ARROWLINE_MODE)) {
-    Vector2 center = ElementCenterLocal(el);
-    s = RotatePoint(el.start, center, el.rotation);
-    e = RotatePoint(el.end, center, el.rotation);
-  }
-  if (el.type == LINE_MODE)
-    DrawLineEx(s, e, el.strokeWidth, el.color);
-  else if (el.type == DOTTEDLINE_MODE)
-    DrawDashedLine(s, e, el.strokeWidth, el.color);
-  else if (el.type == ARROWLINE_MODE)
-    DrawArrowLine(s, e, el.strokeWidth, el.color);
-  else if (el.type == CIRCLE_MODE)
-    DrawRing(el.start, Vector2Distance(el.start, el.end) - el.strokeWidth / 2,
-             Vector2Distance(el.start, el.end) + el.strokeWidth / 2, 0, 360, 60,
-             el.color);
-  else if (el.type == DOTTEDCIRCLE_MODE)
-    DrawDashedRing(el.start, Vector2Distance(el.start, el.end), el.strokeWidth,
-                   el.color);
-  else if (el.type == RECTANGLE_MODE) {
-    Rectangle r = {min(el.start.x, el.end.x), min(el.start.y, el.end.y),
-                   abs(el.end.x - el.start.x), abs(el.end.y - el.start.y)};
-    if (el.rotation == 0.0f) {
-      DrawRectangleLinesEx(r, el.strokeWidth, el.color);
-    } else {
-      Vector2 center = ElementCenterLocal(el);
-      Vector2 origin = {r.width * 0.5f, r.height * 0.5f};
-      Rectangle rect = {center.x, center.y, r.width, r.height};
-      DrawRectanglePro(rect, origin, el.rotation * RAD2DEG, Fade(el.color, 0.0f));
-      float rad = el.rotation;
-      Vector2 hx = {cosf(rad) * (r.width * 0.5f),
-                    sinf(rad) * (r.width * 0.5f)};
-      Vector2 hy = {-sinf(rad) * (r.height * 0.5f),
-                    cosf(rad) * (r.height * 0.5f)};
-      Vector2 c1 = Vector2Subtract(Vector2Subtract(center, hx), hy);
-      Vector2 c2 = Vector2Add(Vector2Subtract(center, hx), hy);
-      Vector2 c3 = Vector2Add(Vector2Add(center, hx), hy);
-      Vector2 c4 = Vector2Subtract(Vector2Add(center, hx), hy);
-      DrawLineEx(c1, c2, el.strokeWidth, el.color);
-      DrawLineEx(c2, c3, el.strokeWidth, el.color);
-      DrawLineEx(c3, c4, el.strokeWidth, el.color);
-      DrawLineEx(c4, c1, el.strokeWidth, el.color);
-    }
-  }
-  else if (el.type == DOTTEDRECT_MODE) {
-    Rectangle r = {min(el.start.x, el.end.x), min(el.start.y, el.end.y),
-                   abs(el.end.x - el.start.x), abs(el.end.y - el.start.y)};
-    float overlap = el.strokeWidth * 0.5f;
-    if (el.rotation == 0.0f) {
-      DrawDashedLine({r.x - overlap, r.y}, {r.x + r.width + overlap, r.y},
-                     el.strokeWidth, el.color);
-      DrawDashedLine({r.x + r.width, r.y - overlap},
-                     {r.x + r.width, r.y + r.height + overlap}, el.strokeWidth,
-                     el.color);
-      DrawDashedLine({r.x + r.width + overlap, r.y + r.height},
-                     {r.x - overlap, r.y + r.height}, el.strokeWidth, el.color);
-      DrawDashedLine({r.x, r.y + r.height + overlap}, {r.x, r.y - overlap},
-                     el.strokeWidth, el.color);
-    } else {
-      Vector2 center = ElementCenterLocal(el);
-      float rad = el.rotation;
-      Vector2 hx = {cosf(rad) * (r.width * 0.5f),
-                    sinf(rad) * (r.width * 0.5f)};
-      Vector2 hy = {-sinf(rad) * (r.height * 0.5f),
-                    cosf(rad) * (r.height * 0.5f)};
-      Vector2 c1 = Vector2Subtract(Vector2Subtract(center, hx), hy);
-      Vector2 c2 = Vector2Add(Vector2Subtract(center, hx), hy);
-      Vector2 c3 = Vector2Add(Vector2Add(center, hx), hy);
-      Vector2 c4 = Vector2Subtract(Vector2Add(center, hx), hy);
-      DrawDashedLine(c1, c2, el.strokeWidth, el.color);
-      DrawDashedLine(c2, c3, el.strokeWidth, el.color);
-      DrawDashedLine(c3, c4, el.strokeWidth, el.color);
-      DrawDashedLine(c4, c1, el.strokeWidth, el.color);
-    }
-  } else if (el.type == TRIANGLE_MODE || el.type == DOTTEDTRIANGLE_MODE) {
-    Vector2 apex, left, right;
-    GetTriangleVerticesLocal(el, apex, left, right);
+bool LineIntersectsRect(Vector2 a, Vector2 b, Rectangle r) {
+  Vector2 r1 = {r.x, r.y};
+  Vector2 r2 = {r.x + r.width, r.y};
+  Vector2 r3 = {r.x + r.width, r.y + r.height};
+  Vector2 r4 = {r.x, r.y + r.height};
+  if (CheckCollisionPointRec(a, r) || CheckCollisionPointRec(b, r))
+    return true;
+  if (CheckCollisionLines(a, b, r1, r2, nullptr))
+    return true;
+  if (CheckCollisionLines(a, b, r2, r3, nullptr))
+    return true;
+  if (CheckCollisionLines(a, b, r3, r4, nullptr))
+    return true;
+  if (CheckCollisionLines(a, b, r4, r1, nullptr))
+    return true;
+  return false;
+}
+
+bool PointInQuad(Vector2 p, Vector2 a, Vector2 b, Vector2 c, Vector2 d) {
+  auto cross = [](Vector2 u, Vector2 v) { return u.x * v.y - u.y * v.x; };
+  Vector2 ab = {b.x - a.x, b.y - a.y};
+  Vector2 bc = {c.x - b.x, c.y - b.y};
+  Vector2 cd = {d.x - c.x, d.y - c.y};
+  Vector2 da = {a.x - d.x, a.y - d.y};
+  Vector2 ap = {p.x - a.x, p.y - a.y};
+  Vector2 bp = {p.x - b.x, p.y - b.y};
+  Vector2 cp = {p.x - c.x, p.y - c.y};
+  Vector2 dp = {p.x - d.x, p.y - d.y};
+  float c1 = cross(ab, ap);
+  float c2 = cross(bc, bp);
+  float c3 = cross(cd, cp);
+  float c4 = cross(da, dp);
+  bool hasNeg = (c1 < 0) || (c2 < 0) || (c3 < 0) || (c4 < 0);
+  bool hasPos = (c1 > 0) || (c2 > 0) || (c3 > 0) || (c4 > 0);
+  return !(hasNeg && hasPos);
+}
+
+bool PointInTriangle(Vector2 p, Vector2 a, Vector2 b, Vector2 c) {
+  auto cross = [](Vector2 u, Vector2 v) { return u.x * v.y - u.y * v.x; };
+  Vector2 ab = {b.x - a.x, b.y - a.y};
+  Vector2 bc = {c.x - b.x, c.y - b.y};
+  Vector2 ca = {a.x - c.x, a.y - c.y};
+  Vector2 ap = {p.x - a.x, p.y - a.y};
+  Vector2 bp = {p.x - b.x, p.y - b.y};
+  Vector2 cp = {p.x - c.x, p.y - c.y};
+  float c1 = cross(ab, ap);
+  float c2 = cross(bc, bp);
+  float c3 = cross(ca, cp);
+  bool hasNeg = (c1 < 0) || (c2 < 0) || (c3 < 0);
+  bool hasPos = (c1 > 0) || (c2 > 0) || (c3 > 0);
+  return !(hasNeg && hasPos);
+}
+
+bool IsPointInSelectionVisual(const Element &el, Vector2 p) {
+  const float rectPad = 5.0f;
+  const float linePad = 6.0f;
+  Color selColor = {70, 140, 160, 255};
+  (void)selColor;
+
+  if (el.type == LINE_MODE || el.type == DOTTEDLINE_MODE ||
+      el.type == ARROWLINE_MODE) {
+    Vector2 s = el.start;
+    Vector2 e = el.end;
     if (el.rotation != 0.0f) {
       Vector2 center = ElementCenterLocal(el);
-      apex = RotatePoint(apex, center, el.rotation);
-      left = RotatePoint(left, center, el.rotation);
-      right = RotatePoint(right, center, el.rotation);
+      s = RotatePoint(s, center, el.rotation);
+      e = RotatePoint(e, center, el.rotation);
     }
-    if (el.type == DOTTEDTRIANGLE_MODE) {
-      DrawDashedLine(apex, left, el.strokeWidth, el.color);
-      DrawDashedLine(left, right, el.strokeWidth, el.color);
-      DrawDashedLine(right, apex, el.strokeWidth, el.color);
-    } else {
-      DrawLineEx(apex, left, el.strokeWidth, el.color);
-      DrawLineEx(left, right, el.strokeWidth, el.color);
-      DrawLineEx(right, apex, el.strokeWidth, el.color);
+    float length = Vector2Distance(s, e);
+    if (length < 0.01f) {
+      Rectangle b = el.GetBounds();
+      Rectangle expanded = {b.x - rectPad, b.y - rectPad, b.width + 2 * rectPad,
+                            b.height + 2 * rectPad};
+      return CheckCollisionPointRec(p, expanded);
     }
-  } else if (el.type == PEN_MODE) {
-    int pointCount = (int)el.path.size();
+    float width = length + linePad * 2.0f;
+    float height = el.strokeWidth + linePad * 2.0f;
+    Vector2 center = {(s.x + e.x) * 0.5f, (s.y + e.y) * 0.5f};
+    float rad = atan2f(e.y - s.y, e.x - s.x);
+    Vector2 hx = {cosf(rad) * (width * 0.5f), sinf(rad) * (width * 0.5f)};
+    Vector2 hy = {-sinf(rad) * (height * 0.5f), cosf(rad) * (height * 0.5f)};
+    Vector2 c1 = Vector2Subtract(Vector2Subtract(center, hx), hy);
+    Vector2 c2 = Vector2Add(Vector2Subtract(center, hx), hy);
+    Vector2 c3 = Vector2Add(Vector2Add(center, hx), hy);
+    Vector2 c4 = Vector2Subtract(Vector2Add(center, hx), hy);
+    return PointInQuad(p, c1, c2, c3, c4);
+  }
 
-    if (pointCount == 1) {
-      Vector2 p = el.path[0];
-      if (el.rotation != 0.0f) {
-        Vector2 center = ElementCenterLocal(el);
-        p = RotatePoint(p, center, el.rotation);
-      }
-      DrawCircleV(p, el.strokeWidth / 2, el.color);
-    }
-    else if (pointCount >= 4) {
-      if (el.rotation == 0.0f) {
-        DrawSplineCatmullRom(el.path.data(), pointCount, el.strokeWidth,
-                             el.color);
-      } else {
-        Vector2 center = ElementCenterLocal(el);
-        vector<Vector2> rotated;
-        rotated.reserve(el.path.size());
-        for (const auto &p : el.path)
-          rotated.push_back(RotatePoint(p, center, el.rotation));
-        DrawSplineCatmullRom(rotated.data(), (int)rotated.size(),
-                             el.strokeWidth, el.color);
-      }
-    }
-    else if (pointCount > 1) {
-      if (el.rotation == 0.0f) {
-        DrawLineStrip(el.path.data(), pointCount, el.color);
-      } else {
-        Vector2 center = ElementCenterLocal(el);
-        vector<Vector2> rotated;
-        rotated.reserve(el.path.size());
-        for (const auto &p : el.path)
-          rotated.push_back(RotatePoint(p, center, el.rotation));
-        DrawLineStrip(rotated.data(), (int)rotated.size(), el.color);
-      }
-    }
-  } else if (el.type == GROUP_MODE) {
-    for (const auto &child : el.children)
-      DrawElement(child, font, textSize);
-  } else if (el.type == TEXT_MODE) {
-    float size = (el.textSize > 0.0f) ? el.textSize : textSize;
-    if (el.rotation == 0.0f) {
-      DrawTextEx(font, el.text.c_str(), el.start, size, 2, el.color);
-    } else {
+  if (el.type == TRIANGLE_MODE || el.type == DOTTEDTRIANGLE_MODE) {
+    Vector2 localP = p;
+    if (el.rotation != 0.0f) {
       Vector2 center = ElementCenterLocal(el);
-      Vector2 origin = {center.x - el.start.x, center.y - el.start.y};
-      DrawTextPro(font, el.text.c_str(), center, origin, el.rotation * RAD2DEG,
-                  size, 2, el.color);
+      localP = RotatePoint(p, center, -el.rotation);
     }
+    Vector2 apex, left, right;
+    GetTriangleVerticesLocal(el, apex, left, right);
+    float t = max(0.5f, el.strokeWidth * 0.5f + rectPad);
+    if (PointInTriangle(localP, apex, left, right))
+      return true;
+    return CheckCollisionPointLine(localP, apex, left, t) ||
+           CheckCollisionPointLine(localP, left, right, t) ||
+           CheckCollisionPointLine(localP, right, apex, t);
   }
-}
-
-void UpdateTextBounds(Element &el, const Font &font, float fallbackTextSize) {
-  if (el.type != TEXT_MODE)
-    return;
-  float size = (el.textSize > 0.0f) ? el.textSize : fallbackTextSize;
-  Vector2 measured = MeasureTextEx(font, el.text.c_str(), size, 2);
-  el.end = {el.start.x + max(10.0f, measured.x), el.start.y + max(size, measured.y)};
-}
 
-void ApplyColorRecursive(Element &el, Color c) {
-  el.color = c;
-  for (auto &child : el.children)
-    ApplyColorRecursive(child, c);
-}
+  Rectangle b = el.GetLocalBounds();
+  Rectangle expanded = {b.x - rectPad, b.y - rectPad, b.width + 2 * rectPad,
+                        b.height + 2 * rectPad};
+  if (el.rotation == 0.0f ||
+      el.type == CIRCLE_MODE || el.type == DOTTEDCIRCLE_MODE ||
+      el.type == GROUP_MODE) {
+    return CheckCollisionPointRec(p, expanded);
+  }
 
-void ApplyStrokeRecursive(Element &el, float width) {
-  if (el.type != TEXT_MODE)
-    el.strokeWidth = width;
-  for (auto &child : el.children)
-    ApplyStrokeRecursive(child, width);
+  Vector2 center = ElementCenterLocal(el);
+  Vector2 tl = RotatePoint({expanded.x, expanded.y}, center, el.rotation);
+  Vector2 tr =
+      RotatePoint({expanded.x + expanded.width, expanded.y}, center, el.rotation);
+  Vector2 br = RotatePoint({expanded.x + expanded.width,
+                            expanded.y + expanded.height},
+                           center, el.rotation);
+  Vector2 bl =
+      RotatePoint({expanded.x, expanded.y + expanded.height}, center,
+                  el.rotation);
+  return PointInQuad(p, tl, tr, br, bl);
 }
 
-void ApplyTextSizeRecursive(Element &el, float size, const Font &font,
-                            float fallbackTextSize) {
-  if (el.type == TEXT_MODE) {
-    el.textSize = size;
-    UpdateTextBounds(el, font, fallbackTextSize);
+bool ElementIntersectsRect(const Element &el, Rectangle r, float tol) {
+  Rectangle expanded = {r.x - tol, r.y - tol, r.width + 2 * tol,
+                        r.height + 2 * tol};
+  if (el.type == GROUP_MODE) {
+    for (const auto &child : el.children) {
+      if (ElementIntersectsRect(child, r, tol))
+        return true;
+    }
+    return false;
   }
-  for (auto &child : el.children)
-    ApplyTextSizeRecursive(child, size, font, fallbackTextSize);
-}
 
-void RecomputeTextBoundsRecursive(Element &el, const Font &font,
-                                  float fallbackTextSize) {
-  if (el.type == TEXT_MODE)
-    UpdateTextBounds(el, font, fallbackTextSize);
-  for (auto &child : el.children)
-    RecomputeTextBoundsRecursive(child, font, fallbackTextSize);
-}
-
-void MoveElement(Element &el, Vector2 delta) {
-  el.start = Vector2Add(el.start, delta);
-  el.end = Vector2Add(el.end, delta);
-  for (auto &p : el.path)
-    p = Vector2Add(p, delta);
-  for (auto &child : el.children)
-    MoveElement(child, delta);
-}
-
-void RotateElementGeometry(Element &el, Vector2 center, float radians) {
-  el.start = RotatePoint(el.start, center, radians);
-  el.end = RotatePoint(el.end, center, radians);
-  for (auto &p : el.path)
-    p = RotatePoint(p, center, radians);
-  for (auto &child : el.children)
-    RotateElementGeometry(child, center, radians);
-  if (el.type != CIRCLE_MODE && el.type != DOTTEDCIRCLE_MODE)
-    el.rotation += radians;
-}
-
-void ScaleElementGeometry(Element &el, Vector2 center, float sx, float sy,
-                          const Font &font, float fallbackTextSize) {
-  auto scalePoint = [&](Vector2 p) {
-    return Vector2{center.x + (p.x - center.x) * sx,
-                   center.y + (p.y - center.y) * sy};
-  };
-  el.start = scalePoint(el.start);
-  el.end = scalePoint(el.end);
-  for (auto &p : el.path)
-    p = scalePoint(p);
-  for (auto &child : el.children)
-    ScaleElementGeometry(child, center, sx, sy, font, fallbackTextSize);
-  if (el.type == TEXT_MODE) {
-    float size = (el.textSize > 0.0f) ? el.textSize : fallbackTextSize;
-    float scale = max(fabsf(sx), fabsf(sy));
-    el.textSize = max(1.0f, size * scale);
-    UpdateTextBounds(el, font, fallbackTextSize);
+  if (el.type == LINE_MODE || el.type == DOTTEDLINE_MODE ||
+      el.type == ARROWLINE_MODE) {
+    Vector2 s = el.start;
+    Vector2 e = el.end;
+    if (el.rotation != 0.0f) {
+      Vector2 center = ElementCenterLocal(el);
+      s = RotatePoint(s, center, el.rotation);
+      e = RotatePoint(e, center, el.rotation);
+    }
+    return LineIntersectsRect(s, e, expanded);
   }
-}
-
-void RestoreZOrder(Canvas &canvas) {
-  if (canvas.selectedIndices.empty())
-    return;
-
-  struct PendingRestore {
-    Element el;
-    int target;
-  };
-  vector<PendingRestore> toRestore;
 
- sort(canvas.selectedIndices.begin(), canvas.selectedIndices.end(),
-       greater<int>());
+  if (el.type == CIRCLE_MODE || el.type == DOTTEDCIRCLE_MODE) {
+    float rads = Vector2Distance(el.start, el.end) + el.strokeWidth * 0.5f + tol;
+    float cx = Clamp(el.start.x, expanded.x, expanded.x + expanded.width);
+    float cy = Clamp(el.start.y, expanded.y, expanded.y + expanded.height);
+    float dx = el.start.x - cx;
+    float dy = el.start.y - cy;
+    return (dx * dx + dy * dy) <= (rads * rads);
+  }
 
-  for (int idx : canvas.selectedIndices) {
-    if (idx >= 0 && idx < (int)canvas.elements.size() &&
-        canvas.elements[idx].originalIndex != -1) {
-      toRestore.push_back(
-          {canvas.elements[idx], canvas.elements[idx].originalIndex});
-      canvas.elements.erase(canvas.elements.begin() + idx);
+  if (el.type == POINTS_MODE) {
+    Rectangle b = el.GetBounds();
+    if (!CheckCollisionRecs(b, expanded))
+      return false;
+    if (b.x >= expanded.x && b.y >= expanded.y &&
+        b.x + b.width <= expanded.x + expanded.width &&
+        b.y + b.height <= expanded.y + expanded.height)
+      return true;
+    Vector2 center = ElementCenterLocal(el);
+    for (Vector2 p : el.path) {
+      if (el.rotation != 0.0f)
+        p = RotatePoint(p, center, el.rotation);
+      if (CheckCollisionPointRec(p, expanded))
+        return true;
     }
+    return false;
   }
 
-  sort(toRestore.begin(), toRestore.end(),
-       [](const PendingRestore &a, const PendingRestore &b) {
-         return a.target < b.target;
-       });
-
-  for (auto &item : toRestore) {
-    item.el.originalIndex = -1;
-    if (item.target >= (int)canvas.elements.size()) {
-      canvas.elements.push_back(item.el);
-    } else {
-      canvas.elements.insert(canvas.elements.begin() + item.target, item.el);
+  if (el.type == PEN_MODE) {
+    Vector2 center = ElementCenterLocal(el);
+    if (el.path.empty())
+      return false;
+    Vector2 prev = el.path[0];
+    if (el.rotation != 0.0f)
+      prev = RotatePoint(prev, center, el.rotation);
+    if (CheckCollisionPointRec(prev, expanded))
+      return true;
+    for (size_t i = 1; i < el.path.size(); ++i) {
+      Vector2 cur = el.path[i];
+      if (el.rotation != 0.0f)
+        cur = RotatePoint(cur, center, el.rotation);
+      if (LineIntersectsRect(prev, cur, expanded))
+        return true;
+      prev = cur;
     }
+    return false;
   }
 
-  canvas.selectedIndices.clear();
-}
-
-vector<string> Split(const string &s, char sep) {
-  vector<string> parts;
-  string part;
-  stringstream ss(s);
-  while (getline(ss, part, sep))
-    parts.push_back(part);
-  return parts;
-}
-
-string Trim(const string &s) {
-  size_t begin = s.find_first_not_of(" \t\r\n");
-  if (begin == string::npos)
-    return "";
-  size_t end = s.find_last_not_of(" \t\r\n");
-  return s.substr(begin, end - begin + 1);
-}
-
-string ToLower(string s) {
-  for (char &c : s)
-    c = (char)tolower((unsigned char)c);
-  return s;
-}
-
-bool IsPathSeparator(char c) { return c == '/' || c == '\\'; }
-
-string HomeDirectory() {
-  const char *home = getenv("HOME");
-  if (home && *home)
-    return home;
-  const char *userProfile = getenv("USERPROFILE");
-  if (userProfile && *userProfile)
-    return userProfile;
-  return ".";
-}
+  if (el.type == TRIANGLE_MODE || el.type == DOTTEDTRIANGLE_MODE) {
+    Vector2 apex, left, right;
+    GetTriangleVerticesLocal(el, apex, left, right);
+    if (el.rotation != 0.0f) {
+      Vector2 center = ElementCenterLocal(el);
+      apex = RotatePoint(apex, center, el.rotation);
+      left = RotatePoint(left, center, el.rotation);
+      right = RotatePoint(right, center, el.rotation);
+    }
+    if (CheckCollisionPointRec(apex, expanded) ||
+        CheckCollisionPointRec(left, expanded) ||
+        CheckCollisionPointRec(right, expanded))
+      return true;
+    Vector2 r1 = {expanded.x, expanded.y};
+    Vector2 r2 = {expanded.x + expanded.width, expanded.y};
+    Vector2 r3 = {expanded.x + expanded.width, expanded.y + expanded.height};
+    Vector2 r4 = {expanded.x, expanded.y + expanded.height};
+    if (PointInTriangle(r1, apex, left, right) ||
+        PointInTriangle(r2, apex, left, right) ||
+        PointInTriangle(r3, apex, left, right) ||
+        PointInTriangle(r4, apex, left, right))
+      return true;
+    if (LineIntersectsRect(apex, left, expanded) ||
+        LineIntersectsRect(left, right, expanded) ||
+        LineIntersectsRect(right, apex, expanded))
+      return true;
+    return false;
+  }
 
-string ExpandUserPath(string path) {
-  path = Trim(path);
-  if (path == "~")
-    return HomeDirectory();
-  if (path.rfind("~/", 0) == 0 || path.rfind("~\\", 0) == 0)
-    return HomeDirectory() + path.substr(1);
-  return path;
-}
+  Rectangle b = el.GetLocalBounds();
+  Vector2 center = ElementCenterLocal(el);
+  Vector2 tl = {b.x, b.y};
+  Vector2 tr = {b.x + b.width, b.y};
+  Vector2 br = {b.x + b.width, b.y + b.height};
+  Vector2 bl = {b.x, b.y + b.height};
+  if (el.rotation != 0.0f &&
+      (el.type == RECTANGLE_MODE || el.type == DOTTEDRECT_MODE ||
+       el.type == TEXT_MODE || el.type == TRIANGLE_MODE ||
+       el.type == DOTTEDTRIANGLE_MODE || el.type == INSTANCE_MODE)) {
+    tl = RotatePoint(tl, center, el.rotation);
+    tr = RotatePoint(tr, center, el.rotation);
+    br = RotatePoint(br, center, el.rotation);
+    bl = RotatePoint(bl, center, el.rotation);
+  }
 
-string DefaultDownloadsDir() {
-  filesystem::path p = filesystem::path(HomeDirectory()) / "Downloads";
-  if (filesystem::exists(p) && filesystem::is_directory(p))
-    return p.string();
-  return HomeDirectory();
-}
+  if (PointInQuad({expanded.x, expanded.y}, tl, tr, br, bl) ||
+      PointInQuad({expanded.x + expanded.width, expanded.y}, tl, tr, br, bl) ||
+      PointInQuad({expanded.x + expanded.width, expanded.y + expanded.height}, tl,
+                  tr, br, bl) ||
+      PointInQuad({expanded.x, expanded.y + expanded.height}, tl, tr, br, bl))
+    return true;
+  if (CheckCollisionPointRec(tl, expanded) ||
+      CheckCollisionPointRec(tr, expanded) ||
+      CheckCollisionPointRec(br, expanded) ||
+      CheckCollisionPointRec(bl, expanded))
+    return true;
 
-bool LooksLikeDirPath(const string &value) {
-  if (value.empty())
-    return false;
-  if (value.back() == '/' || value.back() == '\\')
+  if (LineIntersectsRect(tl, tr, expanded) ||
+      LineIntersectsRect(tr, br, expanded) ||
+      LineIntersectsRect(br, bl, expanded) ||
+      LineIntersectsRect(bl, tl, expanded))
     return true;
-  filesystem::path p(ExpandUserPath(value));
-  return filesystem::exists(p) && filesystem::is_directory(p);
-}
 
-bool HasDirectoryPart(const string &value) {
-  filesystem::path p(value);
-  return p.has_parent_path();
+  return false;
 }
 
-string StripQuotes(const string &s) {
-  string t = Trim(s);
-  if (t.size() >= 2) {
-    char a = t.front();
-    char b = t.back();
-    if ((a == '\'' && b == '\'') || (a == '"' && b == '"'))
-      return t.substr(1, t.size() - 2);
+bool IsPointOnElement(const Element &el, Vector2 p, float tolerance) {
+  Vector2 localP = p;
+  if (el.rotation != 0.0f && el.type != CIRCLE_MODE &&
+      el.type != DOTTEDCIRCLE_MODE) {
+    Vector2 center = ElementCenterLocal(el);
+    localP = RotatePoint(p, center, -el.rotation);
   }
-  return t;
-}
-
-vector<string> TokenizeQuotedArgs(const string &raw) {
-  vector<string> tokens;
-  string current;
-  bool inQuote = false;
-  char quoteChar = '\0';
-  for (size_t i = 0; i < raw.size(); i++) {
-    char c = raw[i];
-    if (inQuote) {
-      if (c == quoteChar) {
-        inQuote = false;
-      } else if (c == '\\' && i + 1 < raw.size()) {
-        current.push_back(raw[++i]);
-      } else {
-        current.push_back(c);
-      }
-      continue;
+  float tol = max(0.5f, tolerance);
+  if (el.type == LINE_MODE || el.type == DOTTEDLINE_MODE ||
+      el.type == ARROWLINE_MODE) {
+    if (Vector2Distance(el.start, el.end) < 0.001f) {
+      return Vector2Distance(localP, el.start) <= (el.strokeWidth * 0.5f + tol);
     }
-    if (c == '\'' || c == '"') {
-      inQuote = true;
-      quoteChar = c;
-      continue;
+    return CheckCollisionPointLine(localP, el.start, el.end,
+                                   el.strokeWidth * 0.5f + tol);
+  }
+  if (el.type == CIRCLE_MODE || el.type == DOTTEDCIRCLE_MODE) {
+    float r = Vector2Distance(el.start, el.end);
+    float d = Vector2Distance(localP, el.start);
+    return d <= (r + el.strokeWidth * 0.5f + tol);
+  }
+  if (el.type == RECTANGLE_MODE || el.type == DOTTEDRECT_MODE) {
+    float x0 = min(el.start.x, el.end.x);
+    float y0 = min(el.start.y, el.end.y);
+    float x1 = max(el.start.x, el.end.x);
+    float y1 = max(el.start.y, el.end.y);
+    Rectangle filled = {x0 - tol, y0 - tol, (x1 - x0) + 2 * tol,
+                        (y1 - y0) + 2 * tol};
+    if (CheckCollisionPointRec(localP, filled))
+      return true;
+    Vector2 a = {x0, y0};
+    Vector2 b = {x1, y0};
+    Vector2 c = {x1, y1};
+    Vector2 d = {x0, y1};
+    float t = el.strokeWidth * 0.5f + tol;
+    return CheckCollisionPointLine(localP, a, b, t) ||
+           CheckCollisionPointLine(localP, b, c, t) ||
+           CheckCollisionPointLine(localP, c, d, t) ||
+           CheckCollisionPointLine(localP, d, a, t);
+  }
+  if (el.type == TRIANGLE_MODE || el.type == DOTTEDTRIANGLE_MODE) {
+    Vector2 apex, left, right;
+    GetTriangleVerticesLocal(el, apex, left, right);
+    float t = el.strokeWidth * 0.5f + tol;
+    if (PointInTriangle(localP, apex, left, right))
+      return true;
+    return CheckCollisionPointLine(localP, apex, left, t) ||
+           CheckCollisionPointLine(localP, left, right, t) ||
+           CheckCollisionPointLine(localP, right, apex, t);
+  }
+  if (el.type == PEN_MODE) {
+    if (el.path.empty())
+      return false;
+    if (el.path.size() == 1)
+      return Vector2Distance(localP, el.path[0]) <=
+             (el.strokeWidth * 0.5f + tol);
+    float t = el.strokeWidth * 0.5f + tol;
+    for (size_t i = 1; i < el.path.size(); i++) {
+      if (CheckCollisionPointLine(localP, el.path[i - 1], el.path[i], t))
+        return true;
     }
-    if (isspace((unsigned char)c)) {
-      if (!current.empty()) {
-        tokens.push_back(current);
-        current.clear();
-      }
-      continue;
+    return false;
+  }
+  if (el.type == POINTS_MODE) {
+    float t = el.strokeWidth * 0.5f + tol;
+    for (const auto &q : el.path) {
+      float dx = q.x - localP.x;
+      float dy = q.y - localP.y;
+      if (dx * dx + dy * dy <= t * t)
+        return true;
     }
-    current.push_back(c);
+    return false;
   }
-  if (!current.empty())
-    tokens.push_back(current);
-  return tokens;
+  if (el.type == GROUP_MODE) {
+    for (const auto &child : el.children) {
+      if (IsPointOnElement(child, p, tolerance))
+        return true;
+    }
+    return false;
+  }
+  if (el.type == TEXT_MODE || el.type == INSTANCE_MODE) {
+    return CheckCollisionPointRec(localP, el.GetLocalBounds());
+  }
+  return false;
 }
 
-bool IsExportType(const string &v) {
-  string t = ToLower(Trim(v));
-  return t == "png" || t == "svg" || t == "jpg" || t == "jpeg";
+bool IsPointOnSelectedBounds(const Canvas &canvas, Vector2 p) {
+  for (int i = (int)canvas.selectedIndices.size() - 1; i >= 0; --i) {
+    int idx = canvas.selectedIndices[i];
+    if (idx >= 0 && idx < (int)canvas.elements.size()) {
+      if (IsPointInSelectionVisual(canvas.elements[idx], p))
+        return true;
+    }
+  }
+  return false;
 }
 
-bool IsExportScopeToken(const string &v) {
-  string t = ToLower(Trim(v));
-  return t == "all" || t == "selected" || t == "frame";
+vector<int> GetSelectedIDs(const Canvas &canvas) {
+  vector<int> ids;
+  for (int idx : canvas.selectedIndices) {
+    if (idx >= 0 && idx < (int)canvas.elements.size()) {
+      int id = canvas.elements[idx].uniqueID;
+      if (id >= 0 && find(ids.begin(), ids.end(), id) == ids.end())
+        ids.push_back(id);
+    }
+  }
+  return ids;
 }
 
-ExportScope ParseExportScope(const string &v) {
-  string t = ToLower(Trim(v));
-  if (t == "selected")
-    return EXPORT_SELECTED;
-  if (t == "frame")
-    return EXPORT_FRAME;
-  return EXPORT_ALL;
+void ReselectByIDs(Canvas &canvas, const vector<int> &ids) {
+  canvas.selectedIndices.clear();
+  for (int id : ids) {
+    int idx = FindElementIndexByID(canvas, id);
+    if (idx != -1)
+      canvas.selectedIndices.push_back(idx);
+  }
 }
 
-string NormalizeExportType(const string &v) {
-  string t = ToLower(Trim(v));
-  if (t == "jpeg")
-    return "jpg";
-  return t;
-}
+void MoveSelectionZOrder(Canvas &canvas, bool forward) {
+  vector<int> selectedIDs = GetSelectedIDs(canvas);
+  if (selectedIDs.empty())
+    return;
 
-string EnsureExt(string filename, const string &extNoDot) {
-  filesystem::path p(filename);
-  string ext = "." + extNoDot;
-  if (ToLower(p.extension().string()) != ToLower(ext))
-    p.replace_extension(ext);
-  return p.string();
-}
+  SaveBackup(canvas);
+  RestoreZOrder(canvas);
 
-Rectangle ExpandRect(const Rectangle &r, float pad) {
-  return {r.x - pad, r.y - pad, r.width + pad * 2.0f, r.height + pad * 2.0f};
-}
+  vector<bool> isSelected(canvas.elements.size(), false);
+  for (int id : selectedIDs) {
+    int idx = FindElementIndexByID(canvas, id);
+    if (idx != -1)
+      isSelected[idx] = true;
+  }
 
-bool UnionBounds(const vector<Element> &elements, Rectangle &out) {
-  if (elements.empty())
-    return false;
-  Rectangle b = elements[0].GetBounds();
-  float minX = b.x;
-  float minY = b.y;
-  float maxX = b.x + b.width;
-  float maxY = b.y + b.height;
-  for (size_t i = 1; i < elements.size(); i++) {
-    Rectangle e = elements[i].GetBounds();
-    minX = min(minX, e.x);
-    minY = min(minY, e.y);
-    maxX = max(maxX, e.x + e.width);
-    maxY = max(maxY, e.y + e.height);
+  if (forward) {
+    for (int i = (int)canvas.elements.size() - 2; i >= 0; --i) {
+      if (isSelected[i] && !isSelected[i + 1]) {
+        swap(canvas.elements[i], canvas.elements[i + 1]);
+        swap(isSelected[i], isSelected[i + 1]);
+      }
+    }
+  } else {
+    for (int i = 1; i < (int)canvas.elements.size(); ++i) {
+      if (isSelected[i] && !isSelected[i - 1]) {
+        swap(canvas.elements[i], canvas.elements[i - 1]);
+        swap(isSelected[i], isSelected[i - 1]);
+      }
+    }
   }
-  out = {minX, minY, max(1.0f, maxX - minX), max(1.0f, maxY - minY)};
-  return true;
-}
 
-string ResolveDefaultDir(const string &preferred, const string &fallback) {
-  string p = ExpandUserPath(preferred);
-  if (!p.empty())
-    return p;
-  return fallback;
+  ReselectByIDs(canvas, selectedIDs);
 }
 
-bool EnsureDirectory(const string &dirPath) {
-  filesystem::path dir(ExpandUserPath(dirPath));
-  if (dir.empty())
-    return false;
-  if (filesystem::exists(dir))
-    return filesystem::is_directory(dir);
-  error_code ec;
-  return filesystem::create_directories(dir, ec);
+void DrawDashedLine(Vector2 start, Vector2 end, float width, Color color) {
+  float totalLen = Vector2Distance(start, end);
+  if (totalLen < 1.0f)
+    return;
+  Vector2 dir = Vector2Normalize(Vector2Subtract(end, start));
+  float dashLen = max(width * 2.0f, 6.0f);
+  float gapLen = max(width * 1.2f, 4.0f);
+  for (float i = 0.0f; i < totalLen; i += (dashLen + gapLen)) {
+    float endDist = min(i + dashLen, totalLen);
+    Vector2 s = Vector2Add(start, Vector2Scale(dir, i));
+    Vector2 e = Vector2Add(start, Vector2Scale(dir, endDist));
+    DrawLineEx(s, e, width, color);
+  }
 }
 
-string JoinPath(const string &dirPath, const string &fileName) {
-  filesystem::path p = filesystem::path(ExpandUserPath(dirPath)) / fileName;
-  return p.string();
+void DrawArrowLine(Vector2 start, Vector2 end, float width, Color color) {
+  DrawLineEx(start, end, width, color);
+  float angle = atan2f(end.y - start.y, end.x - start.x);
+  float headSize = max(15.0f, width * 3.0f);
+  float lineLen = Vector2Distance(start, end);
+  if (headSize > lineLen * 0.7f)
+    headSize = lineLen * 0.7f;
+  Vector2 p1 = {end.x - headSize * cosf(angle - PI / 6),
+                end.y - headSize * sinf(angle - PI / 6)};
+  Vector2 p2 = {end.x - headSize * cosf(angle + PI / 6),
+                end.y - headSize * sinf(angle + PI / 6)};
+  DrawLineEx(end, p1, width, color);
+  DrawLineEx(end, p2, width, color);
 }
 
-string DefaultSaveTargetPath(const AppConfig &cfg) {
-  return JoinPath(ResolveDefaultDir(cfg.defaultSaveDir, DefaultDownloadsDir()),
-                  "untitled.toggle");
+void DrawDashedRing(Vector2 center, float radius, float width, Color color) {
+  if (radius <= 0.5f)
+    return;
+
+  float circumference = 2.0f * PI * radius;
+  float dashArcLen = max(width * 2.0f, 6.0f);
+  float gapArcLen = max(width * 1.2f, 4.0f);
+  float dashDeg = (dashArcLen / circumference) * 360.0f;
+  float gapDeg = (gapArcLen / circumference) * 360.0f;
+
+  if (dashDeg <= 0.0f)
+    return;
+
+  for (float a = 0.0f; a < 360.0f; a += (dashDeg + gapDeg)) {
+    float aEnd = min(a + dashDeg, 360.0f);
+    DrawRing(center, radius - width * 0.5f, radius + width * 0.5f, a, aEnd, 24,
+             color);
+  }
 }
 
-string EllipsizeTail(const Font &font, const string &text, float size, float spacing,
-                    float maxWidth) {
-  if (MeasureTextEx(font, text.c_str(), size, spacing).x <= maxWidth)
-    return text;
-  string ell = "...";
-  if (MeasureTextEx(font, ell.c_str(), size, spacing).x > maxWidth)
-    return "";
-  string out = text;
-  while (!out.empty()) {
-    out.pop_back();
-    string candidate = out + ell;
-    if (MeasureTextEx(font, candidate.c_str(), size, spacing).x <= maxWidth)
-      return candidate;
+void DrawElement(const Element &el, const Font &font, float textSize) {
+  Vector2 s = el.start;
+  Vector2 e = el.end;
+  if (el.rotation != 0.0f &&
+      (el.type == LINE_MODE || el.type == DOTTEDLINE_MODE ||
+       el.type == ARROWLINE_MODE)) {
+    Vector2 center = ElementCenterLocal(el);
+    s = RotatePoint(el.start, center, el.rotation);
+    e = RotatePoint(el.end, center, el.rotation);
+  }
+  if (el.type == LINE_MODE)
+    DrawLineEx(s, e, el.strokeWidth, el.color);
+  else if (el.type == DOTTEDLINE_MODE)
+    DrawDashedLine(s, e, el.strokeWidth, el.color);
+  else if (el.type == ARROWLINE_MODE)
+    DrawArrowLine(s, e, el.strokeWidth, el.color);
+  else if (el.type == CIRCLE_MODE)
+    DrawRing(el.start, Vector2Distance(el.start, el.end) - el.strokeWidth / 2,
+             Vector2Distance(el.start, el.end) + el.strokeWidth / 2, 0, 360, 60,
+             el.color);
+  else if (el.type == DOTTEDCIRCLE_MODE)
+    DrawDashedRing(el.start, Vector2Distance(el.start, el.end), el.strokeWidth,
+                   el.color);
+  else if (el.type == RECTANGLE_MODE) {
+    Rectangle r = {min(el.start.x, el.end.x), min(el.start.y, el.end.y),
+                   abs(el.end.x - el.start.x), abs(el.end.y - el.start.y)};
+    if (el.rotation == 0.0f) {
+      DrawRectangleLinesEx(r, el.strokeWidth, el.color);
+    } else {
+      Vector2 center = ElementCenterLocal(el);
+      Vector2 origin = {r.width * 0.5f, r.height * 0.5f};
+      Rectangle rect = {center.x, center.y, r.width, r.height};
+      DrawRectanglePro(rect, origin, el.rotation * RAD2DEG, Fade(el.color, 0.0f));
+      float rad = el.rotation;
+      Vector2 hx = {cosf(rad) * (r.width * 0.5f),
+                    sinf(rad) * (r.width * 0.5f)};
+      Vector2 hy = {-sinf(rad) * (r.height * 0.5f),
+                    cosf(rad) * (r.height * 0.5f)};
+      Vector2 c1 = Vector2Subtract(Vector2Subtract(center, hx), hy);
+      Vector2 c2 = Vector2Add(Vector2Subtract(center, hx), hy);
+      Vector2 c3 = Vector2Add(Vector2Add(center, hx), hy);
+      Vector2 c4 = Vector2Subtract(Vector2Add(center, hx), hy);
+      DrawLineEx(c1, c2, el.strokeWidth, el.color);
+      DrawLineEx(c2, c3, el.strokeWidth, el.color);
+      DrawLineEx(c3, c4, el.strokeWidth, el.color);
+      DrawLineEx(c4, c1, el.strokeWidth, el.color);
+    }
+  }
+  else if (el.type == DOTTEDRECT_MODE) {
+    Rectangle r = {min(el.start.x, el.end.x), min(el.start.y, el.end.y),
+                   abs(el.end.x - el.start.x), abs(el.end.y - el.start.y)};
+    float overlap = el.strokeWidth * 0.5f;
+    if (el.rotation == 0.0f) {
+      DrawDashedLine({r.x - overlap, r.y}, {r.x + r.width + overlap, r.y},
+                     el.strokeWidth, el.color);
+      DrawDashedLine({r.x + r.width, r.y - overlap},
+                     {r.x + r.width, r.y + r.height + overlap}, el.strokeWidth,
+                     el.color);
+      DrawDashedLine({r.x + r.width + overlap, r.y + r.height},
+                     {r.x - overlap, r.y + r.height}, el.strokeWidth, el.color);
+      DrawDashedLine({r.x, r.y + r.height + overlap}, {r.x, r.y - overlap},
+                     el.strokeWidth, el.color);
+    } else {
+      Vector2 center = ElementCenterLocal(el);
+      float rad = el.rotation;
+      Vector2 hx = {cosf(rad) * (r.width * 0.5f),
+                    sinf(rad) * (r.width * 0.5f)};
+      Vector2 hy = {-sinf(rad) * (r.height * 0.5f),
+                    cosf(rad) * (r.height * 0.5f)};
+      Vector2 c1 = Vector2Subtract(Vector2Subtract(center, hx), hy);
+      Vector2 c2 = Vector2Add(Vector2Subtract(center, hx), hy);
+      Vector2 c3 = Vector2Add(Vector2Add(center, hx), hy);
+      Vector2 c4 = Vector2Subtract(Vector2Add(center, hx), hy);
+      DrawDashedLine(c1, c2, el.strokeWidth, el.color);
+      DrawDashedLine(c2, c3, el.strokeWidth, el.color);
+      DrawDashedLine(c3, c4, el.strokeWidth, el.color);
+      DrawDashedLine(c4, c1, el.strokeWidth, el.color);
+    }
+  } else if (el.type == TRIANGLE_MODE || el.type == DOTTEDTRIANGLE_MODE) {
+    Vector2 apex, left, right;
+    GetTriangleVerticesLocal(el, apex, left, right);
+    if (el.rotation != 0.0f) {
+      Vector2 center = ElementCenterLocal(el);
+      apex = RotatePoint(apex, center, el.rotation);
+      left = RotatePoint(left, center, el.rotation);
+      right = RotatePoint(right, center, el.rotation);
+    }
+    if (el.type == DOTTEDTRIANGLE_MODE) {
+      DrawDashedLine(apex, left, el.strokeWidth, el.color);
+      DrawDashedLine(left, right, el.strokeWidth, el.color);
+      DrawDashedLine(right, apex, el.strokeWidth, el.color);
+    } else {
+      DrawLineEx(apex, left, el.strokeWidth, el.color);
+      DrawLineEx(left, right, el.strokeWidth, el.color);
+      DrawLineEx(right, apex, el.strokeWidth, el.color);
+    }
+  } else if (el.type == PEN_MODE) {
+    int pointCount = (int)el.path.size();
+
+    if (pointCount == 1) {
+      Vector2 p = el.path[0];
+      if (el.rotation != 0.0f) {
+        Vector2 center = ElementCenterLocal(el);
+        p = RotatePoint(p, center, el.rotation);
+      }
+      DrawCircleV(p, el.strokeWidth / 2, el.color);
+    }
+    else if (pointCount >= 4) {
+      if (el.rotation == 0.0f) {
+        DrawSplineCatmullRom(el.path.data(), pointCount, el.strokeWidth,
+                             el.color);
+      } else {
+        Vector2 center = ElementCenterLocal(el);
+        vector<Vector2> rotated;
+        rotated.reserve(el.path.size());
+        for (const auto &p : el.path)
+          rotated.push_back(RotatePoint(p, center, el.rotation));
+        DrawSplineCatmullRom(rotated.data(), (int)rotated.size(),
+                             el.strokeWidth, el.color);
+      }
+    }
+    else if (pointCount > 1) {
+      if (el.rotation == 0.0f) {
+        DrawLineStrip(el.path.data(), pointCount, el.color);
+      } else {
+        Vector2 center = ElementCenterLocal(el);
+        vector<Vector2> rotated;
+        rotated.reserve(el.path.size());
+        for (const auto &p : el.path)
+          rotated.push_back(RotatePoint(p, center, el.rotation));
+        DrawLineStrip(rotated.data(), (int)rotated.size(), el.color);
+      }
+    }
+  } else if (el.type == POINTS_MODE) {
+    Vector2 center = el.rotation != 0.0f ? ElementCenterLocal(el) : el.start;
+    float r = el.strokeWidth * 0.5f;
+    for (Vector2 p : el.path) {
+      if (el.rotation != 0.0f)
+        p = RotatePoint(p, center, el.rotation);
+      if (el.strokeWidth < 3.0f)
+        DrawRectangleV({p.x - r, p.y - r}, {el.strokeWidth, el.strokeWidth},
+                       el.color);
+      else
+        DrawCircleV(p, r, el.color);
+    }
+  } else if (el.type == GROUP_MODE) {
+    for (const auto &child : el.children)
+      DrawElement(child, font, textSize);
+  } else if (el.type == TEXT_MODE) {
+    float size = (el.textSize > 0.0f) ? el.textSize : textSize;
+    if (el.rotation == 0.0f) {
+      DrawTextEx(font, el.text.c_str(), el.start, size, 2, el.color);
+    } else {
+      Vector2 center = ElementCenterLocal(el);
+      Vector2 origin = {center.x - el.start.x, center.y - el.start.y};
+      DrawTextPro(font, el.text.c_str(), center, origin, el.rotation * RAD2DEG,
+                  size, 2, el.color);
+    }
   }
-  return ell;
 }
 
-float DrawLabelValue(const Font &font, float x, float y, float size, float spacing,
-                     const string &label, const string &value, Color labelColor,
-                     Color valueColor) {
-  DrawTextEx(font, label.c_str(), {x, y}, size, spacing, labelColor);
-  float lx = MeasureTextEx(font, label.c_str(), size, spacing).x;
-  DrawTextEx(font, value.c_str(), {x + lx, y}, size, spacing, valueColor);
-  float vx = MeasureTextEx(font, value.c_str(), size, spacing).x;
-  return x + lx + vx;
+void UpdateTextBounds(Element &el, const Font &font, float fallbackTextSize) {
+  if (el.type != TEXT_MODE)
+    return;
+  float size = (el.textSize > 0.0f) ? el.textSize : fallbackTextSize;
+  Vector2 measured = MeasureTextEx(font, el.text.c_str(), size, 2);
+  el.end = {el.start.x + max(10.0f, measured.x), el.start.y + max(size, measured.y)};
 }
 
-string BackgroundTypeToString(BackgroundType t) {
-  if (t == BG_GRID)
-    return "grid";
-  if (t == BG_DOTTED)
-    return "dotted";
-  if (t == BG_GRAPH)
-    return "graph";
-  return "blank";
+void ApplyColorRecursive(Element &el, Color c) {
+  el.color = c;
+  for (auto &child : el.children)
+    ApplyColorRecursive(child, c);
 }
 
-bool ParseBackgroundType(const string &s, BackgroundType &out) {
-  string v = ToLower(Trim(s));
-  if (v == "blank") {
-    out = BG_BLANK;
-    return true;
-  }
-  if (v == "grid") {
-    out = BG_GRID;
-    return true;
-  }
-  if (v == "dotted") {
-    out = BG_DOTTED;
-    return true;
-  }
-  if (v == "graph") {
-    out = BG_GRAPH;
-    return true;
+void ApplyStrokeRecursive(Element &el, float width) {
+  if (el.type != TEXT_MODE)
+    el.strokeWidth = width;
+  for (auto &child : el.children)
+    ApplyStrokeRecursive(child, width);
+}
+
+void ApplyTextSizeRecursive(Element &el, float size, const Font &font,
+                            float fallbackTextSize) {
+  if (el.type == TEXT_MODE) {
+    el.textSize = size;
+    UpdateTextBounds(el, font, fallbackTextSize);
   }
-  return false;
+  for (auto &child : el.children)
+    ApplyTextSizeRecursive(child, size, font, fallbackTextSize);
 }
 
-bool ParsePositiveFloat(const string &s, float &value) {
-  if (s.empty())
-    return false;
-  char *endPtr = nullptr;
-  value = strtof(s.c_str(), &endPtr);
-  return endPtr != s.c_str() && *endPtr == '\0';
+void RecomputeTextBoundsRecursive(Element &el, const Font &font,
+                                  float fallbackTextSize) {
+  if (el.type == TEXT_MODE)
+    UpdateTextBounds(el, font, fallbackTextSize);
+  for (auto &child : el.children)
+    RecomputeTextBoundsRecursive(child, font, fallbackTextSize);
 }
 
-bool ParseIntValue(const string &s, int &value) {
-  if (s.empty())
-    return false;
-  char *endPtr = nullptr;
-  long v = strtol(s.c_str(), &endPtr, 10);
-  if (endPtr == s.c_str() || *endPtr != '\0')
-    return false;
-  value = (int)v;
-  return true;
+Vector2 WorldZeroLocal(const Canvas &canvas) {
+  return {(float)-canvas.originX, (float)-canvas.originY};
 }
 
-string FormatGraphNumber(float v) {
-  int rounded = (int)roundf(v);
-  if (rounded == 0)
-    return "0";
-  return to_string(rounded);
+void MoveElement(Element &el, Vector2 delta) {
+  el.start = Vector2Add(el.start, delta);
+  el.end = Vector2Add(el.end, delta);
+  for (auto &p : el.path)
+    p = Vector2Add(p, delta);
+  for (auto &child : el.children)
+    MoveElement(child, delta);
 }
 
-float ChooseGraphStepUnits(float unit, float zoom, float minPx, float maxPx) {
-  float safeUnit = max(0.0001f, unit);
-  float safeZoom = max(0.0001f, zoom);
-  float lo = min(minPx, maxPx);
-  float hi = max(minPx, maxPx);
-  float targetPx = lo;
-  float targetUnits = targetPx / (safeUnit * safeZoom);
-  if (targetUnits <= 0.0f)
-    targetUnits = 1.0f;
-  int expBase = (int)floor(log10f(targetUnits));
-  float best = 0.0f;
-  float bestScore = numeric_limits<float>::max();
-  for (int exp = expBase - 4; exp <= expBase + 4; ++exp) {
-    float base = powf(10.0f, (float)exp);
-    for (float mult : {1.0f, 2.0f, 5.0f}) {
-      float step = mult * base;
-      float px = step * safeUnit * safeZoom;
-      float penalty = 0.0f;
-      if (px < lo)
-        penalty = (lo - px) * 2.0f;
-      else if (px > hi)
-        penalty = (px - hi) * 2.0f;
-      float score = penalty + fabsf(px - targetPx);
-      if (score < bestScore) {
-        bestScore = score;
-        best = step;
-      }
-    }
-  }
-  if (best <= 0.0f)
-    best = 1.0f;
-  return best;
+void RotateElementGeometry(Element &el, Vector2 center, float radians) {
+  el.start = RotatePoint(el.start, center, radians);
+  el.end = RotatePoint(el.end, center, radians);
+  for (auto &p : el.path)
+    p = RotatePoint(p, center, radians);
+  for (auto &child : el.children)
+    RotateElementGeometry(child, center, radians);
+  if (el.type != CIRCLE_MODE && el.type != DOTTEDCIRCLE_MODE)
+    el.rotation += radians;
 }
 
-bool ParseBool(const string &s, bool &value) {
-  string v = ToLower(Trim(s));
-  if (v == "1" || v == "true" || v == "yes" || v == "on") {
-    value = true;
-    return true;
-  }
-  if (v == "0" || v == "false" || v == "no" || v == "off") {
-    value = false;
-    return true;
+void ScaleElementGeometry(Element &el, Vector2 center, float sx, float sy,
+                          const Font &font, float fallbackTextSize) {
+  auto scalePoint = [&](Vector2 p) {
+    return Vector2{center.x + (p.x - center.x) * sx,
+                   center.y + (p.y - center.y) * sy};
+  };
+  el.start = scalePoint(el.start);
+  el.end = scalePoint(el.end);
+  for (auto &p : el.path)
+    p = scalePoint(p);
+  for (auto &child : el.children)
+    ScaleElementGeometry(child, center, sx, sy, font, fallbackTextSize);
+  if (el.type == TEXT_MODE) {
+    float size = (el.textSize > 0.0f) ? el.textSize : fallbackTextSize;
+    float scale = max(fabsf(sx), fabsf(sy));
+    el.textSize = max(1.0f, size * scale);
+    UpdateTextBounds(el, font, fallbackTextSize);
   }
-  return false;
 }
 
-int KeyFromToken(const string &token) {
-  string k = ToLower(Trim(token));
-  if (k.size() == 1) {
-    char c = k[0];
-    if (c >= 'a' && c <= 'z')
-      return KEY_A + (c - 'a');
-    if (c >= '0' && c <= '9')
-      return KEY_ZERO + (c - '0');
-  }
-  if (k == "escape" || k == "esc")
-    return KEY_ESCAPE;
-  if (k == "enter" || k == "return")
-    return KEY_ENTER;
-  if (k == "backspace")
-    return KEY_BACKSPACE;
-  if (k == "space")
-    return KEY_SPACE;
-  if (k == "tab")
-    return KEY_TAB;
-  if (k == "semicolon" || k == ";")
-    return KEY_SEMICOLON;
-  if (k == "minus" || k == "-")
-    return KEY_MINUS;
-  if (k == "equal" || k == "=")
-    return KEY_EQUAL;
-  if (k == "left_bracket" || k == "[")
-    return KEY_LEFT_BRACKET;
-  if (k == "right_bracket" || k == "]")
-    return KEY_RIGHT_BRACKET;
-  if (k == "kp_add")
-    return KEY_KP_ADD;
-  if (k == "kp_subtract")
-    return KEY_KP_SUBTRACT;
-  return KEY_NULL;
-}
+void RestoreZOrder(Canvas &canvas) {
+  if (canvas.selectedIndices.empty())
+    return;
 
-string KeyToToken(int key) {
-  if (key >= KEY_A && key <= KEY_Z) {
-    char c = (char)('A' + (key - KEY_A));
-    return string(1, c);
-  }
-  if (key >= KEY_ZERO && key <= KEY_NINE) {
-    char c = (char)('0' + (key - KEY_ZERO));
-    return string(1, c);
+  struct PendingRestore {
+    Element el;
+    int target;
+  };
+  vector<PendingRestore> toRestore;
+
+ sort(canvas.selectedIndices.begin(), canvas.selectedIndices.end(),
+       greater<int>());
+
+  for (int idx : canvas.selectedIndices) {
+    if (idx >= 0 && idx < (int)canvas.elements.size() &&
+        canvas.elements[idx].originalIndex != -1) {
+      toRestore.push_back(
+          {canvas.elements[idx], canvas.elements[idx].originalIndex});
+      canvas.elements.erase(canvas.elements.begin() + idx);
+    }
   }
-  if (key == KEY_ESCAPE)
-    return "Escape";
-  if (key == KEY_ENTER)
-    return "Enter";
-  if (key == KEY_BACKSPACE)
-    return "Backspace";
-  if (key == KEY_SPACE)
-    return "Space";
-  if (key == KEY_TAB)
-    return "Tab";
-  if (key == KEY_SEMICOLON)
-    return "Semicolon";
-  if (key == KEY_MINUS)
-    return "Minus";
-  if (key == KEY_EQUAL)
-    return "Equal";
-  if (key == KEY_LEFT_BRACKET)
-    return "Left_Bracket";
-  if (key == KEY_RIGHT_BRACKET)
-    return "Right_Bracket";
-  if (key == KEY_KP_ADD)
-    return "Kp_Add";
-  if (key == KEY_KP_SUBTRACT)
-    return "Kp_Subtract";
-  return "Unknown";
-}
 
-bool ParseKeyBinding(const string &raw, KeyBinding &binding) {
-  binding = {};
-  vector<string> tokens = Split(raw, '+');
-  if (tokens.empty())
-    return false;
-  for (string t : tokens) {
-    t = ToLower(Trim(t));
-    if (t.empty())
-      continue;
-    if (t == "shift")
-      binding.shift = true;
-    else if (t == "ctrl" || t == "control")
-      binding.ctrl = true;
-    else if (t == "alt")
-      binding.alt = true;
-    else {
-      int k = KeyFromToken(t);
-      if (k == KEY_NULL)
-        return false;
-      binding.key = k;
+  sort(toRestore.begin(), toRestore.end(),
+       [](const PendingRestore &a, const PendingRestore &b) {
+         return a.target < b.target;
+       });
+
+  for (auto &item : toRestore) {
+    item.el.originalIndex = -1;
+    if (item.target >= (int)canvas.elements.size()) {
+      canvas.elements.push_back(item.el);
+    } else {
+      canvas.elements.insert(canvas.elements.begin() + item.target, item.el);
     }
   }
-  return binding.key != KEY_NULL;
+
+  canvas.selectedIndices.clear();
 }
 
-vector<KeyBinding> ParseBindingList(const string &raw) {
-  vector<KeyBinding> out;
-  for (const string &entry : Split(raw, '|')) {
-    KeyBinding b;
-    if (ParseKeyBinding(entry, b))
-      out.push_back(b);
-  }
-  return out;
+vector<string> Split(const string &s, char sep) {
+  vector<string> parts;
+  string part;
+  stringstream ss(s);
+  while (getline(ss, part, sep))
+    parts.push_back(part);
+  return parts;
 }
 
-bool IsBindingPressed(const KeyBinding &b, bool shiftDown, bool ctrlDown,
-                     bool altDown) {
-  if (b.key == KEY_NULL || !IsKeyPressed(b.key))
-    return false;
-  return (b.shift == shiftDown) && (b.ctrl == ctrlDown) && (b.alt == altDown);
+string Trim(const string &s) {
+  size_t begin = s.find_first_not_of(" \t\r\n");
+  if (begin == string::npos)
+    return "";
+  size_t end = s.find_last_not_of(" \t\r\n");
+  return s.substr(begin, end - begin + 1);
 }
 
-bool IsActionPressed(const AppConfig &cfg, const string &action, bool shiftDown,
-                     bool ctrlDown, bool altDown) {
-  auto it = cfg.keymap.find(action);
-  if (it == cfg.keymap.end())
-    return false;
-  for (const auto &binding : it->second) {
-    if (IsBindingPressed(binding, shiftDown, ctrlDown, altDown))
-      return true;
-  }
-  return false;
+string ToLower(string s) {
+  for (char &c : s)
+    c = (char)tolower((unsigned char)c);
+  return s;
 }
 
-int PrimaryKeyForAction(const AppConfig &cfg, const string &action) {
-  auto it = cfg.keymap.find(action);
-  if (it == cfg.keymap.end() || it->second.empty())
-    return KEY_NULL;
-  return it->second[0].key;
+bool IsPathSeparator(char c) { return c == '/' || c == '\\'; }
+
+string HomeDirectory() {
+  const char *home = getenv("HOME");
+  if (home && *home)
+    return home;
+  const char *userProfile = getenv("USERPROFILE");
+  if (userProfile && *userProfile)
+    return userProfile;
+  return ".";
 }
 
-void AddDefaultBinding(AppConfig &cfg, const string &action,
-                       const string &bindingSpec) {
-  cfg.keymap[action] = ParseBindingList(bindingSpec);
+string ExpandUserPath(string path) {
+  path = Trim(path);
+  if (path == "~")
+    return HomeDirectory();
+  if (path.rfind("~/", 0) == 0 || path.rfind("~\\", 0) == 0)
+    return HomeDirectory() + path.substr(1);
+  return path;
 }
 
-void SetDefaultKeymap(AppConfig &cfg) {
-  AddDefaultBinding(cfg, "open_command_mode", "Shift+Semicolon");
-  AddDefaultBinding(cfg, "zoom_in", "Shift+Equal|Kp_Add");
-  AddDefaultBinding(cfg, "zoom_out", "Shift+Minus|Kp_Subtract");
+string DefaultDownloadsDir() {
+  filesystem::path p = filesystem::path(HomeDirectory()) / "Downloads";
+  if (filesystem::exists(p) && filesystem::is_directory(p))
+    return p.string();
+  return HomeDirectory();
+}
+
+bool LooksLikeDirPath(const string &value) {
+  if (value.empty())
+    return false;
+  if (value.back() == '/' || value.back() == '\\')
+    return true;
+  filesystem::path p(ExpandUserPath(value));
+  return filesystem::exists(p) && filesystem::is_directory(p);
+}
+
+bool HasDirectoryPart(const string &value) {
+  filesystem::path p(value);
+  return p.has_parent_path();
+}
+
+string StripQuotes(const string &s) {
+  string t = Trim(s);
+  if (t.size() >= 2) {
+    char a = t.front();
+    char b = t.back();
+    if ((a == '\'' && b == '\'') || (a == '"' && b == '"'))
+      return t.substr(1, t.size() - 2);
+  }
+  return t;
+}
+
+vector<string> TokenizeQuotedArgs(const string &raw) {
+  vector<string> tokens;
+  string current;
+  bool inQuote = false;
+  char quoteChar = '\0';
+  for (size_t i = 0; i < raw.size(); i++) {
+    char c = raw[i];
+    if (inQuote) {
+      if (c == quoteChar) {
+        inQuote = false;
+      } else if (c == '\\' && i + 1 < raw.size()) {
+        current.push_back(raw[++i]);
+      } else {
+        current.push_back(c);
+      }
+      continue;
+    }
+    if (c == '\'' || c == '"') {
+      inQuote = true;
+      quoteChar = c;
+      continue;
+    }
+    if (isspace((unsigned char)c)) {
+      if (!current.empty()) {
+        tokens.push_back(current);
+        current.clear();
+      }
+      continue;
+    }
+    current.push_back(c);
+  }
+  if (!current.empty())
+    tokens.push_back(current);
+  return tokens;
+}
+
+bool IsExportType(const string &v) {
+  string t = ToLower(Trim(v));
+  return t == "png" || t == "svg" || t == "jpg" || t == "jpeg";
+}
+
+bool IsExportScopeToken(const string &v) {
+  string t = ToLower(Trim(v));
+  return t == "all" || t == "selected" || t == "frame";
+}
+
+ExportScope ParseExportScope(const string &v) {
+  string t = ToLower(Trim(v));
+  if (t == "selected")
+    return EXPORT_SELECTED;
+  if (t == "frame")
+    return EXPORT_FRAME;
+  return EXPORT_ALL;
+}
+
+string NormalizeExportType(const string &v) {
+  string t = ToLower(Trim(v));
+  if (t == "jpeg")
+    return "jpg";
+  return t;
+}
+
+string EnsureExt(string filename, const string &extNoDot) {
+  filesystem::path p(filename);
+  string ext = "." + extNoDot;
+  if (ToLower(p.extension().string()) != ToLower(ext))
+    p.replace_extension(ext);
+  return p.string();
+}
+
+Rectangle ExpandRect(const Rectangle &r, float pad) {
+  return {r.x - pad, r.y - pad, r.width + pad * 2.0f, r.height + pad * 2.0f};
+}
+
+bool UnionBounds(const vector<Element> &elements, Rectangle &out) {
+  if (elements.empty())
+    return false;
+  Rectangle b = elements[0].GetBounds();
+  float minX = b.x;
+  float minY = b.y;
+  float maxX = b.x + b.width;
+  float maxY = b.y + b.height;
+  for (size_t i = 1; i < elements.size(); i++) {
+    Rectangle e = elements[i].GetBounds();
+    minX = min(minX, e.x);
+    minY = min(minY, e.y);
+    maxX = max(maxX, e.x + e.width);
+    maxY = max(maxY, e.y + e.height);
+  }
+  out = {minX, minY, max(1.0f, maxX - minX), max(1.0f, maxY - minY)};
+  return true;
+}
+
+const float kSymbolImpostorPx = 256.0f;
+const int kSymbolMaxDepth = 8;
+
+int FindSymbol(const vector<SymbolDef> &symbols, const string &name) {
+  for (size_t i = 0; i < symbols.size(); i++)
+    if (symbols[i].name == name)
+      return (int)i;
+  return -1;
+}
+
+Vector2 SymbolScale(const SymbolDef &sym, const Element &inst) {
+  return {(inst.end.x - inst.start.x) / max(1e-6f, sym.frame.width),
+          (inst.end.y - inst.start.y) / max(1e-6f, sym.frame.height)};
+}
+
+Vector2 RectCenter(const Rectangle &r) {
+  return {r.x + r.width * 0.5f, r.y + r.height * 0.5f};
+}
+
+// Each leaf turns about its own center, as the editor stores rotation.
+void RotateAboutPivot(Element &el, Vector2 pivot, float radians) {
+  if (el.type == GROUP_MODE) {
+    for (auto &child : el.children)
+      RotateAboutPivot(child, pivot, radians);
+    return;
+  }
+  Vector2 center = ElementCenterLocal(el);
+  MoveElement(el, Vector2Subtract(RotatePoint(center, pivot, radians), center));
+  if (el.type != CIRCLE_MODE && el.type != DOTTEDCIRCLE_MODE)
+    el.rotation += radians;
+}
+
+void ScaleStrokeRecursive(Element &el, float factor) {
+  el.strokeWidth *= factor;
+  for (auto &child : el.children)
+    ScaleStrokeRecursive(child, factor);
+}
+
+vector<Element> BakeInstance(const SymbolDef &sym, const Element &inst,
+                             const Font &font, float textSize) {
+  Vector2 scale = SymbolScale(sym, inst);
+  Vector2 from = RectCenter(sym.frame);
+  Vector2 to = ElementCenterLocal(inst);
+  vector<Element> out = sym.elements;
+  for (auto &el : out) {
+    ScaleElementGeometry(el, from, scale.x, scale.y, font, textSize);
+    ScaleStrokeRecursive(el, sqrtf(fabsf(scale.x * scale.y)));
+    MoveElement(el, Vector2Subtract(to, from));
+    if (inst.rotation != 0.0f)
+      RotateAboutPivot(el, to, inst.rotation);
+  }
+  return out;
+}
+
+void UnbakeInstance(const SymbolDef &sym, const Element &inst,
+                    vector<Element> &elements, const Font &font,
+                    float textSize) {
+  Vector2 scale = SymbolScale(sym, inst);
+  Vector2 to = RectCenter(sym.frame);
+  Vector2 from = ElementCenterLocal(inst);
+  for (auto &el : elements) {
+    if (inst.rotation != 0.0f)
+      RotateAboutPivot(el, from, -inst.rotation);
+    MoveElement(el, Vector2Subtract(to, from));
+    ScaleElementGeometry(el, to, 1.0f / scale.x, 1.0f / scale.y, font,
+                         textSize);
+    ScaleStrokeRecursive(el, 1.0f / sqrtf(fabsf(scale.x * scale.y)));
+  }
+}
+
+bool ContainsInstance(const Element &el) {
+  if (el.type == INSTANCE_MODE)
+    return true;
+  for (const auto &child : el.children)
+    if (ContainsInstance(child))
+      return true;
+  return false;
+}
+
+int CountInstances(const Element &el, const string &name) {
+  int count = el.type == INSTANCE_MODE && el.text == name;
+  for (const auto &child : el.children)
+    count += CountInstances(child, name);
+  return count;
+}
+
+void TouchSymbol(Canvas &canvas, const string &name) {
+  set<string> touched = {name};
+  for (bool grew = true; grew;) {
+    grew = false;
+    for (const auto &sym : canvas.symbols) {
+      if (touched.count(sym.name))
+        continue;
+      for (const auto &el : sym.elements) {
+        bool uses = false;
+        for (const auto &t : touched)
+          if ((uses = CountInstances(el, t) > 0))
+            break;
+        if (uses) {
+          touched.insert(sym.name);
+          grew = true;
+          break;
+        }
+      }
+    }
+  }
+  for (auto &sym : canvas.symbols)
+    if (touched.count(sym.name))
+      sym.version = canvas.nextSymbolVersion++;
+}
+
+void ClearElementIDs(Element &el) {
+  el.uniqueID = -1;
+  el.originalIndex = -1;
+  for (auto &child : el.children)
+    ClearElementIDs(child);
+}
+
+int CountElementIDs(const Element &el) {
+  int count = 1;
+  for (const auto &child : el.children)
+    count += CountElementIDs(child);
+  return count;
+}
+
+void AssignElementIDs(Element &el, int &next) {
+  el.uniqueID = next++;
+  el.originalIndex = -1;
+  for (auto &child : el.children)
+    AssignElementIDs(child, next);
+}
+
+Element ResolveInstances(const vector<SymbolDef> &symbols, const Element &el,
+                         const Font &font, float textSize, int depth = 0) {
+  Element out = el;
+  if (el.type == INSTANCE_MODE) {
+    int index = FindSymbol(symbols, el.text);
+    out.type = GROUP_MODE;
+    out.text.clear();
+    out.children.clear();
+    if (index >= 0 && depth < kSymbolMaxDepth)
+      out.children = BakeInstance(symbols[index], el, font, textSize);
+  }
+  for (auto &child : out.children)
+    if (ContainsInstance(child))
+      child = ResolveInstances(symbols, child, font, textSize, depth + 1);
+  return out;
+}
+
+void DrawSceneElement(const Canvas &canvas, const Element &el,
+                      bool onScreen = false, int depth = 0);
+
+void DrawInstance(const Canvas &canvas, const Element &inst, bool onScreen,
+                  int depth) {
+  int index = FindSymbol(canvas.symbols, inst.text);
+  if (index < 0 || depth >= kSymbolMaxDepth)
+    return;
+  const SymbolDef &sym = canvas.symbols[index];
+  Vector2 scale = SymbolScale(sym, inst);
+  Vector2 center = ElementCenterLocal(inst);
+  Vector2 frameCenter = RectCenter(sym.frame);
+  auto imp = canvas.impostors.find(sym.name);
+  if (onScreen && imp != canvas.impostors.end() &&
+      imp->second.version == sym.version) {
+    const Rectangle &area = imp->second.area;
+    float w = fabsf(scale.x) * area.width;
+    float h = fabsf(scale.y) * area.height;
+    if (max(w, h) * canvas.camera.zoom <= kSymbolImpostorPx * 0.5f) {
+      const Texture2D &tex = imp->second.target.texture;
+      // Render textures are stored bottom-up, hence the negative height.
+      Rectangle src = {0, 0, (float)tex.width, -(float)tex.height};
+      float left = scale.x >= 0.0f ? area.x : area.x + area.width;
+      float top = scale.y >= 0.0f ? area.y : area.y + area.height;
+      if (scale.x < 0.0f)
+        src.width = -src.width;
+      if (scale.y < 0.0f)
+        src.height = -src.height;
+      Vector2 origin = {-scale.x * (left - frameCenter.x),
+                        -scale.y * (top - frameCenter.y)};
+      DrawTexturePro(tex, src, {center.x, center.y, w, h}, origin,
+                     inst.rotation * RAD2DEG, WHITE);
+      return;
+    }
+  }
+  rlPushMatrix();
+  rlTranslatef(center.x, center.y, 0.0f);
+  rlRotatef(inst.rotation * RAD2DEG, 0.0f, 0.0f, 1.0f);
+  rlScalef(scale.x, scale.y, 1.0f);
+  rlTranslatef(-frameCenter.x, -frameCenter.y, 0.0f);
+  for (const auto &el : sym.elements)
+    DrawSceneElement(canvas, el, false, depth + 1);
+  rlPopMatrix();
+}
+
+void DrawSceneElement(const Canvas &canvas, const Element &el, bool onScreen,
+                      int depth) {
+  if (el.type == INSTANCE_MODE) {
+    DrawInstance(canvas, el, onScreen, depth);
+  } else if (el.type == GROUP_MODE && ContainsInstance(el)) {
+    for (const auto &child : el.children)
+      DrawSceneElement(canvas, child, onScreen, depth);
+  } else {
+    DrawElement(el, canvas.font, canvas.textSize);
+  }
+}
+
+// Runs before BeginDrawing since it switches render targets.
+void TickSymbols(Canvas &canvas) {
+  for (auto it = canvas.impostors.begin(); it != canvas.impostors.end();) {
+    if (FindSymbol(canvas.symbols, it->first) >= 0) {
+      ++it;
+      continue;
+    }
+    UnloadRenderTexture(it->second.target);
+    it = canvas.impostors.erase(it);
+  }
+  for (const auto &sym : canvas.symbols) {
+    SymbolImpostor &imp = canvas.impostors[sym.name];
+    if (imp.version == sym.version)
+      continue;
+    Rectangle area;
+    if (!UnionBounds(sym.elements, area))
+      area = sym.frame;
+    float pad = 1.0f;
+    for (const auto &el : sym.elements)
+      pad = max(pad, el.strokeWidth * 0.5f + 1.0f);
+    area = ExpandRect(area, pad);
+    float scale = kSymbolImpostorPx / max(area.width, area.height);
+    int w = max(1, (int)ceilf(area.width * scale));
+    int h = max(1, (int)ceilf(area.height * scale));
+    if (imp.target.id == 0 || imp.target.texture.width != w ||
+        imp.target.texture.height != h) {
+      if (imp.target.id != 0)
+        UnloadRenderTexture(imp.target);
+      imp.target = LoadRenderTexture(w, h);
+      SetTextureFilter(imp.target.texture, TEXTURE_FILTER_BILINEAR);
+    }
+    Camera2D camera = {};
+    camera.target = {area.x, area.y};
+    camera.zoom = scale;
+    BeginTextureMode(imp.target);
+    ClearBackground(BLANK);
+    BeginMode2D(camera);
+    for (const auto &el : sym.elements)
+      DrawSceneElement(canvas, el, false, 1);
+    EndMode2D();
+    EndTextureMode();
+    imp.area = {area.x, area.y, w / scale, h / scale};
+    imp.version = sym.version;
+  }
+}
+
+string ResolveDefaultDir(const string &preferred, const string &fallback) {
+  string p = ExpandUserPath(preferred);
+  if (!p.empty())
+    return p;
+  return fallback;
+}
+
+bool EnsureDirectory(const string &dirPath) {
+  filesystem::path dir(ExpandUserPath(dirPath));
+  if (dir.empty())
+    return false;
+  if (filesystem::exists(dir))
+    return filesystem::is_directory(dir);
+  error_code ec;
+  return filesystem::create_directories(dir, ec);
+}
+
+string JoinPath(const string &dirPath, const string &fileName) {
+  filesystem::path p = filesystem::path(ExpandUserPath(dirPath)) / fileName;
+  return p.string();
+}
+
+string DefaultSaveTargetPath(const AppConfig &cfg) {
+  return JoinPath(ResolveDefaultDir(cfg.defaultSaveDir, DefaultDownloadsDir()),
+                  "untitled.toggle");
+}
+
+string EllipsizeTail(const Font &font, const string &text, float size, float spacing,
+                    float maxWidth) {
+  if (MeasureTextEx(font, text.c_str(), size, spacing).x <= maxWidth)
+    return text;
+  string ell = "...";
+  if (MeasureTextEx(font, ell.c_str(), size, spacing).x > maxWidth)
+    return "";
+  string out = text;
+  while (!out.empty()) {
+    out.pop_back();
+    string candidate = out + ell;
+    if (MeasureTextEx(font, candidate.c_str(), size, spacing).x <= maxWidth)
+      return candidate;
+  }
+  return ell;
+}
+
+float DrawLabelValue(const Font &font, float x, float y, float size, float spacing,
+                     const string &label, const string &value, Color labelColor,
+                     Color valueColor) {
+  DrawTextEx(font, label.c_str(), {x, y}, size, spacing, labelColor);
+  float lx = MeasureTextEx(font, label.c_str(), size, spacing).x;
+  DrawTextEx(font, value.c_str(), {x + lx, y}, size, spacing, valueColor);
+  float vx = MeasureTextEx(font, value.c_str(), size, spacing).x;
+  return x + lx + vx;
+}
+
+string BackgroundTypeToString(BackgroundType t) {
+  if (t == BG_GRID)
+    return "grid";
+  if (t == BG_DOTTED)
+    return "dotted";
+  if (t == BG_GRAPH)
+    return "graph";
+  return "blank";
+}
+
+bool ParseBackgroundType(const string &s, BackgroundType &out) {
+  string v = ToLower(Trim(s));
+  if (v == "blank") {
+    out = BG_BLANK;
+    return true;
+  }
+  if (v == "grid") {
+    out = BG_GRID;
+    return true;
+  }
+  if (v == "dotted") {
+    out = BG_DOTTED;
+    return true;
+  }
+  if (v == "graph") {
+    out = BG_GRAPH;
+    return true;
+  }
+  return false;
+}
+
+bool ParsePositiveFloat(const string &s, float &value) {
+  if (s.empty())
+    return false;
+  char *endPtr = nullptr;
+  value = strtof(s.c_str(), &endPtr);
+  return endPtr != s.c_str() && *endPtr == '\0';
+}
+
+bool ParseByteSize(const string &s, long long &value) {
+  if (s.empty())
+    return false;
+  char *endPtr = nullptr;
+  double v = strtod(s.c_str(), &endPtr);
+  if (endPtr == s.c_str() || v < 0.0)
+    return false;
+  string suffix = ToLower(Trim(endPtr));
+  if (suffix == "k" || suffix == "kb")
+    v *= 1024.0;
+  else if (suffix == "m" || suffix == "mb")
+    v *= 1024.0 * 1024.0;
+  else if (suffix == "g" || suffix == "gb")
+    v *= 1024.0 * 1024.0 * 1024.0;
+  else if (!suffix.empty() && suffix != "b")
+    return false;
+  value = (long long)v;
+  return true;
+}
+
+string FormatByteSize(long long bytes) {
+  if (bytes < 1024)
+    return TextFormat("%dB", (int)max(0LL, bytes));
+  if (bytes < 1024LL * 1024)
+    return TextFormat("%.1fK", bytes / 1024.0);
+  if (bytes < 1024LL * 1024 * 1024)
+    return TextFormat("%.1fM", bytes / (1024.0 * 1024.0));
+  return TextFormat("%.2fG", bytes / (1024.0 * 1024.0 * 1024.0));
+}
+
+void ApplyUndoConfig(Canvas &canvas, const AppConfig &cfg) {
+  canvas.undoStore.maxEntries = cfg.undoMaxEntries;
+  canvas.undoStore.maxBytes = cfg.undoMaxBytes;
+  canvas.undoStore.liveEntries = cfg.undoLiveEntries;
+  EnforceUndoBudget(canvas);
+}
+
+bool ParseIntValue(const string &s, int &value) {
+  if (s.empty())
+    return false;
+  char *endPtr = nullptr;
+  long v = strtol(s.c_str(), &endPtr, 10);
+  if (endPtr == s.c_str() || *endPtr != '\0')
+    return false;
+  value = (int)v;
+  return true;
+}
+
+string FormatGraphNumber(float v) {
+  int rounded = (int)roundf(v);
+  if (rounded == 0)
+    return "0";
+  return to_string(rounded);
+}
+
+float ChooseGraphStepUnits(float unit, float zoom, float minPx, float maxPx) {
+  float safeUnit = max(0.0001f, unit);
+  float safeZoom = max(0.0001f, zoom);
+  float lo = min(minPx, maxPx);
+  float hi = max(minPx, maxPx);
+  float targetPx = lo;
+  float targetUnits = targetPx / (safeUnit * safeZoom);
+  if (targetUnits <= 0.0f)
+    targetUnits = 1.0f;
+  int expBase = (int)floor(log10f(targetUnits));
+  float best = 0.0f;
+  float bestScore = numeric_limits<float>::max();
+  for (int exp = expBase - 4; exp <= expBase + 4; ++exp) {
+    float base = powf(10.0f, (float)exp);
+    for (float mult : {1.0f, 2.0f, 5.0f}) {
+      float step = mult * base;
+      float px = step * safeUnit * safeZoom;
+      float penalty = 0.0f;
+      if (px < lo)
+        penalty = (lo - px) * 2.0f;
+      else if (px > hi)
+        penalty = (px - hi) * 2.0f;
+      float score = penalty + fabsf(px - targetPx);
+      if (score < bestScore) {
+        bestScore = score;
+        best = step;
+      }
+    }
+  }
+  if (best <= 0.0f)
+    best = 1.0f;
+  return best;
+}
+
+bool ParseBool(const string &s, bool &value) {
+  string v = ToLower(Trim(s));
+  if (v == "1" || v == "true" || v == "yes" || v == "on") {
+    value = true;
+    return true;
+  }
+  if (v == "0" || v == "false" || v == "no" || v == "off") {
+    value = false;
+    return true;
+  }
+  return false;
+}
+
+int KeyFromToken(const string &token) {
+  string k = ToLower(Trim(token));
+  if (k.size() == 1) {
+    char c = k[0];
+    if (c >= 'a' && c <= 'z')
+      return KEY_A + (c - 'a');
+    if (c >= '0' && c <= '9')
+      return KEY_ZERO + (c - '0');
+  }
+  if (k == "escape" || k == "esc")
+    return KEY_ESCAPE;
+  if (k == "enter" || k == "return")
+    return KEY_ENTER;
+  if (k == "backspace")
+    return KEY_BACKSPACE;
+  if (k == "space")
+    return KEY_SPACE;
+  if (k == "tab")
+    return KEY_TAB;
+  if (k == "semicolon" || k == ";")
+    return KEY_SEMICOLON;
+  if (k == "minus" || k == "-")
+    return KEY_MINUS;
+  if (k == "equal" || k == "=")
+    return KEY_EQUAL;
+  if (k == "left_bracket" || k == "[")
+    return KEY_LEFT_BRACKET;
+  if (k == "right_bracket" || k == "]")
+    return KEY_RIGHT_BRACKET;
+  if (k == "kp_add")
+    return KEY_KP_ADD;
+  if (k == "kp_subtract")
+    return KEY_KP_SUBTRACT;
+  return KEY_NULL;
+}
+
+string KeyToToken(int key) {
+  if (key >= KEY_A && key <= KEY_Z) {
+    char c = (char)('A' + (key - KEY_A));
+    return string(1, c);
+  }
+  if (key >= KEY_ZERO && key <= KEY_NINE) {
+    char c = (char)('0' + (key - KEY_ZERO));
+    return string(1, c);
+  }
+  if (key == KEY_ESCAPE)
+    return "Escape";
+  if (key == KEY_ENTER)
+    return "Enter";
+  if (key == KEY_BACKSPACE)
+    return "Backspace";
+  if (key == KEY_SPACE)
+    return "Space";
+  if (key == KEY_TAB)
+    return "Tab";
+  if (key == KEY_SEMICOLON)
+    return "Semicolon";
+  if (key == KEY_MINUS)
+    return "Minus";
+  if (key == KEY_EQUAL)
+    return "Equal";
+  if (key == KEY_LEFT_BRACKET)
+    return "Left_Bracket";
+  if (key == KEY_RIGHT_BRACKET)
+    return "Right_Bracket";
+  if (key == KEY_KP_ADD)
+    return "Kp_Add";
+  if (key == KEY_KP_SUBTRACT)
+    return "Kp_Subtract";
+  return "Unknown";
+}
+
+bool ParseKeyBinding(const string &raw, KeyBinding &binding) {
+  binding = {};
+  vector<string> tokens = Split(raw, '+');
+  if (tokens.empty())
+    return false;
+  for (string t : tokens) {
+    t = ToLower(Trim(t));
+    if (t.empty())
+      continue;
+    if (t == "shift")
+      binding.shift = true;
+    else if (t == "ctrl" || t == "control")
+      binding.ctrl = true;
+    else if (t == "alt")
+      binding.alt = true;
+    else {
+      int k = KeyFromToken(t);
+      if (k == KEY_NULL)
+        return false;
+      binding.key = k;
+    }
+  }
+  return binding.key != KEY_NULL;
+}
+
+vector<KeyBinding> ParseBindingList(const string &raw) {
+  vector<KeyBinding> out;
+  for (const string &entry : Split(raw, '|')) {
+    KeyBinding b;
+    if (ParseKeyBinding(entry, b))
+      out.push_back(b);
+  }
+  return out;
+}
+
+bool IsBindingPressed(const KeyBinding &b, bool shiftDown, bool ctrlDown,
+                     bool altDown) {
+  if (b.key == KEY_NULL || !IsKeyPressed(b.key))
+    return false;
+  return (b.shift == shiftDown) && (b.ctrl == ctrlDown) && (b.alt == altDown);
+}
+
+bool IsActionPressed(const AppConfig &cfg, const string &action, bool shiftDown,
+                     bool ctrlDown, bool altDown) {
+  auto it = cfg.keymap.find(action);
+  if (it == cfg.keymap.end())
+    return false;
+  for (const auto &binding : it->second) {
+    if (IsBindingPressed(binding, shiftDown, ctrlDown, altDown))
+      return true;
+  }
+  return false;
+}
+
+int PrimaryKeyForAction(const AppConfig &cfg, const string &action) {
+  auto it = cfg.keymap.find(action);
+  if (it == cfg.keymap.end() || it->second.empty())
+    return KEY_NULL;
+  return it->second[0].key;
+}
+
+void AddDefaultBinding(AppConfig &cfg, const string &action,
+                       const string &bindingSpec) {
+  cfg.keymap[action] = ParseBindingList(bindingSpec);
+}
+
+void SetDefaultKeymap(AppConfig &cfg) {
+  AddDefaultBinding(cfg, "open_command_mode", "Shift+Semicolon");
+  AddDefaultBinding(cfg, "zoom_in", "Shift+Equal|Kp_Add");
+  AddDefaultBinding(cfg, "zoom_out", "Shift+Minus|Kp_Subtract");
   AddDefaultBinding(cfg, "stroke_inc", "Equal");
   AddDefaultBinding(cfg, "stroke_dec", "Minus");
   AddDefaultBinding(cfg, "copy", "Y");
@@ -1588,933 +3268,7323 @@ void SetDefaultKeymap(AppConfig &cfg) {
   AddDefaultBinding(cfg, "select_all", "Ctrl+O");
 }
 
-void WriteDefaultConfig(const AppConfig &cfg) {
-  ofstream out(cfg.configPath);
-  if (!out.is_open())
+void WriteDefaultConfig(const AppConfig &cfg) {
+  ofstream out(cfg.configPath);
+  if (!out.is_open())
+    return;
+  out << "# Toggle config\n";
+  out << "window.width=" << cfg.windowWidth << "\n";
+  out << "window.height=" << cfg.windowHeight << "\n";
+  out << "window.min_width=" << cfg.minWindowWidth << "\n";
+  out << "window.min_height=" << cfg.minWindowHeight << "\n";
+  out << "window.title=" << cfg.windowTitle << "\n";
+  out << "window.start_maximized=" << (cfg.startMaximized ? "true" : "false")
+      << "\n";
+  out << "app.target_fps=" << cfg.targetFps << "\n";
+  out << "app.status_seconds=" << cfg.statusDurationSeconds << "\n";
+  out << "font.default_path=" << cfg.defaultFontPath << "\n";
+  out << "font.atlas_size=" << cfg.fontAtlasSize << "\n";
+  out << "path.default_save_dir=" << cfg.defaultSaveDir << "\n";
+  out << "path.default_export_dir=" << cfg.defaultExportDir << "\n";
+  out << "path.default_open_dir=" << cfg.defaultOpenDir << "\n";
+  out << "export.raster_scale=" << cfg.exportRasterScale << "\n";
+  out << "export.tile_size=" << cfg.exportTileSize << "\n";
+  out << "export.png_level=" << cfg.exportPngLevel << "\n";
+  out << "export.svg_compact=" << (cfg.exportSvgCompact ? "true" : "false")
+      << "\n";
+  out << "export.svg_precision=" << cfg.exportSvgPrecision << "\n";
+  out << "export.skip_unchanged="
+      << (cfg.exportSkipUnchanged ? "true" : "false") << "\n";
+  out << "canvas.theme_dark=" << (cfg.defaultDarkTheme ? "true" : "false") << "\n";
+  out << "canvas.show_tags=" << (cfg.defaultShowTags ? "true" : "false") << "\n";
+  out << "canvas.stroke_width=" << cfg.defaultStrokeWidth << "\n";
+  out << "canvas.min_stroke_width=" << cfg.minStrokeWidth << "\n";
+  out << "canvas.max_stroke_width=" << cfg.maxStrokeWidth << "\n";
+  out << "canvas.text_size=" << cfg.defaultTextSize << "\n";
+  out << "canvas.min_text_size=" << cfg.minTextSize << "\n";
+  out << "canvas.max_text_size=" << cfg.maxTextSize << "\n";
+  out << "canvas.grid_width=" << cfg.defaultGridWidth << "\n";
+  out << "canvas.type=" << BackgroundTypeToString(cfg.defaultBgType) << "\n";
+  out << "graph.unit=" << cfg.defaultGraphUnit << "\n";
+  out << "graph.minor_spacing=" << cfg.defaultGraphMinorSpacing << "\n";
+  out << "graph.label_size=" << cfg.defaultGraphLabelSize << "\n";
+  out << "graph.label_min_px=" << cfg.defaultGraphLabelMinPx << "\n";
+  out << "graph.label_max_px=" << cfg.defaultGraphLabelMaxPx << "\n";
+  out << "canvas.draw_color=" << ColorToHex(cfg.defaultDrawColor) << "\n";
+  out << "triangle.height_ratio=" << cfg.triangleHeightRatio << "\n";
+  out << "zoom.min=" << cfg.minZoom << "\n";
+  out << "zoom.max=" << cfg.maxZoom << "\n";
+  out << "zoom.wheel_step=" << cfg.zoomStep << "\n";
+  out << "zoom.key_scale=" << cfg.zoomKeyScale << "\n";
+  out << "interaction.pen_sample_distance=" << cfg.penSampleDistance << "\n";
+  out << "interaction.selection_box_activation_px="
+      << cfg.selectionBoxActivationPx << "\n";
+  out << "interaction.hit_tolerance=" << cfg.defaultHitTolerance << "\n";
+  out << "interaction.paste_offset_step=" << cfg.pasteOffsetStep << "\n";
+  out << "undo.max_entries=" << cfg.undoMaxEntries << "\n";
+  out << "undo.max_bytes=" << cfg.undoMaxBytes << "\n";
+  out << "undo.live_entries=" << cfg.undoLiveEntries << "\n";
+  out << "journal.enabled=" << (cfg.journalEnabled ? "true" : "false") << "\n";
+  out << "journal.flush_seconds=" << cfg.journalFlushSeconds << "\n";
+  out << "autosave.seconds=" << cfg.autosaveSeconds << "\n";
+  out << "history.enabled=" << (cfg.historyEnabled ? "true" : "false") << "\n";
+  out << "timelapse.fps=" << cfg.timelapseFps << "\n";
+  out << "timelapse.max_frames=" << cfg.timelapseMaxFrames << "\n";
+  out << "stream.capacity=" << cfg.streamCapacity << "\n";
+  out << "chunks.tile_size=" << cfg.chunkTileSize << "\n";
+  out << "chunks.max_bytes=" << cfg.chunkMaxBytes << "\n";
+  out << "world.rebase_distance=" << cfg.worldRebaseDistance << "\n";
+  out << "layers.supersample=" << cfg.layerSupersample << "\n";
+  out << "theme.light.background=" << ColorToHex(cfg.lightBackground) << "\n";
+  out << "theme.dark.background=" << ColorToHex(cfg.darkBackground) << "\n";
+  out << "theme.light.ui_text=" << ColorToHex(cfg.lightUiText) << "\n";
+  out << "theme.dark.ui_text=" << ColorToHex(cfg.darkUiText) << "\n";
+  out << "theme.light.texture_a=" << ColorToHex(cfg.lightTextureA) << "\n";
+  out << "theme.light.texture_b=" << ColorToHex(cfg.lightTextureB) << "\n";
+  out << "theme.dark.texture_a=" << ColorToHex(cfg.darkTextureA) << "\n";
+  out << "theme.dark.texture_b=" << ColorToHex(cfg.darkTextureB) << "\n";
+  out << "theme.light.grid=" << ColorToHex(cfg.lightGridColor) << "\n";
+  out << "theme.dark.grid=" << ColorToHex(cfg.darkGridColor) << "\n";
+  out << "graph.light.axis=" << ColorToHex(cfg.lightGraphAxis) << "\n";
+  out << "graph.dark.axis=" << ColorToHex(cfg.darkGraphAxis) << "\n";
+  out << "graph.light.major=" << ColorToHex(cfg.lightGraphMajor) << "\n";
+  out << "graph.dark.major=" << ColorToHex(cfg.darkGraphMajor) << "\n";
+  out << "graph.light.minor=" << ColorToHex(cfg.lightGraphMinor) << "\n";
+  out << "graph.dark.minor=" << ColorToHex(cfg.darkGraphMinor) << "\n";
+  out << "graph.light.label=" << ColorToHex(cfg.lightGraphLabel) << "\n";
+  out << "graph.dark.label=" << ColorToHex(cfg.darkGraphLabel) << "\n";
+  out << "status.light.bg=" << ColorToHex(cfg.lightStatusBg) << "\n";
+  out << "status.dark.bg=" << ColorToHex(cfg.darkStatusBg) << "\n";
+  out << "status.light.label=" << ColorToHex(cfg.lightStatusLabel) << "\n";
+  out << "status.dark.label=" << ColorToHex(cfg.darkStatusLabel) << "\n";
+  out << "status.light.value=" << ColorToHex(cfg.lightStatusValue) << "\n";
+  out << "status.dark.value=" << ColorToHex(cfg.darkStatusValue) << "\n";
+  out << "mode_color.selection=" << ColorToHex(cfg.modeSelection) << "\n";
+  out << "mode_color.move=" << ColorToHex(cfg.modeMove) << "\n";
+  out << "mode_color.line=" << ColorToHex(cfg.modeLine) << "\n";
+  out << "mode_color.circle=" << ColorToHex(cfg.modeCircle) << "\n";
+  out << "mode_color.rect=" << ColorToHex(cfg.modeRect) << "\n";
+  out << "mode_color.triangle=" << ColorToHex(cfg.modeTriangle) << "\n";
+  out << "mode_color.text=" << ColorToHex(cfg.modeTextColor) << "\n";
+  out << "mode_color.eraser=" << ColorToHex(cfg.modeEraser) << "\n";
+  out << "mode_color.pen=" << ColorToHex(cfg.modePen) << "\n";
+  for (const auto &kv : cfg.keymap) {
+    out << "key." << kv.first << "=";
+    for (size_t i = 0; i < kv.second.size(); i++) {
+      const auto &b = kv.second[i];
+      if (i > 0)
+        out << "|";
+      if (b.ctrl)
+        out << "Ctrl+";
+      if (b.shift)
+        out << "Shift+";
+      if (b.alt)
+        out << "Alt+";
+      out << KeyToToken(b.key);
+    }
+    out << "\n";
+  }
+}
+
+void LoadConfig(AppConfig &cfg) {
+  ifstream in(cfg.configPath);
+  if (!in.is_open()) {
+    WriteDefaultConfig(cfg);
+    return;
+  }
+
+  string line;
+  while (getline(in, line)) {
+    line = Trim(line);
+    if (line.empty() || line[0] == '#')
+      continue;
+    size_t eq = line.find('=');
+    if (eq == string::npos)
+      continue;
+    string key = Trim(line.substr(0, eq));
+    string value = Trim(line.substr(eq + 1));
+
+    int iv;
+    long long lv;
+    float fv;
+    bool bv;
+    Color cv;
+    if (key == "window.width" && ParseIntValue(value, iv))
+      cfg.windowWidth = max(320, iv);
+    else if (key == "window.height" && ParseIntValue(value, iv))
+      cfg.windowHeight = max(240, iv);
+    else if (key == "window.min_width" && ParseIntValue(value, iv))
+      cfg.minWindowWidth = max(200, iv);
+    else if (key == "window.min_height" && ParseIntValue(value, iv))
+      cfg.minWindowHeight = max(150, iv);
+    else if (key == "window.title")
+      cfg.windowTitle = value;
+    else if (key == "window.start_maximized" && ParseBool(value, bv))
+      cfg.startMaximized = bv;
+    else if (key == "window.start_fullscreen" && ParseBool(value, bv))
+      cfg.startMaximized = bv;
+    else if (key == "app.target_fps" && ParseIntValue(value, iv))
+      cfg.targetFps = max(1, iv);
+    else if (key == "app.status_seconds" && ParsePositiveFloat(value, fv))
+      cfg.statusDurationSeconds = max(0.2f, fv);
+    else if (key == "font.default_path")
+      cfg.defaultFontPath = value;
+    else if (key == "font.atlas_size" && ParseIntValue(value, iv))
+      cfg.fontAtlasSize = max(16, iv);
+    else if (key == "path.default_save_dir")
+      cfg.defaultSaveDir = ExpandUserPath(value);
+    else if (key == "path.default_export_dir")
+      cfg.defaultExportDir = ExpandUserPath(value);
+    else if (key == "path.default_open_dir")
+      cfg.defaultOpenDir = ExpandUserPath(value);
+    else if (key == "export.raster_scale" && ParsePositiveFloat(value, fv))
+      cfg.exportRasterScale = max(1.0f, min(8.0f, fv));
+    else if (key == "export.tile_size" && ParseIntValue(value, iv))
+      cfg.exportTileSize = max(256, min(16384, iv));
+    else if (key == "export.png_level" && ParseIntValue(value, iv))
+      cfg.exportPngLevel = max(0, min(9, iv));
+    else if (key == "export.svg_compact" && ParseBool(value, bv))
+      cfg.exportSvgCompact = bv;
+    else if (key == "export.svg_precision" && ParseIntValue(value, iv))
+      cfg.exportSvgPrecision = max(0, min(6, iv));
+    else if (key == "export.skip_unchanged" && ParseBool(value, bv))
+      cfg.exportSkipUnchanged = bv;
+    else if (key == "canvas.theme_dark" && ParseBool(value, bv))
+      cfg.defaultDarkTheme = bv;
+    else if (key == "canvas.show_tags" && ParseBool(value, bv))
+      cfg.defaultShowTags = bv;
+    else if (key == "canvas.stroke_width" && ParsePositiveFloat(value, fv))
+      cfg.defaultStrokeWidth = max(0.1f, fv);
+    else if (key == "canvas.min_stroke_width" && ParsePositiveFloat(value, fv))
+      cfg.minStrokeWidth = max(0.1f, fv);
+    else if (key == "canvas.max_stroke_width" && ParsePositiveFloat(value, fv))
+      cfg.maxStrokeWidth = max(cfg.minStrokeWidth, fv);
+    else if (key == "canvas.text_size" && ParsePositiveFloat(value, fv))
+      cfg.defaultTextSize = max(1.0f, fv);
+    else if (key == "canvas.min_text_size" && ParsePositiveFloat(value, fv))
+      cfg.minTextSize = max(1.0f, fv);
+    else if (key == "canvas.max_text_size" && ParsePositiveFloat(value, fv))
+      cfg.maxTextSize = max(cfg.minTextSize, fv);
+    else if (key == "canvas.grid_width" && ParsePositiveFloat(value, fv))
+      cfg.defaultGridWidth = max(6.0f, fv);
+    else if (key == "canvas.type")
+      ParseBackgroundType(value, cfg.defaultBgType);
+    else if (key == "graph.unit" && ParsePositiveFloat(value, fv))
+      cfg.defaultGraphUnit = max(0.1f, fv);
+    else if (key == "graph.minor_spacing" && ParsePositiveFloat(value, fv))
+      cfg.defaultGraphMinorSpacing = max(0.1f, fv);
+    else if (key == "graph.label_size" && ParsePositiveFloat(value, fv))
+      cfg.defaultGraphLabelSize = max(6.0f, fv);
+    else if (key == "graph.label_min_px" && ParsePositiveFloat(value, fv))
+      cfg.defaultGraphLabelMinPx = max(10.0f, fv);
+    else if (key == "graph.label_max_px" && ParsePositiveFloat(value, fv))
+      cfg.defaultGraphLabelMaxPx = max(10.0f, fv);
+    else if (key == "canvas.draw_color" && ParseHexColor(value, cv))
+      cfg.defaultDrawColor = cv;
+    else if (key == "triangle.height_ratio" && ParsePositiveFloat(value, fv))
+      cfg.triangleHeightRatio = max(0.05f, fv);
+    else if (key == "zoom.min" && ParsePositiveFloat(value, fv))
+      cfg.minZoom = max(1e-6f, fv);
+    else if (key == "zoom.max" && ParsePositiveFloat(value, fv))
+      cfg.maxZoom = max(cfg.minZoom, fv);
+    else if (key == "zoom.wheel_step" && ParsePositiveFloat(value, fv))
+      cfg.zoomStep = max(0.001f, fv);
+    else if (key == "zoom.key_scale" && ParsePositiveFloat(value, fv))
+      cfg.zoomKeyScale = max(1.001f, fv);
+    else if (key == "interaction.pen_sample_distance" &&
+             ParsePositiveFloat(value, fv))
+      cfg.penSampleDistance = max(0.2f, fv);
+    else if (key == "interaction.selection_box_activation_px" &&
+             ParsePositiveFloat(value, fv))
+      cfg.selectionBoxActivationPx = max(0.2f, fv);
+    else if (key == "interaction.hit_tolerance" && ParsePositiveFloat(value, fv))
+      cfg.defaultHitTolerance = max(0.2f, fv);
+    else if (key == "interaction.paste_offset_step" &&
+             ParsePositiveFloat(value, fv))
+      cfg.pasteOffsetStep = max(1.0f, fv);
+    else if (key == "undo.max_entries" && ParseIntValue(value, iv))
+      cfg.undoMaxEntries = max(1, iv);
+    else if (key == "undo.max_bytes" && ParseByteSize(value, lv))
+      cfg.undoMaxBytes = max(1024LL * 1024, lv);
+    else if (key == "undo.live_entries" && ParseIntValue(value, iv))
+      cfg.undoLiveEntries = max(0, iv);
+    else if (key == "journal.enabled" && ParseBool(value, bv))
+      cfg.journalEnabled = bv;
+    else if (key == "journal.flush_seconds" && ParsePositiveFloat(value, fv))
+      cfg.journalFlushSeconds = max(0.05f, fv);
+    else if (key == "autosave.seconds" && ParsePositiveFloat(value, fv))
+      cfg.autosaveSeconds = max(0.0f, fv);
+    else if (key == "history.enabled" && ParseBool(value, bv))
+      cfg.historyEnabled = bv;
+    else if (key == "timelapse.fps" && ParseIntValue(value, iv))
+      cfg.timelapseFps = max(1, min(60, iv));
+    else if (key == "timelapse.max_frames" && ParseIntValue(value, iv))
+      cfg.timelapseMaxFrames = max(1, iv);
+    else if (key == "stream.capacity" && ParseIntValue(value, iv))
+      cfg.streamCapacity = max(1024, iv);
+    else if (key == "chunks.tile_size" && ParsePositiveFloat(value, fv))
+      cfg.chunkTileSize = max(64.0f, fv);
+    else if (key == "chunks.max_bytes" && ParseByteSize(value, lv))
+      cfg.chunkMaxBytes = max(1024LL * 1024, lv);
+    else if (key == "world.rebase_distance" && ParsePositiveFloat(value, fv))
+      cfg.worldRebaseDistance = max(1024.0f, fv);
+    else if (key == "layers.supersample" && ParseIntValue(value, iv))
+      cfg.layerSupersample = max(1, min(4, iv));
+    else if (key == "theme.light.background" && ParseHexColor(value, cv))
+      cfg.lightBackground = cv;
+    else if (key == "theme.dark.background" && ParseHexColor(value, cv))
+      cfg.darkBackground = cv;
+    else if (key == "theme.light.ui_text" && ParseHexColor(value, cv))
+      cfg.lightUiText = cv;
+    else if (key == "theme.dark.ui_text" && ParseHexColor(value, cv))
+      cfg.darkUiText = cv;
+    else if (key == "theme.light.texture_a" && ParseHexColor(value, cv))
+      cfg.lightTextureA = cv;
+    else if (key == "theme.light.texture_b" && ParseHexColor(value, cv))
+      cfg.lightTextureB = cv;
+    else if (key == "theme.dark.texture_a" && ParseHexColor(value, cv))
+      cfg.darkTextureA = cv;
+    else if (key == "theme.dark.texture_b" && ParseHexColor(value, cv))
+      cfg.darkTextureB = cv;
+    else if (key == "theme.light.grid" && ParseHexColor(value, cv))
+      cfg.lightGridColor = cv;
+    else if (key == "theme.dark.grid" && ParseHexColor(value, cv))
+      cfg.darkGridColor = cv;
+    else if (key == "graph.light.axis" && ParseHexColor(value, cv))
+      cfg.lightGraphAxis = cv;
+    else if (key == "graph.dark.axis" && ParseHexColor(value, cv))
+      cfg.darkGraphAxis = cv;
+    else if (key == "graph.light.major" && ParseHexColor(value, cv))
+      cfg.lightGraphMajor = cv;
+    else if (key == "graph.dark.major" && ParseHexColor(value, cv))
+      cfg.darkGraphMajor = cv;
+    else if (key == "graph.light.minor" && ParseHexColor(value, cv))
+      cfg.lightGraphMinor = cv;
+    else if (key == "graph.dark.minor" && ParseHexColor(value, cv))
+      cfg.darkGraphMinor = cv;
+    else if (key == "graph.light.label" && ParseHexColor(value, cv))
+      cfg.lightGraphLabel = cv;
+    else if (key == "graph.dark.label" && ParseHexColor(value, cv))
+      cfg.darkGraphLabel = cv;
+    else if (key == "status.light.bg" && ParseHexColor(value, cv))
+      cfg.lightStatusBg = cv;
+    else if (key == "status.dark.bg" && ParseHexColor(value, cv))
+      cfg.darkStatusBg = cv;
+    else if (key == "status.light.label" && ParseHexColor(value, cv))
+      cfg.lightStatusLabel = cv;
+    else if (key == "status.dark.label" && ParseHexColor(value, cv))
+      cfg.darkStatusLabel = cv;
+    else if (key == "status.light.value" && ParseHexColor(value, cv))
+      cfg.lightStatusValue = cv;
+    else if (key == "status.dark.value" && ParseHexColor(value, cv))
+      cfg.darkStatusValue = cv;
+    else if (key == "mode_color.selection" && ParseHexColor(value, cv))
+      cfg.modeSelection = cv;
+    else if (key == "mode_color.move" && ParseHexColor(value, cv))
+      cfg.modeMove = cv;
+    else if (key == "mode_color.line" && ParseHexColor(value, cv))
+      cfg.modeLine = cv;
+    else if (key == "mode_color.circle" && ParseHexColor(value, cv))
+      cfg.modeCircle = cv;
+    else if (key == "mode_color.rect" && ParseHexColor(value, cv))
+      cfg.modeRect = cv;
+    else if (key == "mode_color.triangle" && ParseHexColor(value, cv))
+      cfg.modeTriangle = cv;
+    else if (key == "mode_color.text" && ParseHexColor(value, cv))
+      cfg.modeTextColor = cv;
+    else if (key == "mode_color.eraser" && ParseHexColor(value, cv))
+      cfg.modeEraser = cv;
+    else if (key == "mode_color.pen" && ParseHexColor(value, cv))
+      cfg.modePen = cv;
+    else if (key.rfind("key.", 0) == 0)
+      cfg.keymap[key.substr(4)] = ParseBindingList(value);
+  }
+
+  cfg.maxStrokeWidth = max(cfg.minStrokeWidth, cfg.maxStrokeWidth);
+  cfg.defaultStrokeWidth =
+      min(cfg.maxStrokeWidth, max(cfg.minStrokeWidth, cfg.defaultStrokeWidth));
+  cfg.maxTextSize = max(cfg.minTextSize, cfg.maxTextSize);
+  cfg.defaultTextSize =
+      min(cfg.maxTextSize, max(cfg.minTextSize, cfg.defaultTextSize));
+  if (cfg.defaultGraphLabelMaxPx < cfg.defaultGraphLabelMinPx)
+    cfg.defaultGraphLabelMaxPx = cfg.defaultGraphLabelMinPx;
+  if (cfg.defaultSaveDir.empty())
+    cfg.defaultSaveDir = DefaultDownloadsDir();
+  if (cfg.defaultExportDir.empty())
+    cfg.defaultExportDir = cfg.defaultSaveDir;
+  if (cfg.defaultOpenDir.empty())
+    cfg.defaultOpenDir = cfg.defaultSaveDir;
+}
+
+bool ParseHexColor(string hex, Color &outColor) {
+  if (!hex.empty() && hex[0] == '#')
+    hex.erase(hex.begin());
+  if (hex.size() != 6 && hex.size() != 8)
+    return false;
+  for (char c : hex) {
+    if (!isxdigit((unsigned char)c))
+      return false;
+  }
+  auto byteFromHex = [](const string &s) -> unsigned char {
+    return (unsigned char)strtol(s.c_str(), nullptr, 16);
+  };
+  outColor.r = byteFromHex(hex.substr(0, 2));
+  outColor.g = byteFromHex(hex.substr(2, 2));
+  outColor.b = byteFromHex(hex.substr(4, 2));
+  outColor.a = (hex.size() == 8) ? byteFromHex(hex.substr(6, 2)) : 255;
+  return true;
+}
+
+bool ParseNamedColor(string name, Color &outColor) {
+  name = ToLower(Trim(name));
+  static const unordered_map<string, Color> colors = {
+      {"lightgray", LIGHTGRAY}, {"gray", GRAY},       {"darkgray", DARKGRAY},
+      {"yellow", YELLOW},       {"gold", GOLD},       {"orange", ORANGE},
+      {"pink", PINK},           {"red", RED},         {"maroon", MAROON},
+      {"green", GREEN},         {"lime", LIME},       {"darkgreen", DARKGREEN},
+      {"skyblue", SKYBLUE},     {"blue", BLUE},       {"darkblue", DARKBLUE},
+      {"purple", PURPLE},       {"violet", VIOLET},   {"darkpurple", DARKPURPLE},
+      {"beige", BEIGE},         {"brown", BROWN},     {"darkbrown", DARKBROWN},
+      {"white", WHITE},         {"black", BLACK},     {"blank", BLANK},
+      {"magenta", MAGENTA},     {"raywhite", RAYWHITE},
+  };
+  auto it = colors.find(name);
+  if (it == colors.end())
+    return false;
+  outColor = it->second;
+  return true;
+}
+
+string ColorToHex(Color c) {
+  return TextFormat("#%02X%02X%02X%02X", c.r, c.g, c.b, c.a);
+}
+
+void SetStatus(Canvas &canvas, const AppConfig &cfg, const string &message,
+               double seconds = -1.0) {
+  canvas.statusMessage = message;
+  if (seconds <= 0.0)
+    seconds = cfg.statusDurationSeconds;
+  canvas.statusUntil = GetTime() + seconds;
+}
+
+void SetTheme(Canvas &canvas, const AppConfig &cfg, bool dark) {
+  canvas.darkTheme = dark;
+  if (dark) {
+    canvas.backgroundColor = cfg.darkBackground;
+    canvas.uiTextColor = cfg.darkUiText;
+    canvas.textureColorA = cfg.darkTextureA;
+    canvas.textureColorB = cfg.darkTextureB;
+    canvas.gridColor = cfg.darkGridColor;
+    canvas.graphAxisColor = cfg.darkGraphAxis;
+    canvas.graphMajorColor = cfg.darkGraphMajor;
+    canvas.graphMinorColor = cfg.darkGraphMinor;
+    canvas.graphLabelColor = cfg.darkGraphLabel;
+    canvas.statusBarBg = cfg.darkStatusBg;
+    canvas.statusBarBg.a = 255;
+    canvas.statusLabelColor = cfg.darkStatusLabel;
+    canvas.statusValueColor = cfg.darkStatusValue;
+    canvas.drawColor = RAYWHITE;
+  } else {
+    canvas.backgroundColor = cfg.lightBackground;
+    canvas.uiTextColor = cfg.lightUiText;
+    canvas.textureColorA = cfg.lightTextureA;
+    canvas.textureColorB = cfg.lightTextureB;
+    canvas.gridColor = cfg.lightGridColor;
+    canvas.graphAxisColor = cfg.lightGraphAxis;
+    canvas.graphMajorColor = cfg.lightGraphMajor;
+    canvas.graphMinorColor = cfg.lightGraphMinor;
+    canvas.graphLabelColor = cfg.lightGraphLabel;
+    canvas.statusBarBg = cfg.lightStatusBg;
+    canvas.statusBarBg.a = 255;
+    canvas.statusLabelColor = cfg.lightStatusLabel;
+    canvas.statusValueColor = cfg.lightStatusValue;
+    canvas.drawColor = BLACK;
+  }
+}
+
+void DrawBackgroundPattern(const Canvas &canvas) {
+  float left = canvas.camera.target.x - canvas.camera.offset.x / canvas.camera.zoom;
+  float top = canvas.camera.target.y - canvas.camera.offset.y / canvas.camera.zoom;
+  float right =
+      canvas.camera.target.x + (float)GetScreenWidth() / canvas.camera.zoom;
+  float bottom =
+      canvas.camera.target.y + (float)GetScreenHeight() / canvas.camera.zoom;
+
+  if (canvas.bgType == BG_BLANK)
+    return;
+
+  // Patterns are anchored in absolute coordinates.
+  double ox = canvas.originX;
+  double oy = canvas.originY;
+  float spacing = max(6.0f, canvas.gridWidth);
+  float minPatternPx = canvas.bgType == BG_DOTTED ? 4.0f : 2.0f;
+  while (spacing * canvas.camera.zoom < minPatternPx)
+    spacing *= 2.0f;
+
+  float startX = (float)(floor((left + ox) / spacing) * spacing - ox);
+  float startY = (float)(floor((top + oy) / spacing) * spacing - oy);
+  Color lineColor = canvas.gridColor;
+
+  if (canvas.bgType == BG_GRID) {
+    for (float x = startX; x <= right + spacing; x += spacing)
+      DrawLineV({x, top - spacing}, {x, bottom + spacing}, lineColor);
+    for (float y = startY; y <= bottom + spacing; y += spacing)
+      DrawLineV({left - spacing, y}, {right + spacing, y}, lineColor);
+  } else if (canvas.bgType == BG_DOTTED) {
+    for (float x = startX; x <= right + spacing; x += spacing) {
+      for (float y = startY; y <= bottom + spacing; y += spacing) {
+        DrawCircleV({x, y}, 1.4f, lineColor);
+      }
+    }
+  } else if (canvas.bgType == BG_GRAPH) {
+    float unit = max(0.0001f, canvas.graphUnit);
+    float minorSpacing = max(0.0001f, canvas.graphMinorSpacing);
+    float majorUnitsRaw = ChooseGraphStepUnits(unit, canvas.camera.zoom,
+                                               canvas.graphLabelMinPx,
+                                               canvas.graphLabelMaxPx);
+    int majorUnits = max(1, (int)roundf(majorUnitsRaw));
+    float majorSpacing = max(minorSpacing, (float)majorUnits * unit);
+
+    float minorPx = minorSpacing * canvas.camera.zoom;
+    if (minorPx >= 4.0f) {
+      float minorStartX =
+          (float)(floor((left + ox) / minorSpacing) * minorSpacing - ox);
+      float minorStartY =
+          (float)(floor((top + oy) / minorSpacing) * minorSpacing - oy);
+      for (float x = minorStartX; x <= right + minorSpacing; x += minorSpacing)
+        DrawLineV({x, top - minorSpacing}, {x, bottom + minorSpacing},
+                  canvas.graphMinorColor);
+      for (float y = minorStartY; y <= bottom + minorSpacing; y += minorSpacing)
+        DrawLineV({left - minorSpacing, y}, {right + minorSpacing, y},
+                  canvas.graphMinorColor);
+    }
+
+    float majorStartX =
+        (float)(floor((left + ox) / majorSpacing) * majorSpacing - ox);
+    float majorStartY =
+        (float)(floor((top + oy) / majorSpacing) * majorSpacing - oy);
+    for (float x = majorStartX; x <= right + majorSpacing; x += majorSpacing)
+      DrawLineV({x, top - majorSpacing}, {x, bottom + majorSpacing},
+                canvas.graphMajorColor);
+    for (float y = majorStartY; y <= bottom + majorSpacing; y += majorSpacing)
+      DrawLineV({left - majorSpacing, y}, {right + majorSpacing, y},
+                canvas.graphMajorColor);
+
+    float axisX = (float)-ox;
+    float axisY = (float)-oy;
+    bool axisXVisible = (axisX >= left && axisX <= right);
+    bool axisYVisible = (axisY >= top && axisY <= bottom);
+    if (axisXVisible) {
+      DrawLineEx({axisX, top - majorSpacing}, {axisX, bottom + majorSpacing},
+                 2.0f, canvas.graphAxisColor);
+    }
+    if (axisYVisible) {
+      DrawLineEx({left - majorSpacing, axisY}, {right + majorSpacing, axisY},
+                 2.0f, canvas.graphAxisColor);
+    }
+
+    float labelSize = max(6.0f, canvas.graphLabelSize);
+    float labelPad = 6.0f / max(0.0001f, canvas.camera.zoom);
+    float labelLineY =
+        axisYVisible ? axisY : (axisY < top ? top + labelPad : bottom - labelPad);
+
+    float xLabelY = labelLineY + labelPad;
+    if (axisYVisible) {
+      float below = axisY + labelPad;
+      float above = axisY - labelPad - labelSize;
+      if (below + labelSize <= bottom)
+        xLabelY = below;
+      else
+        xLabelY = above;
+    } else {
+      xLabelY = (axisY < top) ? (top + labelPad)
+                              : (bottom - labelPad - labelSize);
+    }
+    float minLabelY = top + labelPad;
+    float maxLabelY = bottom - labelPad - labelSize;
+    if (maxLabelY < minLabelY)
+      maxLabelY = minLabelY;
+    xLabelY = min(max(xLabelY, minLabelY), maxLabelY);
+
+    long long startXi = (long long)floor((left + ox) / majorSpacing);
+    long long endXi = (long long)ceil((right + ox) / majorSpacing);
+    for (long long i = startXi; i <= endXi; ++i) {
+      float x = (float)((double)i * majorSpacing - ox);
+      long long value = i * majorUnits;
+      if (value == 0)
+        continue;
+      string label = to_string(value);
+      Vector2 size = MeasureTextEx(canvas.font, label.c_str(), labelSize, 1.0f);
+      DrawTextEx(canvas.font, label.c_str(),
+                 {x - size.x * 0.5f, xLabelY}, labelSize, 1.0f,
+                 canvas.graphLabelColor);
+    }
+
+    long long startYi = (long long)floor((top + oy) / majorSpacing);
+    long long endYi = (long long)ceil((bottom + oy) / majorSpacing);
+    for (long long i = startYi; i <= endYi; ++i) {
+      float y = (float)((double)i * majorSpacing - oy);
+      long long value = -i * majorUnits;
+      if (value == 0)
+        continue;
+      string label = to_string(value);
+      Vector2 size = MeasureTextEx(canvas.font, label.c_str(), labelSize, 1.0f);
+      float yLabelX = 0.0f;
+      if (axisXVisible) {
+        yLabelX = axisX + labelPad;
+        if (yLabelX + size.x > right)
+          yLabelX = axisX - labelPad - size.x;
+      } else if (axisX < left) {
+        yLabelX = left + labelPad;
+      } else {
+        yLabelX = right - labelPad - size.x;
+      }
+      float minLabelX = left + labelPad;
+      float maxLabelX = right - labelPad - size.x;
+      if (maxLabelX < minLabelX)
+        maxLabelX = minLabelX;
+      yLabelX = min(max(yLabelX, minLabelX), maxLabelX);
+      DrawTextEx(canvas.font, label.c_str(),
+                 {yLabelX, y - size.y * 0.5f}, labelSize, 1.0f,
+                 canvas.graphLabelColor);
+    }
+
+    Vector2 zeroSize = MeasureTextEx(canvas.font, "0", labelSize, 1.0f);
+    float zeroX = axisX - labelPad - zeroSize.x;
+    float zeroY = axisY + labelPad;
+    float minZeroX = left + labelPad;
+    float maxZeroX = right - labelPad - zeroSize.x;
+    float minZeroY = top + labelPad;
+    float maxZeroY = bottom - labelPad - labelSize;
+    if (maxZeroX < minZeroX)
+      maxZeroX = minZeroX;
+    if (maxZeroY < minZeroY)
+      maxZeroY = minZeroY;
+    zeroX = min(max(zeroX, minZeroX), maxZeroX);
+    zeroY = min(max(zeroY, minZeroY), maxZeroY);
+    DrawTextEx(canvas.font, "0", {zeroX, zeroY}, labelSize, 1.0f,
+               canvas.graphLabelColor);
+  }
+}
+
+void SetMode(Canvas &canvas, const AppConfig &cfg, Mode mode) {
+  canvas.mode = mode;
+  canvas.isTypingNumber = false;
+  if (mode == SELECTION_MODE) {
+    canvas.modeText = "SELECTION";
+    canvas.modeColor = cfg.modeSelection;
+  } else if (mode == MOVE_MODE) {
+    canvas.modeText = "MOVE";
+    canvas.modeColor = cfg.modeMove;
+  } else if (mode == RESIZE_ROTATE_MODE) {
+    canvas.modeText = "RESIZE/ROTATE";
+    canvas.modeColor = cfg.modeSelection;
+  } else if (mode == LINE_MODE) {
+    canvas.modeText = "LINE";
+    canvas.modeColor = cfg.modeLine;
+  } else if (mode == DOTTEDLINE_MODE) {
+    canvas.modeText = "DOTTED LINE";
+    canvas.modeColor = cfg.modeLine;
+  } else if (mode == ARROWLINE_MODE) {
+    canvas.modeText = "ARROW LINE";
+    canvas.modeColor = cfg.modeLine;
+  } else if (mode == CIRCLE_MODE) {
+    canvas.modeText = "CIRCLE";
+    canvas.modeColor = cfg.modeCircle;
+  } else if (mode == DOTTEDCIRCLE_MODE) {
+    canvas.modeText = "DOTTED CIRCLE";
+    canvas.modeColor = cfg.modeCircle;
+  } else if (mode == RECTANGLE_MODE) {
+    canvas.modeText = "RECTANGLE";
+    canvas.modeColor = cfg.modeRect;
+  } else if (mode == DOTTEDRECT_MODE) {
+    canvas.modeText = "DOTTED RECT";
+    canvas.modeColor = cfg.modeRect;
+  } else if (mode == TRIANGLE_MODE) {
+    canvas.modeText = "TRIANGLE";
+    canvas.modeColor = cfg.modeTriangle;
+  } else if (mode == DOTTEDTRIANGLE_MODE) {
+    canvas.modeText = "DOTTED TRIANGLE";
+    canvas.modeColor = cfg.modeTriangle;
+  } else if (mode == TEXT_MODE) {
+    canvas.modeText = "TEXT";
+    canvas.modeColor = cfg.modeTextColor;
+  } else if (mode == ERASER_MODE) {
+    canvas.modeText = "ERASER";
+    canvas.modeColor = cfg.modeEraser;
+  } else if (mode == PEN_MODE) {
+    canvas.modeText = "PEN";
+    canvas.modeColor = cfg.modePen;
+  }
+}
+
+void SerializeElement(ostream &out, const Element &el, double baseX,
+                      double baseY) {
+  bool framed = el.frameX != baseX || el.frameY != baseY;
+  out << "ELEMENT " << (int)el.type << " " << el.uniqueID << " "
+      << el.strokeWidth << " " << (int)el.color.r << " " << (int)el.color.g
+      << " " << (int)el.color.b << " " << (int)el.color.a << " " << el.start.x
+      << " " << el.start.y << " " << el.end.x << " " << el.end.y << " "
+      << el.rotation << " " << el.textSize;
+  if (el.layer != 0 || framed)
+    out << " " << el.layer;
+  if (framed) {
+    streamsize precision = out.precision(17);
+    out << " " << el.frameX << " " << el.frameY;
+    out.precision(precision);
+  }
+  out << "\n";
+  out << "TEXT " << el.text.size() << "\n" << el.text << "\n";
+  out << "PATH " << el.path.size() << "\n";
+  for (const auto &p : el.path)
+    out << p.x << " " << p.y << "\n";
+  out << "CHILDREN " << el.children.size() << "\n";
+  for (const auto &c : el.children)
+    SerializeElement(out, c, c.frameX, c.frameY);
+  out << "END\n";
+}
+
+void SerializeElement(ostream &out, const Element &el) {
+  SerializeElement(out, el, el.frameX, el.frameY);
+}
+
+SceneSettings CaptureSceneSettings(const Canvas &canvas) {
+  SceneSettings settings;
+  settings.textSize = canvas.textSize;
+  settings.strokeWidth = canvas.strokeWidth;
+  settings.drawColor = canvas.drawColor;
+  settings.bgType = canvas.bgType;
+  settings.gridWidth = canvas.gridWidth;
+  settings.originX = canvas.originX;
+  settings.originY = canvas.originY;
+  settings.artboards = canvas.artboards;
+  settings.functions = canvas.functions;
+  settings.symbols = canvas.symbols;
+  settings.layers = canvas.layers;
+  return settings;
+}
+
+bool SameSceneSettings(const SceneSettings &a, const SceneSettings &b) {
+  return a.textSize == b.textSize && a.strokeWidth == b.strokeWidth &&
+         memcmp(&a.drawColor, &b.drawColor, sizeof(Color)) == 0 &&
+         a.bgType == b.bgType && a.gridWidth == b.gridWidth &&
+         a.originX == b.originX && a.originY == b.originY &&
+         a.artboards.size() == b.artboards.size() &&
+         equal(a.artboards.begin(), a.artboards.end(), b.artboards.begin(),
+               [](const Artboard &p, const Artboard &q) {
+                 return p.name == q.name && p.x == q.x && p.y == q.y &&
+                        p.width == q.width && p.height == q.height;
+               }) &&
+         a.functions.size() == b.functions.size() &&
+         equal(a.functions.begin(), a.functions.end(), b.functions.begin(),
+               [](const GraphFunction &p, const GraphFunction &q) {
+                 return p.expr == q.expr && p.strokeWidth == q.strokeWidth &&
+                        memcmp(&p.color, &q.color, sizeof(Color)) == 0;
+               }) &&
+         a.symbols.size() == b.symbols.size() &&
+         equal(a.symbols.begin(), a.symbols.end(), b.symbols.begin(),
+               [](const SymbolDef &p, const SymbolDef &q) {
+                 return p.name == q.name && p.version == q.version;
+               }) &&
+         a.layers.size() == b.layers.size() &&
+         equal(a.layers.begin(), a.layers.end(), b.layers.begin(),
+               [](const Layer &p, const Layer &q) {
+                 return p.name == q.name && p.visible == q.visible &&
+                        p.locked == q.locked && p.opacity == q.opacity;
+               });
+}
+
+const Element &SceneElement(const Element &el) { return el; }
+const Element &SceneElement(const shared_ptr<const Element> &el) { return *el; }
+
+bool SyncPath(const string &path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  bool ok = fsync(fd) == 0;
+  ::close(fd);
+  return ok;
+}
+
+// Written to a temp file and renamed, so a crash never truncates the file.
+template <typename T>
+bool SaveSceneFile(const string &path, const SceneSettings &settings,
+                   const vector<T> &elements) {
+  string tmpPath = path + ".tmp";
+  {
+    ofstream out(tmpPath);
+    if (!out.is_open())
+      return false;
+    out << "TOGGLE_V1\n";
+    out << "TEXTSIZE " << settings.textSize << "\n";
+    out << "STROKEWIDTH " << settings.strokeWidth << "\n";
+    out << "DRAWCOLOR " << (int)settings.drawColor.r << " "
+        << (int)settings.drawColor.g << " " << (int)settings.drawColor.b << " "
+        << (int)settings.drawColor.a << "\n";
+    out << "GRIDTYPE " << (int)settings.bgType << "\n";
+    out << "GRIDWIDTH " << settings.gridWidth << "\n";
+    if (settings.originX != 0.0 || settings.originY != 0.0)
+      out << "ORIGIN " << setprecision(17) << settings.originX << " "
+          << settings.originY << setprecision(6) << "\n";
+    for (const auto &board : settings.artboards)
+      out << "ARTBOARD " << setprecision(17) << board.x << " " << board.y
+          << setprecision(6) << " " << board.width << " " << board.height
+          << " " << board.name << "\n";
+    for (const auto &fn : settings.functions)
+      out << "FUNCTION " << (int)fn.color.r << " " << (int)fn.color.g << " "
+          << (int)fn.color.b << " " << (int)fn.color.a << " " << fn.strokeWidth
+          << " " << fn.expr << "\n";
+    for (const auto &layer : settings.layers)
+      out << "LAYER " << (int)layer.visible << " " << (int)layer.locked << " "
+          << layer.opacity << " " << layer.name << "\n";
+    for (const auto &sym : settings.symbols) {
+      out << "SYMBOL " << sym.frame.x << " " << sym.frame.y << " "
+          << sym.frame.width << " " << sym.frame.height << " "
+          << sym.elements.size() << " " << sym.name << "\n";
+      for (const auto &el : sym.elements)
+        SerializeElement(out, el);
+    }
+    out << "ELEMENT_COUNT " << elements.size() << "\n";
+    for (const auto &el : elements)
+      SerializeElement(out, SceneElement(el), settings.originX,
+                       settings.originY);
+    out.flush();
+    if (!out)
+      return false;
+  }
+  error_code ec;
+  if (!SyncPath(tmpPath)) {
+    filesystem::remove(tmpPath, ec);
+    return false;
+  }
+  filesystem::rename(tmpPath, path, ec);
+  if (ec) {
+    filesystem::remove(tmpPath, ec);
+    return false;
+  }
+  string dir = filesystem::path(path).parent_path().string();
+  SyncPath(dir.empty() ? "." : dir);
+  return true;
+}
+
+bool SaveCanvasToFile(Canvas &canvas, const string &path) {
+  RecordUndoState(canvas);
+  return SaveSceneFile(path, CaptureSceneSettings(canvas),
+                       canvas.undoTree.head);
+}
+
+bool DeserializeElement(istream &in, Element &el, double baseX = 0.0,
+                        double baseY = 0.0) {
+  string tag;
+  if (!(in >> tag) || tag != "ELEMENT")
+    return false;
+  string line;
+  getline(in, line);
+  line = Trim(line);
+  stringstream ls(line);
+  int type = 0;
+  int r = 0, g = 0, b = 0, a = 255;
+  el.textSize = 24.0f;
+  el.rotation = 0.0f;
+  if (!(ls >> type >> el.uniqueID >> el.strokeWidth >> r >> g >> b >> a >>
+        el.start.x >> el.start.y >> el.end.x >> el.end.y))
+    return false;
+  vector<string> tail;
+  string v;
+  while (ls >> v)
+    tail.push_back(v);
+  if (tail.size() == 1) {
+    el.textSize = strtof(tail[0].c_str(), nullptr);
+  } else if (tail.size() >= 2) {
+    el.rotation = strtof(tail[0].c_str(), nullptr);
+    el.textSize = strtof(tail[1].c_str(), nullptr);
+  }
+  el.layer = 0;
+  if (tail.size() >= 3)
+    el.layer = max(0, (int)strtof(tail[2].c_str(), nullptr));
+  el.frameX = baseX;
+  el.frameY = baseY;
+  if (tail.size() >= 5) {
+    el.frameX = strtod(tail[3].c_str(), nullptr);
+    el.frameY = strtod(tail[4].c_str(), nullptr);
+  }
+  el.type = (Mode)type;
+  el.color = {(unsigned char)r, (unsigned char)g, (unsigned char)b,
+              (unsigned char)a};
+
+  size_t textLen = 0;
+  if (!(in >> tag >> textLen) || tag != "TEXT")
+    return false;
+  in.ignore(numeric_limits<streamsize>::max(), '\n');
+  string textLine;
+  getline(in, textLine);
+  el.text = textLine;
+
+  size_t pathCount = 0;
+  if (!(in >> tag >> pathCount) || tag != "PATH")
+    return false;
+  el.path.clear();
+  el.path.reserve(pathCount);
+  for (size_t i = 0; i < pathCount; i++) {
+    Vector2 p{};
+    if (!(in >> p.x >> p.y))
+      return false;
+    el.path.push_back(p);
+  }
+
+  size_t childCount = 0;
+  if (!(in >> tag >> childCount) || tag != "CHILDREN")
+    return false;
+  el.children.clear();
+  el.children.reserve(childCount);
+  for (size_t i = 0; i < childCount; i++) {
+    Element child;
+    if (!DeserializeElement(in, child))
+      return false;
+    el.children.push_back(child);
+  }
+
+  if (!(in >> tag) || tag != "END")
+    return false;
+  el.originalIndex = -1;
+  return true;
+}
+
+string JournalPathFor(const string &savePath) { return savePath + ".journal"; }
+
+string AutosavePathFor(const string &savePath) {
+  return savePath + ".autosave";
+}
+
+void RemoveAutosave(const string &savePath) {
+  if (!savePath.empty())
+    remove(AutosavePathFor(savePath).c_str());
+}
+
+string UnsavedJournalBase(const AppConfig &cfg) {
+  return JoinPath(ResolveDefaultDir(cfg.defaultSaveDir, DefaultDownloadsDir()),
+                  ".toggle-unsaved");
+}
+
+string JournalHeader(const string &savePath) {
+  error_code ec;
+  long long size = -1;
+  long long stamp = 0;
+  if (filesystem::exists(savePath, ec)) {
+    size = (long long)filesystem::file_size(savePath, ec);
+    stamp = (long long)filesystem::last_write_time(savePath, ec)
+                .time_since_epoch()
+                .count();
+  }
+  return "TOGGLE_JOURNAL_V1 " + to_string(size) + " " + to_string(stamp) + "\n";
+}
+
+// A torn or malformed batch returns false, so none of it gets applied.
+bool ReadSceneBatch(istream &in, vector<SceneOp> &ops, double *time = nullptr) {
+  ops.clear();
+  string tag;
+  while (in >> tag) {
+    if (tag == "COMMIT")
+      return true;
+    SceneOp op;
+    if (tag == "TIME") {
+      double t = 0.0;
+      if (!(in >> t))
+        break;
+      if (time)
+        *time = t;
+      continue;
+    } else if (tag == "CLEAR") {
+      op.kind = SceneOp::CLEAR;
+    } else if (tag == "ORIGIN") {
+      op.kind = SceneOp::ORIGIN;
+      if (!(in >> op.x >> op.y))
+        break;
+    } else if (tag == "PUT") {
+      op.kind = SceneOp::PUT;
+      if (!DeserializeElement(in, op.el))
+        break;
+    } else if (tag == "DEL") {
+      op.kind = SceneOp::DEL;
+      if (!(in >> op.id))
+        break;
+    } else if (tag == "ORDER") {
+      op.kind = SceneOp::ORDER;
+      size_t count = 0;
+      if (!(in >> count))
+        break;
+      op.order.reserve(min<size_t>(count, 1 << 20));
+      int id = 0;
+      for (size_t i = 0; i < count && in >> id; i++)
+        op.order.push_back(id);
+      if (op.order.size() != count)
+        break;
+    } else {
+      break;
+    }
+    ops.push_back(std::move(op));
+  }
+  return false;
+}
+
+void IndexSceneReplay(SceneReplay &replay) {
+  replay.live.assign(replay.elements.size(), 1);
+  replay.gaps = 0;
+  replay.index.clear();
+  replay.index.reserve(replay.elements.size());
+  for (size_t i = 0; i < replay.elements.size(); i++)
+    replay.index.emplace(replay.elements[i].uniqueID, i);
+}
+
+void CompactSceneReplay(SceneReplay &replay) {
+  if (replay.gaps == 0)
+    return;
+  size_t kept = 0;
+  for (size_t i = 0; i < replay.elements.size(); i++) {
+    if (!replay.live[i])
+      continue;
+    if (kept != i)
+      replay.elements[kept] = std::move(replay.elements[i]);
+    kept++;
+  }
+  replay.elements.resize(kept);
+  IndexSceneReplay(replay);
+}
+
+void ApplySceneOps(SceneReplay &replay, vector<SceneOp> &ops,
+                   SceneSettings &next) {
+  for (SceneOp &op : ops) {
+    if (op.kind == SceneOp::CLEAR) {
+      replay.elements.clear();
+      IndexSceneReplay(replay);
+    } else if (op.kind == SceneOp::ORIGIN) {
+      next.originX = op.x;
+      next.originY = op.y;
+    } else if (op.kind == SceneOp::PUT) {
+      auto it = replay.index.find(op.el.uniqueID);
+      if (it != replay.index.end()) {
+        replay.elements[it->second] = std::move(op.el);
+      } else {
+        replay.index[op.el.uniqueID] = replay.elements.size();
+        replay.elements.push_back(std::move(op.el));
+        replay.live.push_back(1);
+      }
+    } else if (op.kind == SceneOp::DEL) {
+      auto it = replay.index.find(op.id);
+      if (it == replay.index.end())
+        continue;
+      replay.elements[it->second] = Element();
+      replay.live[it->second] = 0;
+      replay.index.erase(it);
+      replay.gaps++;
+    } else if (op.kind == SceneOp::ORDER) {
+      vector<Element> ordered;
+      ordered.reserve(op.order.size());
+      for (int id : op.order) {
+        auto it = replay.index.find(id);
+        if (it == replay.index.end())
+          continue;
+        ordered.push_back(std::move(replay.elements[it->second]));
+        replay.index.erase(it);
+      }
+      replay.elements.swap(ordered);
+      IndexSceneReplay(replay);
+    }
+  }
+  if (replay.gaps > replay.elements.size() / 2)
+    CompactSceneReplay(replay);
+}
+
+int ReplayJournal(const string &savePath, const string &basePath,
+                  vector<Element> &elements, SceneSettings &settings) {
+  ifstream in(JournalPathFor(savePath));
+  if (!in.is_open())
+    return 0;
+  string header;
+  getline(in, header);
+  if (header + "\n" != JournalHeader(basePath))
+    return 0;
+
+  SceneReplay replay;
+  replay.elements.swap(elements);
+  IndexSceneReplay(replay);
+  vector<SceneOp> ops;
+  int batches = 0;
+  string tag;
+  while (in >> tag && tag == "BATCH" && ReadSceneBatch(in, ops)) {
+    ApplySceneOps(replay, ops, settings);
+    batches++;
+  }
+  CompactSceneReplay(replay);
+  elements.swap(replay.elements);
+  return batches;
+}
+
+string RecoverySource(const string &savePath) {
+  string autosavePath = AutosavePathFor(savePath);
+  error_code ec;
+  if (!filesystem::exists(autosavePath, ec))
+    return savePath;
+  ifstream journal(JournalPathFor(savePath));
+  string header;
+  if (journal.is_open() && getline(journal, header)) {
+    if (header + "\n" == JournalHeader(autosavePath))
+      return autosavePath;
+    if (header + "\n" == JournalHeader(savePath))
+      return savePath;
+  }
+  if (!filesystem::exists(savePath, ec))
+    return autosavePath;
+  auto autosaved = filesystem::last_write_time(autosavePath, ec);
+  return !ec && autosaved > filesystem::last_write_time(savePath, ec)
+             ? autosavePath
+             : savePath;
+}
+
+bool ParseSceneFile(const string &path, SceneDocument &doc,
+                    atomic<float> *progress = nullptr,
+                    const atomic<bool> *cancel = nullptr) {
+  doc.source = RecoverySource(path);
+  ifstream in(doc.source);
+  if (!in.is_open())
+    return false;
+  error_code ec;
+  double fileSize = (double)filesystem::file_size(doc.source, ec);
+  if (ec || fileSize <= 0.0)
+    fileSize = 1.0;
+
+  string magic;
+  getline(in, magic);
+  if (Trim(magic) != "TOGGLE_V1")
+    return false;
+
+  SceneSettings &settings = doc.settings;
+  string tag;
+  if (!(in >> tag) || tag != "TEXTSIZE")
+    return false;
+  in >> settings.textSize;
+
+  if (!(in >> tag) || tag != "STROKEWIDTH")
+    return false;
+  in >> settings.strokeWidth;
+
+  int r, g, b, a;
+  if (!(in >> tag) || tag != "DRAWCOLOR")
+    return false;
+  if (!(in >> r >> g >> b >> a))
+    return false;
+  settings.drawColor = {(unsigned char)r, (unsigned char)g, (unsigned char)b,
+                        (unsigned char)a};
+
+  int bgType;
+  if (!(in >> tag) || tag != "GRIDTYPE")
+    return false;
+  if (!(in >> bgType))
+    return false;
+  settings.bgType = (BackgroundType)bgType;
+
+  if (!(in >> tag) || tag != "GRIDWIDTH")
+    return false;
+  in >> settings.gridWidth;
+
+  size_t count = 0;
+  if (!(in >> tag))
+    return false;
+  if (tag == "ORIGIN" &&
+      (!(in >> settings.originX >> settings.originY) || !(in >> tag)))
+    return false;
+  settings.artboards.clear();
+  while (tag == "ARTBOARD") {
+    Artboard board;
+    if (!(in >> board.x >> board.y >> board.width >> board.height))
+      return false;
+    getline(in, board.name);
+    board.name = Trim(board.name);
+    settings.artboards.push_back(board);
+    if (!(in >> tag))
+      return false;
+  }
+  settings.functions.clear();
+  while (tag == "FUNCTION") {
+    GraphFunction fn;
+    int r, g, b, a;
+    if (!(in >> r >> g >> b >> a >> fn.strokeWidth))
+      return false;
+    fn.color = {(unsigned char)r, (unsigned char)g, (unsigned char)b,
+                (unsigned char)a};
+    getline(in, fn.expr);
+    fn.expr = Trim(fn.expr);
+    settings.functions.push_back(fn);
+    if (!(in >> tag))
+      return false;
+  }
+  settings.layers.clear();
+  while (tag == "LAYER") {
+    Layer layer;
+    int visible = 1, locked = 0;
+    if (!(in >> visible >> locked >> layer.opacity))
+      return false;
+    layer.visible = visible != 0;
+    layer.locked = locked != 0;
+    layer.opacity = Clamp(layer.opacity, 0.0f, 1.0f);
+    getline(in, layer.name);
+    layer.name = Trim(layer.name);
+    settings.layers.push_back(layer);
+    if (!(in >> tag))
+      return false;
+  }
+  settings.symbols.clear();
+  while (tag == "SYMBOL") {
+    SymbolDef sym;
+    size_t parts = 0;
+    if (!(in >> sym.frame.x >> sym.frame.y >> sym.frame.width >>
+          sym.frame.height >> parts))
+      return false;
+    getline(in, sym.name);
+    sym.name = Trim(sym.name);
+    sym.elements.resize(parts);
+    for (auto &el : sym.elements) {
+      if (!DeserializeElement(in, el))
+        return false;
+    }
+    settings.symbols.push_back(move(sym));
+    if (!(in >> tag))
+      return false;
+  }
+  if (tag != "ELEMENT_COUNT")
+    return false;
+  if (!(in >> count))
+    return false;
+
+  vector<Element> &loaded = doc.elements;
+  loaded.clear();
+  loaded.reserve(min<size_t>(count, 1 << 20));
+  for (size_t i = 0; i < count; i++) {
+    if ((i & 255) == 0) {
+      if (cancel && cancel->load())
+        return false;
+      if (progress)
+        progress->store((float)((double)in.tellg() / fileSize));
+    }
+    Element el;
+    if (!DeserializeElement(in, el, settings.originX, settings.originY))
+      return false;
+    loaded.push_back(std::move(el));
+  }
+
+  doc.recovered = ReplayJournal(path, doc.source, loaded, settings);
+  if (progress)
+    progress->store(1.0f);
+  return true;
+}
+
+void ShareSceneDocument(SceneDocument &doc) {
+  unordered_set<int> used;
+  doc.nextId = 0;
+  for (auto &el : doc.elements)
+    NormalizeElementIDs(el, used, doc.nextId);
+  doc.shared.clear();
+  doc.shared.reserve(doc.elements.size());
+  for (auto &el : doc.elements) {
+    doc.shared.push_back(make_shared<const Element>(el));
+    RehomeElement(el, doc.settings.originX, doc.settings.originY);
+  }
+  doc.ready = true;
+}
+
+void ApplySceneDocument(Canvas &canvas, SceneDocument &doc) {
+  if (!doc.ready)
+    ShareSceneDocument(doc);
+  canvas.textSize = doc.settings.textSize;
+  canvas.strokeWidth = doc.settings.strokeWidth;
+  canvas.drawColor = doc.settings.drawColor;
+  canvas.bgType = doc.settings.bgType;
+  canvas.gridWidth = doc.settings.gridWidth;
+  canvas.originX = doc.settings.originX;
+  canvas.originY = doc.settings.originY;
+  canvas.artboards = doc.settings.artboards;
+  canvas.functions = doc.settings.functions;
+  canvas.symbols = move(doc.settings.symbols);
+  for (auto &sym : canvas.symbols)
+    sym.version = canvas.nextSymbolVersion++;
+  canvas.symbolEdit.text.clear();
+  canvas.layers = doc.settings.layers;
+  canvas.activeLayer = 0;
+  canvas.journal.recovered = doc.recovered;
+  canvas.elements.swap(doc.elements);
+  canvas.nextElementId = doc.nextId;
+  canvas.selectedIndices.clear();
+  ResetUndoTree(canvas, &doc.shared);
+  canvas.isTextEditing = false;
+  canvas.commandMode = false;
+}
+
+bool LoadCanvasFromFile(Canvas &canvas, const string &path) {
+  SceneDocument doc;
+  if (!ParseSceneFile(path, doc))
+    return false;
+  ApplySceneDocument(canvas, doc);
+  return true;
+}
+
+void JournalWriterLoop(Journal *journal) {
+  FILE *file = nullptr;
+  string openPath;
+  bool failed = false;
+  while (true) {
+    JournalJob job;
+    {
+      unique_lock<mutex> guard(journal->lock);
+      journal->wake.wait(guard,
+                         [&] { return journal->stop || !journal->jobs.empty(); });
+      if (journal->jobs.empty())
+        break;
+      job = std::move(journal->jobs.front());
+      journal->jobs.pop_front();
+    }
+    if (file && (job.kind != JournalJob::APPEND || job.path != openPath)) {
+      fclose(file);
+      file = nullptr;
+    }
+    if (job.kind == JournalJob::REMOVE) {
+      remove(job.path.c_str());
+      continue;
+    }
+    // The file now misses a batch; only a reset rewrites it.
+    if (failed && job.kind == JournalJob::APPEND && job.path == openPath)
+      continue;
+    if (!file) {
+      file = fopen(job.path.c_str(),
+                   job.kind == JournalJob::RESET ? "wb" : "ab");
+      openPath = job.path;
+    }
+    failed = !file ||
+             fwrite(job.data.data(), 1, job.data.size(), file) !=
+                 job.data.size() ||
+             fflush(file) != 0 || fsync(fileno(file)) != 0;
+    if (failed) {
+      lock_guard<mutex> guard(journal->lock);
+      journal->error = strerror(errno);
+    }
+    if (file && (failed || job.kind == JournalJob::RESET)) {
+      fclose(file);
+      file = nullptr;
+    }
+  }
+  if (file)
+    fclose(file);
+}
+
+void QueueJournalJob(Journal &journal, JournalJob::Kind kind, string data) {
+  if (journal.path.empty())
+    return;
+  if (!journal.writer.joinable())
+    journal.writer = thread(JournalWriterLoop, &journal);
+  {
+    lock_guard<mutex> guard(journal.lock);
+    journal.jobs.push_back({kind, journal.path, std::move(data)});
+  }
+  journal.wake.notify_one();
+}
+
+void ResetJournalPending(Canvas &canvas) {
+  Journal &journal = canvas.journal;
+  journal.pending.clear();
+  journal.capturing = false;
+  journal.carry.clear();
+  journal.lastFlush = GetTime();
+}
+
+void FlushJournal(Canvas &canvas);
+
+void RebaseJournal(Canvas &canvas, const string &savePath) {
+  Journal &journal = canvas.journal;
+  FlushJournal(canvas);
+  string carry = std::move(journal.carry);
+  journal.carry.clear();
+  journal.capturing = false;
+  if (journal.path != JournalPathFor(savePath) || !journal.enabled)
+    return;
+  QueueJournalJob(journal, JournalJob::RESET,
+                  JournalHeader(AutosavePathFor(savePath)));
+  if (!carry.empty())
+    QueueJournalJob(journal, JournalJob::APPEND, std::move(carry));
+}
+
+void AttachJournal(Canvas &canvas, const string &savePath,
+                   const string &basePath = "") {
+  Journal &journal = canvas.journal;
+  string nextPath = JournalPathFor(savePath);
+  if (!journal.path.empty() && journal.path != nextPath)
+    QueueJournalJob(journal, JournalJob::REMOVE, "");
+  journal.path = nextPath;
+  ResetJournalPending(canvas);
+  if (!journal.enabled) {
+    QueueJournalJob(journal, JournalJob::REMOVE, "");
+    return;
+  }
+  ifstream existing(nextPath);
+  string header;
+  if (existing.is_open() && getline(existing, header) &&
+      (header + "\n" == JournalHeader(savePath) ||
+       header + "\n" == JournalHeader(AutosavePathFor(savePath))))
+    return;
+  QueueJournalJob(journal, JournalJob::RESET,
+                  JournalHeader(basePath.empty() ? savePath : basePath));
+}
+
+void CompactJournal(Canvas &canvas, const string &savePath) {
+  if (canvas.journal.path != JournalPathFor(savePath)) {
+    AttachJournal(canvas, savePath);
+    return;
+  }
+  ResetJournalPending(canvas);
+  if (canvas.journal.enabled)
+    QueueJournalJob(canvas.journal, JournalJob::RESET, JournalHeader(savePath));
+}
+
+// Frames are written relative to 0, so no op depends on an earlier ORIGIN.
+void WriteSceneDeltaOps(ostream &out, const SceneDelta &delta, bool forward) {
+  const vector<Element> &from = forward ? delta.before : delta.after;
+  const vector<Element> &to = forward ? delta.after : delta.before;
+  const vector<int> &order = forward ? delta.afterOrder : delta.beforeOrder;
+  if (delta.full)
+    out << "CLEAR\n";
+  unordered_set<int> kept;
+  for (const auto &el : to)
+    kept.insert(el.uniqueID);
+  if (!delta.full) {
+    for (const auto &el : from) {
+      if (kept.count(el.uniqueID) == 0)
+        out << "DEL " << el.uniqueID << "\n";
+    }
+  }
+  for (const auto &el : to) {
+    out << "PUT\n";
+    SerializeElement(out, el, 0.0, 0.0);
+  }
+  if (!order.empty()) {
+    out << "ORDER " << order.size();
+    for (int id : order)
+      out << " " << id;
+    out << "\n";
+  }
+}
+
+void FlushJournal(Canvas &canvas) {
+  Journal &journal = canvas.journal;
+  journal.lastFlush = GetTime();
+  if (journal.pending.empty())
+    return;
+  string batch = "BATCH\n" + journal.pending + "COMMIT\n";
+  journal.pending.clear();
+  if (journal.capturing)
+    journal.carry += batch;
+  QueueJournalJob(journal, JournalJob::APPEND, std::move(batch));
+}
+
+void TickJournal(Canvas &canvas, const AppConfig &cfg) {
+  string error;
+  {
+    lock_guard<mutex> guard(canvas.journal.lock);
+    error.swap(canvas.journal.error);
+  }
+  if (!error.empty())
+    SetStatus(canvas, cfg,
+              "Journal write failed (" + error +
+                  "); crash recovery is off until the next save");
+  if (GetTime() - canvas.journal.lastFlush < canvas.journal.flushSeconds)
+    return;
+  CommitPendingEdit(canvas);
+  FlushJournal(canvas);
+}
+
+void CloseJournal(Canvas &canvas, bool removeFile) {
+  Journal &journal = canvas.journal;
+  if (removeFile)
+    QueueJournalJob(journal, JournalJob::REMOVE, "");
+  if (journal.writer.joinable()) {
+    {
+      lock_guard<mutex> guard(journal.lock);
+      journal.stop = true;
+    }
+    journal.wake.notify_one();
+    journal.writer.join();
+  }
+}
+
+void DetachJournal(Canvas &canvas) {
+  QueueJournalJob(canvas.journal, JournalJob::REMOVE, "");
+  canvas.journal.path.clear();
+  ResetJournalPending(canvas);
+}
+
+string HistoryPathFor(const string &savePath) { return savePath + ".history"; }
+
+void AppendHistory(HistoryRecorder &recorder, const string &text) {
+  if (!recorder.file)
+    return;
+  fwrite(text.data(), 1, text.size(), recorder.file);
+  fflush(recorder.file);
+}
+
+string HistoryBatchStart() {
+  double now = chrono::duration<double>(
+                   chrono::system_clock::now().time_since_epoch())
+                   .count();
+  ostringstream out;
+  out << "BATCH\nTIME " << fixed << setprecision(3) << now << "\n";
+  return out.str();
+}
+
+void TrackChunkDelta(Canvas &canvas, const SceneDelta &delta, bool forward);
+
+void PublishSceneDelta(Canvas &canvas, const SceneDelta &delta, bool forward) {
+  TrackChunkDelta(canvas, delta, forward);
+  Journal &journal = canvas.journal;
+  HistoryRecorder &recorder = canvas.recorder;
+  bool journaled = journal.enabled && !journal.path.empty();
+  if (!journaled && !recorder.file)
+    return;
+  ostringstream out;
+  WriteSceneDeltaOps(out, delta, forward);
+  string ops = out.str();
+  if (recorder.file)
+    AppendHistory(recorder, HistoryBatchStart() + ops + "COMMIT\n");
+  if (journaled)
+    journal.pending += ops;
+}
+
+void DetachHistory(Canvas &canvas) {
+  HistoryRecorder &recorder = canvas.recorder;
+  if (recorder.file)
+    fclose(recorder.file);
+  recorder.file = nullptr;
+  if (recorder.unsaved && !recorder.path.empty())
+    remove(recorder.path.c_str());
+  recorder.path.clear();
+  recorder.unsaved = false;
+}
+
+bool IsHistoryFresh(const string &path) {
+  error_code ec;
+  return !filesystem::exists(path, ec) || filesystem::file_size(path, ec) == 0;
+}
+
+string HistorySnapshot(const vector<shared_ptr<const Element>> &elements) {
+  ostringstream out;
+  out << "TOGGLE_HISTORY_V1\n";
+  if (!elements.empty()) {
+    out << HistoryBatchStart();
+    for (const auto &el : elements) {
+      out << "PUT\n";
+      SerializeElement(out, *el, 0.0, 0.0);
+    }
+    out << "COMMIT\n";
+  }
+  return out.str();
+}
+
+void AttachHistory(Canvas &canvas, const string &savePath, bool unsaved) {
+  DetachHistory(canvas);
+  HistoryRecorder &recorder = canvas.recorder;
+  if (!recorder.enabled || savePath.empty())
+    return;
+  string path = HistoryPathFor(savePath);
+  bool fresh = IsHistoryFresh(path);
+  recorder.file = fopen(path.c_str(), "ab");
+  if (!recorder.file)
+    return;
+  recorder.path = path;
+  recorder.unsaved = unsaved;
+  if (fresh)
+    AppendHistory(recorder, HistorySnapshot(canvas.undoTree.head));
+}
+
+void MoveHistory(Canvas &canvas, const string &savePath) {
+  HistoryRecorder &recorder = canvas.recorder;
+  string next = HistoryPathFor(savePath);
+  if (!recorder.file || recorder.path == next) {
+    if (!recorder.file)
+      AttachHistory(canvas, savePath, false);
+    return;
+  }
+  fclose(recorder.file);
+  recorder.file = nullptr;
+  error_code ec;
+  if (recorder.unsaved)
+    filesystem::rename(recorder.path, next, ec);
+  else
+    filesystem::copy_file(recorder.path, next,
+                          filesystem::copy_options::overwrite_existing, ec);
+  recorder.file = ec ? nullptr : fopen(next.c_str(), "ab");
+  if (!recorder.file) {
+    recorder.unsaved = false;
+    recorder.path.clear();
+    AttachHistory(canvas, savePath, false);
+    return;
+  }
+  recorder.path = next;
+  recorder.unsaved = false;
+}
+
+string ChunkIndexPath(const ChunkStore &store) {
+  return JoinPath(store.dir, "index.toggle-chunks");
+}
+
+string ChunkTilePath(const ChunkStore &store, pair<int, int> key) {
+  return JoinPath(store.dir, "tile_" + to_string(key.first) + "_" +
+                                 to_string(key.second) + ".chunk");
+}
+
+pair<int, int> ChunkKeyFor(const ChunkStore &store, const Element &el, double x,
+                           double y) {
+  Rectangle b = el.GetBounds();
+  double size = store.tileSize;
+  return {(int)floor((x + b.x + b.width * 0.5f) / size),
+          (int)floor((y + b.y + b.height * 0.5f) / size)};
+}
+
+Vector2 ChunkTileShift(const Canvas &canvas, pair<int, int> key) {
+  double size = canvas.chunks.tileSize;
+  return {(float)(canvas.originX - key.first * size),
+          (float)(canvas.originY - key.second * size)};
+}
+
+bool WriteChunkIndex(const Canvas &canvas) {
+  const ChunkStore &store = canvas.chunks;
+  string path = ChunkIndexPath(store);
+  string tmpPath = path + ".tmp";
+  {
+    ofstream out(tmpPath);
+    if (!out.is_open())
+      return false;
+    out << "TOGGLE_CHUNKS_V1\n";
+    out << "TILESIZE " << store.tileSize << "\n";
+    out << "NEXTID " << store.nextId << "\n";
+    out << "SETTINGS " << canvas.textSize << " " << canvas.strokeWidth << " "
+        << (int)canvas.drawColor.r << " " << (int)canvas.drawColor.g << " "
+        << (int)canvas.drawColor.b << " " << (int)canvas.drawColor.a << " "
+        << (int)canvas.bgType << " " << canvas.gridWidth << "\n";
+    int onDisk = 0;
+    for (const auto &kv : store.tiles)
+      onDisk += kv.second.onDisk ? 1 : 0;
+    out << "TILE_COUNT " << onDisk << "\n";
+    for (const auto &kv : store.tiles) {
+      if (!kv.second.onDisk)
+        continue;
+      const Rectangle &b = kv.second.bounds;
+      out << "TILE " << kv.first.first << " " << kv.first.second << " "
+          << kv.second.count << " " << b.x << " " << b.y << " " << b.width << " "
+          << b.height << "\n";
+    }
+    out.flush();
+    if (!out)
+      return false;
+  }
+  error_code ec;
+  filesystem::rename(tmpPath, path, ec);
+  return !ec;
+}
+
+bool ReadChunkIndex(Canvas &canvas, const string &dir) {
+  ifstream in(JoinPath(dir, "index.toggle-chunks"));
+  if (!in.is_open())
+    return false;
+  string magic;
+  getline(in, magic);
+  if (Trim(magic) != "TOGGLE_CHUNKS_V1")
+    return false;
+  ChunkStore &store = canvas.chunks;
+  string tag;
+  int r, g, b, a, bgType;
+  size_t count = 0;
+  if (!(in >> tag >> store.tileSize) || tag != "TILESIZE" ||
+      !(in >> tag >> store.nextId) || tag != "NEXTID" || !(in >> tag) ||
+      tag != "SETTINGS" ||
+      !(in >> canvas.textSize >> canvas.strokeWidth >> r >> g >> b >> a >>
+        bgType >> canvas.gridWidth) ||
+      !(in >> tag >> count) || tag != "TILE_COUNT")
+    return false;
+  canvas.drawColor = {(unsigned char)r, (unsigned char)g, (unsigned char)b,
+                      (unsigned char)a};
+  canvas.bgType = (BackgroundType)bgType;
+  store.tiles.clear();
+  for (size_t i = 0; i < count; i++) {
+    pair<int, int> key;
+    ChunkTile tile;
+    if (!(in >> tag >> key.first >> key.second >> tile.count >> tile.bounds.x >>
+          tile.bounds.y >> tile.bounds.width >> tile.bounds.height) ||
+        tag != "TILE")
+      return false;
+    tile.onDisk = true;
+    store.tiles[key] = tile;
+  }
+  return true;
+}
+
+Rectangle ChunkTileBounds(const ChunkStore &store, const Element &el, double x,
+                          double y, pair<int, int> key) {
+  Rectangle b = el.GetBounds();
+  b.x += (float)(x - key.first * (double)store.tileSize);
+  b.y += (float)(y - key.second * (double)store.tileSize);
+  return b;
+}
+
+void ExtendChunkBounds(ChunkTile &tile, const Rectangle &b, bool first) {
+  if (first) {
+    tile.bounds = b;
+    return;
+  }
+  float x1 = max(tile.bounds.x + tile.bounds.width, b.x + b.width);
+  float y1 = max(tile.bounds.y + tile.bounds.height, b.y + b.height);
+  tile.bounds.x = min(tile.bounds.x, b.x);
+  tile.bounds.y = min(tile.bounds.y, b.y);
+  tile.bounds.width = x1 - tile.bounds.x;
+  tile.bounds.height = y1 - tile.bounds.y;
+}
+
+ChunkTile &OwnerChunkTile(ChunkStore &store, pair<int, int> key) {
+  ChunkTile &tile = store.tiles[key];
+  if (!tile.resident && !tile.onDisk)
+    tile.resident = true;
+  return tile;
+}
+
+bool ReadChunkTile(const string &path, vector<pair<double, Element>> &out) {
+  ifstream in(path);
+  string tag;
+  size_t count = 0;
+  if (!in.is_open() || !(in >> tag >> count) || tag != "TOGGLE_TILE_V1")
+    return false;
+  for (size_t i = 0; i < count; i++) {
+    double z = 0.0;
+    Element el;
+    if (!(in >> tag >> z) || tag != "Z" || !DeserializeElement(in, el))
+      return false;
+    out.push_back({z, std::move(el)});
+  }
+  return true;
+}
+
+bool WriteChunkTileFile(const string &path,
+                        const vector<pair<double, Element>> &owned) {
+  error_code ec;
+  if (owned.empty()) {
+    filesystem::remove(path, ec);
+    return true;
+  }
+  string tmpPath = path + ".tmp";
+  {
+    ofstream out(tmpPath);
+    if (!out.is_open())
+      return false;
+    out << "TOGGLE_TILE_V1 " << owned.size() << "\n";
+    for (const auto &item : owned) {
+      out << "Z " << setprecision(17) << item.first << setprecision(6) << "\n";
+      SerializeElement(out, item.second);
+    }
+    out.flush();
+    if (!out)
+      return false;
+  }
+  filesystem::rename(tmpPath, path, ec);
+  return !ec;
+}
+
+void ChunkWorkerLoop(ChunkStore *store) {
+  while (true) {
+    ChunkJob job;
+    {
+      unique_lock<mutex> guard(store->lock);
+      store->wake.wait(guard, [&] { return store->stop || !store->jobs.empty(); });
+      if (store->jobs.empty())
+        break;
+      job = std::move(store->jobs.front());
+      store->jobs.pop_front();
+    }
+    if (job.kind == ChunkJob::READ) {
+      job.ok = ReadChunkTile(job.path, job.elements);
+    } else {
+      job.ok = WriteChunkTileFile(job.path, job.elements);
+      if (job.ok)
+        job.elements.clear();
+    }
+    lock_guard<mutex> guard(store->lock);
+    store->done.push_back(std::move(job));
+  }
+}
+
+void QueueChunkJob(ChunkStore &store, ChunkJob job) {
+  if (!store.worker.joinable())
+    store.worker = thread(ChunkWorkerLoop, &store);
+  {
+    lock_guard<mutex> guard(store.lock);
+    store.jobs.push_back(std::move(job));
+  }
+  store.wake.notify_one();
+}
+
+void DrainChunkJobs(ChunkStore &store) {
+  if (!store.worker.joinable())
+    return;
+  {
+    lock_guard<mutex> guard(store.lock);
+    store.stop = true;
+  }
+  store.wake.notify_one();
+  store.worker.join();
+  store.stop = false;
+}
+
+void GatherChunkTile(Canvas &canvas, pair<int, int> key,
+                     vector<pair<double, Element>> &owned) {
+  ChunkStore &store = canvas.chunks;
+  ChunkTile &tile = store.tiles[key];
+  Vector2 shift = ChunkTileShift(canvas, key);
+  for (const auto &el : canvas.elements) {
+    auto it = store.owner.find(el.uniqueID);
+    if (it == store.owner.end() || it->second != key)
+      continue;
+    owned.push_back({store.rank[el.uniqueID], el});
+    MoveElement(owned.back().second, shift);
+    ExtendChunkBounds(tile, owned.back().second.GetBounds(), owned.size() == 1);
+  }
+  tile.count = (int)owned.size();
+}
+
+bool WriteChunkTile(Canvas &canvas, pair<int, int> key) {
+  vector<pair<double, Element>> owned;
+  GatherChunkTile(canvas, key, owned);
+  if (!WriteChunkTileFile(ChunkTilePath(canvas.chunks, key), owned))
+    return false;
+  canvas.chunks.tiles[key].onDisk = !owned.empty();
+  return true;
+}
+
+void RepairChunkRanks(Canvas &canvas) {
+  ChunkStore &store = canvas.chunks;
+  double prev = -numeric_limits<double>::infinity();
+  for (const auto &el : canvas.elements) {
+    auto it = store.rank.find(el.uniqueID);
+    if (it == store.rank.end() || it->second <= prev) {
+      double next = isinf(prev) ? 0.0 : prev + 1.0;
+      store.rank[el.uniqueID] = next;
+      prev = next;
+    } else {
+      prev = it->second;
+    }
+  }
+  if (!isinf(prev))
+    store.topRank = max(store.topRank, prev);
+}
+
+void AssignChunkOwners(Canvas &canvas) {
+  ChunkStore &store = canvas.chunks;
+  for (const auto &el : canvas.elements) {
+    auto it = store.owner.find(el.uniqueID);
+    pair<int, int> key =
+        it != store.owner.end()
+            ? it->second
+            : ChunkKeyFor(store, el, canvas.originX, canvas.originY);
+    store.owner[el.uniqueID] = key;
+    if (!OwnerChunkTile(store, key).resident)
+      store.wanted.insert(key);
+  }
+}
+
+void MeasureChunkBytes(Canvas &canvas) {
+  ChunkStore &store = canvas.chunks;
+  for (auto &kv : store.tiles) {
+    if (kv.second.resident)
+      kv.second.bytes = 0;
+  }
+  store.residentBytes = 0;
+  for (const auto &el : canvas.elements) {
+    auto it = store.owner.find(el.uniqueID);
+    if (it == store.owner.end())
+      continue;
+    ChunkTile &tile = store.tiles[it->second];
+    if (!tile.resident)
+      continue;
+    size_t bytes = EstimateElementBytes(el);
+    ExtendChunkBounds(tile,
+                      ChunkTileBounds(store, el, canvas.originX, canvas.originY,
+                                      it->second),
+                      tile.bytes == 0);
+    tile.bytes += bytes;
+    store.residentBytes += (long long)bytes;
+  }
+}
+
+void TrackChunkDelta(Canvas &canvas, const SceneDelta &delta, bool forward) {
+  ChunkStore &store = canvas.chunks;
+  if (!store.active)
+    return;
+  const vector<Element> &from = forward ? delta.before : delta.after;
+  const vector<Element> &to = forward ? delta.after : delta.before;
+  const vector<int> &toOrder = forward ? delta.afterOrder : delta.beforeOrder;
+  for (const auto &el : from) {
+    auto it = store.owner.find(el.uniqueID);
+    if (it == store.owner.end())
+      continue;
+    ChunkTile &tile = OwnerChunkTile(store, it->second);
+    if (!tile.resident) {
+      store.stale.insert(el.uniqueID);
+      continue;
+    }
+    size_t bytes = min(tile.bytes, EstimateElementBytes(el));
+    tile.bytes -= bytes;
+    store.residentBytes -= (long long)bytes;
+  }
+  for (const auto &el : to) {
+    auto it = store.owner.find(el.uniqueID);
+    pair<int, int> key = it != store.owner.end()
+                             ? it->second
+                             : ChunkKeyFor(store, el, el.frameX, el.frameY);
+    store.owner[el.uniqueID] = key;
+    if (toOrder.empty() && store.rank.count(el.uniqueID) == 0)
+      store.rank[el.uniqueID] = ++store.topRank;
+    ChunkTile &tile = OwnerChunkTile(store, key);
+    if (!tile.resident) {
+      store.stale.insert(el.uniqueID);
+      store.wanted.insert(key);
+      continue;
+    }
+    size_t bytes = EstimateElementBytes(el);
+    ExtendChunkBounds(tile, ChunkTileBounds(store, el, el.frameX, el.frameY, key),
+                      tile.bytes == 0);
+    tile.bytes += bytes;
+    store.residentBytes += (long long)bytes;
+  }
+  if (delta.full || !toOrder.empty())
+    store.rescan = true;
+}
+
+void SyncUndoHeadAfterPaging(Canvas &canvas) {
+  UndoTree &tree = canvas.undoTree;
+  unordered_map<int, shared_ptr<const Element>> byId;
+  byId.reserve(tree.head.size());
+  for (auto &item : tree.head)
+    byId[item->uniqueID] = std::move(item);
+  tree.head.clear();
+  tree.head.reserve(canvas.elements.size());
+  for (const auto &el : canvas.elements) {
+    auto it = byId.find(el.uniqueID);
+    if (it != byId.end() && it->second)
+      tree.head.push_back(std::move(it->second));
+    else
+      tree.head.push_back(make_shared<const Element>(
+          StoredElement(el, nullptr, canvas.originX, canvas.originY)));
+  }
+}
+
+void MergeChunkTile(Canvas &canvas, pair<int, int> key,
+                    vector<pair<double, Element>> &loaded) {
+  ChunkStore &store = canvas.chunks;
+  ChunkTile &tile = store.tiles[key];
+  tile.resident = true;
+  tile.bytes = 0;
+  store.wanted.erase(key);
+  unordered_set<int> live;
+  live.reserve(canvas.elements.size());
+  vector<pair<double, Element>> merged;
+  merged.reserve(canvas.elements.size() + loaded.size());
+  double last = 0.0;
+  for (auto &el : canvas.elements) {
+    auto it = store.rank.find(el.uniqueID);
+    last = it != store.rank.end() ? it->second : last;
+    live.insert(el.uniqueID);
+    auto owner = store.owner.find(el.uniqueID);
+    if (owner != store.owner.end() && owner->second == key)
+      tile.bytes += EstimateElementBytes(el);
+    merged.push_back({last, std::move(el)});
+  }
+  Vector2 shift = Vector2Negate(ChunkTileShift(canvas, key));
+  for (auto &item : loaded) {
+    int id = item.second.uniqueID;
+    if (store.stale.erase(id) > 0 || live.count(id) > 0)
+      continue;
+    MoveElement(item.second, shift);
+    store.owner[id] = key;
+    store.rank[id] = item.first;
+    store.topRank = max(store.topRank, item.first);
+    tile.bytes += EstimateElementBytes(item.second);
+    merged.push_back(std::move(item));
+  }
+  for (auto it = store.stale.begin(); it != store.stale.end();) {
+    auto owner = store.owner.find(*it);
+    if (owner != store.owner.end() && owner->second == key)
+      it = store.stale.erase(it);
+    else
+      ++it;
+  }
+  store.residentBytes += (long long)tile.bytes;
+  stable_sort(merged.begin(), merged.end(),
+              [](const pair<double, Element> &a, const pair<double, Element> &b) {
+                return a.first < b.first;
+              });
+  canvas.elements.clear();
+  for (auto &item : merged)
+    canvas.elements.push_back(std::move(item.second));
+}
+
+void PageInChunk(Canvas &canvas, pair<int, int> key) {
+  ChunkStore &store = canvas.chunks;
+  ChunkTile &tile = OwnerChunkTile(store, key);
+  if (tile.resident)
+    store.wanted.erase(key);
+  if (tile.resident || tile.loading)
+    return;
+  tile.loading = true;
+  ChunkJob job;
+  job.kind = ChunkJob::READ;
+  job.key = key;
+  job.path = ChunkTilePath(store, key);
+  QueueChunkJob(store, std::move(job));
+}
+
+void PageOutChunk(Canvas &canvas, pair<int, int> key) {
+  ChunkStore &store = canvas.chunks;
+  ChunkJob job;
+  job.kind = ChunkJob::WRITE;
+  job.key = key;
+  job.path = ChunkTilePath(store, key);
+  GatherChunkTile(canvas, key, job.elements);
+  canvas.elements.erase(
+      remove_if(canvas.elements.begin(), canvas.elements.end(),
+                [&](const Element &el) {
+                  auto it = store.owner.find(el.uniqueID);
+                  return it != store.owner.end() && it->second == key;
+                }),
+      canvas.elements.end());
+  for (const auto &item : job.elements)
+    store.rank.erase(item.second.uniqueID);
+  ChunkTile &tile = store.tiles[key];
+  store.residentBytes -= (long long)tile.bytes;
+  tile.bytes = 0;
+  tile.resident = false;
+  tile.onDisk = !job.elements.empty();
+  QueueChunkJob(store, std::move(job));
+  if (!tile.onDisk)
+    store.tiles.erase(key);
+}
+
+bool CollectChunkJobs(Canvas &canvas) {
+  ChunkStore &store = canvas.chunks;
+  deque<ChunkJob> done;
+  {
+    lock_guard<mutex> guard(store.lock);
+    done.swap(store.done);
+  }
+  bool changed = false;
+  for (auto &job : done) {
+    auto it = store.tiles.find(job.key);
+    if (job.kind == ChunkJob::READ) {
+      if (it == store.tiles.end())
+        continue;
+      it->second.loading = false;
+      if (!job.ok || it->second.resident)
+        continue;
+    } else if (job.ok) {
+      continue;
+    }
+    MergeChunkTile(canvas, job.key, job.elements);
+    changed = true;
+  }
+  return changed;
+}
+
+// Paging is held off mid-interaction, since that relies on indices.
+void TickChunks(Canvas &canvas) {
+  ChunkStore &store = canvas.chunks;
+  if (!store.active || GetTime() - store.lastPage < 0.25 ||
+      EditInProgress(canvas) || !canvas.selectedIndices.empty())
+    return;
+  store.lastPage = GetTime();
+  store.tick++;
+  CommitPendingEdit(canvas);
+  if (store.rescan) {
+    store.rescan = false;
+    RepairChunkRanks(canvas);
+    AssignChunkOwners(canvas);
+    MeasureChunkBytes(canvas);
+  }
+
+  Vector2 a = GetScreenToWorld2D({0.0f, 0.0f}, canvas.camera);
+  Vector2 b = GetScreenToWorld2D(
+      {(float)GetScreenWidth(), (float)GetScreenHeight()}, canvas.camera);
+  Rectangle view = ExpandRect({min(a.x, b.x), min(a.y, b.y), fabsf(b.x - a.x),
+                               fabsf(b.y - a.y)},
+                              store.tileSize * 0.5f);
+  vector<pair<int, int>> needed(store.wanted.begin(), store.wanted.end());
+  for (auto &kv : store.tiles) {
+    ChunkTile &tile = kv.second;
+    Vector2 shift = ChunkTileShift(canvas, kv.first);
+    Rectangle cell = {-shift.x, -shift.y, store.tileSize, store.tileSize};
+    Rectangle bounds = {tile.bounds.x - shift.x, tile.bounds.y - shift.y,
+                        tile.bounds.width, tile.bounds.height};
+    bool visible = CheckCollisionRecs(view, cell) ||
+                   ((tile.resident || tile.onDisk) &&
+                    CheckCollisionRecs(view, bounds));
+    if (!visible)
+      continue;
+    tile.lastUsed = store.tick;
+    if (!tile.resident)
+      needed.push_back(kv.first);
+  }
+  for (const auto &key : needed)
+    PageInChunk(canvas, key);
+
+  vector<pair<long long, pair<int, int>>> lru;
+  if (store.residentBytes > store.maxBytes) {
+    for (const auto &kv : store.tiles) {
+      if (kv.second.resident && kv.second.lastUsed < store.tick)
+        lru.push_back({kv.second.lastUsed, kv.first});
+    }
+    sort(lru.begin(), lru.end());
+  }
+  bool ready = false;
+  {
+    lock_guard<mutex> guard(store.lock);
+    ready = !store.done.empty();
+  }
+  if (!ready && lru.empty())
+    return;
+  RecordUndoState(canvas);
+  canvas.undoTree.pendingDrop = -1;
+  bool changed = ready && CollectChunkJobs(canvas);
+  for (const auto &item : lru) {
+    if (store.residentBytes <= store.maxBytes)
+      break;
+    PageOutChunk(canvas, item.second);
+    changed = true;
+  }
+  if (changed) {
+    NormalizeCanvasIDs(canvas);
+    SyncUndoHeadAfterPaging(canvas);
+  }
+}
+
+bool FlushChunks(Canvas &canvas) {
+  ChunkStore &store = canvas.chunks;
+  if (!store.active)
+    return true;
+  RecordUndoState(canvas);
+  canvas.undoTree.pendingDrop = -1;
+  DrainChunkJobs(store);
+  bool changed = CollectChunkJobs(canvas);
+  AssignChunkOwners(canvas);
+  set<pair<int, int>> load = store.wanted;
+  for (int id : store.stale) {
+    auto it = store.owner.find(id);
+    if (it != store.owner.end())
+      load.insert(it->second);
+  }
+  bool ok = true;
+  for (const auto &key : load) {
+    ChunkTile &tile = OwnerChunkTile(store, key);
+    if (tile.resident)
+      continue;
+    vector<pair<double, Element>> loaded;
+    if (!ReadChunkTile(ChunkTilePath(store, key), loaded)) {
+      ok = false;
+      continue;
+    }
+    MergeChunkTile(canvas, key, loaded);
+    changed = true;
+  }
+  RepairChunkRanks(canvas);
+  if (changed) {
+    NormalizeCanvasIDs(canvas);
+    SyncUndoHeadAfterPaging(canvas);
+  }
+  vector<pair<int, int>> resident;
+  for (const auto &kv : store.tiles) {
+    if (kv.second.resident)
+      resident.push_back(kv.first);
+  }
+  for (const auto &key : resident) {
+    ok = WriteChunkTile(canvas, key) && ok;
+    if (!store.tiles[key].onDisk && store.tiles[key].count == 0)
+      store.tiles.erase(key);
+  }
+  return WriteChunkIndex(canvas) && ok;
+}
+
+void CloseChunks(Canvas &canvas) {
+  if (!canvas.chunks.active)
+    return;
+  FlushChunks(canvas);
+  DrainChunkJobs(canvas.chunks);
+  canvas.chunks.active = false;
+  canvas.chunks.tiles.clear();
+  canvas.chunks.owner.clear();
+  canvas.chunks.rank.clear();
+  canvas.chunks.stale.clear();
+  canvas.chunks.wanted.clear();
+  canvas.chunks.done.clear();
+  canvas.chunks.dir.clear();
+  canvas.chunks.residentBytes = 0;
+}
+
+bool OpenChunks(Canvas &canvas, const string &dir, bool &created) {
+  CloseChunks(canvas);
+  ChunkStore &store = canvas.chunks;
+  store.dir = dir;
+  store.owner.clear();
+  store.rank.clear();
+  store.topRank = -1.0;
+  created = !FileExists(ChunkIndexPath(store).c_str());
+  if (!created) {
+    if (!ReadChunkIndex(canvas, dir))
+      return false;
+    canvas.elements.clear();
+  } else {
+    if (!EnsureDirectory(dir))
+      return false;
+    store.tiles.clear();
+    store.nextId = canvas.nextElementId;
+  }
+  store.active = true;
+  store.rescan = created;
+  store.lastPage = 0.0;
+  canvas.selectedIndices.clear();
+  RemoveAutosave(canvas.savePath);
+  canvas.savePath.clear();
+  DetachJournal(canvas);
+  DetachHistory(canvas);
+  ResetUndoTree(canvas);
+  return !created || FlushChunks(canvas);
+}
+
+void CollectChunkedScene(Canvas &canvas, vector<Element> &out) {
+  ChunkStore &store = canvas.chunks;
+  DrainChunkJobs(store);
+  vector<pair<double, Element>> all;
+  unordered_set<int> live;
+  live.reserve(canvas.elements.size());
+  double last = 0.0;
+  for (const auto &el : canvas.elements) {
+    auto it = store.rank.find(el.uniqueID);
+    last = it != store.rank.end() ? it->second : last;
+    live.insert(el.uniqueID);
+    all.push_back({last, el});
+  }
+  for (const auto &kv : store.tiles) {
+    if (kv.second.resident || !kv.second.onDisk)
+      continue;
+    vector<pair<double, Element>> loaded;
+    ReadChunkTile(ChunkTilePath(store, kv.first), loaded);
+    Vector2 shift = Vector2Negate(ChunkTileShift(canvas, kv.first));
+    for (auto &item : loaded) {
+      if (store.stale.count(item.second.uniqueID) > 0 ||
+          live.count(item.second.uniqueID) > 0)
+        continue;
+      MoveElement(item.second, shift);
+      all.push_back(std::move(item));
+    }
+  }
+  stable_sort(all.begin(), all.end(),
+              [](const pair<double, Element> &a, const pair<double, Element> &b) {
+                return a.first < b.first;
+              });
+  out.clear();
+  out.reserve(all.size());
+  for (auto &item : all) {
+    out.push_back(std::move(item.second));
+    out.back().frameX = canvas.originX;
+    out.back().frameY = canvas.originY;
+  }
+}
+
+void ResetAutosave(Canvas &canvas) {
+  Autosave &autosave = canvas.autosave;
+  autosave.savedNode = canvas.undoTree.current;
+  autosave.settings = CaptureSceneSettings(canvas);
+  autosave.lastCheck = GetTime();
+}
+
+bool FinishAutosave(Canvas &canvas, bool wait) {
+  Autosave &autosave = canvas.autosave;
+  if (!autosave.worker.joinable())
+    return true;
+  if (!wait && !autosave.done.load())
+    return false;
+  autosave.worker.join();
+  if (autosave.ok) {
+    autosave.lastSaved = time(nullptr);
+    autosave.lastDurationMs = autosave.durationMs;
+    if (autosave.path == AutosavePathFor(canvas.savePath))
+      RebaseJournal(canvas, canvas.savePath);
+  }
+  canvas.journal.capturing = false;
+  canvas.journal.carry.clear();
+  autosave.written.clear();
+  return true;
+}
+
+void TickAutosave(Canvas &canvas) {
+  Autosave &autosave = canvas.autosave;
+  if (!FinishAutosave(canvas, false) || autosave.intervalSeconds <= 0.0f ||
+      canvas.savePath.empty() ||
+      GetTime() - autosave.lastCheck < autosave.intervalSeconds)
+    return;
+  autosave.lastCheck = GetTime();
+  CommitPendingEdit(canvas);
+  SceneSettings settings = CaptureSceneSettings(canvas);
+  if (canvas.undoTree.current == autosave.savedNode &&
+      SameSceneSettings(settings, autosave.settings))
+    return;
+  autosave.savedNode = canvas.undoTree.current;
+  autosave.settings = settings;
+  autosave.path = AutosavePathFor(canvas.savePath);
+  autosave.written = canvas.undoTree.head;
+  FlushJournal(canvas);
+  canvas.journal.capturing = true;
+  autosave.done = false;
+  autosave.worker = thread([&autosave, settings]() {
+    auto started = chrono::steady_clock::now();
+    autosave.ok = SaveSceneFile(autosave.path, settings, autosave.written);
+    autosave.durationMs = chrono::duration<double, milli>(
+                              chrono::steady_clock::now() - started)
+                              .count();
+    autosave.done = true;
+  });
+}
+
+// Stored elements keep their frames; live copies are re-derived from them.
+void TickWorldOrigin(Canvas &canvas, const AppConfig &cfg) {
+  Vector2 target = canvas.camera.target;
+  if (fabsf(target.x) < cfg.worldRebaseDistance &&
+      fabsf(target.y) < cfg.worldRebaseDistance)
+    return;
+  if (EditInProgress(canvas))
+    return;
+  RecordUndoState(canvas);
+  canvas.undoTree.pendingDrop = -1;
+  Vector2 step = {roundf(target.x), roundf(target.y)};
+  Vector2 delta = Vector2Negate(step);
+  canvas.originX += step.x;
+  canvas.originY += step.y;
+  canvas.camera.target = Vector2Add(canvas.camera.target, delta);
+  const vector<shared_ptr<const Element>> &head = canvas.undoTree.head;
+  for (size_t i = 0; i < canvas.elements.size(); i++) {
+    Element &el = canvas.elements[i];
+    if (i < head.size() && head[i]->uniqueID == el.uniqueID)
+      CopyElementGeometry(
+          el, *head[i], FrameShift(*head[i], canvas.originX, canvas.originY));
+    else
+      MoveElement(el, delta);
+  }
+  for (auto &p : canvas.currentPath)
+    p = Vector2Add(p, delta);
+  canvas.startPoint = Vector2Add(canvas.startPoint, delta);
+  canvas.currentMouse = Vector2Add(canvas.currentMouse, delta);
+  canvas.textPos = Vector2Add(canvas.textPos, delta);
+  canvas.lastClickPos = Vector2Add(canvas.lastClickPos, delta);
+  if (canvas.journal.enabled && !canvas.journal.path.empty()) {
+    ostringstream op;
+    op << setprecision(17) << "ORIGIN " << canvas.originX << " "
+       << canvas.originY << "\n";
+    canvas.journal.pending += op.str();
+  }
+}
+
+void StartOpen(Canvas &canvas, const AppConfig &cfg, const string &path) {
+  PendingOpen &pending = canvas.pendingOpen;
+  if (pending.worker.joinable()) {
+    SetStatus(canvas, cfg, "Already opening " + pending.path);
+    return;
+  }
+  pending.path = path;
+  pending.doc = SceneDocument();
+  pending.ok = false;
+  pending.done = false;
+  pending.cancel = false;
+  pending.progress = 0.0f;
+  bool history = canvas.recorder.enabled;
+  pending.worker = thread([&pending, history]() {
+    pending.ok = ParseSceneFile(pending.path, pending.doc, &pending.progress,
+                                &pending.cancel);
+    if (pending.ok) {
+      ShareSceneDocument(pending.doc);
+      string historyPath = HistoryPathFor(pending.path);
+      if (history && IsHistoryFresh(historyPath)) {
+        ofstream out(historyPath, ios::binary | ios::app);
+        out << HistorySnapshot(pending.doc.shared);
+      }
+    }
+    pending.done = true;
+  });
+}
+
+bool TickPendingOpen(Canvas &canvas, const AppConfig &cfg, bool escPressed) {
+  PendingOpen &pending = canvas.pendingOpen;
+  if (!pending.worker.joinable())
+    return false;
+  if (!pending.done.load()) {
+    if (escPressed)
+      pending.cancel = true;
+    SetStatus(canvas, cfg,
+              pending.cancel.load()
+                  ? "Cancelling open..."
+                  : TextFormat("Opening %s... %d%% (Esc to cancel)",
+                               pending.path.c_str(),
+                               (int)(pending.progress.load() * 100.0f)));
+    return escPressed;
+  }
+  pending.worker.join();
+  if (pending.cancel.load()) {
+    SetStatus(canvas, cfg, "Open cancelled");
+  } else if (!pending.ok) {
+    SetStatus(canvas, cfg, "Open failed: " + pending.path);
+  } else {
+    FinishAutosave(canvas, true);
+    CloseChunks(canvas);
+    if (canvas.savePath != pending.path)
+      RemoveAutosave(canvas.savePath);
+    ApplySceneDocument(canvas, pending.doc);
+    canvas.savePath = pending.path;
+    AttachJournal(canvas, pending.path, pending.doc.source);
+    AttachHistory(canvas, pending.path, false);
+    ResetAutosave(canvas);
+    string recovered;
+    if (pending.doc.source != pending.path)
+      recovered = "autosave";
+    if (canvas.journal.recovered > 0)
+      recovered += (recovered.empty() ? "" : " and ") +
+                   to_string(canvas.journal.recovered) + " journal batches";
+    if (!recovered.empty())
+      SetStatus(canvas, cfg,
+                "Opened " + pending.path + " (recovered " + recovered + ")");
+    else
+      SetStatus(canvas, cfg, "Opened " + pending.path);
+  }
+  pending.doc = SceneDocument();
+  return false;
+}
+
+string SvgEscape(const string &text) {
+  string out;
+  out.reserve(text.size());
+  for (char c : text) {
+    if (c == '&')
+      out += "&amp;";
+    else if (c == '<')
+      out += "&lt;";
+    else if (c == '>')
+      out += "&gt;";
+    else if (c == '"')
+      out += "&quot;";
+    else if (c == '\'')
+      out += "&apos;";
+    else
+      out.push_back(c);
+  }
+  return out;
+}
+
+struct SvgBuffer {
+  string text;
+
+  SvgBuffer &operator<<(const char *value) {
+    text += value;
+    return *this;
+  }
+  SvgBuffer &operator<<(const string &value) {
+    text += value;
+    return *this;
+  }
+  SvgBuffer &operator<<(char value) {
+    text.push_back(value);
+    return *this;
+  }
+  SvgBuffer &operator<<(int value) {
+    char buf[16];
+    text.append(buf, to_chars(buf, buf + sizeof(buf), value).ptr);
+    return *this;
+  }
+  SvgBuffer &operator<<(double value) {
+    char buf[400];
+    text.append(buf, to_chars(buf, buf + sizeof(buf), value,
+                              chars_format::fixed, 3)
+                         .ptr);
+    return *this;
+  }
+  SvgBuffer &operator<<(float value) { return *this << (double)value; }
+};
+
+string SvgColor(Color c) {
+  SvgBuffer out;
+  out << "rgb(" << (int)c.r << ',' << (int)c.g << ',' << (int)c.b << ')';
+  return out.text;
+}
+
+void WriteSvgUse(SvgBuffer &out, const vector<SymbolDef> *symbols,
+                 const Element &el, const Camera2D &camera) {
+  int index = symbols ? FindSymbol(*symbols, el.text) : -1;
+  if (index < 0)
+    return;
+  const SymbolDef &sym = (*symbols)[index];
+  Vector2 scale = SymbolScale(sym, el);
+  Vector2 center = GetWorldToScreen2D(ElementCenterLocal(el), camera);
+  Vector2 from = RectCenter(sym.frame);
+  float c = cosf(el.rotation) * camera.zoom;
+  float s = sinf(el.rotation) * camera.zoom;
+  float a = c * scale.x, b = s * scale.x;
+  float cc = -s * scale.y, d = c * scale.y;
+  out << "<use href=\"#symbol-" << index << "\" transform=\"matrix(" << a
+      << " " << b << " " << cc << " " << d << " "
+      << center.x - (a * from.x + cc * from.y) << " "
+      << center.y - (b * from.x + d * from.y) << ")\" />\n";
+}
+
+void WriteSvgElement(SvgBuffer &out, const Element &el, const string &fontFamily,
+                     float textSize, const Camera2D &camera,
+                     const vector<SymbolDef> *symbols = nullptr) {
+  string stroke = SvgColor(el.color);
+  Vector2 s = el.start;
+  Vector2 e = el.end;
+  if (el.rotation != 0.0f &&
+      (el.type == LINE_MODE || el.type == DOTTEDLINE_MODE ||
+       el.type == ARROWLINE_MODE)) {
+    Vector2 center = ElementCenterLocal(el);
+    s = RotatePoint(s, center, el.rotation);
+    e = RotatePoint(e, center, el.rotation);
+  }
+  s = GetWorldToScreen2D(s, camera);
+  e = GetWorldToScreen2D(e, camera);
+  float scaledStroke = max(0.5f, el.strokeWidth * camera.zoom);
+  float effectiveTextSize = (el.textSize > 0.0f) ? el.textSize : textSize;
+  float scaledTextSize = max(6.0f, effectiveTextSize * camera.zoom);
+  if (el.type == LINE_MODE || el.type == DOTTEDLINE_MODE || el.type == ARROWLINE_MODE) {
+    out << "<line x1=\"" << s.x << "\" y1=\"" << s.y << "\" x2=\""
+        << e.x << "\" y2=\"" << e.y << "\" stroke=\"" << stroke
+        << "\" stroke-width=\"" << scaledStroke << "\"";
+    if (el.type == DOTTEDLINE_MODE)
+      out << " stroke-dasharray=\"8,6\"";
+    out << " fill=\"none\" stroke-linecap=\"round\" />\n";
+    if (el.type == ARROWLINE_MODE) {
+      float angle = atan2f(e.y - s.y, e.x - s.x);
+      float lineLen = Vector2Distance(s, e);
+      float headSize = max(12.0f, scaledStroke * 3.0f);
+      if (headSize > lineLen * 0.7f)
+        headSize = lineLen * 0.7f;
+      Vector2 p1 = {e.x - headSize * cosf(angle - PI / 6),
+                    e.y - headSize * sinf(angle - PI / 6)};
+      Vector2 p2 = {e.x - headSize * cosf(angle + PI / 6),
+                    e.y - headSize * sinf(angle + PI / 6)};
+      out << "<line x1=\"" << e.x << "\" y1=\"" << e.y << "\" x2=\"" << p1.x
+          << "\" y2=\"" << p1.y << "\" stroke=\"" << stroke
+          << "\" stroke-width=\"" << scaledStroke
+          << "\" fill=\"none\" stroke-linecap=\"round\" />\n";
+      out << "<line x1=\"" << e.x << "\" y1=\"" << e.y << "\" x2=\"" << p2.x
+          << "\" y2=\"" << p2.y << "\" stroke=\"" << stroke
+          << "\" stroke-width=\"" << scaledStroke
+          << "\" fill=\"none\" stroke-linecap=\"round\" />\n";
+    }
+  } else if (el.type == RECTANGLE_MODE || el.type == DOTTEDRECT_MODE) {
+    float x = min(s.x, e.x);
+    float y = min(s.y, e.y);
+    float w = fabsf(e.x - s.x);
+    float h = fabsf(e.y - s.y);
+    out << "<rect x=\"" << x << "\" y=\"" << y << "\" width=\"" << w
+        << "\" height=\"" << h << "\" stroke=\"" << stroke
+        << "\" stroke-width=\"" << scaledStroke << "\" fill=\"none\"";
+    if (el.rotation != 0.0f) {
+      Vector2 center = ElementCenterLocal(el);
+      Vector2 cs = GetWorldToScreen2D(center, camera);
+      out << " transform=\"rotate(" << (el.rotation * RAD2DEG) << " " << cs.x
+          << " " << cs.y << ")\"";
+    }
+    if (el.type == DOTTEDRECT_MODE)
+      out << " stroke-dasharray=\"8,6\"";
+    out << " />\n";
+  } else if (el.type == CIRCLE_MODE || el.type == DOTTEDCIRCLE_MODE) {
+    float r = Vector2Distance(s, e);
+    out << "<circle cx=\"" << s.x << "\" cy=\"" << s.y
+        << "\" r=\"" << r << "\" stroke=\"" << stroke << "\" stroke-width=\""
+        << scaledStroke << "\" fill=\"none\"";
+    if (el.type == DOTTEDCIRCLE_MODE)
+      out << " stroke-dasharray=\"8,6\"";
+    out << " />\n";
+  } else if (el.type == TRIANGLE_MODE || el.type == DOTTEDTRIANGLE_MODE) {
+    Vector2 apex, left, right;
+    GetTriangleVerticesLocal(el, apex, left, right);
+    if (el.rotation != 0.0f) {
+      Vector2 center = ElementCenterLocal(el);
+      apex = RotatePoint(apex, center, el.rotation);
+      left = RotatePoint(left, center, el.rotation);
+      right = RotatePoint(right, center, el.rotation);
+    }
+    Vector2 a = GetWorldToScreen2D(apex, camera);
+    Vector2 b = GetWorldToScreen2D(left, camera);
+    Vector2 c = GetWorldToScreen2D(right, camera);
+    out << "<polygon points=\"" << a.x << "," << a.y << " " << b.x << ","
+        << b.y << " " << c.x << "," << c.y << "\" stroke=\"" << stroke
+        << "\" stroke-width=\"" << scaledStroke
+        << "\" fill=\"none\" stroke-linejoin=\"round\"";
+    if (el.type == DOTTEDTRIANGLE_MODE)
+      out << " stroke-dasharray=\"8,6\"";
+    out << " />\n";
+  } else if (el.type == PEN_MODE) {
+    if (el.path.size() >= 2) {
+      out << "<polyline points=\"";
+      Vector2 center = ElementCenterLocal(el);
+      for (const auto &p : el.path) {
+        Vector2 wp = p;
+        if (el.rotation != 0.0f)
+          wp = RotatePoint(wp, center, el.rotation);
+        Vector2 sp = GetWorldToScreen2D(wp, camera);
+        out << sp.x << "," << sp.y << " ";
+      }
+      out << "\" stroke=\"" << stroke << "\" stroke-width=\"" << scaledStroke
+          << "\" fill=\"none\" stroke-linecap=\"round\" stroke-linejoin=\"round\" />\n";
+    } else if (el.path.size() == 1) {
+      Vector2 wp = el.path[0];
+      if (el.rotation != 0.0f) {
+        Vector2 center = ElementCenterLocal(el);
+        wp = RotatePoint(wp, center, el.rotation);
+      }
+      Vector2 sp = GetWorldToScreen2D(wp, camera);
+      out << "<circle cx=\"" << sp.x << "\" cy=\"" << sp.y
+          << "\" r=\"" << max(0.5f, el.strokeWidth * 0.5f * camera.zoom)
+          << "\" fill=\""
+          << stroke << "\" />\n";
+    }
+  } else if (el.type == POINTS_MODE) {
+    Vector2 center = ElementCenterLocal(el);
+    out << "<path d=\"";
+    for (const auto &p : el.path) {
+      Vector2 wp = p;
+      if (el.rotation != 0.0f)
+        wp = RotatePoint(wp, center, el.rotation);
+      Vector2 sp = GetWorldToScreen2D(wp, camera);
+      out << "M" << sp.x << " " << sp.y << "h0";
+    }
+    out << "\" stroke=\"" << stroke << "\" stroke-width=\"" << scaledStroke
+        << "\" fill=\"none\" stroke-linecap=\"round\" />\n";
+  } else if (el.type == TEXT_MODE) {
+    out << "<text x=\"" << s.x << "\" y=\"" << (s.y + scaledTextSize)
+        << "\" fill=\"" << stroke << "\" font-family=\"" << SvgEscape(fontFamily)
+        << "\" font-size=\"" << scaledTextSize << "\"";
+    if (el.rotation != 0.0f) {
+      Vector2 center = ElementCenterLocal(el);
+      Vector2 cs = GetWorldToScreen2D(center, camera);
+      out << " transform=\"rotate(" << (el.rotation * RAD2DEG) << " " << cs.x
+          << " " << cs.y << ")\"";
+    }
+    out << ">" << SvgEscape(el.text) << "</text>\n";
+  } else if (el.type == INSTANCE_MODE) {
+    WriteSvgUse(out, symbols, el, camera);
+  } else if (el.type == GROUP_MODE) {
+    for (const auto &child : el.children)
+      WriteSvgElement(out, child, fontFamily, textSize, camera, symbols);
+  }
+}
+
+// Steps are taken between quantized positions, so rounding never drifts.
+struct SvgCompact {
+  int precision = 2;
+  long long scale = 100;
+  map<string, int> classes;
+};
+
+long long SvgQuantize(const SvgCompact &svg, double value) {
+  return llround(value * (double)svg.scale);
+}
+
+void AppendSvgFixed(SvgBuffer &out, const SvgCompact &svg, long long q) {
+  if (q < 0) {
+    out << '-';
+    q = -q;
+  }
+  long long whole = q / svg.scale;
+  long long frac = q % svg.scale;
+  char buf[32];
+  if (whole != 0 || frac == 0)
+    out.text.append(buf, to_chars(buf, buf + sizeof(buf), whole).ptr);
+  if (frac == 0)
+    return;
+  int digits = svg.precision;
+  while (frac % 10 == 0) {
+    frac /= 10;
+    digits--;
+  }
+  char *end = to_chars(buf, buf + sizeof(buf), frac).ptr;
+  out << '.';
+  out.text.append(digits - (int)(end - buf), '0');
+  out.text.append(buf, end);
+}
+
+void AppendSvgNumber(SvgBuffer &out, const SvgCompact &svg, double value) {
+  AppendSvgFixed(out, svg, SvgQuantize(svg, value));
+}
+
+string SvgHexColor(Color c) {
+  const char *hex = "0123456789abcdef";
+  string out = "#";
+  bool shortForm = c.r % 17 == 0 && c.g % 17 == 0 && c.b % 17 == 0;
+  for (unsigned char v : {c.r, c.g, c.b}) {
+    out.push_back(hex[v >> 4]);
+    if (!shortForm)
+      out.push_back(hex[v & 15]);
+  }
+  return out;
+}
+
+struct SvgPathData {
+  SvgBuffer &out;
+  const SvgCompact &svg;
+  long long x = 0;
+  long long y = 0;
+  bool started = false;
+  char command = 0;
+
+  SvgPathData(SvgBuffer &buffer, const SvgCompact &compact)
+      : out(buffer), svg(compact) {}
+
+  void Pair(char cmd, long long dx, long long dy) {
+    if (cmd != command)
+      out << cmd;
+    else if (dx >= 0)
+      out << ' ';
+    command = cmd;
+    AppendSvgFixed(out, svg, dx);
+    if (dy >= 0)
+      out << ' ';
+    AppendSvgFixed(out, svg, dy);
+  }
+  void MoveTo(Vector2 p) {
+    long long qx = SvgQuantize(svg, p.x);
+    long long qy = SvgQuantize(svg, p.y);
+    if (!started)
+      Pair('M', qx, qy);
+    else
+      Pair('m', qx - x, qy - y);
+    // Pairs after a moveto are implicit linetos; force an explicit 'l'.
+    command = 0;
+    started = true;
+    x = qx;
+    y = qy;
+  }
+  void LineTo(Vector2 p) {
+    long long qx = SvgQuantize(svg, p.x);
+    long long qy = SvgQuantize(svg, p.y);
+    Pair('l', qx - x, qy - y);
+    x = qx;
+    y = qy;
+  }
+  void HorizontalTo(float px) {
+    long long qx = SvgQuantize(svg, px);
+    out << 'h';
+    AppendSvgFixed(out, svg, qx - x);
+    command = 'h';
+    x = qx;
+  }
+  void VerticalTo(float py) {
+    long long qy = SvgQuantize(svg, py);
+    out << 'v';
+    AppendSvgFixed(out, svg, qy - y);
+    command = 'v';
+    y = qy;
+  }
+  void Close() {
+    out << 'z';
+    command = 'z';
+  }
+};
+
+string SvgCompactStyle(const SvgCompact &svg, const Element &el,
+                       const string &fontFamily, float textSize,
+                       const Camera2D &camera) {
+  SvgBuffer body;
+  string color = SvgHexColor(el.color);
+  bool dashed = el.type == DOTTEDLINE_MODE || el.type == DOTTEDRECT_MODE ||
+                el.type == DOTTEDCIRCLE_MODE || el.type == DOTTEDTRIANGLE_MODE;
+  if (el.type == TEXT_MODE) {
+    float size = (el.textSize > 0.0f) ? el.textSize : textSize;
+    body << "fill:" << color << ";font-family:\"" << SvgEscape(fontFamily)
+         << "\";font-size:";
+    AppendSvgNumber(body, svg, max(6.0f, size * camera.zoom));
+    body << "px";
+  } else if (el.type == PEN_MODE && el.path.size() == 1) {
+    body << "fill:" << color;
+  } else {
+    body << "fill:none;stroke:" << color << ";stroke-width:";
+    AppendSvgNumber(body, svg, max(0.5f, el.strokeWidth * camera.zoom));
+    bool roundCap = el.type == LINE_MODE || el.type == DOTTEDLINE_MODE ||
+                    el.type == ARROWLINE_MODE || el.type == PEN_MODE ||
+                    el.type == POINTS_MODE;
+    bool roundJoin = el.type == ARROWLINE_MODE || el.type == PEN_MODE ||
+                     el.type == TRIANGLE_MODE || el.type == DOTTEDTRIANGLE_MODE;
+    if (roundCap)
+      body << ";stroke-linecap:round";
+    if (roundJoin)
+      body << ";stroke-linejoin:round";
+    if (dashed)
+      body << ";stroke-dasharray:8,6";
+  }
+  return body.text;
+}
+
+void CollectSvgClasses(SvgCompact &svg, const Element &el,
+                       const string &fontFamily, float textSize,
+                       const Camera2D &camera) {
+  if (el.type == GROUP_MODE) {
+    for (const auto &child : el.children)
+      CollectSvgClasses(svg, child, fontFamily, textSize, camera);
+    return;
+  }
+  if (el.type == INSTANCE_MODE)
+    return;
+  string body = SvgCompactStyle(svg, el, fontFamily, textSize, camera);
+  svg.classes.emplace(body, (int)svg.classes.size());
+}
+
+string SvgClassName(int index) {
+  string name;
+  do {
+    name.insert(name.begin(), (char)('a' + index % 26));
+    index = index / 26 - 1;
+  } while (index >= 0);
+  return name;
+}
+
+void WriteSvgCompactElement(SvgBuffer &out, const SvgCompact &svg,
+                            const Element &el, const string &fontFamily,
+                            float textSize, const Camera2D &camera,
+                            const vector<SymbolDef> *symbols = nullptr) {
+  if (el.type == GROUP_MODE) {
+    out << "<g>\n";
+    for (const auto &child : el.children)
+      WriteSvgCompactElement(out, svg, child, fontFamily, textSize, camera,
+                             symbols);
+    out << "</g>\n";
+    return;
+  }
+  if (el.type == INSTANCE_MODE) {
+    WriteSvgUse(out, symbols, el, camera);
+    return;
+  }
+  auto found = svg.classes.find(
+      SvgCompactStyle(svg, el, fontFamily, textSize, camera));
+  string cls = found == svg.classes.end() ? "" : SvgClassName(found->second);
+  Vector2 s = el.start;
+  Vector2 e = el.end;
+  if (el.rotation != 0.0f &&
+      (el.type == LINE_MODE || el.type == DOTTEDLINE_MODE ||
+       el.type == ARROWLINE_MODE)) {
+    Vector2 center = ElementCenterLocal(el);
+    s = RotatePoint(s, center, el.rotation);
+    e = RotatePoint(e, center, el.rotation);
+  }
+  s = GetWorldToScreen2D(s, camera);
+  e = GetWorldToScreen2D(e, camera);
+  float scaledStroke = max(0.5f, el.strokeWidth * camera.zoom);
+
+  if (el.type == TEXT_MODE) {
+    float size = (el.textSize > 0.0f) ? el.textSize : textSize;
+    out << "<text class=\"" << cls << "\" x=\"";
+    AppendSvgNumber(out, svg, s.x);
+    out << "\" y=\"";
+    AppendSvgNumber(out, svg, s.y + max(6.0f, size * camera.zoom));
+    out << '"';
+    if (el.rotation != 0.0f) {
+      Vector2 cs = GetWorldToScreen2D(ElementCenterLocal(el), camera);
+      out << " transform=\"rotate(";
+      AppendSvgNumber(out, svg, el.rotation * RAD2DEG);
+      out << ' ';
+      AppendSvgNumber(out, svg, cs.x);
+      out << ' ';
+      AppendSvgNumber(out, svg, cs.y);
+      out << ")\"";
+    }
+    out << '>' << SvgEscape(el.text) << "</text>\n";
+    return;
+  }
+  if (el.type == CIRCLE_MODE || el.type == DOTTEDCIRCLE_MODE ||
+      (el.type == PEN_MODE && el.path.size() == 1)) {
+    Vector2 c = s;
+    float r = Vector2Distance(s, e);
+    if (el.type == PEN_MODE) {
+      Vector2 wp = el.path[0];
+      if (el.rotation != 0.0f)
+        wp = RotatePoint(wp, ElementCenterLocal(el), el.rotation);
+      c = GetWorldToScreen2D(wp, camera);
+      r = max(0.5f, el.strokeWidth * 0.5f * camera.zoom);
+    }
+    out << "<circle class=\"" << cls << "\" cx=\"";
+    AppendSvgNumber(out, svg, c.x);
+    out << "\" cy=\"";
+    AppendSvgNumber(out, svg, c.y);
+    out << "\" r=\"";
+    AppendSvgNumber(out, svg, r);
+    out << "\"/>\n";
+    return;
+  }
+
+  size_t mark = out.text.size();
+  out << "<path class=\"" << cls << "\" d=\"";
+  size_t dataStart = out.text.size();
+  SvgPathData d(out, svg);
+  if (el.type == LINE_MODE || el.type == DOTTEDLINE_MODE ||
+      el.type == ARROWLINE_MODE) {
+    d.MoveTo(s);
+    d.LineTo(e);
+    if (el.type == ARROWLINE_MODE) {
+      float angle = atan2f(e.y - s.y, e.x - s.x);
+      float headSize = min(max(12.0f, scaledStroke * 3.0f),
+                           Vector2Distance(s, e) * 0.7f);
+      d.LineTo({e.x - headSize * cosf(angle - PI / 6),
+                e.y - headSize * sinf(angle - PI / 6)});
+      d.MoveTo(e);
+      d.LineTo({e.x - headSize * cosf(angle + PI / 6),
+                e.y - headSize * sinf(angle + PI / 6)});
+    }
+  } else if (el.type == RECTANGLE_MODE || el.type == DOTTEDRECT_MODE) {
+    float x = min(s.x, e.x);
+    float y = min(s.y, e.y);
+    float w = fabsf(e.x - s.x);
+    float h = fabsf(e.y - s.y);
+    if (el.rotation == 0.0f) {
+      d.MoveTo({x, y});
+      d.HorizontalTo(x + w);
+      d.VerticalTo(y + h);
+      d.HorizontalTo(x);
+    } else {
+      Vector2 cs = GetWorldToScreen2D(ElementCenterLocal(el), camera);
+      Vector2 corners[4] = {{x, y}, {x + w, y}, {x + w, y + h}, {x, y + h}};
+      for (int i = 0; i < 4; i++) {
+        Vector2 p = RotatePoint(corners[i], cs, el.rotation);
+        if (i == 0)
+          d.MoveTo(p);
+        else
+          d.LineTo(p);
+      }
+    }
+    d.Close();
+  } else if (el.type == TRIANGLE_MODE || el.type == DOTTEDTRIANGLE_MODE) {
+    Vector2 v[3];
+    GetTriangleVerticesLocal(el, v[0], v[1], v[2]);
+    Vector2 center = ElementCenterLocal(el);
+    for (int i = 0; i < 3; i++) {
+      Vector2 p = el.rotation != 0.0f ? RotatePoint(v[i], center, el.rotation)
+                                      : v[i];
+      p = GetWorldToScreen2D(p, camera);
+      if (i == 0)
+        d.MoveTo(p);
+      else
+        d.LineTo(p);
+    }
+    d.Close();
+  } else if (el.type == POINTS_MODE) {
+    Vector2 center = ElementCenterLocal(el);
+    for (Vector2 wp : el.path) {
+      if (el.rotation != 0.0f)
+        wp = RotatePoint(wp, center, el.rotation);
+      Vector2 sp = GetWorldToScreen2D(wp, camera);
+      d.MoveTo(sp);
+      d.HorizontalTo(sp.x);
+    }
+  } else if (el.type == PEN_MODE && el.path.size() >= 2) {
+    Vector2 center = ElementCenterLocal(el);
+    for (size_t i = 0; i < el.path.size(); i++) {
+      Vector2 wp = el.path[i];
+      if (el.rotation != 0.0f)
+        wp = RotatePoint(wp, center, el.rotation);
+      Vector2 sp = GetWorldToScreen2D(wp, camera);
+      if (i == 0)
+        d.MoveTo(sp);
+      else
+        d.LineTo(sp);
+    }
+  }
+  if (out.text.size() == dataStart) {
+    out.text.resize(mark);
+    return;
+  }
+  out << "\"/>\n";
+}
+
+size_t SvgElementWeight(const Element &el) {
+  size_t weight = 1 + el.path.size();
+  for (const auto &child : el.children)
+    weight += SvgElementWeight(child);
+  return weight;
+}
+
+bool WriteSvgText(FILE *file, const string &text) {
+  return text.empty() || fwrite(text.data(), 1, text.size(), file) == text.size();
+}
+
+bool WriteSvgFile(const ExportJob &job) {
+  FILE *file = fopen(job.path.c_str(), "wb");
+  if (!file)
+    return false;
+  int w = job.width;
+  int h = job.height;
+  SvgBuffer head;
+  head << "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"" << w
+       << "\" height=\"" << h << "\" viewBox=\"0 0 " << w << " " << h << "\">\n";
+  Camera2D world = {};
+  world.zoom = 1.0f;
+  SvgCompact compact;
+  if (job.svgCompact) {
+    compact.precision = job.svgPrecision;
+    compact.scale = 1;
+    for (int i = 0; i < compact.precision; i++)
+      compact.scale *= 10;
+    for (const auto &sym : job.symbols)
+      for (const auto &el : sym.elements)
+        CollectSvgClasses(compact, el, job.fontFamily, job.textSize, world);
+    for (const auto &el : job.elements)
+      CollectSvgClasses(compact, el, job.fontFamily, job.textSize, job.camera);
+    vector<const string *> bodies(compact.classes.size());
+    for (const auto &entry : compact.classes)
+      bodies[entry.second] = &entry.first;
+    head << "<style>";
+    for (size_t i = 0; i < bodies.size(); i++)
+      head << '.' << SvgClassName((int)i) << '{' << *bodies[i] << '}';
+    head << "</style>\n<rect width=\"100%\" height=\"100%\" fill=\""
+         << SvgHexColor(job.background) << "\"/>\n";
+  } else {
+    head << "<rect width=\"100%\" height=\"100%\" fill=\"rgb("
+         << (int)job.background.r << "," << (int)job.background.g << ","
+         << (int)job.background.b << ")\" />\n";
+  }
+  if (!job.symbols.empty()) {
+    head << "<defs>\n";
+    for (size_t i = 0; i < job.symbols.size(); i++) {
+      head << "<symbol id=\"symbol-" << (int)i << "\" overflow=\"visible\">\n";
+      for (const auto &el : job.symbols[i].elements) {
+        if (job.svgCompact)
+          WriteSvgCompactElement(head, compact, el, job.fontFamily,
+                                 job.textSize, world, &job.symbols);
+        else
+          WriteSvgElement(head, el, job.fontFamily, job.textSize, world,
+                          &job.symbols);
+      }
+      head << "</symbol>\n";
+    }
+    head << "</defs>\n";
+  }
+  bool ok = WriteSvgText(file, head.text);
+
+  const size_t chunkWeight = 16384;
+  vector<pair<size_t, size_t>> chunks;
+  size_t weight = 0;
+  for (size_t i = 0; i < job.elements.size(); i++) {
+    if (chunks.empty() || weight >= chunkWeight) {
+      chunks.push_back({i, i});
+      weight = 0;
+    }
+    chunks.back().second = i + 1;
+    weight += SvgElementWeight(job.elements[i]);
+  }
+  size_t threads = max(1u, thread::hardware_concurrency());
+  size_t wave = threads * 4;
+  for (size_t first = 0; ok && first < chunks.size(); first += wave) {
+    size_t count = min(wave, chunks.size() - first);
+    vector<SvgBuffer> parts(count);
+    atomic<size_t> next{0};
+    auto work = [&] {
+      size_t i;
+      while ((i = next++) < count) {
+        for (size_t k = chunks[first + i].first; k < chunks[first + i].second; k++) {
+          if (job.svgCompact)
+            WriteSvgCompactElement(parts[i], compact, job.elements[k],
+                                   job.fontFamily, job.textSize, job.camera,
+                                   &job.symbols);
+          else
+            WriteSvgElement(parts[i], job.elements[k], job.fontFamily,
+                            job.textSize, job.camera, &job.symbols);
+        }
+      }
+    };
+    vector<thread> pool;
+    for (size_t t = 1; t < min(threads, count); t++)
+      pool.emplace_back(work);
+    work();
+    for (auto &t : pool)
+      t.join();
+    for (size_t i = 0; ok && i < count; i++)
+      ok = WriteSvgText(file, parts[i].text);
+  }
+  ok = WriteSvgText(file, "</svg>\n") && ok;
+  return fclose(file) == 0 && ok;
+}
+
+struct BitWriter {
+  vector<unsigned char> bytes;
+  unsigned long long bits = 0;
+  int count = 0;
+
+  void Put(unsigned int value, int n) {
+    bits |= (unsigned long long)value << count;
+    count += n;
+    while (count >= 8) {
+      bytes.push_back((unsigned char)(bits & 0xFF));
+      bits >>= 8;
+      count -= 8;
+    }
+  }
+  // Huffman codes are stored MSB-first, everything else LSB-first.
+  void PutCode(unsigned int code, int n) {
+    unsigned int rev = 0;
+    for (int i = 0; i < n; i++)
+      rev |= ((code >> i) & 1u) << (n - 1 - i);
+    Put(rev, n);
+  }
+  void Align() {
+    if (count > 0)
+      Put(0, 8 - count);
+  }
+};
+
+const unsigned short kDeflateLengthBase[29] = {
+    3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+    31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+const unsigned char kDeflateLengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                               1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                               4, 4, 4, 4, 5, 5, 5, 5, 0};
+const unsigned short kDeflateDistBase[30] = {
+    1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+    33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145,  8193,  12289, 16385, 24577};
+const unsigned char kDeflateDistExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3,
+                                             4, 4, 5, 5, 6, 6, 7, 7, 8, 8,
+                                             9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+const unsigned char kCodeLengthOrder[19] = {16, 17, 18, 0, 8,  7, 9,  6, 10, 5,
+                                            11, 4,  12, 3, 13, 2, 14, 1, 15};
+
+void BuildHuffmanCode(const vector<unsigned int> &freq, int maxBits,
+                      vector<unsigned char> &lengths,
+                      vector<unsigned short> &codes) {
+  size_t n = freq.size();
+  lengths.assign(n, 0);
+  codes.assign(n, 0);
+  vector<int> used;
+  for (size_t i = 0; i < n; i++) {
+    if (freq[i] > 0)
+      used.push_back((int)i);
+  }
+  if (used.empty())
+    return;
+  if (used.size() == 1) {
+    lengths[used[0]] = 1;
+  } else {
+    struct Node {
+      unsigned long long weight;
+      int left, right;
+    };
+    vector<Node> nodes;
+    nodes.reserve(used.size() * 2);
+    typedef pair<unsigned long long, int> Item;
+    priority_queue<Item, vector<Item>, greater<Item>> heap;
+    for (int sym : used) {
+      nodes.push_back({freq[sym], -1, sym});
+      heap.push({freq[sym], (int)nodes.size() - 1});
+    }
+    while (heap.size() > 1) {
+      Item a = heap.top();
+      heap.pop();
+      Item b = heap.top();
+      heap.pop();
+      nodes.push_back({a.first + b.first, a.second, b.second});
+      heap.push({a.first + b.first, (int)nodes.size() - 1});
+    }
+    vector<pair<int, int>> stack = {{heap.top().second, 0}};
+    vector<int> depthCount(64, 0);
+    while (!stack.empty()) {
+      pair<int, int> top = stack.back();
+      stack.pop_back();
+      const Node &node = nodes[top.first];
+      if (node.left < 0) {
+        lengths[node.right] = (unsigned char)min(top.second, 63);
+        continue;
+      }
+      stack.push_back({node.left, top.second + 1});
+      stack.push_back({node.right, top.second + 1});
+    }
+    sort(used.begin(), used.end(), [&](int a, int b) {
+      return freq[a] != freq[b] ? freq[a] > freq[b] : a < b;
+    });
+    long long kraft = 0;
+    for (int sym : used) {
+      if (lengths[sym] > maxBits)
+        lengths[sym] = (unsigned char)maxBits;
+      kraft += 1LL << (maxBits - lengths[sym]);
+    }
+    long long limit = 1LL << maxBits;
+    for (size_t i = used.size(); kraft > limit && i-- > 0;) {
+      while (lengths[used[i]] < maxBits && kraft > limit) {
+        kraft -= 1LL << (maxBits - lengths[used[i]] - 1);
+        lengths[used[i]]++;
+      }
+      if (i == 0 && kraft > limit)
+        i = used.size();
+    }
+    for (int sym : used) {
+      while (lengths[sym] > 1 &&
+             kraft + (1LL << (maxBits - lengths[sym])) <= limit) {
+        kraft += 1LL << (maxBits - lengths[sym]);
+        lengths[sym]--;
+      }
+    }
+  }
+  vector<int> blCount(maxBits + 1, 0);
+  for (size_t i = 0; i < n; i++) {
+    if (lengths[i])
+      blCount[lengths[i]]++;
+  }
+  vector<unsigned short> next(maxBits + 2, 0);
+  int code = 0;
+  for (int bits = 1; bits <= maxBits; bits++) {
+    code = (code + blCount[bits - 1]) << 1;
+    next[bits] = (unsigned short)code;
+  }
+  for (size_t i = 0; i < n; i++) {
+    if (lengths[i])
+      codes[i] = next[lengths[i]]++;
+  }
+}
+
+int DeflateLengthSymbol(int length) {
+  int i = 28;
+  while (kDeflateLengthBase[i] > length)
+    i--;
+  return i;
+}
+
+int DeflateDistSymbol(int dist) {
+  int i = 29;
+  while (kDeflateDistBase[i] > dist)
+    i--;
+  return i;
+}
+
+// Literals are stored as their byte, matches as length << 16 | distance.
+void WriteDeflateBlock(BitWriter &out, const vector<unsigned int> &syms,
+                       bool final) {
+  vector<unsigned int> litFreq(286, 0), distFreq(30, 0);
+  for (unsigned int s : syms) {
+    if (s < 256) {
+      litFreq[s]++;
+    } else {
+      litFreq[257 + DeflateLengthSymbol((int)(s >> 16))]++;
+      distFreq[DeflateDistSymbol((int)(s & 0xFFFF))]++;
+    }
+  }
+  litFreq[256] = 1;
+  bool anyDist = false;
+  for (unsigned int f : distFreq)
+    anyDist = anyDist || f > 0;
+  if (!anyDist)
+    distFreq[0] = 1;
+  vector<unsigned char> litLen, distLen;
+  vector<unsigned short> litCode, distCode;
+  BuildHuffmanCode(litFreq, 15, litLen, litCode);
+  BuildHuffmanCode(distFreq, 15, distLen, distCode);
+
+  int hlit = 286;
+  while (hlit > 257 && litLen[hlit - 1] == 0)
+    hlit--;
+  int hdist = 30;
+  while (hdist > 1 && distLen[hdist - 1] == 0)
+    hdist--;
+  vector<unsigned char> all(litLen.begin(), litLen.begin() + hlit);
+  all.insert(all.end(), distLen.begin(), distLen.begin() + hdist);
+
+  vector<pair<int, int>> rle;
+  for (size_t i = 0; i < all.size();) {
+    size_t run = 1;
+    while (i + run < all.size() && all[i + run] == all[i])
+      run++;
+    if (all[i] == 0 && run >= 3) {
+      size_t take = min<size_t>(run, 138);
+      rle.push_back(take >= 11 ? make_pair(18, (int)take - 11)
+                               : make_pair(17, (int)take - 3));
+      i += take;
+    } else if (all[i] != 0 && run >= 4) {
+      rle.push_back({all[i], 0});
+      size_t take = min<size_t>(run - 1, 6);
+      rle.push_back({16, (int)take - 3});
+      i += 1 + take;
+    } else {
+      rle.push_back({all[i], 0});
+      i++;
+    }
+  }
+  vector<unsigned int> clFreq(19, 0);
+  for (const auto &item : rle)
+    clFreq[item.first]++;
+  vector<unsigned char> clLen;
+  vector<unsigned short> clCode;
+  BuildHuffmanCode(clFreq, 7, clLen, clCode);
+  int hclen = 19;
+  while (hclen > 4 && clLen[kCodeLengthOrder[hclen - 1]] == 0)
+    hclen--;
+
+  out.Put(final ? 1 : 0, 1);
+  out.Put(2, 2);
+  out.Put(hlit - 257, 5);
+  out.Put(hdist - 1, 5);
+  out.Put(hclen - 4, 4);
+  for (int i = 0; i < hclen; i++)
+    out.Put(clLen[kCodeLengthOrder[i]], 3);
+  for (const auto &item : rle) {
+    out.PutCode(clCode[item.first], clLen[item.first]);
+    if (item.first == 16)
+      out.Put(item.second, 2);
+    else if (item.first == 17)
+      out.Put(item.second, 3);
+    else if (item.first == 18)
+      out.Put(item.second, 7);
+  }
+  for (unsigned int s : syms) {
+    if (s < 256) {
+      out.PutCode(litCode[s], litLen[s]);
+      continue;
+    }
+    int length = (int)(s >> 16);
+    int dist = (int)(s & 0xFFFF);
+    int ls = DeflateLengthSymbol(length);
+    out.PutCode(litCode[257 + ls], litLen[257 + ls]);
+    out.Put(length - kDeflateLengthBase[ls], kDeflateLengthExtra[ls]);
+    int ds = DeflateDistSymbol(dist);
+    out.PutCode(distCode[ds], distLen[ds]);
+    out.Put(dist - kDeflateDistBase[ds], kDeflateDistExtra[ds]);
+  }
+  out.PutCode(litCode[256], litLen[256]);
+}
+
+// Ends in a sync flush, so segments can be deflated apart and concatenated.
+void DeflateSegment(const unsigned char *data, size_t size, int level,
+                    vector<unsigned char> &out) {
+  BitWriter bw;
+  if (level <= 0) {
+    for (size_t pos = 0; pos < size;) {
+      size_t take = min<size_t>(size - pos, 65535);
+      bw.Put(0, 3);
+      bw.Align();
+      bw.Put((unsigned int)take, 16);
+      bw.Put((unsigned int)(~take & 0xFFFF), 16);
+      bw.bytes.insert(bw.bytes.end(), data + pos, data + pos + take);
+      pos += take;
+    }
+  } else {
+    const int kWindow = 32768;
+    const int kHashBits = 15;
+    int maxChain = level >= 9 ? 256 : level >= 6 ? 64 : level >= 3 ? 16 : 4;
+    int niceLength = level >= 9 ? 258 : level >= 6 ? 128 : 32;
+    vector<int> head(1 << kHashBits, -1);
+    vector<int> prev(kWindow, -1);
+    vector<unsigned int> syms;
+    syms.reserve(1 << 16);
+    auto hashAt = [&](size_t p) {
+      unsigned int v = (unsigned int)data[p] | ((unsigned int)data[p + 1] << 8) |
+                       ((unsigned int)data[p + 2] << 16);
+      return (v * 2654435761u) >> (32 - kHashBits);
+    };
+    auto insert = [&](size_t p) {
+      if (p + 2 >= size)
+        return;
+      unsigned int h = hashAt(p);
+      prev[p & (kWindow - 1)] = head[h];
+      head[h] = (int)p;
+    };
+    size_t pos = 0;
+    while (pos < size) {
+      int bestLen = 0;
+      int bestDist = 0;
+      if (pos + 2 < size) {
+        int cand = head[hashAt(pos)];
+        int chain = maxChain;
+        size_t maxLen = min<size_t>(258, size - pos);
+        while (cand >= 0 && chain-- > 0 && (size_t)bestLen < maxLen &&
+               pos - (size_t)cand <= (size_t)kWindow - 1) {
+          const unsigned char *a = data + cand;
+          const unsigned char *b = data + pos;
+          if (a[bestLen] == b[bestLen]) {
+            size_t len = 0;
+            while (len < maxLen && a[len] == b[len])
+              len++;
+            if ((int)len > bestLen) {
+              bestLen = (int)len;
+              bestDist = (int)(pos - cand);
+              if (bestLen >= niceLength)
+                break;
+            }
+          }
+          int next = prev[cand & (kWindow - 1)];
+          if (next >= cand)
+            break;
+          cand = next;
+        }
+      }
+      if (bestLen >= 3) {
+        syms.push_back(((unsigned int)bestLen << 16) | (unsigned int)bestDist);
+        for (int i = 0; i < bestLen; i++)
+          insert(pos + i);
+        pos += bestLen;
+      } else {
+        syms.push_back(data[pos]);
+        insert(pos);
+        pos++;
+      }
+      if (syms.size() >= (1 << 16) - 1) {
+        WriteDeflateBlock(bw, syms, false);
+        syms.clear();
+      }
+    }
+    if (!syms.empty())
+      WriteDeflateBlock(bw, syms, false);
+  }
+  // Sync flush: an empty stored block leaves the stream byte aligned.
+  bw.Put(0, 3);
+  bw.Align();
+  bw.Put(0x0000, 16);
+  bw.Put(0xFFFF, 16);
+  out.insert(out.end(), bw.bytes.begin(), bw.bytes.end());
+}
+
+unsigned int Crc32Update(unsigned int crc, const unsigned char *data, size_t size) {
+  static unsigned int table[256];
+  static once_flag tableOnce;
+  call_once(tableOnce, [] {
+    for (unsigned int i = 0; i < 256; i++) {
+      unsigned int c = i;
+      for (int k = 0; k < 8; k++)
+        c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      table[i] = c;
+    }
+  });
+  crc = ~crc;
+  for (size_t i = 0; i < size; i++)
+    crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
+
+unsigned int Adler32Update(unsigned int adler, const unsigned char *data,
+                           size_t size) {
+  unsigned int a = adler & 0xFFFF;
+  unsigned int b = adler >> 16;
+  while (size > 0) {
+    size_t take = min<size_t>(size, 5552);
+    size -= take;
+    while (take-- > 0) {
+      a += *data++;
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+  }
+  return (b << 16) | a;
+}
+
+struct PngStream {
+  FILE *file = nullptr;
+  int width = 0;
+  int height = 0;
+  int level = 6;
+  int rowsWritten = 0;
+  unsigned int adler = 1;
+  vector<unsigned char> prevRow;
+  bool animated = false;
+  int frame = 0;
+  unsigned int sequence = 0;
+};
+
+const unsigned char kZlibHeader[2] = {0x78, 0x9C};
+
+void PutBigEndian(vector<unsigned char> &out, unsigned int v) {
+  out.push_back((unsigned char)(v >> 24));
+  out.push_back((unsigned char)(v >> 16));
+  out.push_back((unsigned char)(v >> 8));
+  out.push_back((unsigned char)v);
+}
+
+bool WritePngChunk(FILE *file, const char *type, const unsigned char *data,
+                   size_t size) {
+  vector<unsigned char> head;
+  PutBigEndian(head, (unsigned int)size);
+  head.insert(head.end(), type, type + 4);
+  unsigned int crc = Crc32Update(0, head.data() + 4, 4);
+  crc = Crc32Update(crc, data, size);
+  vector<unsigned char> tail;
+  PutBigEndian(tail, crc);
+  return fwrite(head.data(), 1, head.size(), file) == head.size() &&
+         (size == 0 || fwrite(data, 1, size, file) == size) &&
+         fwrite(tail.data(), 1, tail.size(), file) == tail.size();
+}
+
+bool WritePngData(PngStream &png, const unsigned char *data, size_t size) {
+  if (!png.animated || png.frame == 0)
+    return WritePngChunk(png.file, "IDAT", data, size);
+  vector<unsigned char> chunk;
+  chunk.reserve(size + 4);
+  PutBigEndian(chunk, png.sequence++);
+  chunk.insert(chunk.end(), data, data + size);
+  return WritePngChunk(png.file, "fdAT", chunk.data(), chunk.size());
+}
+
+bool BeginPngFile(PngStream &png, const string &path, int width, int height,
+                  int level) {
+  png.file = fopen(path.c_str(), "wb");
+  if (!png.file)
+    return false;
+  png.width = width;
+  png.height = height;
+  png.level = level;
+  png.rowsWritten = 0;
+  png.adler = 1;
+  png.prevRow.assign((size_t)width * 4, 0);
+  static const unsigned char signature[8] = {0x89, 'P',  'N',  'G',
+                                             '\r', '\n', 0x1A, '\n'};
+  vector<unsigned char> ihdr;
+  PutBigEndian(ihdr, (unsigned int)width);
+  PutBigEndian(ihdr, (unsigned int)height);
+  ihdr.insert(ihdr.end(), {8, 6, 0, 0, 0});
+  return fwrite(signature, 1, 8, png.file) == 8 &&
+         WritePngChunk(png.file, "IHDR", ihdr.data(), ihdr.size());
+}
+
+bool BeginPngStream(PngStream &png, const string &path, int width, int height,
+                    int level) {
+  return BeginPngFile(png, path, width, height, level) &&
+         WritePngData(png, kZlibHeader, 2);
+}
+
+void FilterPngRows(const unsigned char *rgba, int rows, int width,
+                   const unsigned char *prevRow, vector<unsigned char> &out) {
+  size_t stride = (size_t)width * 4;
+  vector<unsigned char> candidate(stride);
+  vector<unsigned char> best(stride);
+  for (int y = 0; y < rows; y++) {
+    const unsigned char *row = rgba + (size_t)y * stride;
+    const unsigned char *up = y == 0 ? prevRow : row - stride;
+    unsigned long long bestCost = ~0ULL;
+    unsigned char bestType = 0;
+    for (unsigned char type = 0; type < 5; type++) {
+      unsigned long long cost = 0;
+      for (size_t i = 0; i < stride; i++) {
+        int a = i >= 4 ? row[i - 4] : 0;
+        int b = up[i];
+        int c = i >= 4 ? up[i - 4] : 0;
+        int predicted = 0;
+        if (type == 1)
+          predicted = a;
+        else if (type == 2)
+          predicted = b;
+        else if (type == 3)
+          predicted = (a + b) / 2;
+        else if (type == 4) {
+          int p = a + b - c;
+          int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+          predicted = (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+        }
+        unsigned char v = (unsigned char)(row[i] - predicted);
+        candidate[i] = v;
+        cost += v < 128 ? v : 256 - v;
+      }
+      if (cost < bestCost) {
+        bestCost = cost;
+        bestType = type;
+        best.swap(candidate);
+      }
+    }
+    out.push_back(bestType);
+    out.insert(out.end(), best.begin(), best.end());
+  }
+}
+
+// As zlib's adler32_combine.
+unsigned int Adler32Combine(unsigned int adlerA, unsigned int adlerB,
+                            size_t sizeB) {
+  const unsigned long long base = 65521;
+  unsigned long long rem = sizeB % base;
+  unsigned long long sum1 = adlerA & 0xFFFF;
+  unsigned long long sum2 = (rem * sum1) % base;
+  sum1 += (adlerB & 0xFFFF) + base - 1;
+  sum2 += ((adlerA >> 16) & 0xFFFF) + ((adlerB >> 16) & 0xFFFF) + base - rem;
+  if (sum1 >= base)
+    sum1 -= base;
+  if (sum1 >= base)
+    sum1 -= base;
+  if (sum2 >= base * 2)
+    sum2 -= base * 2;
+  if (sum2 >= base)
+    sum2 -= base;
+  return (unsigned int)(sum1 | (sum2 << 16));
+}
+
+bool WritePngRows(PngStream &png, const unsigned char *rgba, int rows) {
+  if (!png.file || rows <= 0)
+    return rows == 0;
+  size_t stride = (size_t)png.width * 4;
+  int segmentRows = (int)max<size_t>(1, ((size_t)1 << 18) / stride);
+  int segments = (rows + segmentRows - 1) / segmentRows;
+  vector<vector<unsigned char>> compressed(segments);
+  vector<unsigned int> adlers(segments, 1);
+  vector<size_t> sizes(segments, 0);
+  atomic<int> next{0};
+  auto work = [&] {
+    vector<unsigned char> filtered;
+    int i;
+    while ((i = next++) < segments) {
+      int first = i * segmentRows;
+      int count = min(segmentRows, rows - first);
+      const unsigned char *start = rgba + (size_t)first * stride;
+      const unsigned char *above =
+          first == 0 ? png.prevRow.data() : start - stride;
+      filtered.clear();
+      FilterPngRows(start, count, png.width, above, filtered);
+      adlers[i] = Adler32Update(1, filtered.data(), filtered.size());
+      sizes[i] = filtered.size();
+      DeflateSegment(filtered.data(), filtered.size(), png.level,
+                     compressed[i]);
+    }
+  };
+  int threads = (int)min<unsigned>(max(1u, thread::hardware_concurrency()),
+                                   (unsigned)segments);
+  vector<thread> pool;
+  for (int i = 1; i < threads; i++)
+    pool.emplace_back(work);
+  work();
+  for (auto &t : pool)
+    t.join();
+
+  memcpy(png.prevRow.data(), rgba + (size_t)(rows - 1) * stride, stride);
+  png.rowsWritten += rows;
+  bool ok = true;
+  for (int i = 0; i < segments && ok; i++) {
+    png.adler = Adler32Combine(png.adler, adlers[i], sizes[i]);
+    ok = WritePngData(png, compressed[i].data(), compressed[i].size());
+  }
+  return ok;
+}
+
+bool EndPngData(PngStream &png) {
+  vector<unsigned char> tail = {0x03, 0x00};
+  PutBigEndian(tail, png.adler);
+  bool ok = png.rowsWritten == png.height &&
+            WritePngData(png, tail.data(), tail.size());
+  png.frame++;
+  return ok;
+}
+
+bool EndPngStream(PngStream &png) {
+  if (!png.file)
+    return false;
+  bool ok = EndPngData(png) && WritePngChunk(png.file, "IEND", nullptr, 0);
+  ok = fclose(png.file) == 0 && ok;
+  png.file = nullptr;
+  return ok;
+}
+
+void PutAnimationControl(vector<unsigned char> &out, unsigned int frames) {
+  PutBigEndian(out, frames);
+  PutBigEndian(out, 0);
+}
+
+bool BeginAnimatedPng(PngStream &png, const string &path, int width,
+                      int height, int level, int frames) {
+  if (!BeginPngFile(png, path, width, height, level))
+    return false;
+  png.animated = true;
+  png.frame = 0;
+  png.sequence = 0;
+  vector<unsigned char> actl;
+  PutAnimationControl(actl, (unsigned int)max(1, frames));
+  return WritePngChunk(png.file, "acTL", actl.data(), actl.size());
+}
+
+bool BeginPngFrame(PngStream &png, int delayNum, int delayDen) {
+  png.rowsWritten = 0;
+  png.adler = 1;
+  fill(png.prevRow.begin(), png.prevRow.end(), 0);
+  vector<unsigned char> fctl;
+  PutBigEndian(fctl, png.sequence++);
+  PutBigEndian(fctl, (unsigned int)png.width);
+  PutBigEndian(fctl, (unsigned int)png.height);
+  PutBigEndian(fctl, 0);
+  PutBigEndian(fctl, 0);
+  fctl.insert(fctl.end(), {(unsigned char)(delayNum >> 8), (unsigned char)delayNum,
+                           (unsigned char)(delayDen >> 8), (unsigned char)delayDen,
+                           0, 0});
+  return WritePngChunk(png.file, "fcTL", fctl.data(), fctl.size()) &&
+         WritePngData(png, kZlibHeader, 2);
+}
+
+// acTL sits right after the signature and the 25-byte IHDR chunk.
+bool EndAnimatedPng(PngStream &png) {
+  if (!png.file)
+    return false;
+  bool ok = png.frame > 0 && WritePngChunk(png.file, "IEND", nullptr, 0);
+  vector<unsigned char> actl;
+  PutAnimationControl(actl, (unsigned int)png.frame);
+  ok = ok && fseek(png.file, 33, SEEK_SET) == 0 &&
+       WritePngChunk(png.file, "acTL", actl.data(), actl.size());
+  ok = fclose(png.file) == 0 && ok;
+  png.file = nullptr;
+  return ok;
+}
+
+bool WritePngImage(const Image &image, const string &path, int level) {
+  PngStream png;
+  bool ok = BeginPngStream(png, path, image.width, image.height, level) &&
+            WritePngRows(png, (const unsigned char *)image.data, image.height);
+  return EndPngStream(png) && ok;
+}
+
+bool SaveRasterImage(const Image &image, const string &path, int pngLevel) {
+  if (!image.data)
+    return false;
+  if (image.format == PIXELFORMAT_UNCOMPRESSED_R8G8B8A8 &&
+      ToLower(filesystem::path(path).extension().string()) == ".png")
+    return WritePngImage(image, path, pngLevel);
+  return ExportImage(image, path.c_str());
+}
+
+vector<Rectangle> ExportPixelBounds(const vector<Element> &elements,
+                                    const Camera2D &camera) {
+  vector<Rectangle> out;
+  out.reserve(elements.size());
+  for (const auto &el : elements) {
+    Rectangle b = el.GetBounds();
+    Vector2 a = GetWorldToScreen2D({b.x, b.y}, camera);
+    Vector2 c = GetWorldToScreen2D({b.x + b.width, b.y + b.height}, camera);
+    float pad = (el.strokeWidth * 2.0f + 8.0f) * camera.zoom + 2.0f;
+    out.push_back({min(a.x, c.x) - pad, min(a.y, c.y) - pad,
+                   fabsf(c.x - a.x) + pad * 2.0f, fabsf(c.y - a.y) + pad * 2.0f});
+  }
+  return out;
+}
+
+void RenderExportStrip(const Canvas &canvas, const vector<Element> &elements,
+                       const vector<Rectangle> &pixelBounds,
+                       const Camera2D &camera, int width, int y0, int rows,
+                       const RenderTexture2D &target, unsigned char *out) {
+  int tile = target.texture.width;
+  int tileRows = target.texture.height;
+  size_t stride = (size_t)width * 4;
+  for (int x0 = 0; x0 < width; x0 += tile) {
+    int cols = min(tile, width - x0);
+    Rectangle area = {(float)x0, (float)y0, (float)cols, (float)rows};
+    Camera2D tileCamera = camera;
+    tileCamera.offset = {camera.offset.x - (float)x0,
+                         camera.offset.y - (float)y0};
+    BeginTextureMode(target);
+    ClearBackground(canvas.backgroundColor);
+    BeginMode2D(tileCamera);
+    for (size_t i = 0; i < elements.size(); i++) {
+      if (CheckCollisionRecs(pixelBounds[i], area))
+        DrawSceneElement(canvas, elements[i]);
+    }
+    EndMode2D();
+    EndTextureMode();
+
+    // Render textures read back bottom-up.
+    Image img = LoadImageFromTexture(target.texture);
+    const unsigned char *pixels = (const unsigned char *)img.data;
+    for (int r = 0; pixels && r < rows; r++) {
+      const unsigned char *src =
+          pixels + (size_t)(tileRows - 1 - r) * tile * 4;
+      memcpy(out + r * stride + (size_t)x0 * 4, src, (size_t)cols * 4);
+    }
+    UnloadImage(img);
+  }
+}
+
+// Element hashes leave out IDs, so renumbering does not invalidate exports.
+const unsigned long long kFnvOffset = 1469598103934665603ull;
+
+unsigned long long HashBytes(unsigned long long h, const void *data,
+                             size_t size) {
+  const unsigned char *p = (const unsigned char *)data;
+  for (size_t i = 0; i < size; i++) {
+    h ^= p[i];
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+template <typename T> unsigned long long HashValue(unsigned long long h, T v) {
+  return HashBytes(h, &v, sizeof(v));
+}
+
+unsigned long long HashElement(const Element &el) {
+  unsigned long long h = kFnvOffset;
+  h = HashValue(h, (int)el.type);
+  h = HashValue(h, el.start.x);
+  h = HashValue(h, el.start.y);
+  h = HashValue(h, el.end.x);
+  h = HashValue(h, el.end.y);
+  h = HashValue(h, el.strokeWidth);
+  h = HashBytes(h, &el.color, sizeof(el.color));
+  h = HashValue(h, el.rotation);
+  h = HashValue(h, el.textSize);
+  h = HashValue(h, el.path.size());
+  if (!el.path.empty())
+    h = HashBytes(h, el.path.data(), el.path.size() * sizeof(Vector2));
+  h = HashValue(h, el.text.size());
+  h = HashBytes(h, el.text.data(), el.text.size());
+  h = HashValue(h, el.children.size());
+  for (const auto &child : el.children)
+    h = HashValue(h, HashElement(child));
+  return h;
+}
+
+string ExportStampPath(const string &path) { return path + ".meta"; }
+
+bool ExportIsCurrent(const string &path, const string &stamp) {
+  error_code ec;
+  if (!filesystem::exists(path, ec))
+    return false;
+  ifstream in(ExportStampPath(path), ios::binary);
+  if (!in.is_open())
+    return false;
+  stringstream previous;
+  previous << in.rdbuf();
+  return previous.str() == stamp;
+}
+
+void WriteExportStamp(const string &path, const string &stamp) {
+  ofstream out(ExportStampPath(path), ios::binary | ios::trunc);
+  if (out.is_open())
+    out << stamp;
+}
+
+ExportJob MakeExportJob(const Canvas &canvas, const string &filename,
+                        const Camera2D &camera, int outWidth, int outHeight) {
+  ExportJob job;
+  job.path = filename;
+  job.camera = camera;
+  job.width = outWidth;
+  job.height = outHeight;
+  job.background = canvas.backgroundColor;
+  job.fontFamily = canvas.fontFamilyPath;
+  job.textSize = canvas.textSize;
+  job.symbols = canvas.symbols;
+  return job;
+}
+
+Image RenderExportImage(const Canvas &canvas, const vector<Element> &elements,
+                        const Camera2D &camera, int outWidth, int outHeight,
+                        int tileSize) {
+  if (outWidth > tileSize || outHeight > tileSize) {
+    Image img = GenImageColor(outWidth, outHeight, canvas.backgroundColor);
+    RenderTexture2D target = LoadRenderTexture(tileSize, tileSize);
+    if (!img.data || target.id == 0) {
+      UnloadImage(img);
+      UnloadRenderTexture(target);
+      return {};
+    }
+    vector<Rectangle> pixelBounds = ExportPixelBounds(elements, camera);
+    size_t stride = (size_t)outWidth * 4;
+    for (int y0 = 0; y0 < outHeight; y0 += tileSize) {
+      RenderExportStrip(canvas, elements, pixelBounds, camera, outWidth, y0,
+                        min(tileSize, outHeight - y0), target,
+                        (unsigned char *)img.data + (size_t)y0 * stride);
+    }
+    UnloadRenderTexture(target);
+    return img;
+  }
+
+  RenderTexture2D target = LoadRenderTexture(outWidth, outHeight);
+  BeginTextureMode(target);
+  ClearBackground(canvas.backgroundColor);
+  BeginMode2D(camera);
+  for (const auto &el : elements)
+    DrawSceneElement(canvas, el);
+  EndMode2D();
+  EndTextureMode();
+
+  Image img = LoadImageFromTexture(target.texture);
+  ImageFlipVertical(&img);
+  UnloadRenderTexture(target);
+  return img;
+}
+
+bool WriteStreamedPng(ExportJob &job) {
+  ExportBands &bands = *job.bands;
+  PngStream png;
+  bool ok = BeginPngStream(png, job.path, job.width, job.height, job.pngLevel);
+  size_t stride = (size_t)job.width * 4;
+  while (ok) {
+    vector<unsigned char> strip;
+    {
+      unique_lock<mutex> guard(bands.lock);
+      bands.ready.wait(guard,
+                       [&] { return !bands.strips.empty() || bands.finished; });
+      if (bands.strips.empty())
+        break;
+      strip = std::move(bands.strips.front());
+      bands.strips.pop_front();
+    }
+    bands.ready.notify_all();
+    ok = WritePngRows(png, strip.data(), (int)(strip.size() / stride));
+  }
+  if (!ok) {
+    lock_guard<mutex> guard(bands.lock);
+    bands.failed = true;
+    bands.strips.clear();
+  }
+  bands.ready.notify_all();
+  ok = EndPngStream(png) && ok;
+  if (!ok) {
+    error_code ec;
+    filesystem::remove(job.path, ec);
+  }
+  return ok;
+}
+
+bool WriteFrameStream(ExportJob &job) {
+  ExportBands &bands = *job.bands;
+  PngStream png;
+  bool ok = job.sequence ? EnsureDirectory(job.path)
+                         : BeginAnimatedPng(png, job.path, job.width,
+                                            job.height, job.pngLevel,
+                                            job.frameCount);
+  int frame = 0;
+  while (ok) {
+    vector<unsigned char> pixels;
+    {
+      unique_lock<mutex> guard(bands.lock);
+      bands.ready.wait(guard,
+                       [&] { return !bands.strips.empty() || bands.finished; });
+      if (bands.strips.empty())
+        break;
+      pixels = std::move(bands.strips.front());
+      bands.strips.pop_front();
+    }
+    bands.ready.notify_all();
+    frame++;
+    if (job.sequence) {
+      char name[32];
+      snprintf(name, sizeof(name), "frame_%05d.png", frame);
+      Image image = {pixels.data(), job.width, job.height, 1,
+                     PIXELFORMAT_UNCOMPRESSED_R8G8B8A8};
+      ok = WritePngImage(image, JoinPath(job.path, name), job.pngLevel);
+    } else {
+      int delay = frame == job.frameCount ? job.fps * 2 : 1;
+      ok = BeginPngFrame(png, delay, job.fps) &&
+           WritePngRows(png, pixels.data(), job.height) && EndPngData(png);
+    }
+  }
+  if (!ok) {
+    lock_guard<mutex> guard(bands.lock);
+    bands.failed = true;
+    bands.strips.clear();
+  }
+  bands.ready.notify_all();
+  if (!job.sequence) {
+    ok = EndAnimatedPng(png) && ok;
+    if (!ok) {
+      error_code ec;
+      filesystem::remove(job.path, ec);
+    }
+  }
+  return ok && frame > 0;
+}
+
+bool WriteExportJob(ExportJob &job) {
+  bool ok = false;
+  if (job.svg) {
+    ok = WriteSvgFile(job);
+  } else if (job.frames) {
+    ok = WriteFrameStream(job);
+  } else if (job.bands) {
+    ok = WriteStreamedPng(job);
+  } else {
+    ok = SaveRasterImage(job.image, job.path, job.pngLevel);
+    UnloadImage(job.image);
+    job.image = {};
+  }
+  if (ok && !job.stamp.empty())
+    WriteExportStamp(job.path, job.stamp);
+  return ok;
+}
+
+bool ExportCanvasSvg(const Canvas &canvas, const string &filename,
+                     const vector<Element> &elements, const Camera2D &camera,
+                     int outWidth, int outHeight, bool compact,
+                     int precision) {
+  ExportJob job = MakeExportJob(canvas, filename, camera, outWidth, outHeight);
+  job.svg = true;
+  job.svgCompact = compact;
+  job.svgPrecision = precision;
+  job.elements = elements;
+  return WriteExportJob(job);
+}
+
+struct SvgTag {
+  string name;
+  vector<pair<string, string>> attrs;
+  bool closing = false;
+  bool selfClosing = false;
+
+  const string *Get(const char *key) const {
+    for (const auto &a : attrs) {
+      if (a.first == key)
+        return &a.second;
+    }
+    return nullptr;
+  }
+};
+
+enum SvgEvent { SVG_END, SVG_TAG, SVG_TEXT };
+
+struct SvgReader {
+  FILE *file = nullptr;
+  vector<char> block = vector<char>(65536);
+  size_t pos = 0;
+  size_t len = 0;
+  bool keepText = false;
+
+  int Next() {
+    if (pos == len) {
+      pos = 0;
+      len = fread(block.data(), 1, block.size(), file);
+      if (len == 0)
+        return EOF;
+    }
+    return (unsigned char)block[pos++];
+  }
+  int Peek() {
+    int c = Next();
+    if (c != EOF)
+      pos--;
+    return c;
+  }
+  bool SkipPast(const char *delim, string *out = nullptr) {
+    size_t n = strlen(delim);
+    string tail;
+    string &text = out ? *out : tail;
+    size_t base = text.size();
+    int c;
+    while ((c = Next()) != EOF) {
+      text.push_back((char)c);
+      if (text.size() - base >= n &&
+          memcmp(text.data() + text.size() - n, delim, n) == 0) {
+        text.resize(text.size() - n);
+        return true;
+      }
+      if (!out && tail.size() > 256)
+        tail.erase(0, tail.size() - n);
+    }
+    return false;
+  }
+};
+
+void AppendUtf8(string &out, unsigned int cp) {
+  if (cp < 0x80) {
+    out.push_back((char)cp);
+  } else if (cp < 0x800) {
+    out.push_back((char)(0xC0 | (cp >> 6)));
+    out.push_back((char)(0x80 | (cp & 0x3F)));
+  } else if (cp < 0x10000) {
+    out.push_back((char)(0xE0 | (cp >> 12)));
+    out.push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+    out.push_back((char)(0x80 | (cp & 0x3F)));
+  } else {
+    out.push_back((char)(0xF0 | (cp >> 18)));
+    out.push_back((char)(0x80 | ((cp >> 12) & 0x3F)));
+    out.push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+    out.push_back((char)(0x80 | (cp & 0x3F)));
+  }
+}
+
+string DecodeSvgEntities(const string &text) {
+  if (text.find('&') == string::npos)
+    return text;
+  string out;
+  out.reserve(text.size());
+  for (size_t i = 0; i < text.size(); i++) {
+    size_t semi = text[i] == '&' ? text.find(';', i) : string::npos;
+    if (semi == string::npos || semi - i > 10) {
+      out.push_back(text[i]);
+      continue;
+    }
+    string name = text.substr(i + 1, semi - i - 1);
+    if (name == "amp")
+      out.push_back('&');
+    else if (name == "lt")
+      out.push_back('<');
+    else if (name == "gt")
+      out.push_back('>');
+    else if (name == "quot")
+      out.push_back('"');
+    else if (name == "apos")
+      out.push_back('\'');
+    else if (name.size() > 1 && name[0] == '#')
+      AppendUtf8(out, (unsigned int)strtoul(name.c_str() + (name[1] == 'x' ? 2 : 1),
+                                            nullptr, name[1] == 'x' ? 16 : 10));
+    else
+      out.append(text, i, semi - i + 1);
+    i = semi;
+  }
+  return out;
+}
+
+SvgEvent ReadSvgEvent(SvgReader &in, SvgTag &tag, string &text) {
+  text.clear();
+  int c;
+  while ((c = in.Next()) != EOF) {
+    if (c != '<') {
+      if (in.keepText)
+        text.push_back((char)c);
+      continue;
+    }
+    if (!text.empty()) {
+      in.pos--;
+      return SVG_TEXT;
+    }
+    int k = in.Peek();
+    if (k == '?') {
+      in.SkipPast("?>");
+      continue;
+    }
+    if (k == '!') {
+      in.Next();
+      if (in.Peek() == '-') {
+        in.SkipPast("-->");
+      } else if (in.Peek() == '[') {
+        in.SkipPast("CDATA[");
+        in.SkipPast("]]>", in.keepText ? &text : nullptr);
+        if (!text.empty())
+          return SVG_TEXT;
+      } else {
+        int depth = 0;
+        while ((c = in.Next()) != EOF && (c != '>' || depth > 0)) {
+          if (c == '[')
+            depth++;
+          else if (c == ']')
+            depth--;
+        }
+      }
+      continue;
+    }
+
+    tag.name.clear();
+    tag.attrs.clear();
+    tag.closing = k == '/';
+    tag.selfClosing = false;
+    if (tag.closing)
+      in.Next();
+    c = in.Next();
+    while (c != EOF && !isspace(c) && c != '>' && c != '/') {
+      tag.name.push_back((char)c);
+      c = in.Next();
+    }
+    size_t colon = tag.name.find(':');
+    if (colon != string::npos)
+      tag.name.erase(0, colon + 1);
+    while (c != EOF && c != '>') {
+      if (c == '/' || isspace(c)) {
+        tag.selfClosing = c == '/';
+        c = in.Next();
+        continue;
+      }
+      string key;
+      string value;
+      while (c != EOF && !isspace(c) && c != '=' && c != '>' && c != '/') {
+        key.push_back((char)c);
+        c = in.Next();
+      }
+      while (c != EOF && isspace(c))
+        c = in.Next();
+      if (c == '=') {
+        c = in.Next();
+        while (c != EOF && isspace(c))
+          c = in.Next();
+        if (c == '"' || c == '\'') {
+          int quote = c;
+          while ((c = in.Next()) != EOF && c != quote)
+            value.push_back((char)c);
+          c = in.Next();
+        } else {
+          while (c != EOF && !isspace(c) && c != '>') {
+            value.push_back((char)c);
+            c = in.Next();
+          }
+        }
+      }
+      if (!key.empty())
+        tag.attrs.push_back({key, DecodeSvgEntities(value)});
+    }
+    return SVG_TAG;
+  }
+  return text.empty() ? SVG_END : SVG_TEXT;
+}
+
+// 2D affine transform; points map to (a*x + c*y + e, b*x + d*y + f).
+struct SvgMatrix {
+  double a = 1.0, b = 0.0, c = 0.0, d = 1.0, e = 0.0, f = 0.0;
+
+  // Applies `m` first, then this transform.
+  SvgMatrix operator*(const SvgMatrix &m) const {
+    SvgMatrix r;
+    r.a = a * m.a + c * m.b;
+    r.b = b * m.a + d * m.b;
+    r.c = a * m.c + c * m.d;
+    r.d = b * m.c + d * m.d;
+    r.e = a * m.e + c * m.f + e;
+    r.f = b * m.e + d * m.f + f;
+    return r;
+  }
+  Vector2 Apply(Vector2 p) const {
+    return {(float)(a * p.x + c * p.y + e), (float)(b * p.x + d * p.y + f)};
+  }
+  double Scale() const { return sqrt(fabs(a * d - b * c)); }
+  bool IsSimilarity() const {
+    double eps = 1e-6 * max(1.0, Scale());
+    return a * d - b * c > 0.0 && fabs(a - d) < eps && fabs(b + c) < eps;
+  }
+};
+
+void SkipSvgSeparators(const char *&p) {
+  while (*p && (isspace((unsigned char)*p) || *p == ','))
+    p++;
+}
+
+bool ReadSvgNumber(const char *&p, float &value) {
+  SkipSvgSeparators(p);
+  if (!*p || isalpha((unsigned char)*p))
+    return false;
+  char *end = nullptr;
+  value = strtof(p, &end);
+  if (end == p)
+    return false;
+  p = end;
+  return true;
+}
+
+// Arc flags may be written without separators ("a5 5 0 015 5").
+bool ReadSvgFlag(const char *&p, bool &flag) {
+  SkipSvgSeparators(p);
+  if (*p != '0' && *p != '1')
+    return false;
+  flag = *p++ == '1';
+  return true;
+}
+
+SvgMatrix ParseSvgTransform(const string &text) {
+  SvgMatrix result;
+  const char *p = text.c_str();
+  while (true) {
+    SkipSvgSeparators(p);
+    string name;
+    while (isalpha((unsigned char)*p))
+      name.push_back(*p++);
+    while (isspace((unsigned char)*p))
+      p++;
+    if (name.empty() || *p != '(')
+      break;
+    p++;
+    vector<float> v;
+    float value;
+    while (v.size() < 6 && ReadSvgNumber(p, value))
+      v.push_back(value);
+    SkipSvgSeparators(p);
+    if (*p != ')')
+      break;
+    p++;
+    SvgMatrix m;
+    if (name == "matrix" && v.size() == 6) {
+      m.a = v[0];
+      m.b = v[1];
+      m.c = v[2];
+      m.d = v[3];
+      m.e = v[4];
+      m.f = v[5];
+    } else if (name == "translate" && !v.empty()) {
+      m.e = v[0];
+      m.f = v.size() > 1 ? v[1] : 0.0f;
+    } else if (name == "scale" && !v.empty()) {
+      m.a = v[0];
+      m.d = v.size() > 1 ? v[1] : v[0];
+    } else if (name == "rotate" && !v.empty()) {
+      double r = v[0] * DEG2RAD;
+      double cx = v.size() > 2 ? v[1] : 0.0;
+      double cy = v.size() > 2 ? v[2] : 0.0;
+      m.a = cos(r);
+      m.b = sin(r);
+      m.c = -m.b;
+      m.d = m.a;
+      m.e = cx - m.a * cx - m.c * cy;
+      m.f = cy - m.b * cx - m.d * cy;
+    } else if (name == "skewX" && !v.empty()) {
+      m.c = tan(v[0] * DEG2RAD);
+    } else if (name == "skewY" && !v.empty()) {
+      m.b = tan(v[0] * DEG2RAD);
+    }
+    result = result * m;
+  }
+  return result;
+}
+
+bool ParseSvgColor(string text, Color &out) {
+  text = ToLower(Trim(text));
+  if (text.empty())
+    return false;
+  if (text[0] == '#' && text.size() == 4) {
+    text = string("#") + text[1] + text[1] + text[2] + text[2] + text[3] +
+           text[3];
+  }
+  if (text[0] == '#')
+    return ParseHexColor(text, out);
+  if (text.rfind("rgb", 0) == 0) {
+    size_t open = text.find('(');
+    if (open == string::npos)
+      return false;
+    const char *p = text.c_str() + open + 1;
+    float v[4] = {0.0f, 0.0f, 0.0f, 1.0f};
+    float value;
+    for (int i = 0; i < 4 && ReadSvgNumber(p, value); i++) {
+      v[i] = value;
+      if (*p == '%') {
+        v[i] *= i < 3 ? 2.55f : 0.01f;
+        p++;
+      }
+    }
+    out = {(unsigned char)Clamp(v[0], 0.0f, 255.0f),
+           (unsigned char)Clamp(v[1], 0.0f, 255.0f),
+           (unsigned char)Clamp(v[2], 0.0f, 255.0f),
+           (unsigned char)(Clamp(v[3], 0.0f, 1.0f) * 255.0f)};
+    return true;
+  }
+  // CSS keywords first: they differ from raylib's palette of the same names.
+  static const unordered_map<string, Color> css = {
+      {"black", {0, 0, 0, 255}},       {"white", {255, 255, 255, 255}},
+      {"red", {255, 0, 0, 255}},       {"green", {0, 128, 0, 255}},
+      {"lime", {0, 255, 0, 255}},      {"blue", {0, 0, 255, 255}},
+      {"yellow", {255, 255, 0, 255}},  {"orange", {255, 165, 0, 255}},
+      {"purple", {128, 0, 128, 255}},  {"gray", {128, 128, 128, 255}},
+      {"grey", {128, 128, 128, 255}},  {"currentcolor", {0, 0, 0, 255}},
+  };
+  auto it = css.find(text);
+  if (it != css.end()) {
+    out = it->second;
+    return true;
+  }
+  return ParseNamedColor(text, out);
+}
+
+struct SvgStyle {
+  bool stroke = false;
+  Color strokeColor = {0, 0, 0, 255};
+  bool fill = true;
+  Color fillColor = {0, 0, 0, 255};
+  float strokeWidth = 1.0f;
+  float strokeOpacity = 1.0f;
+  float fillOpacity = 1.0f;
+  bool dashed = false;
+  float fontSize = 16.0f;
+  float alpha = 1.0f;
+  float opacity = 1.0f;
+  bool hidden = false;
+};
+
+bool ApplySvgProperty(SvgStyle &style, const string &key, const string &value) {
+  Color c;
+  if (key == "stroke" || key == "fill") {
+    bool none = ToLower(Trim(value)) == "none";
+    if (!none && !ParseSvgColor(value, c))
+      return true;
+    if (key == "stroke") {
+      style.stroke = !none;
+      style.strokeColor = none ? style.strokeColor : c;
+    } else {
+      style.fill = !none;
+      style.fillColor = none ? style.fillColor : c;
+    }
+  } else if (key == "stroke-width") {
+    style.strokeWidth = max(0.0f, strtof(value.c_str(), nullptr));
+  } else if (key == "stroke-dasharray") {
+    string v = ToLower(Trim(value));
+    style.dashed = !v.empty() && v != "none";
+  } else if (key == "font-size") {
+    float size = strtof(value.c_str(), nullptr);
+    if (size > 0.0f)
+      style.fontSize = size;
+  } else if (key == "opacity") {
+    style.opacity = Clamp(strtof(value.c_str(), nullptr), 0.0f, 1.0f);
+  } else if (key == "stroke-opacity") {
+    style.strokeOpacity = Clamp(strtof(value.c_str(), nullptr), 0.0f, 1.0f);
+  } else if (key == "fill-opacity") {
+    style.fillOpacity = Clamp(strtof(value.c_str(), nullptr), 0.0f, 1.0f);
+  } else if (key == "display" || key == "visibility") {
+    string v = ToLower(Trim(value));
+    style.hidden = v == "none" || v == "hidden";
+  } else {
+    return false;
+  }
+  return true;
+}
+
+void ApplySvgDeclarations(SvgStyle &style, const string &body) {
+  size_t pos = 0;
+  while (pos < body.size()) {
+    size_t semi = body.find(';', pos);
+    if (semi == string::npos)
+      semi = body.size();
+    string decl = body.substr(pos, semi - pos);
+    size_t colon = decl.find(':');
+    if (colon != string::npos)
+      ApplySvgProperty(style, Trim(decl.substr(0, colon)),
+                       Trim(decl.substr(colon + 1)));
+    pos = semi + 1;
+  }
+}
+
+void ParseSvgStyleSheet(const string &css, map<string, string> &classes) {
+  size_t pos = 0;
+  while (true) {
+    size_t open = css.find('{', pos);
+    size_t close = open == string::npos ? open : css.find('}', open);
+    if (close == string::npos)
+      return;
+    string body = css.substr(open + 1, close - open - 1);
+    stringstream selectors(css.substr(pos, open - pos));
+    string selector;
+    while (getline(selectors, selector, ',')) {
+      selector = Trim(selector);
+      if (selector.size() > 1 && selector[0] == '.' &&
+          selector.find_first_of(" .:>[#", 1) == string::npos)
+        classes[selector.substr(1)] += body + ";";
+    }
+    pos = close + 1;
+  }
+}
+
+SvgStyle ResolveSvgStyle(const SvgStyle &parent, const SvgTag &tag,
+                         const map<string, string> &classes) {
+  SvgStyle style = parent;
+  style.opacity = 1.0f;
+  for (const auto &a : tag.attrs)
+    ApplySvgProperty(style, a.first, a.second);
+  if (const string *cls = tag.Get("class")) {
+    stringstream names(*cls);
+    string name;
+    while (names >> name) {
+      auto it = classes.find(name);
+      if (it != classes.end())
+        ApplySvgDeclarations(style, it->second);
+    }
+  }
+  if (const string *inlineStyle = tag.Get("style"))
+    ApplySvgDeclarations(style, *inlineStyle);
+  style.alpha *= style.opacity;
+  return style;
+}
+
+float SvgAttr(const SvgTag &tag, const char *key, float fallback = 0.0f) {
+  const string *value = tag.Get(key);
+  if (!value)
+    return fallback;
+  char *end = nullptr;
+  float v = strtof(value->c_str(), &end);
+  return end == value->c_str() ? fallback : v;
+}
+
+void FlattenSvgCubic(vector<Vector2> &out, Vector2 p0, Vector2 p1, Vector2 p2,
+                     Vector2 p3, float tolerance) {
+  Vector2 d1 = {p0.x - 2.0f * p1.x + p2.x, p0.y - 2.0f * p1.y + p2.y};
+  Vector2 d2 = {p1.x - 2.0f * p2.x + p3.x, p1.y - 2.0f * p2.y + p3.y};
+  float dd = max(Vector2Length(d1), Vector2Length(d2));
+  int n = (int)Clamp(ceilf(sqrtf(0.75f * dd / tolerance)), 1.0f, 1000.0f);
+  for (int i = 1; i <= n; i++) {
+    float t = (float)i / n;
+    float mt = 1.0f - t;
+    float a = mt * mt * mt, b = 3.0f * mt * mt * t, c = 3.0f * mt * t * t,
+          d = t * t * t;
+    out.push_back({a * p0.x + b * p1.x + c * p2.x + d * p3.x,
+                   a * p0.y + b * p1.y + c * p2.y + d * p3.y});
+  }
+}
+
+void FlattenSvgQuad(vector<Vector2> &out, Vector2 p0, Vector2 p1, Vector2 p2,
+                    float tolerance) {
+  Vector2 dd = {p0.x - 2.0f * p1.x + p2.x, p0.y - 2.0f * p1.y + p2.y};
+  int n = (int)Clamp(ceilf(sqrtf(Vector2Length(dd) / (4.0f * tolerance))),
+                     1.0f, 1000.0f);
+  for (int i = 1; i <= n; i++) {
+    float t = (float)i / n;
+    float mt = 1.0f - t;
+    out.push_back({mt * mt * p0.x + 2.0f * mt * t * p1.x + t * t * p2.x,
+                   mt * mt * p0.y + 2.0f * mt * t * p1.y + t * t * p2.y});
+  }
+}
+
+int SvgArcSegments(double r, double sweep, float tolerance) {
+  double step = tolerance >= r ? PI / 2.0 : 2.0 * acos(1.0 - tolerance / r);
+  return (int)Clamp((float)ceil(fabs(sweep) / max(step, 1e-4)), 1.0f, 1000.0f);
+}
+
+void FlattenSvgArc(vector<Vector2> &out, Vector2 p0, double rx, double ry,
+                   double angle, bool large, bool sweep, Vector2 p1,
+                   float tolerance) {
+  rx = fabs(rx);
+  ry = fabs(ry);
+  if (rx < 1e-9 || ry < 1e-9 || (p0.x == p1.x && p0.y == p1.y)) {
+    out.push_back(p1);
+    return;
+  }
+  double phi = angle * DEG2RAD;
+  double cp = cos(phi), sp = sin(phi);
+  double dx = (p0.x - p1.x) * 0.5, dy = (p0.y - p1.y) * 0.5;
+  double x1 = cp * dx + sp * dy, y1 = -sp * dx + cp * dy;
+  double lambda = (x1 * x1) / (rx * rx) + (y1 * y1) / (ry * ry);
+  if (lambda > 1.0) {
+    rx *= sqrt(lambda);
+    ry *= sqrt(lambda);
+  }
+  double num = rx * rx * ry * ry - rx * rx * y1 * y1 - ry * ry * x1 * x1;
+  double den = rx * rx * y1 * y1 + ry * ry * x1 * x1;
+  double coef = sqrt(max(0.0, num / den)) * (large == sweep ? -1.0 : 1.0);
+  double cx1 = coef * rx * y1 / ry, cy1 = -coef * ry * x1 / rx;
+  double cx = cp * cx1 - sp * cy1 + (p0.x + p1.x) * 0.5;
+  double cy = sp * cx1 + cp * cy1 + (p0.y + p1.y) * 0.5;
+  double theta = atan2((y1 - cy1) / ry, (x1 - cx1) / rx);
+  double delta = atan2((-y1 - cy1) / ry, (-x1 - cx1) / rx) - theta;
+  if (!sweep && delta > 0.0)
+    delta -= 2.0 * PI;
+  else if (sweep && delta < 0.0)
+    delta += 2.0 * PI;
+  int n = SvgArcSegments(max(rx, ry), delta, tolerance);
+  for (int i = 1; i < n; i++) {
+    double t = theta + delta * i / n;
+    out.push_back({(float)(cx + rx * cos(t) * cp - ry * sin(t) * sp),
+                   (float)(cy + rx * cos(t) * sp + ry * sin(t) * cp)});
+  }
+  out.push_back(p1);
+}
+
+struct SvgSubpath {
+  vector<Vector2> points;
+  bool closed = false;
+};
+
+void ParseSvgPath(const string &data, float tolerance,
+                  vector<SvgSubpath> &out) {
+  const char *p = data.c_str();
+  char cmd = 0;
+  char last = 0;
+  Vector2 cur = {0.0f, 0.0f};
+  Vector2 begin = cur;
+  Vector2 ctrl = cur;
+  while (true) {
+    SkipSvgSeparators(p);
+    if (!*p)
+      return;
+    if (isalpha((unsigned char)*p))
+      cmd = *p++;
+    else if (cmd == 0 || cmd == 'z' || cmd == 'Z')
+      return;
+    char up = (char)toupper((unsigned char)cmd);
+    Vector2 base = cmd != up ? cur : Vector2{0.0f, 0.0f};
+    auto point = [&](Vector2 &v) {
+      if (!ReadSvgNumber(p, v.x) || !ReadSvgNumber(p, v.y))
+        return false;
+      v = Vector2Add(v, base);
+      return true;
+    };
+    if (up == 'Z') {
+      if (!out.empty())
+        out.back().closed = true;
+      cur = begin;
+      last = up;
+      continue;
+    }
+    Vector2 a, b, c;
+    if (up == 'M') {
+      if (!point(a))
+        return;
+      out.push_back({});
+      out.back().points.push_back(a);
+      cur = begin = a;
+      cmd = cmd == 'm' ? 'l' : 'L';
+      last = up;
+      continue;
+    }
+    if (out.empty() || out.back().closed) {
+      out.push_back({});
+      out.back().points.push_back(cur);
+    }
+    vector<Vector2> &pts = out.back().points;
+    float v = 0.0f;
+    if (up == 'L') {
+      if (!point(a))
+        return;
+      pts.push_back(a);
+      cur = a;
+    } else if (up == 'H' || up == 'V') {
+      if (!ReadSvgNumber(p, v))
+        return;
+      if (up == 'H')
+        cur.x = v + base.x;
+      else
+        cur.y = v + base.y;
+      pts.push_back(cur);
+    } else if (up == 'C' || up == 'S') {
+      if (up == 'C' && !point(a))
+        return;
+      if (up == 'S')
+        a = (last == 'C' || last == 'S')
+                ? Vector2{2.0f * cur.x - ctrl.x, 2.0f * cur.y - ctrl.y}
+                : cur;
+      if (!point(b) || !point(c))
+        return;
+      FlattenSvgCubic(pts, cur, a, b, c, tolerance);
+      ctrl = b;
+      cur = c;
+    } else if (up == 'Q' || up == 'T') {
+      if (up == 'Q' && !point(a))
+        return;
+      if (up == 'T')
+        a = (last == 'Q' || last == 'T')
+                ? Vector2{2.0f * cur.x - ctrl.x, 2.0f * cur.y - ctrl.y}
+                : cur;
+      if (!point(c))
+        return;
+      FlattenSvgQuad(pts, cur, a, c, tolerance);
+      ctrl = a;
+      cur = c;
+    } else if (up == 'A') {
+      float rx, ry, angle;
+      bool large, sweep;
+      if (!ReadSvgNumber(p, rx) || !ReadSvgNumber(p, ry) ||
+          !ReadSvgNumber(p, angle) || !ReadSvgFlag(p, large) ||
+          !ReadSvgFlag(p, sweep) || !point(c))
+        return;
+      FlattenSvgArc(pts, cur, rx, ry, angle, large, sweep, c, tolerance);
+      cur = c;
+    } else {
+      return;
+    }
+    last = up;
+  }
+}
+
+Element SvgShape(Mode type, Color color, float strokeWidth) {
+  Element el;
+  el.type = type;
+  el.start = {0.0f, 0.0f};
+  el.end = {0.0f, 0.0f};
+  el.strokeWidth = strokeWidth;
+  el.color = color;
+  return el;
+}
+
+// Catmull-Rom end points only steer the curve, so the ends are repeated.
+Element PolylinePenPath(const vector<Vector2> &points, bool closed,
+                        Color color, float strokeWidth, float guard) {
+  Element el = SvgShape(PEN_MODE, color, strokeWidth);
+  vector<Vector2> pts;
+  pts.reserve(points.size() + 1);
+  for (const auto &p : points) {
+    if (pts.empty() || Vector2Distance(pts.back(), p) > 1e-4f)
+      pts.push_back(p);
+  }
+  if (pts.empty())
+    return el;
+  closed = closed && pts.size() > 2;
+  if (closed && Vector2Distance(pts.front(), pts.back()) > 1e-4f)
+    pts.push_back(pts.front());
+  if (pts.size() == 1) {
+    el.path = pts;
+    el.start = el.end = pts[0];
+    return el;
+  }
+  size_t n = pts.size();
+  auto sharp = [&](Vector2 prev, Vector2 at, Vector2 next) {
+    Vector2 a = Vector2Normalize(Vector2Subtract(at, prev));
+    Vector2 b = Vector2Normalize(Vector2Subtract(next, at));
+    return a.x * b.x + a.y * b.y < 0.966f; // turns by more than 15 degrees
+  };
+  vector<bool> corner(n, false);
+  for (size_t i = 1; i + 1 < n; i++)
+    corner[i] = sharp(pts[i - 1], pts[i], pts[i + 1]);
+  if (closed)
+    corner[0] = corner[n - 1] = sharp(pts[n - 2], pts[0], pts[1]);
+  vector<Vector2> body;
+  body.reserve(n + n / 2);
+  for (size_t i = 0; i + 1 < n; i++) {
+    body.push_back(pts[i]);
+    Vector2 d = Vector2Subtract(pts[i + 1], pts[i]);
+    float len = Vector2Length(d);
+    if (len > guard * 4.0f) {
+      Vector2 g = Vector2Scale(d, guard / len);
+      if (corner[i])
+        body.push_back(Vector2Add(pts[i], g));
+      if (corner[i + 1])
+        body.push_back(Vector2Subtract(pts[i + 1], g));
+    }
+  }
+  body.push_back(pts.back());
+  el.path.reserve(body.size() + 2);
+  el.path.push_back(closed ? body[body.size() - 2] : body.front());
+  el.path.insert(el.path.end(), body.begin(), body.end());
+  el.path.push_back(closed ? body[1] : body.back());
+  el.start = body.front();
+  el.end = body.back();
+  return el;
+}
+
+struct SvgScope {
+  SvgMatrix matrix;
+  SvgStyle style;
+  bool group = false;
+  vector<Element> elements;
+};
+
+struct SvgImport {
+  SvgReader in;
+  float tolerance = 0.5f;
+  map<string, string> classes;
+  vector<SvgScope> scopes;
+  int skipDepth = 0;
+  bool inText = false;
+  bool textAnchored = false;
+  Vector2 textAt = {0.0f, 0.0f};
+  SvgMatrix textMatrix;
+  SvgStyle textStyle;
+  string text;
+  bool inStyle = false;
+  string css;
+};
+
+bool SvgPaint(const SvgStyle &style, const SvgMatrix &m, Color &color,
+              float &width) {
+  if (style.hidden || (!style.stroke && !style.fill))
+    return false;
+  color = style.stroke ? style.strokeColor : style.fillColor;
+  float alpha = style.alpha * (style.stroke ? style.strokeOpacity
+                                            : style.fillOpacity);
+  color.a = (unsigned char)(color.a * alpha);
+  width = max(0.5f, (float)(style.strokeWidth * m.Scale()));
+  return color.a > 0;
+}
+
+void AddSvgSubpaths(SvgImport &svg, const vector<SvgSubpath> &subpaths,
+                    const SvgMatrix &m, const SvgStyle &style) {
+  Color color;
+  float width;
+  if (!SvgPaint(style, m, color, width))
     return;
-  out << "# Toggle config\n";
-  out << "window.width=" << cfg.windowWidth << "\n";
-  out << "window.height=" << cfg.windowHeight << "\n";
-  out << "window.min_width=" << cfg.minWindowWidth << "\n";
-  out << "window.min_height=" << cfg.minWindowHeight << "\n";
-  out << "window.title=" << cfg.windowTitle << "\n";
-  out << "window.start_maximized=" << (cfg.startMaximized ? "true" : "false")
-      << "\n";
-  out << "app.target_fps=" << cfg.targetFps << "\n";
-  out << "app.status_seconds=" << cfg.statusDurationSeconds << "\n";
-  out << "font.default_path=" << cfg.defaultFontPath << "\n";
-  out << "font.atlas_size=" << cfg.fontAtlasSize << "\n";
-  out << "path.default_save_dir=" << cfg.defaultSaveDir << "\n";
-  out << "path.default_export_dir=" << cfg.defaultExportDir << "\n";
-  out << "path.default_open_dir=" << cfg.defaultOpenDir << "\n";
-  out << "export.raster_scale=" << cfg.exportRasterScale << "\n";
-  out << "canvas.theme_dark=" << (cfg.defaultDarkTheme ? "true" : "false") << "\n";
-  out << "canvas.show_tags=" << (cfg.defaultShowTags ? "true" : "false") << "\n";
-  out << "canvas.stroke_width=" << cfg.defaultStrokeWidth << "\n";
-  out << "canvas.min_stroke_width=" << cfg.minStrokeWidth << "\n";
-  out << "canvas.max_stroke_width=" << cfg.maxStrokeWidth << "\n";
-  out << "canvas.text_size=" << cfg.defaultTextSize << "\n";
-  out << "canvas.min_text_size=" << cfg.minTextSize << "\n";
-  out << "canvas.max_text_size=" << cfg.maxTextSize << "\n";
-  out << "canvas.grid_width=" << cfg.defaultGridWidth << "\n";
-  out << "canvas.type=" << BackgroundTypeToString(cfg.defaultBgType) << "\n";
-  out << "graph.unit=" << cfg.defaultGraphUnit << "\n";
-  out << "graph.minor_spacing=" << cfg.defaultGraphMinorSpacing << "\n";
-  out << "graph.label_size=" << cfg.defaultGraphLabelSize << "\n";
-  out << "graph.label_min_px=" << cfg.defaultGraphLabelMinPx << "\n";
-  out << "graph.label_max_px=" << cfg.defaultGraphLabelMaxPx << "\n";
-  out << "canvas.draw_color=" << ColorToHex(cfg.defaultDrawColor) << "\n";
-  out << "triangle.height_ratio=" << cfg.triangleHeightRatio << "\n";
-  out << "zoom.min=" << cfg.minZoom << "\n";
-  out << "zoom.max=" << cfg.maxZoom << "\n";
-  out << "zoom.wheel_step=" << cfg.zoomStep << "\n";
-  out << "zoom.key_scale=" << cfg.zoomKeyScale << "\n";
-  out << "interaction.pen_sample_distance=" << cfg.penSampleDistance << "\n";
-  out << "interaction.selection_box_activation_px="
-      << cfg.selectionBoxActivationPx << "\n";
-  out << "interaction.hit_tolerance=" << cfg.defaultHitTolerance << "\n";
-  out << "interaction.paste_offset_step=" << cfg.pasteOffsetStep << "\n";
-  out << "theme.light.background=" << ColorToHex(cfg.lightBackground) << "\n";
-  out << "theme.dark.background=" << ColorToHex(cfg.darkBackground) << "\n";
-  out << "theme.light.ui_text=" << ColorToHex(cfg.lightUiText) << "\n";
-  out << "theme.dark.ui_text=" << ColorToHex(cfg.darkUiText) << "\n";
-  out << "theme.light.texture_a=" << ColorToHex(cfg.lightTextureA) << "\n";
-  out << "theme.light.texture_b=" << ColorToHex(cfg.lightTextureB) << "\n";
-  out << "theme.dark.texture_a=" << ColorToHex(cfg.darkTextureA) << "\n";
-  out << "theme.dark.texture_b=" << ColorToHex(cfg.darkTextureB) << "\n";
-  out << "theme.light.grid=" << ColorToHex(cfg.lightGridColor) << "\n";
-  out << "theme.dark.grid=" << ColorToHex(cfg.darkGridColor) << "\n";
-  out << "graph.light.axis=" << ColorToHex(cfg.lightGraphAxis) << "\n";
-  out << "graph.dark.axis=" << ColorToHex(cfg.darkGraphAxis) << "\n";
-  out << "graph.light.major=" << ColorToHex(cfg.lightGraphMajor) << "\n";
-  out << "graph.dark.major=" << ColorToHex(cfg.darkGraphMajor) << "\n";
-  out << "graph.light.minor=" << ColorToHex(cfg.lightGraphMinor) << "\n";
-  out << "graph.dark.minor=" << ColorToHex(cfg.darkGraphMinor) << "\n";
-  out << "graph.light.label=" << ColorToHex(cfg.lightGraphLabel) << "\n";
-  out << "graph.dark.label=" << ColorToHex(cfg.darkGraphLabel) << "\n";
-  out << "status.light.bg=" << ColorToHex(cfg.lightStatusBg) << "\n";
-  out << "status.dark.bg=" << ColorToHex(cfg.darkStatusBg) << "\n";
-  out << "status.light.label=" << ColorToHex(cfg.lightStatusLabel) << "\n";
-  out << "status.dark.label=" << ColorToHex(cfg.darkStatusLabel) << "\n";
-  out << "status.light.value=" << ColorToHex(cfg.lightStatusValue) << "\n";
-  out << "status.dark.value=" << ColorToHex(cfg.darkStatusValue) << "\n";
-  out << "mode_color.selection=" << ColorToHex(cfg.modeSelection) << "\n";
-  out << "mode_color.move=" << ColorToHex(cfg.modeMove) << "\n";
-  out << "mode_color.line=" << ColorToHex(cfg.modeLine) << "\n";
-  out << "mode_color.circle=" << ColorToHex(cfg.modeCircle) << "\n";
-  out << "mode_color.rect=" << ColorToHex(cfg.modeRect) << "\n";
-  out << "mode_color.triangle=" << ColorToHex(cfg.modeTriangle) << "\n";
-  out << "mode_color.text=" << ColorToHex(cfg.modeTextColor) << "\n";
-  out << "mode_color.eraser=" << ColorToHex(cfg.modeEraser) << "\n";
-  out << "mode_color.pen=" << ColorToHex(cfg.modePen) << "\n";
-  for (const auto &kv : cfg.keymap) {
-    out << "key." << kv.first << "=";
-    for (size_t i = 0; i < kv.second.size(); i++) {
-      const auto &b = kv.second[i];
-      if (i > 0)
-        out << "|";
-      if (b.ctrl)
-        out << "Ctrl+";
-      if (b.shift)
-        out << "Shift+";
-      if (b.alt)
-        out << "Alt+";
-      out << KeyToToken(b.key);
+  auto &out = svg.scopes.back().elements;
+  vector<Vector2> pts;
+  for (const auto &sub : subpaths) {
+    pts.clear();
+    for (const auto &p : sub.points)
+      pts.push_back(m.Apply(p));
+    if (!pts.empty())
+      out.push_back(PolylinePenPath(pts, sub.closed, color, width, svg.tolerance));
+  }
+}
+
+void AddSvgEllipse(SvgImport &svg, const SvgTag &tag, const SvgMatrix &m,
+                   const SvgStyle &style, float rx, float ry) {
+  Vector2 c = {SvgAttr(tag, "cx"), SvgAttr(tag, "cy")};
+  if (rx <= 0.0f || ry <= 0.0f)
+    return;
+  Color color;
+  float width;
+  if (!SvgPaint(style, m, color, width))
+    return;
+  if (fabsf(rx - ry) < 1e-6f * rx && m.IsSimilarity()) {
+    float r = rx * (float)m.Scale();
+    Vector2 center = m.Apply(c);
+    if (!style.stroke) {
+      Element dot = SvgShape(PEN_MODE, color, r * 2.0f);
+      dot.path = {center};
+      dot.start = dot.end = center;
+      svg.scopes.back().elements.push_back(dot);
+      return;
+    }
+    Element el = SvgShape(style.dashed ? DOTTEDCIRCLE_MODE : CIRCLE_MODE,
+                          color, width);
+    el.start = center;
+    el.end = {center.x + r, center.y};
+    svg.scopes.back().elements.push_back(el);
+    return;
+  }
+  SvgSubpath sub;
+  sub.closed = true;
+  int n = SvgArcSegments(max(rx, ry) * m.Scale(), 2.0 * PI, svg.tolerance);
+  n = max(n, 8);
+  for (int i = 0; i < n; i++) {
+    double t = 2.0 * PI * i / n;
+    sub.points.push_back(
+        {(float)(c.x + rx * cos(t)), (float)(c.y + ry * sin(t))});
+  }
+  AddSvgSubpaths(svg, {sub}, m, style);
+}
+
+void AddSvgShape(SvgImport &svg, const SvgTag &tag, const SvgMatrix &m,
+                 const SvgStyle &style) {
+  const string &name = tag.name;
+  float tolerance = svg.tolerance / (float)max(m.Scale(), 1e-6);
+  if (name == "line") {
+    Color color;
+    float width;
+    if (!SvgPaint(style, m, color, width))
+      return;
+    Element el = SvgShape(style.dashed ? DOTTEDLINE_MODE : LINE_MODE, color,
+                          width);
+    el.start = m.Apply({SvgAttr(tag, "x1"), SvgAttr(tag, "y1")});
+    el.end = m.Apply({SvgAttr(tag, "x2"), SvgAttr(tag, "y2")});
+    svg.scopes.back().elements.push_back(el);
+  } else if (name == "rect") {
+    const string *ws = tag.Get("width");
+    const string *hs = tag.Get("height");
+    if (!ws || !hs || ws->find('%') != string::npos ||
+        hs->find('%') != string::npos)
+      return;
+    float x = SvgAttr(tag, "x"), y = SvgAttr(tag, "y");
+    float w = SvgAttr(tag, "width"), h = SvgAttr(tag, "height");
+    if (w <= 0.0f || h <= 0.0f)
+      return;
+    Color color;
+    float width;
+    if (!SvgPaint(style, m, color, width))
+      return;
+    if (m.IsSimilarity()) {
+      float s = (float)m.Scale();
+      Vector2 c = m.Apply({x + w * 0.5f, y + h * 0.5f});
+      Element el = SvgShape(style.dashed ? DOTTEDRECT_MODE : RECTANGLE_MODE,
+                            color, width);
+      el.start = {c.x - w * s * 0.5f, c.y - h * s * 0.5f};
+      el.end = {c.x + w * s * 0.5f, c.y + h * s * 0.5f};
+      float rotation = (float)atan2(m.b, m.a);
+      el.rotation = fabsf(rotation) < 1e-6f ? 0.0f : rotation;
+      svg.scopes.back().elements.push_back(el);
+      return;
+    }
+    SvgSubpath sub;
+    sub.closed = true;
+    sub.points = {{x, y}, {x + w, y}, {x + w, y + h}, {x, y + h}};
+    AddSvgSubpaths(svg, {sub}, m, style);
+  } else if (name == "circle") {
+    float r = SvgAttr(tag, "r");
+    AddSvgEllipse(svg, tag, m, style, r, r);
+  } else if (name == "ellipse") {
+    AddSvgEllipse(svg, tag, m, style, SvgAttr(tag, "rx"), SvgAttr(tag, "ry"));
+  } else if (name == "polyline" || name == "polygon") {
+    const string *points = tag.Get("points");
+    if (!points)
+      return;
+    SvgSubpath sub;
+    sub.closed = name == "polygon";
+    const char *p = points->c_str();
+    Vector2 v;
+    while (ReadSvgNumber(p, v.x) && ReadSvgNumber(p, v.y))
+      sub.points.push_back(v);
+    AddSvgSubpaths(svg, {sub}, m, style);
+  } else if (name == "path") {
+    const string *data = tag.Get("d");
+    if (!data)
+      return;
+    vector<SvgSubpath> subpaths;
+    ParseSvgPath(*data, tolerance, subpaths);
+    AddSvgSubpaths(svg, subpaths, m, style);
+  }
+}
+
+void FinishSvgText(SvgImport &svg) {
+  svg.inText = false;
+  svg.in.keepText = svg.inStyle;
+  string content = Trim(svg.text);
+  svg.text.clear();
+  const SvgStyle &style = svg.textStyle;
+  if (content.empty() || style.hidden || (!style.fill && !style.stroke))
+    return;
+  Color color = style.fill ? style.fillColor : style.strokeColor;
+  color.a = (unsigned char)(color.a * style.alpha *
+                            (style.fill ? style.fillOpacity
+                                        : style.strokeOpacity));
+  const SvgMatrix &m = svg.textMatrix;
+  float size = max(1.0f, style.fontSize * (float)m.Scale());
+  // SVG anchors text on its baseline; elements anchor their top-left corner.
+  Vector2 at = m.Apply(svg.textAt);
+  Element el = SvgShape(TEXT_MODE, color, 1.0f);
+  el.text = content;
+  el.textSize = size;
+  el.start = {at.x, at.y - size};
+  el.end = {at.x + 10.0f, at.y};
+  float rotation = (float)atan2(m.b, m.a);
+  el.rotation = fabsf(rotation) < 1e-6f ? 0.0f : rotation;
+  svg.scopes.back().elements.push_back(el);
+}
+
+void CloseSvgScope(SvgImport &svg) {
+  SvgScope scope = move(svg.scopes.back());
+  svg.scopes.pop_back();
+  auto &out = svg.scopes.back().elements;
+  if (scope.group && scope.elements.size() > 1) {
+    Element group = SvgShape(GROUP_MODE, scope.style.strokeColor, 1.0f);
+    group.children = move(scope.elements);
+    Rectangle gb = group.GetBounds();
+    group.start = {gb.x, gb.y};
+    out.push_back(move(group));
+  } else {
+    for (auto &el : scope.elements)
+      out.push_back(move(el));
+  }
+}
+
+bool ImportSvgFile(const string &path, float tolerance, vector<Element> &out,
+                   string &error) {
+  SvgImport svg;
+  svg.in.file = fopen(path.c_str(), "rb");
+  if (!svg.in.file) {
+    error = "cannot open file";
+    return false;
+  }
+  svg.tolerance = max(0.01f, tolerance);
+  svg.scopes.emplace_back();
+  static const unordered_set<string> skipped = {
+      "defs",   "symbol",         "clipPath",       "mask",
+      "marker", "pattern",        "linearGradient", "radialGradient",
+      "filter", "metadata",       "title",          "desc",
+      "script", "foreignObject",
+  };
+  bool sawSvg = false;
+  SvgTag tag;
+  string chars;
+  SvgEvent event;
+  while ((event = ReadSvgEvent(svg.in, tag, chars)) != SVG_END) {
+    if (event == SVG_TEXT) {
+      if (svg.inStyle)
+        svg.css += chars;
+      else if (svg.inText)
+        svg.text += DecodeSvgEntities(chars);
+      continue;
+    }
+    if (svg.skipDepth > 0) {
+      if (tag.closing)
+        svg.skipDepth--;
+      else if (!tag.selfClosing)
+        svg.skipDepth++;
+      continue;
+    }
+    const string &name = tag.name;
+    if (tag.closing) {
+      if (name == "style" && svg.inStyle) {
+        ParseSvgStyleSheet(svg.css, svg.classes);
+        svg.css.clear();
+        svg.inStyle = false;
+        svg.in.keepText = svg.inText;
+      } else if (name == "text" && svg.inText) {
+        FinishSvgText(svg);
+      } else if ((name == "g" || name == "svg" || name == "a" ||
+                  name == "switch") &&
+                 svg.scopes.size() > 1) {
+        CloseSvgScope(svg);
+      }
+      continue;
+    }
+    if (skipped.count(name)) {
+      if (!tag.selfClosing)
+        svg.skipDepth = 1;
+      continue;
+    }
+    if (name == "style") {
+      if (!tag.selfClosing) {
+        svg.inStyle = true;
+        svg.in.keepText = true;
+      }
+      continue;
+    }
+    if (svg.inText) {
+      if (!svg.textAnchored && tag.Get("x") && tag.Get("y")) {
+        svg.textAt = {SvgAttr(tag, "x"), SvgAttr(tag, "y")};
+        svg.textAnchored = true;
+      }
+      continue;
+    }
+    const SvgScope &parent = svg.scopes.back();
+    SvgStyle style = ResolveSvgStyle(parent.style, tag, svg.classes);
+    SvgMatrix m = parent.matrix;
+    if (const string *t = tag.Get("transform"))
+      m = m * ParseSvgTransform(*t);
+
+    if (name == "svg" || name == "g" || name == "a" || name == "switch") {
+      if (name == "svg") {
+        SvgMatrix local;
+        if (sawSvg) {
+          local.e = SvgAttr(tag, "x");
+          local.f = SvgAttr(tag, "y");
+        }
+        if (const string *vb = tag.Get("viewBox")) {
+          const char *p = vb->c_str();
+          float v[4];
+          bool ok = true;
+          for (float &x : v)
+            ok = ok && ReadSvgNumber(p, x);
+          float w = SvgAttr(tag, "width", v[2]);
+          float h = SvgAttr(tag, "height", v[3]);
+          if (ok && v[2] > 0.0f && v[3] > 0.0f && w > 0.0f && h > 0.0f) {
+            SvgMatrix fit;
+            fit.a = w / v[2];
+            fit.d = h / v[3];
+            fit.e = -v[0] * fit.a;
+            fit.f = -v[1] * fit.d;
+            local = local * fit;
+          }
+        }
+        m = m * local;
+      }
+      if (tag.selfClosing)
+        continue;
+      if (style.hidden) {
+        svg.skipDepth = 1;
+        continue;
+      }
+      SvgScope scope;
+      scope.matrix = m;
+      scope.style = style;
+      scope.group = name == "g" || (name == "svg" && sawSvg);
+      sawSvg = sawSvg || name == "svg";
+      svg.scopes.push_back(move(scope));
+      continue;
+    }
+    if (name == "text") {
+      svg.textStyle = style;
+      svg.textMatrix = m;
+      svg.textAnchored = tag.Get("x") || tag.Get("y");
+      svg.textAt = {SvgAttr(tag, "x"), SvgAttr(tag, "y")};
+      svg.text.clear();
+      if (!tag.selfClosing) {
+        svg.inText = true;
+        svg.in.keepText = true;
+      }
+      continue;
+    }
+    if (!style.hidden)
+      AddSvgShape(svg, tag, m, style);
+    if (!tag.selfClosing)
+      svg.skipDepth = 1;
+  }
+  fclose(svg.in.file);
+  while (svg.scopes.size() > 1)
+    CloseSvgScope(svg);
+  out = move(svg.scopes.back().elements);
+  if (!sawSvg) {
+    error = "not an SVG document";
+    return false;
+  }
+  return true;
+}
+
+const size_t kPlotMaxPoints = 16384;
+
+struct PlotDecimator {
+  double column = 1.0;
+  vector<vector<PlotPoint>> segments;
+  size_t points = 0;
+  size_t limit = kPlotMaxPoints;
+  bool open = false;
+  long long bucket = 0;
+  PlotPoint first, last, lo, hi;
+  int loAt = 0, hiAt = 0, count = 0;
+
+  void Flush(vector<PlotPoint> &out) {
+    if (!open)
+      return;
+    open = false;
+    PlotPoint pts[4] = {first, lo, hi, last};
+    int seq[4] = {0, loAt, hiAt, count - 1};
+    if (seq[1] > seq[2]) {
+      swap(pts[1], pts[2]);
+      swap(seq[1], seq[2]);
+    }
+    for (int i = 0; i < 4; i++) {
+      if (i == 0 || seq[i] != seq[i - 1])
+        out.push_back(pts[i]);
+    }
+  }
+  void Add(vector<PlotPoint> &out, PlotPoint p) {
+    long long b = (long long)floor(p.x / column);
+    if (open && b != bucket)
+      Flush(out);
+    if (!open) {
+      open = true;
+      bucket = b;
+      first = last = lo = hi = p;
+      loAt = hiAt = 0;
+      count = 1;
+      return;
+    }
+    if (p.y < lo.y) {
+      lo = p;
+      loAt = count;
+    }
+    if (p.y > hi.y) {
+      hi = p;
+      hiAt = count;
+    }
+    last = p;
+    count++;
+  }
+  void Push(PlotPoint p) {
+    if (segments.empty())
+      segments.emplace_back();
+    size_t before = segments.back().size();
+    Add(segments.back(), p);
+    points += segments.back().size() - before;
+    if (points > limit)
+      Coarsen();
+  }
+  void Break() {
+    if (segments.empty())
+      return;
+    size_t before = segments.back().size();
+    Flush(segments.back());
+    points += segments.back().size() - before;
+    if (!segments.back().empty())
+      segments.emplace_back();
+  }
+  void Coarsen() {
+    Flush(segments.back());
+    double minX = segments[0].empty() ? 0.0 : segments[0][0].x;
+    double maxX = minX;
+    for (const auto &seg : segments) {
+      for (const auto &p : seg) {
+        minX = min(minX, p.x);
+        maxX = max(maxX, p.x);
+      }
+    }
+    column = max(column * 2.0, (maxX - minX) / (double)(kPlotMaxPoints / 8));
+    size_t before = points;
+    points = 0;
+    vector<PlotPoint> kept;
+    for (auto &seg : segments) {
+      kept.clear();
+      for (const auto &p : seg)
+        Add(kept, p);
+      Flush(kept);
+      points += kept.size();
+      seg.swap(kept);
+    }
+    limit = points * 10 > before * 9 ? points * 2 : kPlotMaxPoints;
+  }
+  void Finish() {
+    Break();
+    while (!segments.empty() && segments.back().empty())
+      segments.pop_back();
+  }
+};
+
+void SplitCsvFields(const string &line, char sep,
+                    vector<pair<size_t, size_t>> &fields) {
+  fields.clear();
+  size_t i = 0, n = line.size();
+  while (i <= n) {
+    if (sep == ' ') {
+      while (i < n && isspace((unsigned char)line[i]))
+        i++;
+      if (i == n)
+        return;
+    }
+    size_t end = i;
+    while (end < n && (sep == ' ' ? !isspace((unsigned char)line[end])
+                                  : line[end] != sep))
+      end++;
+    size_t a = i, b = end;
+    while (a < b && (isspace((unsigned char)line[a]) || line[a] == '"'))
+      a++;
+    while (b > a && (isspace((unsigned char)line[b - 1]) || line[b - 1] == '"'))
+      b--;
+    fields.push_back({a, b});
+    i = end + 1;
+  }
+}
+
+bool ParseCsvNumber(const string &line, pair<size_t, size_t> field,
+                    double &value) {
+  const char *a = line.data() + field.first;
+  const char *b = line.data() + field.second;
+  if (a < b && *a == '+')
+    a++;
+  auto result = from_chars(a, b, value);
+  return result.ec == errc() && result.ptr == b && isfinite(value);
+}
+
+template <typename Sink>
+bool PlotCsvFile(const string &path, const string &xcol, const string &ycol,
+                 Sink &dec, long long &rows, string &error) {
+  ifstream in(path);
+  if (!in) {
+    error = "cannot open file";
+    return false;
+  }
+  string line;
+  vector<pair<size_t, size_t>> fields;
+  char sep = 0;
+  int xi = -1, yi = -1;
+  rows = 0;
+  while (getline(in, line)) {
+    if (!line.empty() && line.back() == '\r')
+      line.pop_back();
+    if (line.empty() || line[0] == '#')
+      continue;
+    if (sep == 0) {
+      sep = ' ';
+      size_t best = 0;
+      for (char c : {',', ';', '\t'}) {
+        size_t n = (size_t)count(line.begin(), line.end(), c);
+        if (n > best) {
+          best = n;
+          sep = c;
+        }
+      }
+      SplitCsvFields(line, sep, fields);
+      bool header = false;
+      double v;
+      for (const auto &f : fields)
+        header = header || !ParseCsvNumber(line, f, v);
+      auto resolve = [&](const string &spec, int &index) {
+        int iv = 0;
+        if (ParseIntValue(spec, iv) && iv >= 1) {
+          index = iv - 1;
+          return true;
+        }
+        for (size_t i = 0; header && i < fields.size(); i++) {
+          string name = line.substr(fields[i].first,
+                                    fields[i].second - fields[i].first);
+          if (ToLower(name) == ToLower(spec)) {
+            index = (int)i;
+            return true;
+          }
+        }
+        error = "no column " + spec;
+        return false;
+      };
+      if (xcol.empty() && ycol.empty()) {
+        xi = fields.size() > 1 ? 0 : -1;
+        yi = fields.size() > 1 ? 1 : 0;
+      } else if ((!xcol.empty() && !resolve(xcol, xi)) || !resolve(ycol, yi)) {
+        return false;
+      }
+      if (header)
+        continue;
+    }
+    SplitCsvFields(line, sep, fields);
+    rows++;
+    double x = (double)rows, y = 0.0;
+    bool ok = yi < (int)fields.size() && ParseCsvNumber(line, fields[yi], y);
+    if (xi >= 0)
+      ok = ok && xi < (int)fields.size() && ParseCsvNumber(line, fields[xi], x);
+    if (ok)
+      dec.Push({x, y});
+    else
+      dec.Break();
+  }
+  dec.Finish();
+  if (sep == 0) {
+    error = "file is empty";
+    return false;
+  }
+  return true;
+}
+
+double PlotPixelColumn(const Canvas &canvas) {
+  return 1.0 / (max(0.0001f, canvas.graphUnit) *
+                max(0.0001f, canvas.camera.zoom));
+}
+
+// Graph labels count up the screen, so y is flipped like the axis.
+Vector2 PlotToWorld(const Canvas &canvas, PlotPoint p) {
+  double unit = max(0.0001f, canvas.graphUnit);
+  return {(float)(p.x * unit - canvas.originX),
+          (float)(-p.y * unit - canvas.originY)};
+}
+
+Element PlotElement(const Canvas &canvas, const PlotDecimator &dec,
+                    Color color, float strokeWidth, float guard) {
+  vector<Element> series;
+  vector<Vector2> pts;
+  for (const auto &seg : dec.segments) {
+    pts.clear();
+    for (const auto &p : seg)
+      pts.push_back(PlotToWorld(canvas, p));
+    series.push_back(PolylinePenPath(pts, false, color, strokeWidth, guard));
+  }
+  if (series.size() == 1)
+    return series[0];
+  Element group = SvgShape(GROUP_MODE, color, strokeWidth);
+  group.children = move(series);
+  Rectangle gb = group.GetBounds();
+  group.start = {gb.x, gb.y};
+  return group;
+}
+
+void CloseLiveStream(LiveStream &stream) {
+  if (stream.fd >= 0)
+    close(stream.fd);
+  stream.fd = -1;
+  stream.active = false;
+}
+
+bool OpenLiveStream(LiveStream &stream, const string &source, int capacity,
+                    string &error) {
+  CloseLiveStream(stream);
+  string path = source;
+  bool unixPrefix = path.rfind("unix:", 0) == 0;
+  if (unixPrefix)
+    path.erase(0, 5);
+  path = ExpandUserPath(path);
+  struct stat st = {};
+  bool exists = stat(path.c_str(), &st) == 0;
+  stream.isSocket = unixPrefix || (exists && S_ISSOCK(st.st_mode));
+  stream.tail = !stream.isSocket && exists && S_ISREG(st.st_mode);
+  int fd = -1;
+  if (stream.isSocket) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+      error = "socket path too long";
+      return false;
     }
-    out << "\n";
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0) {
+      int saved = errno;
+      close(fd);
+      fd = -1;
+      errno = saved;
+    }
+    if (fd >= 0)
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  } else if (exists) {
+    fd = open(path.c_str(), O_RDONLY | O_NONBLOCK);
+  } else {
+    errno = ENOENT;
+  }
+  if (fd < 0) {
+    error = strerror(errno);
+    return false;
   }
+  stream.offset = stream.tail ? (long long)lseek(fd, 0, SEEK_END) : 0;
+  stream.fd = fd;
+  stream.source = source;
+  stream.active = true;
+  stream.block.resize(65536);
+  stream.line.clear();
+  stream.line.reserve(4096);
+  stream.ring.assign((size_t)max(1, capacity), {0.0, 0.0});
+  stream.head = 0;
+  stream.count = 0;
+  stream.total = 0;
+  stream.unordered = -1;
+  stream.follow = true;
+  stream.rateStart = GetTime();
+  stream.rateSamples = 0;
+  stream.rate = 0.0f;
+  return true;
 }
 
-void LoadConfig(AppConfig &cfg) {
-  ifstream in(cfg.configPath);
-  if (!in.is_open()) {
-    WriteDefaultConfig(cfg);
+const PlotPoint &StreamSample(const LiveStream &stream, size_t i) {
+  return stream.ring[(stream.head + i) % stream.ring.size()];
+}
+
+void AddStreamLine(LiveStream &stream) {
+  const string &line = stream.line;
+  if (line.empty() || line[0] == '#')
+    return;
+  char sep = ' ';
+  for (char c : {',', ';', '\t'}) {
+    if (line.find(c) != string::npos) {
+      sep = c;
+      break;
+    }
+  }
+  SplitCsvFields(line, sep, stream.fields);
+  if (stream.fields.empty())
+    return;
+  PlotPoint p = {(double)stream.total, 0.0};
+  bool ok = stream.fields.size() > 1
+                ? ParseCsvNumber(line, stream.fields[0], p.x) &&
+                      ParseCsvNumber(line, stream.fields[1], p.y)
+                : ParseCsvNumber(line, stream.fields[0], p.y);
+  if (!ok)
     return;
+  size_t cap = stream.ring.size();
+  if (stream.count > 0 && p.x < StreamSample(stream, stream.count - 1).x)
+    stream.unordered = stream.total;
+  if (stream.count < cap) {
+    stream.ring[(stream.head + stream.count) % cap] = p;
+    stream.count++;
+  } else {
+    stream.ring[stream.head] = p;
+    stream.head = (stream.head + 1) % cap;
   }
+  stream.total++;
+  stream.rateSamples++;
+}
 
-  string line;
-  while (getline(in, line)) {
-    line = Trim(line);
-    if (line.empty() || line[0] == '#')
+void TickLiveStream(Canvas &canvas, const AppConfig &cfg) {
+  LiveStream &stream = canvas.stream;
+  if (!stream.active)
+    return;
+  Camera2D &cam = canvas.camera;
+  if (stream.follow &&
+      (fabs(cam.target.x + canvas.originX - stream.followX) > 0.5 ||
+       fabs(cam.target.y + canvas.originY - stream.followY) > 0.5))
+    stream.follow = false;
+
+  long long before = stream.total;
+  size_t budget = 16u << 20;
+  size_t got = 0;
+  while (got < budget) {
+    ssize_t n = read(stream.fd, stream.block.data(), stream.block.size());
+    if (n > 0) {
+      got += (size_t)n;
+      stream.offset += n;
+      const char *p = stream.block.data();
+      const char *end = p + n;
+      while (p < end) {
+        const char *nl = (const char *)memchr(p, '\n', end - p);
+        stream.line.append(p, nl ? nl : end);
+        if (!nl)
+          break;
+        if (!stream.line.empty() && stream.line.back() == '\r')
+          stream.line.pop_back();
+        AddStreamLine(stream);
+        stream.line.clear();
+        p = nl + 1;
+      }
+      if (stream.line.size() > (1u << 20))
+        stream.line.clear();
       continue;
-    size_t eq = line.find('=');
-    if (eq == string::npos)
+    }
+    if (n < 0 && errno == EINTR)
       continue;
-    string key = Trim(line.substr(0, eq));
-    string value = Trim(line.substr(eq + 1));
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if (n == 0 && stream.tail) {
+      // A truncated file starts over, as tail -F does.
+      struct stat st = {};
+      if (fstat(stream.fd, &st) == 0 && st.st_size < stream.offset) {
+        lseek(stream.fd, 0, SEEK_SET);
+        stream.offset = 0;
+        stream.line.clear();
+        continue;
+      }
+      break;
+    }
+    // A FIFO reads as empty until a writer opens it again.
+    if (n == 0 && !stream.isSocket)
+      break;
+    SetStatus(canvas, cfg, "Stream closed: " + stream.source);
+    CloseLiveStream(stream);
+    return;
+  }
 
-    int iv;
-    float fv;
-    bool bv;
-    Color cv;
-    if (key == "window.width" && ParseIntValue(value, iv))
-      cfg.windowWidth = max(320, iv);
-    else if (key == "window.height" && ParseIntValue(value, iv))
-      cfg.windowHeight = max(240, iv);
-    else if (key == "window.min_width" && ParseIntValue(value, iv))
-      cfg.minWindowWidth = max(200, iv);
-    else if (key == "window.min_height" && ParseIntValue(value, iv))
-      cfg.minWindowHeight = max(150, iv);
-    else if (key == "window.title")
-      cfg.windowTitle = value;
-    else if (key == "window.start_maximized" && ParseBool(value, bv))
-      cfg.startMaximized = bv;
-    else if (key == "window.start_fullscreen" && ParseBool(value, bv))
-      cfg.startMaximized = bv;
-    else if (key == "app.target_fps" && ParseIntValue(value, iv))
-      cfg.targetFps = max(1, iv);
-    else if (key == "app.status_seconds" && ParsePositiveFloat(value, fv))
-      cfg.statusDurationSeconds = max(0.2f, fv);
-    else if (key == "font.default_path")
-      cfg.defaultFontPath = value;
-    else if (key == "font.atlas_size" && ParseIntValue(value, iv))
-      cfg.fontAtlasSize = max(16, iv);
-    else if (key == "path.default_save_dir")
-      cfg.defaultSaveDir = ExpandUserPath(value);
-    else if (key == "path.default_export_dir")
-      cfg.defaultExportDir = ExpandUserPath(value);
-    else if (key == "path.default_open_dir")
-      cfg.defaultOpenDir = ExpandUserPath(value);
-    else if (key == "export.raster_scale" && ParsePositiveFloat(value, fv))
-      cfg.exportRasterScale = max(1.0f, min(8.0f, fv));
-    else if (key == "canvas.theme_dark" && ParseBool(value, bv))
-      cfg.defaultDarkTheme = bv;
-    else if (key == "canvas.show_tags" && ParseBool(value, bv))
-      cfg.defaultShowTags = bv;
-    else if (key == "canvas.stroke_width" && ParsePositiveFloat(value, fv))
-      cfg.defaultStrokeWidth = max(0.1f, fv);
-    else if (key == "canvas.min_stroke_width" && ParsePositiveFloat(value, fv))
-      cfg.minStrokeWidth = max(0.1f, fv);
-    else if (key == "canvas.max_stroke_width" && ParsePositiveFloat(value, fv))
-      cfg.maxStrokeWidth = max(cfg.minStrokeWidth, fv);
-    else if (key == "canvas.text_size" && ParsePositiveFloat(value, fv))
-      cfg.defaultTextSize = max(1.0f, fv);
-    else if (key == "canvas.min_text_size" && ParsePositiveFloat(value, fv))
-      cfg.minTextSize = max(1.0f, fv);
-    else if (key == "canvas.max_text_size" && ParsePositiveFloat(value, fv))
-      cfg.maxTextSize = max(cfg.minTextSize, fv);
-    else if (key == "canvas.grid_width" && ParsePositiveFloat(value, fv))
-      cfg.defaultGridWidth = max(6.0f, fv);
-    else if (key == "canvas.type")
-      ParseBackgroundType(value, cfg.defaultBgType);
-    else if (key == "graph.unit" && ParsePositiveFloat(value, fv))
-      cfg.defaultGraphUnit = max(0.1f, fv);
-    else if (key == "graph.minor_spacing" && ParsePositiveFloat(value, fv))
-      cfg.defaultGraphMinorSpacing = max(0.1f, fv);
-    else if (key == "graph.label_size" && ParsePositiveFloat(value, fv))
-      cfg.defaultGraphLabelSize = max(6.0f, fv);
-    else if (key == "graph.label_min_px" && ParsePositiveFloat(value, fv))
-      cfg.defaultGraphLabelMinPx = max(10.0f, fv);
-    else if (key == "graph.label_max_px" && ParsePositiveFloat(value, fv))
-      cfg.defaultGraphLabelMaxPx = max(10.0f, fv);
-    else if (key == "canvas.draw_color" && ParseHexColor(value, cv))
-      cfg.defaultDrawColor = cv;
-    else if (key == "triangle.height_ratio" && ParsePositiveFloat(value, fv))
-      cfg.triangleHeightRatio = max(0.05f, fv);
-    else if (key == "zoom.min" && ParsePositiveFloat(value, fv))
-      cfg.minZoom = max(0.01f, fv);
-    else if (key == "zoom.max" && ParsePositiveFloat(value, fv))
-      cfg.maxZoom = max(cfg.minZoom, fv);
-    else if (key == "zoom.wheel_step" && ParsePositiveFloat(value, fv))
-      cfg.zoomStep = max(0.001f, fv);
-    else if (key == "zoom.key_scale" && ParsePositiveFloat(value, fv))
-      cfg.zoomKeyScale = max(1.001f, fv);
-    else if (key == "interaction.pen_sample_distance" &&
-             ParsePositiveFloat(value, fv))
-      cfg.penSampleDistance = max(0.2f, fv);
-    else if (key == "interaction.selection_box_activation_px" &&
-             ParsePositiveFloat(value, fv))
-      cfg.selectionBoxActivationPx = max(0.2f, fv);
-    else if (key == "interaction.hit_tolerance" && ParsePositiveFloat(value, fv))
-      cfg.defaultHitTolerance = max(0.2f, fv);
-    else if (key == "interaction.paste_offset_step" &&
-             ParsePositiveFloat(value, fv))
-      cfg.pasteOffsetStep = max(1.0f, fv);
-    else if (key == "theme.light.background" && ParseHexColor(value, cv))
-      cfg.lightBackground = cv;
-    else if (key == "theme.dark.background" && ParseHexColor(value, cv))
-      cfg.darkBackground = cv;
-    else if (key == "theme.light.ui_text" && ParseHexColor(value, cv))
-      cfg.lightUiText = cv;
-    else if (key == "theme.dark.ui_text" && ParseHexColor(value, cv))
-      cfg.darkUiText = cv;
-    else if (key == "theme.light.texture_a" && ParseHexColor(value, cv))
-      cfg.lightTextureA = cv;
-    else if (key == "theme.light.texture_b" && ParseHexColor(value, cv))
-      cfg.lightTextureB = cv;
-    else if (key == "theme.dark.texture_a" && ParseHexColor(value, cv))
-      cfg.darkTextureA = cv;
-    else if (key == "theme.dark.texture_b" && ParseHexColor(value, cv))
-      cfg.darkTextureB = cv;
-    else if (key == "theme.light.grid" && ParseHexColor(value, cv))
-      cfg.lightGridColor = cv;
-    else if (key == "theme.dark.grid" && ParseHexColor(value, cv))
-      cfg.darkGridColor = cv;
-    else if (key == "graph.light.axis" && ParseHexColor(value, cv))
-      cfg.lightGraphAxis = cv;
-    else if (key == "graph.dark.axis" && ParseHexColor(value, cv))
-      cfg.darkGraphAxis = cv;
-    else if (key == "graph.light.major" && ParseHexColor(value, cv))
-      cfg.lightGraphMajor = cv;
-    else if (key == "graph.dark.major" && ParseHexColor(value, cv))
-      cfg.darkGraphMajor = cv;
-    else if (key == "graph.light.minor" && ParseHexColor(value, cv))
-      cfg.lightGraphMinor = cv;
-    else if (key == "graph.dark.minor" && ParseHexColor(value, cv))
-      cfg.darkGraphMinor = cv;
-    else if (key == "graph.light.label" && ParseHexColor(value, cv))
-      cfg.lightGraphLabel = cv;
-    else if (key == "graph.dark.label" && ParseHexColor(value, cv))
-      cfg.darkGraphLabel = cv;
-    else if (key == "status.light.bg" && ParseHexColor(value, cv))
-      cfg.lightStatusBg = cv;
-    else if (key == "status.dark.bg" && ParseHexColor(value, cv))
-      cfg.darkStatusBg = cv;
-    else if (key == "status.light.label" && ParseHexColor(value, cv))
-      cfg.lightStatusLabel = cv;
-    else if (key == "status.dark.label" && ParseHexColor(value, cv))
-      cfg.darkStatusLabel = cv;
-    else if (key == "status.light.value" && ParseHexColor(value, cv))
-      cfg.lightStatusValue = cv;
-    else if (key == "status.dark.value" && ParseHexColor(value, cv))
-      cfg.darkStatusValue = cv;
-    else if (key == "mode_color.selection" && ParseHexColor(value, cv))
-      cfg.modeSelection = cv;
-    else if (key == "mode_color.move" && ParseHexColor(value, cv))
-      cfg.modeMove = cv;
-    else if (key == "mode_color.line" && ParseHexColor(value, cv))
-      cfg.modeLine = cv;
-    else if (key == "mode_color.circle" && ParseHexColor(value, cv))
-      cfg.modeCircle = cv;
-    else if (key == "mode_color.rect" && ParseHexColor(value, cv))
-      cfg.modeRect = cv;
-    else if (key == "mode_color.triangle" && ParseHexColor(value, cv))
-      cfg.modeTriangle = cv;
-    else if (key == "mode_color.text" && ParseHexColor(value, cv))
-      cfg.modeTextColor = cv;
-    else if (key == "mode_color.eraser" && ParseHexColor(value, cv))
-      cfg.modeEraser = cv;
-    else if (key == "mode_color.pen" && ParseHexColor(value, cv))
-      cfg.modePen = cv;
-    else if (key.rfind("key.", 0) == 0)
-      cfg.keymap[key.substr(4)] = ParseBindingList(value);
+  double now = GetTime();
+  if (now - stream.rateStart >= 1.0) {
+    stream.rate = (float)(stream.rateSamples / (now - stream.rateStart));
+    stream.rateStart = now;
+    stream.rateSamples = 0;
+  }
+  if (stream.follow && stream.count > 0 && stream.total != before) {
+    Vector2 last = PlotToWorld(canvas, StreamSample(stream, stream.count - 1));
+    cam.target.x = last.x - (GetScreenWidth() * 0.9f - cam.offset.x) / cam.zoom;
   }
+  stream.followX = cam.target.x + canvas.originX;
+  stream.followY = cam.target.y + canvas.originY;
+}
 
-  cfg.maxStrokeWidth = max(cfg.minStrokeWidth, cfg.maxStrokeWidth);
-  cfg.defaultStrokeWidth =
-      min(cfg.maxStrokeWidth, max(cfg.minStrokeWidth, cfg.defaultStrokeWidth));
-  cfg.maxTextSize = max(cfg.minTextSize, cfg.maxTextSize);
-  cfg.defaultTextSize =
-      min(cfg.maxTextSize, max(cfg.minTextSize, cfg.defaultTextSize));
-  if (cfg.defaultGraphLabelMaxPx < cfg.defaultGraphLabelMinPx)
-    cfg.defaultGraphLabelMaxPx = cfg.defaultGraphLabelMinPx;
-  if (cfg.defaultSaveDir.empty())
-    cfg.defaultSaveDir = DefaultDownloadsDir();
-  if (cfg.defaultExportDir.empty())
-    cfg.defaultExportDir = cfg.defaultSaveDir;
-  if (cfg.defaultOpenDir.empty())
-    cfg.defaultOpenDir = cfg.defaultSaveDir;
+void DrawLiveStream(Canvas &canvas) {
+  LiveStream &stream = canvas.stream;
+  if (!stream.active || stream.count == 0)
+    return;
+  const Camera2D &cam = canvas.camera;
+  double unit = max(0.0001f, canvas.graphUnit);
+  double column = PlotPixelColumn(canvas);
+  Vector2 a = GetScreenToWorld2D({0.0f, 0.0f}, cam);
+  Vector2 b = GetScreenToWorld2D(
+      {(float)GetScreenWidth(), (float)GetScreenHeight()}, cam);
+  double x0 = (min(a.x, b.x) + canvas.originX) / unit - column;
+  double x1 = (max(a.x, b.x) + canvas.originX) / unit + column;
+  size_t first = 0;
+  size_t last = stream.count;
+  if (stream.unordered <= stream.total - (long long)stream.count) {
+    size_t lo = 0, hi = stream.count;
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      if (StreamSample(stream, mid).x < x0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    first = lo > 0 ? lo - 1 : 0;
+    hi = stream.count;
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      if (StreamSample(stream, mid).x <= x1)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    last = min(stream.count, lo + 1);
+  }
+  PlotDecimator dec;
+  dec.column = column;
+  stream.columns.clear();
+  for (size_t i = first; i < last; i++)
+    dec.Add(stream.columns, StreamSample(stream, i));
+  dec.Flush(stream.columns);
+  stream.scratch.clear();
+  for (const auto &p : stream.columns)
+    stream.scratch.push_back(PlotToWorld(canvas, p));
+  int n = (int)stream.scratch.size();
+  if (n == 1)
+    DrawCircleV(stream.scratch[0], stream.strokeWidth * 0.5f, stream.color);
+  else if (stream.strokeWidth * cam.zoom <= 1.5f)
+    DrawLineStrip(stream.scratch.data(), n, stream.color);
+  else
+    DrawSplineLinear(stream.scratch.data(), n, stream.strokeWidth,
+                     stream.color);
+}
+
+double EvalFn(const FnProgram &program, double x) {
+  double stack[kFnMaxStack];
+  int top = 0;
+  for (const auto &op : program.ops) {
+    switch (op.code) {
+    case FN_CONST:
+      stack[top++] = op.value;
+      break;
+    case FN_X:
+      stack[top++] = x;
+      break;
+    case FN_NEG:
+      stack[top - 1] = -stack[top - 1];
+      break;
+    case FN_CALL:
+      stack[top - 1] = op.call(stack[top - 1]);
+      break;
+    default: {
+      double b = stack[--top];
+      double &a = stack[top - 1];
+      if (op.code == FN_ADD)
+        a += b;
+      else if (op.code == FN_SUB)
+        a -= b;
+      else if (op.code == FN_MUL)
+        a *= b;
+      else if (op.code == FN_DIV)
+        a /= b;
+      else
+        a = pow(a, b);
+    }
+    }
+  }
+  return top == 1 ? stack[0] : NAN;
 }
 
-bool ParseHexColor(string hex, Color &outColor) {
-  if (!hex.empty() && hex[0] == '#')
-    hex.erase(hex.begin());
-  if (hex.size() != 6 && hex.size() != 8)
+struct FnCompiler {
+  const string &text;
+  size_t pos = 0;
+  int depth = 0;
+  int maxDepth = 0;
+  string error;
+  FnProgram out;
+
+  explicit FnCompiler(const string &source) : text(source) {}
+
+  void Emit(FnOpCode code, double value = 0.0, double (*call)(double) = nullptr) {
+    out.ops.push_back({code, value, call});
+    if (code == FN_CONST || code == FN_X)
+      maxDepth = max(maxDepth, ++depth);
+    else if (code != FN_NEG && code != FN_CALL)
+      depth--;
+  }
+  char Peek() {
+    while (pos < text.size() && isspace((unsigned char)text[pos]))
+      pos++;
+    return pos < text.size() ? text[pos] : '\0';
+  }
+  bool Fail(const string &message) {
+    if (error.empty())
+      error = message;
+    return false;
+  }
+  bool StartsPrimary() {
+    char c = Peek();
+    return isalnum((unsigned char)c) || c == '.' || c == '(';
+  }
+  bool Sum() {
+    if (!Product())
+      return false;
+    while (Peek() == '+' || Peek() == '-') {
+      char op = text[pos++];
+      if (!Product())
+        return false;
+      Emit(op == '+' ? FN_ADD : FN_SUB);
+    }
+    return true;
+  }
+  bool Product() {
+    if (!Unary())
+      return false;
+    while (true) {
+      char c = Peek();
+      if (c == '*' || c == '/') {
+        pos++;
+        if (!Unary())
+          return false;
+        Emit(c == '*' ? FN_MUL : FN_DIV);
+      } else if (StartsPrimary()) {
+        if (!Unary())
+          return false;
+        Emit(FN_MUL);
+      } else {
+        return true;
+      }
+    }
+  }
+  bool Unary() {
+    char c = Peek();
+    if (c == '-' || c == '+') {
+      pos++;
+      if (!Unary())
+        return false;
+      if (c == '-')
+        Emit(FN_NEG);
+      return true;
+    }
+    return Power();
+  }
+  bool Power() {
+    if (!Primary())
+      return false;
+    if (Peek() == '^') {
+      pos++;
+      if (!Unary())
+        return false;
+      Emit(FN_POW);
+    }
+    return true;
+  }
+  bool Primary() {
+    static const unordered_map<string, double (*)(double)> functions = {
+        {"sin", [](double v) { return sin(v); }},
+        {"cos", [](double v) { return cos(v); }},
+        {"tan", [](double v) { return tan(v); }},
+        {"asin", [](double v) { return asin(v); }},
+        {"acos", [](double v) { return acos(v); }},
+        {"atan", [](double v) { return atan(v); }},
+        {"sinh", [](double v) { return sinh(v); }},
+        {"cosh", [](double v) { return cosh(v); }},
+        {"tanh", [](double v) { return tanh(v); }},
+        {"sqrt", [](double v) { return sqrt(v); }},
+        {"abs", [](double v) { return fabs(v); }},
+        {"exp", [](double v) { return exp(v); }},
+        {"ln", [](double v) { return log(v); }},
+        {"log", [](double v) { return log10(v); }},
+        {"log2", [](double v) { return log2(v); }},
+        {"floor", [](double v) { return floor(v); }},
+        {"ceil", [](double v) { return ceil(v); }},
+        {"round", [](double v) { return round(v); }},
+        {"sign", [](double v) { return (double)((v > 0.0) - (v < 0.0)); }},
+    };
+    char c = Peek();
+    if (isdigit((unsigned char)c) || c == '.') {
+      double value = 0.0;
+      auto result = from_chars(text.data() + pos, text.data() + text.size(),
+                               value, chars_format::fixed);
+      if (result.ec != errc())
+        return Fail("bad number");
+      pos = result.ptr - text.data();
+      Emit(FN_CONST, value);
+      return true;
+    }
+    if (c == '(' || c == '|') {
+      pos++;
+      if (!Sum())
+        return false;
+      if (Peek() != (c == '(' ? ')' : '|'))
+        return Fail(c == '(' ? "missing )" : "missing |");
+      pos++;
+      if (c == '|')
+        Emit(FN_CALL, 0.0, functions.at("abs"));
+      return true;
+    }
+    if (!isalpha((unsigned char)c))
+      return Fail(c ? string("unexpected ") + c : "unexpected end");
+    // Names run over digits ("log2"), so "xsin(x)" needs a space.
+    size_t start = pos;
+    while (pos < text.size() && isalnum((unsigned char)text[pos]))
+      pos++;
+    string name = ToLower(text.substr(start, pos - start));
+    if (name == "x") {
+      Emit(FN_X);
+      return true;
+    }
+    if (name == "pi" || name == "e") {
+      Emit(FN_CONST, name == "pi" ? PI : exp(1.0));
+      return true;
+    }
+    auto it = functions.find(name);
+    if (it == functions.end())
+      return Fail("unknown name " + name);
+    if (Peek() != '(')
+      return Fail(name + " needs (");
+    pos++;
+    if (!Sum())
+      return false;
+    if (Peek() != ')')
+      return Fail("missing )");
+    pos++;
+    Emit(FN_CALL, 0.0, it->second);
+    return true;
+  }
+};
+
+bool CompileFn(string source, FnProgram &program, string &error) {
+  source = Trim(source);
+  if (source.size() > 1 && tolower((unsigned char)source[0]) == 'y') {
+    size_t eq = source.find_first_not_of(" \t", 1);
+    if (eq != string::npos && source[eq] == '=')
+      source = source.substr(eq + 1);
+  }
+  FnCompiler compiler(source);
+  bool ok = compiler.Sum();
+  if (ok && compiler.Peek() != '\0')
+    ok = compiler.Fail(string("unexpected ") + compiler.text[compiler.pos]);
+  if (ok && compiler.out.ops.empty())
+    ok = compiler.Fail("empty expression");
+  if (ok && compiler.maxDepth > kFnMaxStack)
+    ok = compiler.Fail("expression too deep");
+  if (!ok) {
+    error = compiler.error;
     return false;
-  for (char c : hex) {
-    if (!isxdigit((unsigned char)c))
-      return false;
   }
-  auto byteFromHex = [](const string &s) -> unsigned char {
-    return (unsigned char)strtol(s.c_str(), nullptr, 16);
-  };
-  outColor.r = byteFromHex(hex.substr(0, 2));
-  outColor.g = byteFromHex(hex.substr(2, 2));
-  outColor.b = byteFromHex(hex.substr(4, 2));
-  outColor.a = (hex.size() == 8) ? byteFromHex(hex.substr(6, 2)) : 255;
+  program = move(compiler.out);
   return true;
 }
 
-bool ParseNamedColor(string name, Color &outColor) {
-  name = ToLower(Trim(name));
-  static const unordered_map<string, Color> colors = {
-      {"lightgray", LIGHTGRAY}, {"gray", GRAY},       {"darkgray", DARKGRAY},
-      {"yellow", YELLOW},       {"gold", GOLD},       {"orange", ORANGE},
-      {"pink", PINK},           {"red", RED},         {"maroon", MAROON},
-      {"green", GREEN},         {"lime", LIME},       {"darkgreen", DARKGREEN},
-      {"skyblue", SKYBLUE},     {"blue", BLUE},       {"darkblue", DARKBLUE},
-      {"purple", PURPLE},       {"violet", VIOLET},   {"darkpurple", DARKPURPLE},
-      {"beige", BEIGE},         {"brown", BROWN},     {"darkbrown", DARKBROWN},
-      {"white", WHITE},         {"black", BLACK},     {"blank", BLANK},
-      {"magenta", MAGENTA},     {"raywhite", RAYWHITE},
-  };
-  auto it = colors.find(name);
-  if (it == colors.end())
-    return false;
-  outColor = it->second;
-  return true;
+void RefineFn(const FnProgram &program, double x0, double y0, double x1,
+              double y1, double scale, double breakPx, int depth,
+              vector<PlotPoint> &out) {
+  const int maxDepth = 8;
+  double xm = (x0 + x1) * 0.5;
+  double ym = EvalFn(program, xm);
+  bool finite = isfinite(y0) && isfinite(ym) && isfinite(y1);
+  bool bent = finite ? fabs(ym - (y0 + y1) * 0.5) * scale > 0.25
+                     : isfinite(y0) || isfinite(ym) || isfinite(y1);
+  if (depth < maxDepth && bent) {
+    RefineFn(program, x0, y0, xm, ym, scale, breakPx, depth + 1, out);
+    RefineFn(program, xm, ym, x1, y1, scale, breakPx, depth + 1, out);
+    return;
+  }
+  if (finite && fabs(y1 - y0) * scale > breakPx &&
+      (ym - y0) * (y1 - ym) < 0.0)
+    out.push_back({xm, NAN});
+  out.push_back({x1, isfinite(y1) ? y1 : NAN});
 }
 
-string ColorToHex(Color c) {
-  return TextFormat("#%02X%02X%02X%02X", c.r, c.g, c.b, c.a);
+void SampleFnCells(FunctionPlot &plot, long long from, long long to,
+                   double breakPx) {
+  plot.strip.clear();
+  double x = from * plot.step;
+  double y = EvalFn(plot.program, x);
+  plot.strip.push_back({x, isfinite(y) ? y : NAN});
+  for (long long k = from; k < to; k++) {
+    double nx = (k + 1) * plot.step;
+    double ny = EvalFn(plot.program, nx);
+    RefineFn(plot.program, x, y, nx, ny, plot.scale, breakPx, 0, plot.strip);
+    x = nx;
+    y = ny;
+  }
 }
 
-void SetStatus(Canvas &canvas, const AppConfig &cfg, const string &message,
-               double seconds = -1.0) {
-  canvas.statusMessage = message;
-  if (seconds <= 0.0)
-    seconds = cfg.statusDurationSeconds;
-  canvas.statusUntil = GetTime() + seconds;
+void TickFunctionPlots(Canvas &canvas) {
+  if (canvas.functionPlots.size() != canvas.functions.size())
+    canvas.functionPlots.resize(canvas.functions.size());
+  if (canvas.functions.empty())
+    return;
+  double unit = max(0.0001f, canvas.graphUnit);
+  double scale = unit * max(0.0001f, canvas.camera.zoom);
+  Vector2 a = GetScreenToWorld2D({0.0f, 0.0f}, canvas.camera);
+  Vector2 b = GetScreenToWorld2D(
+      {(float)GetScreenWidth(), (float)GetScreenHeight()}, canvas.camera);
+  double left = (min(a.x, b.x) + canvas.originX) / unit;
+  double right = (max(a.x, b.x) + canvas.originX) / unit;
+  double margin = (right - left) * 0.5;
+  double breakPx = GetScreenHeight();
+  for (size_t i = 0; i < canvas.functions.size(); i++) {
+    FunctionPlot &plot = canvas.functionPlots[i];
+    if (plot.expr != canvas.functions[i].expr || plot.expr.empty()) {
+      string error;
+      plot = FunctionPlot();
+      plot.expr = canvas.functions[i].expr;
+      plot.valid = CompileFn(plot.expr, plot.program, error);
+    }
+    if (!plot.valid)
+      continue;
+    double ratio = scale / max(1e-12, plot.scale);
+    bool rebuild = plot.samples.empty() || ratio > 1.25 || ratio < 0.5;
+    if (rebuild) {
+      plot.scale = scale;
+      plot.step = 8.0 / scale;
+    }
+    long long want0 = (long long)floor((left - margin) / plot.step);
+    long long want1 = (long long)ceil((right + margin) / plot.step);
+    if (rebuild || want1 < plot.first || want0 > plot.last) {
+      SampleFnCells(plot, want0, want1, breakPx);
+      plot.samples.assign(plot.strip.begin(), plot.strip.end());
+      plot.first = want0;
+      plot.last = want1;
+      continue;
+    }
+    if (want0 < plot.first) {
+      SampleFnCells(plot, want0, plot.first, breakPx);
+      plot.strip.pop_back(); // shared with the cache's first sample
+      plot.samples.insert(plot.samples.begin(), plot.strip.begin(),
+                          plot.strip.end());
+      plot.first = want0;
+    }
+    if (want1 > plot.last) {
+      SampleFnCells(plot, plot.last, want1, breakPx);
+      plot.samples.insert(plot.samples.end(), plot.strip.begin() + 1,
+                          plot.strip.end());
+      plot.last = want1;
+    }
+    long long keep = (long long)ceil((right - left) / plot.step);
+    if (plot.first < want0 - keep) {
+      long long cut = want0 - keep / 2;
+      double cx = cut * plot.step;
+      while (!plot.samples.empty() && plot.samples.front().x < cx)
+        plot.samples.pop_front();
+      plot.first = cut;
+    }
+    if (plot.last > want1 + keep) {
+      long long cut = want1 + keep / 2;
+      double cx = cut * plot.step;
+      while (!plot.samples.empty() && plot.samples.back().x > cx)
+        plot.samples.pop_back();
+      plot.last = cut;
+    }
+  }
 }
 
-void SetTheme(Canvas &canvas, const AppConfig &cfg, bool dark) {
-  canvas.darkTheme = dark;
-  if (dark) {
-    canvas.backgroundColor = cfg.darkBackground;
-    canvas.uiTextColor = cfg.darkUiText;
-    canvas.textureColorA = cfg.darkTextureA;
-    canvas.textureColorB = cfg.darkTextureB;
-    canvas.gridColor = cfg.darkGridColor;
-    canvas.graphAxisColor = cfg.darkGraphAxis;
-    canvas.graphMajorColor = cfg.darkGraphMajor;
-    canvas.graphMinorColor = cfg.darkGraphMinor;
-    canvas.graphLabelColor = cfg.darkGraphLabel;
-    canvas.statusBarBg = cfg.darkStatusBg;
-    canvas.statusBarBg.a = 255;
-    canvas.statusLabelColor = cfg.darkStatusLabel;
-    canvas.statusValueColor = cfg.darkStatusValue;
-    canvas.drawColor = RAYWHITE;
-  } else {
-    canvas.backgroundColor = cfg.lightBackground;
-    canvas.uiTextColor = cfg.lightUiText;
-    canvas.textureColorA = cfg.lightTextureA;
-    canvas.textureColorB = cfg.lightTextureB;
-    canvas.gridColor = cfg.lightGridColor;
-    canvas.graphAxisColor = cfg.lightGraphAxis;
-    canvas.graphMajorColor = cfg.lightGraphMajor;
-    canvas.graphMinorColor = cfg.lightGraphMinor;
-    canvas.graphLabelColor = cfg.lightGraphLabel;
-    canvas.statusBarBg = cfg.lightStatusBg;
-    canvas.statusBarBg.a = 255;
-    canvas.statusLabelColor = cfg.lightStatusLabel;
-    canvas.statusValueColor = cfg.lightStatusValue;
-    canvas.drawColor = BLACK;
+void DrawFunctionPlots(Canvas &canvas) {
+  if (canvas.functions.empty())
+    return;
+  const Camera2D &cam = canvas.camera;
+  Vector2 a = GetScreenToWorld2D({0.0f, 0.0f}, cam);
+  Vector2 b = GetScreenToWorld2D(
+      {(float)GetScreenWidth(), (float)GetScreenHeight()}, cam);
+  double unit = max(0.0001f, canvas.graphUnit);
+  double left = (min(a.x, b.x) + canvas.originX) / unit;
+  double right = (max(a.x, b.x) + canvas.originX) / unit;
+  float span = fabsf(b.y - a.y);
+  float top = min(a.y, b.y) - span;
+  float bottom = max(a.y, b.y) + span;
+  vector<Vector2> &run = canvas.stream.scratch; // shared draw scratch
+  for (size_t i = 0; i < canvas.functions.size() &&
+                     i < canvas.functionPlots.size();
+       i++) {
+    const GraphFunction &fn = canvas.functions[i];
+    const FunctionPlot &plot = canvas.functionPlots[i];
+    if (!plot.valid || plot.samples.empty())
+      continue;
+    auto begin = lower_bound(plot.samples.begin(), plot.samples.end(), left,
+                             [](const PlotPoint &p, double x) { return p.x < x; });
+    if (begin != plot.samples.begin())
+      --begin;
+    auto flush = [&]() {
+      if (run.size() > 1) {
+        if (fn.strokeWidth * cam.zoom <= 1.5f)
+          DrawLineStrip(run.data(), (int)run.size(), fn.color);
+        else
+          DrawSplineLinear(run.data(), (int)run.size(), fn.strokeWidth,
+                           fn.color);
+      }
+      run.clear();
+    };
+    run.clear();
+    for (auto it = begin; it != plot.samples.end(); ++it) {
+      if (isnan(it->y)) {
+        flush();
+      } else {
+        Vector2 p = PlotToWorld(canvas, *it);
+        p.y = Clamp(p.y, top, bottom);
+        run.push_back(p);
+      }
+      if (it->x > right)
+        break;
+    }
+    flush();
   }
 }
 
-void DrawBackgroundPattern(const Canvas &canvas) {
-  float left = canvas.camera.target.x - canvas.camera.offset.x / canvas.camera.zoom;
-  float top = canvas.camera.target.y - canvas.camera.offset.y / canvas.camera.zoom;
-  float right =
-      canvas.camera.target.x + (float)GetScreenWidth() / canvas.camera.zoom;
-  float bottom =
-      canvas.camera.target.y + (float)GetScreenHeight() / canvas.camera.zoom;
+const size_t kCloudLeaf = 16;
+const size_t kCloudMarkerLimit = 20000;
+const int kCloudBinMargin = 64;
 
-  if (canvas.bgType == BG_BLANK)
-    return;
+struct CloudCollector {
+  vector<PlotPoint> points;
+  void Push(PlotPoint p) { points.push_back(p); }
+  void Break() {}
+  void Finish() {}
+};
 
-  float spacing = max(6.0f, canvas.gridWidth);
+void BuildCloudTree(vector<CloudPoint> &tree, size_t lo, size_t hi, int axis) {
+  while (hi - lo > kCloudLeaf) {
+    size_t mid = lo + (hi - lo) / 2;
+    nth_element(tree.begin() + lo, tree.begin() + mid, tree.begin() + hi,
+                [axis](const CloudPoint &a, const CloudPoint &b) {
+                  return axis == 0 ? a.p.x < b.p.x : a.p.y < b.p.y;
+                });
+    BuildCloudTree(tree, lo, mid, axis ^ 1);
+    lo = mid + 1;
+    axis ^= 1;
+  }
+}
 
-  float startX = floorf(left / spacing) * spacing;
-  float startY = floorf(top / spacing) * spacing;
-  Color lineColor = canvas.gridColor;
+template <typename F>
+bool VisitCloudRange(const vector<CloudPoint> &tree, size_t lo, size_t hi,
+                     int axis, const Rectangle &r, F &visit) {
+  if (hi - lo <= kCloudLeaf) {
+    for (size_t i = lo; i < hi; i++) {
+      const Vector2 &p = tree[i].p;
+      if (p.x >= r.x && p.x <= r.x + r.width && p.y >= r.y &&
+          p.y <= r.y + r.height && !visit(tree[i]))
+        return false;
+    }
+    return true;
+  }
+  size_t mid = lo + (hi - lo) / 2;
+  const Vector2 &p = tree[mid].p;
+  float split = axis == 0 ? p.x : p.y;
+  float low = axis == 0 ? r.x : r.y;
+  float high = low + (axis == 0 ? r.width : r.height);
+  if (low <= split && !VisitCloudRange(tree, lo, mid, axis ^ 1, r, visit))
+    return false;
+  if (p.x >= r.x && p.x <= r.x + r.width && p.y >= r.y &&
+      p.y <= r.y + r.height && !visit(tree[mid]))
+    return false;
+  return high < split ||
+         VisitCloudRange(tree, mid + 1, hi, axis ^ 1, r, visit);
+}
 
-  if (canvas.bgType == BG_GRID) {
-    for (float x = startX; x <= right + spacing; x += spacing)
-      DrawLineV({x, top - spacing}, {x, bottom + spacing}, lineColor);
-    for (float y = startY; y <= bottom + spacing; y += spacing)
-      DrawLineV({left - spacing, y}, {right + spacing, y}, lineColor);
-  } else if (canvas.bgType == BG_DOTTED) {
-    for (float x = startX; x <= right + spacing; x += spacing) {
-      for (float y = startY; y <= bottom + spacing; y += spacing) {
-        DrawCircleV({x, y}, 1.4f, lineColor);
+void NearestCloudPoint(const vector<CloudPoint> &tree, size_t lo, size_t hi,
+                       int axis, Vector2 q, size_t &best, float &bestDist) {
+  if (hi - lo <= kCloudLeaf) {
+    for (size_t i = lo; i < hi; i++) {
+      float dx = tree[i].p.x - q.x;
+      float dy = tree[i].p.y - q.y;
+      float d = dx * dx + dy * dy;
+      if (d < bestDist) {
+        bestDist = d;
+        best = i;
       }
     }
-  } else if (canvas.bgType == BG_GRAPH) {
-    float unit = max(0.0001f, canvas.graphUnit);
-    float minorSpacing = max(0.0001f, canvas.graphMinorSpacing);
-    float majorUnitsRaw = ChooseGraphStepUnits(unit, canvas.camera.zoom,
-                                               canvas.graphLabelMinPx,
-                                               canvas.graphLabelMaxPx);
-    int majorUnits = max(1, (int)roundf(majorUnitsRaw));
-    float majorSpacing = max(minorSpacing, (float)majorUnits * unit);
+    return;
+  }
+  size_t mid = lo + (hi - lo) / 2;
+  float dx = tree[mid].p.x - q.x;
+  float dy = tree[mid].p.y - q.y;
+  if (dx * dx + dy * dy < bestDist) {
+    bestDist = dx * dx + dy * dy;
+    best = mid;
+  }
+  float diff = axis == 0 ? -dx : -dy;
+  if (diff < 0.0f) {
+    NearestCloudPoint(tree, lo, mid, axis ^ 1, q, best, bestDist);
+    if (diff * diff < bestDist)
+      NearestCloudPoint(tree, mid + 1, hi, axis ^ 1, q, best, bestDist);
+  } else {
+    NearestCloudPoint(tree, mid + 1, hi, axis ^ 1, q, best, bestDist);
+    if (diff * diff < bestDist)
+      NearestCloudPoint(tree, lo, mid, axis ^ 1, q, best, bestDist);
+  }
+}
 
-    float minorPx = minorSpacing * canvas.camera.zoom;
-    if (minorPx >= 4.0f) {
-      float minorStartX = floorf(left / minorSpacing) * minorSpacing;
-      float minorStartY = floorf(top / minorSpacing) * minorSpacing;
-      for (float x = minorStartX; x <= right + minorSpacing; x += minorSpacing)
-        DrawLineV({x, top - minorSpacing}, {x, bottom + minorSpacing},
-                  canvas.graphMinorColor);
-      for (float y = minorStartY; y <= bottom + minorSpacing; y += minorSpacing)
-        DrawLineV({left - minorSpacing, y}, {right + minorSpacing, y},
-                  canvas.graphMinorColor);
-    }
+PointCloudCache &CloudCacheFor(Canvas &canvas, const Element &el) {
+  PointCloudCache &cache = canvas.pointClouds[el.uniqueID];
+  size_t n = el.path.size();
+  Vector2 first = n ? el.path[0] : Vector2{0, 0};
+  Vector2 middle = n ? el.path[n / 2] : Vector2{0, 0};
+  Vector2 last = n ? el.path[n - 1] : Vector2{0, 0};
+  if (cache.count == n && cache.rotation == el.rotation &&
+      memcmp(&cache.first, &first, sizeof(Vector2)) == 0 &&
+      memcmp(&cache.middle, &middle, sizeof(Vector2)) == 0 &&
+      memcmp(&cache.last, &last, sizeof(Vector2)) == 0 && !cache.tree.empty())
+    return cache;
+  cache.count = n;
+  cache.first = first;
+  cache.middle = middle;
+  cache.last = last;
+  cache.rotation = el.rotation;
+  cache.tree.resize(n);
+  Vector2 center = el.rotation != 0.0f ? ElementCenterLocal(el) : first;
+  for (size_t i = 0; i < n; i++) {
+    Vector2 p = el.path[i];
+    if (el.rotation != 0.0f)
+      p = RotatePoint(p, center, el.rotation);
+    cache.tree[i] = {p, (int)i};
+  }
+  BuildCloudTree(cache.tree, 0, n, 0);
+  cache.binSize = 0.0f;
+  return cache;
+}
 
-    float majorStartX = floorf(left / majorSpacing) * majorSpacing;
-    float majorStartY = floorf(top / majorSpacing) * majorSpacing;
-    for (float x = majorStartX; x <= right + majorSpacing; x += majorSpacing)
-      DrawLineV({x, top - majorSpacing}, {x, bottom + majorSpacing},
-                canvas.graphMajorColor);
-    for (float y = majorStartY; y <= bottom + majorSpacing; y += majorSpacing)
-      DrawLineV({left - majorSpacing, y}, {right + majorSpacing, y},
-                canvas.graphMajorColor);
+void CountCloudCells(PointCloudCache &cache, int cx0, int cx1, int cy0,
+                     int cy1) {
+  if (cx0 >= cx1 || cy0 >= cy1)
+    return;
+  float size = cache.binSize;
+  Rectangle r = {cx0 * size, cy0 * size, (cx1 - cx0) * size,
+                 (cy1 - cy0) * size};
+  auto visit = [&](const CloudPoint &cp) {
+    int cx = (int)floorf(cp.p.x / size);
+    int cy = (int)floorf(cp.p.y / size);
+    if (cx >= cx0 && cx < cx1 && cy >= cy0 && cy < cy1)
+      cache.bins[(size_t)(cy - cache.binY) * cache.binW + (cx - cache.binX)]++;
+    return true;
+  };
+  VisitCloudRange(cache.tree, 0, cache.tree.size(), 0, r, visit);
+}
 
-    bool axisXVisible = (0.0f >= left && 0.0f <= right);
-    bool axisYVisible = (0.0f >= top && 0.0f <= bottom);
-    if (axisXVisible) {
-      DrawLineEx({0.0f, top - majorSpacing}, {0.0f, bottom + majorSpacing},
-                 2.0f, canvas.graphAxisColor);
-    }
-    if (axisYVisible) {
-      DrawLineEx({left - majorSpacing, 0.0f}, {right + majorSpacing, 0.0f},
-                 2.0f, canvas.graphAxisColor);
-    }
+void UpdateCloudBins(PointCloudCache &cache, const Camera2D &camera) {
+  Vector2 a = GetScreenToWorld2D({0.0f, 0.0f}, camera);
+  Vector2 b = GetScreenToWorld2D(
+      {(float)GetScreenWidth(), (float)GetScreenHeight()}, camera);
+  float size = exp2f(ceilf(log2f(1.0f / max(0.0001f, camera.zoom))));
+  int x0 = (int)floorf(min(a.x, b.x) / size);
+  int x1 = (int)ceilf(max(a.x, b.x) / size);
+  int y0 = (int)floorf(min(a.y, b.y) / size);
+  int y1 = (int)ceilf(max(a.y, b.y) / size);
+  if (cache.binSize == size && x0 >= cache.binX && y0 >= cache.binY &&
+      x1 <= cache.binX + cache.binW && y1 <= cache.binY + cache.binH)
+    return;
+  int nx = x0 - kCloudBinMargin;
+  int ny = y0 - kCloudBinMargin;
+  int nw = x1 - x0 + 2 * kCloudBinMargin;
+  int nh = y1 - y0 + 2 * kCloudBinMargin;
+  int ox0 = max(nx, cache.binX), ox1 = min(nx + nw, cache.binX + cache.binW);
+  int oy0 = max(ny, cache.binY), oy1 = min(ny + nh, cache.binY + cache.binH);
+  bool shift = cache.binSize == size && ox0 < ox1 && oy0 < oy1;
+  cache.spare.assign((size_t)nw * nh, 0);
+  if (shift) {
+    for (int y = oy0; y < oy1; y++)
+      memcpy(&cache.spare[(size_t)(y - ny) * nw + (ox0 - nx)],
+             &cache.bins[(size_t)(y - cache.binY) * cache.binW +
+                         (ox0 - cache.binX)],
+             (size_t)(ox1 - ox0) * sizeof(unsigned int));
+  }
+  swap(cache.bins, cache.spare);
+  cache.binSize = size;
+  cache.binX = nx;
+  cache.binY = ny;
+  cache.binW = nw;
+  cache.binH = nh;
+  if (shift) {
+    CountCloudCells(cache, nx, ox0, ny, ny + nh);
+    CountCloudCells(cache, ox1, nx + nw, ny, ny + nh);
+    CountCloudCells(cache, ox0, ox1, ny, oy0);
+    CountCloudCells(cache, ox0, ox1, oy1, ny + nh);
+  } else {
+    CountCloudCells(cache, nx, nx + nw, ny, ny + nh);
+  }
+  cache.dirty = true;
+}
 
-    float labelSize = max(6.0f, canvas.graphLabelSize);
-    float labelPad = 6.0f / max(0.0001f, canvas.camera.zoom);
-    float labelLineY =
-        axisYVisible ? 0.0f : (0.0f < top ? top + labelPad : bottom - labelPad);
+void UploadCloudBins(PointCloudCache &cache) {
+  if (!cache.dirty)
+    return;
+  cache.dirty = false;
+  unsigned int peak = 1;
+  for (unsigned int c : cache.bins)
+    peak = max(peak, c);
+  float norm = 1.0f / logf(1.0f + (float)peak);
+  auto alpha = [&](unsigned int c) {
+    return (unsigned char)(255.0f *
+                           (0.25f + 0.75f * logf(1.0f + (float)c) * norm));
+  };
+  unsigned char low[256];
+  low[0] = 0;
+  for (unsigned int c = 1; c < 256; c++)
+    low[c] = alpha(c);
+  cache.pixels.resize(cache.bins.size() * 2);
+  unsigned char *px = cache.pixels.data();
+  for (unsigned int c : cache.bins) {
+    *px++ = 255;
+    *px++ = c < 256 ? low[c] : alpha(c);
+  }
+  if (cache.texture.id == 0 || cache.texture.width != cache.binW ||
+      cache.texture.height != cache.binH) {
+    if (cache.texture.id != 0)
+      UnloadTexture(cache.texture);
+    Image img = {cache.pixels.data(), cache.binW, cache.binH, 1,
+                 PIXELFORMAT_UNCOMPRESSED_GRAY_ALPHA};
+    cache.texture = LoadTextureFromImage(img);
+  } else {
+    UpdateTexture(cache.texture, cache.pixels.data());
+  }
+}
 
-    float xLabelY = labelLineY + labelPad;
-    if (axisYVisible) {
-      float below = 0.0f + labelPad;
-      float above = 0.0f - labelPad - labelSize;
-      if (below + labelSize <= bottom)
-        xLabelY = below;
+void DrawPointCloud(Canvas &canvas, const Element &el) {
+  if (el.path.empty())
+    return;
+  if (el.uniqueID < 0) {
+    DrawElement(el, canvas.font, canvas.textSize);
+    return;
+  }
+  PointCloudCache &cache = CloudCacheFor(canvas, el);
+  const Camera2D &cam = canvas.camera;
+  Vector2 a = GetScreenToWorld2D({0.0f, 0.0f}, cam);
+  Vector2 b = GetScreenToWorld2D(
+      {(float)GetScreenWidth(), (float)GetScreenHeight()}, cam);
+  float size = max(el.strokeWidth, 1.0f / max(0.0001f, cam.zoom));
+  float r = size * 0.5f;
+  Rectangle view = {min(a.x, b.x) - r, min(a.y, b.y) - r,
+                    fabsf(b.x - a.x) + size, fabsf(b.y - a.y) + size};
+  cache.visible.clear();
+  auto collect = [&](const CloudPoint &cp) {
+    cache.visible.push_back(&cp - cache.tree.data());
+    return cache.visible.size() <= kCloudMarkerLimit;
+  };
+  if (VisitCloudRange(cache.tree, 0, cache.tree.size(), 0, view, collect)) {
+    bool round = size * cam.zoom >= 3.0f;
+    for (size_t i : cache.visible) {
+      Vector2 p = cache.tree[i].p;
+      if (round)
+        DrawCircleV(p, r, el.color);
       else
-        xLabelY = above;
-    } else {
-      xLabelY = (0.0f < top) ? (top + labelPad)
-                             : (bottom - labelPad - labelSize);
-    }
-    float minLabelY = top + labelPad;
-    float maxLabelY = bottom - labelPad - labelSize;
-    if (maxLabelY < minLabelY)
-      maxLabelY = minLabelY;
-    xLabelY = min(max(xLabelY, minLabelY), maxLabelY);
-
-    int startXi = (int)floorf(left / majorSpacing);
-    int endXi = (int)ceilf(right / majorSpacing);
-    for (int i = startXi; i <= endXi; ++i) {
-      float x = (float)i * majorSpacing;
-      int value = i * majorUnits;
-      if (value == 0)
-        continue;
-      string label = to_string(value);
-      Vector2 size = MeasureTextEx(canvas.font, label.c_str(), labelSize, 1.0f);
-      DrawTextEx(canvas.font, label.c_str(),
-                 {x - size.x * 0.5f, xLabelY}, labelSize, 1.0f,
-                 canvas.graphLabelColor);
-    }
-
-    int startYi = (int)floorf(top / majorSpacing);
-    int endYi = (int)ceilf(bottom / majorSpacing);
-    for (int i = startYi; i <= endYi; ++i) {
-      float y = (float)i * majorSpacing;
-      int value = -i * majorUnits;
-      if (value == 0)
-        continue;
-      string label = to_string(value);
-      Vector2 size = MeasureTextEx(canvas.font, label.c_str(), labelSize, 1.0f);
-      float yLabelX = 0.0f;
-      if (axisXVisible) {
-        yLabelX = 0.0f + labelPad;
-        if (yLabelX + size.x > right)
-          yLabelX = 0.0f - labelPad - size.x;
-      } else if (0.0f < left) {
-        yLabelX = left + labelPad;
-      } else {
-        yLabelX = right - labelPad - size.x;
-      }
-      float minLabelX = left + labelPad;
-      float maxLabelX = right - labelPad - size.x;
-      if (maxLabelX < minLabelX)
-        maxLabelX = minLabelX;
-      yLabelX = min(max(yLabelX, minLabelX), maxLabelX);
-      DrawTextEx(canvas.font, label.c_str(),
-                 {yLabelX, y - size.y * 0.5f}, labelSize, 1.0f,
-                 canvas.graphLabelColor);
+        DrawRectangleV({p.x - r, p.y - r}, {size, size}, el.color);
     }
-
-    Vector2 zeroSize = MeasureTextEx(canvas.font, "0", labelSize, 1.0f);
-    float zeroX = 0.0f - labelPad - zeroSize.x;
-    float zeroY = 0.0f + labelPad;
-    float minZeroX = left + labelPad;
-    float maxZeroX = right - labelPad - zeroSize.x;
-    float minZeroY = top + labelPad;
-    float maxZeroY = bottom - labelPad - labelSize;
-    if (maxZeroX < minZeroX)
-      maxZeroX = minZeroX;
-    if (maxZeroY < minZeroY)
-      maxZeroY = minZeroY;
-    zeroX = min(max(zeroX, minZeroX), maxZeroX);
-    zeroY = min(max(zeroY, minZeroY), maxZeroY);
-    DrawTextEx(canvas.font, "0", {zeroX, zeroY}, labelSize, 1.0f,
-               canvas.graphLabelColor);
+    return;
   }
+  UpdateCloudBins(cache, cam);
+  UploadCloudBins(cache);
+  float s = cache.binSize;
+  DrawTexturePro(cache.texture, {0, 0, (float)cache.binW, (float)cache.binH},
+                 {cache.binX * s, cache.binY * s, cache.binW * s,
+                  cache.binH * s},
+                 {0, 0}, 0.0f, el.color);
 }
 
-void SetMode(Canvas &canvas, const AppConfig &cfg, Mode mode) {
-  canvas.mode = mode;
-  canvas.isTypingNumber = false;
-  if (mode == SELECTION_MODE) {
-    canvas.modeText = "SELECTION";
-    canvas.modeColor = cfg.modeSelection;
-  } else if (mode == MOVE_MODE) {
-    canvas.modeText = "MOVE";
-    canvas.modeColor = cfg.modeMove;
-  } else if (mode == RESIZE_ROTATE_MODE) {
-    canvas.modeText = "RESIZE/ROTATE";
-    canvas.modeColor = cfg.modeSelection;
-  } else if (mode == LINE_MODE) {
-    canvas.modeText = "LINE";
-    canvas.modeColor = cfg.modeLine;
-  } else if (mode == DOTTEDLINE_MODE) {
-    canvas.modeText = "DOTTED LINE";
-    canvas.modeColor = cfg.modeLine;
-  } else if (mode == ARROWLINE_MODE) {
-    canvas.modeText = "ARROW LINE";
-    canvas.modeColor = cfg.modeLine;
-  } else if (mode == CIRCLE_MODE) {
-    canvas.modeText = "CIRCLE";
-    canvas.modeColor = cfg.modeCircle;
-  } else if (mode == DOTTEDCIRCLE_MODE) {
-    canvas.modeText = "DOTTED CIRCLE";
-    canvas.modeColor = cfg.modeCircle;
-  } else if (mode == RECTANGLE_MODE) {
-    canvas.modeText = "RECTANGLE";
-    canvas.modeColor = cfg.modeRect;
-  } else if (mode == DOTTEDRECT_MODE) {
-    canvas.modeText = "DOTTED RECT";
-    canvas.modeColor = cfg.modeRect;
-  } else if (mode == TRIANGLE_MODE) {
-    canvas.modeText = "TRIANGLE";
-    canvas.modeColor = cfg.modeTriangle;
-  } else if (mode == DOTTEDTRIANGLE_MODE) {
-    canvas.modeText = "DOTTED TRIANGLE";
-    canvas.modeColor = cfg.modeTriangle;
-  } else if (mode == TEXT_MODE) {
-    canvas.modeText = "TEXT";
-    canvas.modeColor = cfg.modeTextColor;
-  } else if (mode == ERASER_MODE) {
-    canvas.modeText = "ERASER";
-    canvas.modeColor = cfg.modeEraser;
-  } else if (mode == PEN_MODE) {
-    canvas.modeText = "PEN";
-    canvas.modeColor = cfg.modePen;
-  }
+int PickCloudPoint(Canvas &canvas, const Element &el, Vector2 p,
+                   float tolerance) {
+  if (el.path.empty() || el.uniqueID < 0)
+    return -1;
+  PointCloudCache &cache = CloudCacheFor(canvas, el);
+  float reach = el.strokeWidth * 0.5f + max(0.5f, tolerance);
+  float bestDist = reach * reach;
+  size_t best = cache.tree.size();
+  NearestCloudPoint(cache.tree, 0, cache.tree.size(), 0, p, best, bestDist);
+  return best == cache.tree.size() ? -1 : cache.tree[best].index;
 }
 
-void SerializeElement(ofstream &out, const Element &el) {
-  out << "ELEMENT " << (int)el.type << " " << el.uniqueID << " "
-      << el.strokeWidth << " " << (int)el.color.r << " " << (int)el.color.g
-      << " " << (int)el.color.b << " " << (int)el.color.a << " " << el.start.x
-      << " " << el.start.y << " " << el.end.x << " " << el.end.y << " "
-      << el.rotation << " " << el.textSize << "\n";
-  out << "TEXT " << el.text.size() << "\n" << el.text << "\n";
-  out << "PATH " << el.path.size() << "\n";
-  for (const auto &p : el.path)
-    out << p.x << " " << p.y << "\n";
-  out << "CHILDREN " << el.children.size() << "\n";
-  for (const auto &c : el.children)
-    SerializeElement(out, c);
-  out << "END\n";
+int LayerCount(const Canvas &canvas) {
+  return max(1, (int)canvas.layers.size());
 }
 
-bool SaveCanvasToFile(const Canvas &canvas, const string &path) {
-  ofstream out(path);
-  if (!out.is_open())
-    return false;
-  out << "TOGGLE_V1\n";
-  out << "TEXTSIZE " << canvas.textSize << "\n";
-  out << "STROKEWIDTH " << canvas.strokeWidth << "\n";
-  out << "DRAWCOLOR " << (int)canvas.drawColor.r << " " << (int)canvas.drawColor.g
-      << " " << (int)canvas.drawColor.b << " " << (int)canvas.drawColor.a << "\n";
-  out << "GRIDTYPE " << (int)canvas.bgType << "\n";
-  out << "GRIDWIDTH " << canvas.gridWidth << "\n";
-  out << "ELEMENT_COUNT " << canvas.elements.size() << "\n";
-  for (const auto &el : canvas.elements)
-    SerializeElement(out, el);
-  return true;
+int ElementLayer(const Canvas &canvas, const Element &el) {
+  return min(max(el.layer, 0), LayerCount(canvas) - 1);
 }
 
-bool DeserializeElement(istream &in, Element &el) {
-  string tag;
-  if (!(in >> tag) || tag != "ELEMENT")
+bool LayerVisible(const Canvas &canvas, int layer) {
+  return canvas.layers.empty() || canvas.layers[layer].visible;
+}
+
+bool ElementPickable(const Canvas &canvas, const Element &el) {
+  if (canvas.layers.empty())
+    return true;
+  const Layer &layer = canvas.layers[ElementLayer(canvas, el)];
+  return layer.visible && !layer.locked;
+}
+
+bool HitSceneElement(Canvas &canvas, const AppConfig &cfg, int index,
+                     Vector2 p, float tolerance) {
+  const Element &el = canvas.elements[index];
+  if (!ElementPickable(canvas, el))
     return false;
-  string line;
-  getline(in, line);
-  line = Trim(line);
-  stringstream ls(line);
-  int type = 0;
-  int r = 0, g = 0, b = 0, a = 255;
-  el.textSize = 24.0f;
-  el.rotation = 0.0f;
-  if (!(ls >> type >> el.uniqueID >> el.strokeWidth >> r >> g >> b >> a >>
-        el.start.x >> el.start.y >> el.end.x >> el.end.y))
+  if (el.type != POINTS_MODE)
+    return IsPointOnElement(el, p, tolerance);
+  int point = PickCloudPoint(canvas, el, p, tolerance);
+  if (point < 0)
     return false;
-  vector<float> tail;
-  float v = 0.0f;
-  while (ls >> v)
-    tail.push_back(v);
-  if (tail.size() == 1) {
-    el.textSize = tail[0];
-  } else if (tail.size() >= 2) {
-    el.rotation = tail[0];
-    el.textSize = tail[1];
+  double unit = max(0.0001f, canvas.graphUnit);
+  Vector2 q = el.path[point];
+  SetStatus(canvas, cfg,
+            TextFormat("Point %d of %d: %.6g, %.6g", point + 1,
+                       (int)el.path.size(), (q.x + canvas.originX) / unit,
+                       -(q.y + canvas.originY) / unit));
+  return true;
+}
+
+void TickPointClouds(Canvas &canvas) {
+  if (canvas.pointClouds.empty())
+    return;
+  unordered_set<int> live;
+  for (const auto &el : canvas.elements)
+    if (el.type == POINTS_MODE)
+      live.insert(el.uniqueID);
+  for (auto it = canvas.pointClouds.begin(); it != canvas.pointClouds.end();) {
+    if (live.count(it->first)) {
+      ++it;
+      continue;
+    }
+    if (it->second.texture.id != 0)
+      UnloadTexture(it->second.texture);
+    it = canvas.pointClouds.erase(it);
   }
-  el.type = (Mode)type;
-  el.color = {(unsigned char)r, (unsigned char)g, (unsigned char)b,
-              (unsigned char)a};
+}
 
-  size_t textLen = 0;
-  if (!(in >> tag >> textLen) || tag != "TEXT")
-    return false;
-  in.ignore(numeric_limits<streamsize>::max(), '\n');
-  string textLine;
-  getline(in, textLine);
-  el.text = textLine;
+unsigned long long MixLayerKey(unsigned long long h, unsigned long long v) {
+  h = (h ^ v) * 0x9E3779B97F4A7C15ull;
+  return h ^ (h >> 29);
+}
 
-  size_t pathCount = 0;
-  if (!(in >> tag >> pathCount) || tag != "PATH")
-    return false;
-  el.path.clear();
-  el.path.reserve(pathCount);
-  for (size_t i = 0; i < pathCount; i++) {
-    Vector2 p{};
-    if (!(in >> p.x >> p.y))
-      return false;
-    el.path.push_back(p);
+unsigned long long PackLayerKey(float a, float b) {
+  unsigned int x, y;
+  memcpy(&x, &a, sizeof(x));
+  memcpy(&y, &b, sizeof(y));
+  return ((unsigned long long)x << 32) | y;
+}
+
+unsigned long long LayerElementKey(unsigned long long h, const Element &el) {
+  unsigned int color;
+  memcpy(&color, &el.color, sizeof(color));
+  h = MixLayerKey(h, ((unsigned long long)el.type << 32) | color);
+  h = MixLayerKey(h, PackLayerKey(el.start.x, el.start.y));
+  h = MixLayerKey(h, PackLayerKey(el.end.x, el.end.y));
+  h = MixLayerKey(h, PackLayerKey(el.strokeWidth, el.rotation));
+  h = MixLayerKey(h, PackLayerKey(el.textSize, (float)el.path.size()));
+  if (!el.text.empty())
+    h = MixLayerKey(h, hash<string>()(el.text));
+  for (const Vector2 &p : el.path)
+    h = MixLayerKey(h, PackLayerKey(p.x, p.y));
+  h = MixLayerKey(h, el.children.size());
+  for (const auto &child : el.children)
+    h = LayerElementKey(h, child);
+  return h;
+}
+
+int LayerSkipIndex(const Canvas &canvas) {
+  return canvas.mode == TEXT_MODE && canvas.isTextEditing ? canvas.editingIndex
+                                                          : -1;
+}
+
+void DrawLayerElements(Canvas &canvas, int layer) {
+  int skip = LayerSkipIndex(canvas);
+  for (size_t i = 0; i < canvas.elements.size(); i++) {
+    const Element &el = canvas.elements[i];
+    if ((int)i == skip || ElementLayer(canvas, el) != layer)
+      continue;
+    if (el.type == POINTS_MODE)
+      DrawPointCloud(canvas, el);
+    else
+      DrawSceneElement(canvas, el, true);
   }
+}
 
-  size_t childCount = 0;
-  if (!(in >> tag >> childCount) || tag != "CHILDREN")
-    return false;
-  el.children.clear();
-  el.children.reserve(childCount);
-  for (size_t i = 0; i < childCount; i++) {
-    Element child;
-    if (!DeserializeElement(in, child))
-      return false;
-    el.children.push_back(child);
+void TickLayers(Canvas &canvas, const AppConfig &cfg) {
+  int count = LayerCount(canvas);
+  for (size_t i = count; i < canvas.layerCaches.size(); i++)
+    if (canvas.layerCaches[i].target.id != 0)
+      UnloadRenderTexture(canvas.layerCaches[i].target);
+  canvas.layerCaches.resize(count);
+
+  int scale = max(1, cfg.layerSupersample);
+  int width = max(1, GetScreenWidth()) * scale;
+  int height = max(1, GetScreenHeight()) * scale;
+  const Camera2D &cam = canvas.camera;
+  const Camera2D &last = canvas.layerCamera;
+  bool still = cam.target.x == last.target.x && cam.target.y == last.target.y &&
+               cam.offset.x == last.offset.x && cam.offset.y == last.offset.y &&
+               cam.zoom == last.zoom && cam.rotation == last.rotation;
+  canvas.layerCamera = cam;
+
+  bool anyCached = false;
+  for (int layer = 0; layer < count; layer++) {
+    LayerCache &cache = canvas.layerCaches[layer];
+    float opacity = canvas.layers.empty() ? 1.0f : canvas.layers[layer].opacity;
+    cache.direct = opacity >= 1.0f && (count == 1 || !still);
+    if (cache.direct && count == 1 && cache.target.id != 0) {
+      UnloadRenderTexture(cache.target);
+      cache.target = {};
+    }
+    if (cache.direct)
+      cache.key = 0;
+    else if (LayerVisible(canvas, layer))
+      anyCached = true;
+  }
+  if (!anyCached)
+    return;
+
+  Camera2D camera = cam;
+  camera.zoom *= scale;
+  camera.offset = {camera.offset.x * scale, camera.offset.y * scale};
+  int skip = LayerSkipIndex(canvas);
+  unsigned long long base = kFnvOffset;
+  base = MixLayerKey(base, PackLayerKey(cam.target.x, cam.target.y));
+  base = MixLayerKey(base, PackLayerKey(cam.offset.x, cam.offset.y));
+  base = MixLayerKey(base, PackLayerKey(cam.zoom, cam.rotation));
+  base = MixLayerKey(base, ((unsigned long long)width << 32) | height);
+  base = MixLayerKey(base, PackLayerKey(canvas.textSize, 0.0f));
+  base = MixLayerKey(base, canvas.nextSymbolVersion);
+  vector<unsigned long long> keys(count, base);
+  // Numbered within the layer, so edits elsewhere leave its key alone.
+  vector<unsigned long long> ordinals(count, 0);
+  for (size_t i = 0; i < canvas.elements.size(); i++) {
+    int layer = ElementLayer(canvas, canvas.elements[i]);
+    if (canvas.layerCaches[layer].direct || !LayerVisible(canvas, layer))
+      continue;
+    unsigned long long ordinal = ordinals[layer]++ << 1 | ((int)i == skip);
+    keys[layer] =
+        LayerElementKey(MixLayerKey(keys[layer], ordinal), canvas.elements[i]);
   }
 
-  if (!(in >> tag) || tag != "END")
-    return false;
-  el.originalIndex = -1;
-  return true;
+  for (int layer = 0; layer < count; layer++) {
+    LayerCache &cache = canvas.layerCaches[layer];
+    if (cache.direct || !LayerVisible(canvas, layer) ||
+        (cache.target.id != 0 && cache.key == keys[layer]))
+      continue;
+    if (cache.target.id == 0 || cache.target.texture.width != width ||
+        cache.target.texture.height != height) {
+      if (cache.target.id != 0)
+        UnloadRenderTexture(cache.target);
+      cache.target = LoadRenderTexture(width, height);
+      SetTextureFilter(cache.target.texture, TEXTURE_FILTER_BILINEAR);
+    }
+    BeginTextureMode(cache.target);
+    ClearBackground(BLANK);
+    // Premultiplied alpha, so translucent strokes match a direct draw.
+    rlSetBlendFactorsSeparate(RL_SRC_ALPHA, RL_ONE_MINUS_SRC_ALPHA, RL_ONE,
+                              RL_ONE_MINUS_SRC_ALPHA, RL_FUNC_ADD,
+                              RL_FUNC_ADD);
+    BeginBlendMode(BLEND_CUSTOM_SEPARATE);
+    BeginMode2D(camera);
+    DrawLayerElements(canvas, layer);
+    EndMode2D();
+    EndBlendMode();
+    EndTextureMode();
+    cache.key = keys[layer];
+  }
 }
 
-bool LoadCanvasFromFile(Canvas &canvas, const string &path) {
-  ifstream in(path);
-  if (!in.is_open())
-    return false;
+void DrawLayers(Canvas &canvas) {
+  for (int layer = 0; layer < (int)canvas.layerCaches.size(); layer++) {
+    const LayerCache &cache = canvas.layerCaches[layer];
+    if (!LayerVisible(canvas, layer))
+      continue;
+    if (cache.direct) {
+      BeginMode2D(canvas.camera);
+      DrawLayerElements(canvas, layer);
+      EndMode2D();
+      continue;
+    }
+    if (cache.target.id == 0)
+      continue;
+    float opacity = canvas.layers.empty() ? 1.0f : canvas.layers[layer].opacity;
+    unsigned char a = (unsigned char)roundf(Clamp(opacity, 0.0f, 1.0f) * 255);
+    const Texture2D &tex = cache.target.texture;
+    BeginBlendMode(BLEND_ALPHA_PREMULTIPLY);
+    // Render textures are stored bottom-up, hence the negative height.
+    DrawTexturePro(tex, {0, 0, (float)tex.width, -(float)tex.height},
+                   {0, 0, (float)GetScreenWidth(), (float)GetScreenHeight()},
+                   {0, 0}, 0.0f, {a, a, a, a});
+    EndBlendMode();
+  }
+}
 
-  string magic;
-  getline(in, magic);
-  if (Trim(magic) != "TOGGLE_V1")
-    return false;
+void FadeElementRecursive(Element &el, float opacity) {
+  el.color.a = (unsigned char)roundf(el.color.a * opacity);
+  for (auto &child : el.children)
+    FadeElementRecursive(child, opacity);
+}
 
-  string tag;
-  if (!(in >> tag) || tag != "TEXTSIZE")
-    return false;
-  in >> canvas.textSize;
+bool LayersAffectExport(const Canvas &canvas) {
+  for (const auto &layer : canvas.layers)
+    if (!layer.visible || layer.opacity < 1.0f)
+      return true;
+  return false;
+}
 
-  if (!(in >> tag) || tag != "STROKEWIDTH")
-    return false;
-  in >> canvas.strokeWidth;
+void ApplyExportLayers(const Canvas &canvas, vector<Element> &elements) {
+  if (!LayersAffectExport(canvas))
+    return;
+  size_t kept = 0;
+  for (size_t i = 0; i < elements.size(); i++) {
+    const Layer &layer = canvas.layers[ElementLayer(canvas, elements[i])];
+    if (!layer.visible)
+      continue;
+    if (layer.opacity < 1.0f)
+      FadeElementRecursive(elements[i], layer.opacity);
+    if (kept != i)
+      elements[kept] = move(elements[i]);
+    kept++;
+  }
+  elements.resize(kept);
+}
 
-  int r, g, b, a;
-  if (!(in >> tag) || tag != "DRAWCOLOR")
-    return false;
-  if (!(in >> r >> g >> b >> a))
-    return false;
-  canvas.drawColor = {(unsigned char)r, (unsigned char)g, (unsigned char)b,
-                      (unsigned char)a};
+bool NeedsTiledPng(const string &filename, int outWidth, int outHeight,
+                   int tileSize) {
+  return (outWidth > tileSize || outHeight > tileSize) &&
+         ToLower(filesystem::path(filename).extension().string()) == ".png";
+}
 
-  int bgType;
-  if (!(in >> tag) || tag != "GRIDTYPE")
-    return false;
-  if (!(in >> bgType))
-    return false;
-  canvas.bgType = (BackgroundType)bgType;
+bool ExportCanvasRaster(const Canvas &canvas, const string &filename,
+                        const vector<Element> &elements, const Camera2D &camera,
+                        int outWidth, int outHeight, int tileSize,
+                        int pngLevel) {
+  if (NeedsTiledPng(filename, outWidth, outHeight, tileSize)) {
+    int band = min(tileSize, kExportBandRows);
+    RenderTexture2D target = LoadRenderTexture(tileSize, band);
+    if (target.id == 0)
+      return false;
+    vector<Rectangle> pixelBounds = ExportPixelBounds(elements, camera);
+    vector<unsigned char> strip;
+    PngStream png;
+    bool ok = BeginPngStream(png, filename, outWidth, outHeight, pngLevel);
+    for (int y0 = 0; ok && y0 < outHeight; y0 += band) {
+      int rows = min(band, outHeight - y0);
+      strip.resize((size_t)outWidth * 4 * rows);
+      RenderExportStrip(canvas, elements, pixelBounds, camera, outWidth, y0,
+                        rows, target, strip.data());
+      ok = WritePngRows(png, strip.data(), rows);
+    }
+    UnloadRenderTexture(target);
+    ok = EndPngStream(png) && ok;
+    return ok;
+  }
+  ExportJob job = MakeExportJob(canvas, filename, camera, outWidth, outHeight);
+  job.pngLevel = pngLevel;
+  job.image = RenderExportImage(canvas, elements, camera, outWidth, outHeight,
+                                tileSize);
+  return WriteExportJob(job);
+}
 
-  if (!(in >> tag) || tag != "GRIDWIDTH")
-    return false;
-  in >> canvas.gridWidth;
+struct SoftPart {
+  enum Kind { BUTT, ROUND, ARC } kind = BUTT;
+  Vector2 a = {0.0f, 0.0f};
+  Vector2 b = {0.0f, 0.0f};
+  float halfWidth = 0.5f;
+  float radius = 0.0f;
+  float angle0 = 0.0f;
+  float angle1 = 2.0f * PI;
+  Rectangle bounds = {};
+};
 
-  size_t count = 0;
-  if (!(in >> tag) || tag != "ELEMENT_COUNT")
+struct SoftShape {
+  vector<SoftPart> parts;
+  Color color = BLACK;
+  float alpha = 1.0f;
+  Rectangle bounds = {};
+  bool glyph = false;
+  float inverse[6] = {0};
+  Rectangle source = {};
+};
+
+struct SoftwareFont {
+  Font font = {};
+  Image atlas = {};
+};
+
+bool LoadSoftwareFont(SoftwareFont &out, const string &path, int atlasSize) {
+  int size = 0;
+  unsigned char *data = LoadFileData(path.c_str(), &size);
+  if (!data)
     return false;
-  if (!(in >> count))
+  Font font = {};
+  font.baseSize = max(16, atlasSize);
+  font.glyphCount = 95;
+  font.glyphPadding = 4;
+  font.glyphs =
+      LoadFontData(data, size, font.baseSize, nullptr, 0, FONT_DEFAULT);
+  UnloadFileData(data);
+  if (!font.glyphs)
     return false;
+  Image atlas = GenImageFontAtlas(font.glyphs, &font.recs, font.glyphCount,
+                                  font.baseSize, font.glyphPadding, 0);
+  ImageFormat(&atlas, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+  out.font = font;
+  out.atlas = atlas;
+  return atlas.data != nullptr;
+}
 
-  vector<Element> loaded;
-  loaded.reserve(count);
-  for (size_t i = 0; i < count; i++) {
-    Element el;
-    if (!DeserializeElement(in, el))
-      return false;
-    loaded.push_back(el);
+void UnloadSoftwareFont(SoftwareFont &soft) {
+  if (soft.font.glyphs)
+    UnloadFontData(soft.font.glyphs, soft.font.glyphCount);
+  if (soft.font.recs)
+    MemFree(soft.font.recs);
+  UnloadImage(soft.atlas);
+  soft = {};
+}
+
+Rectangle SoftPartBounds(const SoftPart &part) {
+  float pad = part.halfWidth + 1.0f;
+  if (part.kind == SoftPart::ARC) {
+    float r = part.radius + pad;
+    return {part.a.x - r, part.a.y - r, r * 2.0f, r * 2.0f};
   }
+  return {min(part.a.x, part.b.x) - pad, min(part.a.y, part.b.y) - pad,
+          fabsf(part.a.x - part.b.x) + pad * 2.0f,
+          fabsf(part.a.y - part.b.y) + pad * 2.0f};
+}
 
-  canvas.elements = loaded;
-  canvas.selectedIndices.clear();
-  canvas.undoStack.clear();
-  canvas.redoStack.clear();
-  canvas.isTextEditing = false;
-  canvas.commandMode = false;
-  return true;
+Rectangle UnionRect(const Rectangle &a, const Rectangle &b) {
+  float x0 = min(a.x, b.x);
+  float y0 = min(a.y, b.y);
+  float x1 = max(a.x + a.width, b.x + b.width);
+  float y1 = max(a.y + a.height, b.y + b.height);
+  return {x0, y0, x1 - x0, y1 - y0};
 }
 
-string SvgEscape(const string &text) {
-  string out;
-  out.reserve(text.size());
-  for (char c : text) {
-    if (c == '&')
-      out += "&amp;";
-    else if (c == '<')
-      out += "&lt;";
-    else if (c == '>')
-      out += "&gt;";
-    else if (c == '"')
-      out += "&quot;";
-    else if (c == '\'')
-      out += "&apos;";
-    else
-      out.push_back(c);
+SoftShape MakeSoftShape(Color color, float pixelWidth) {
+  SoftShape shape;
+  shape.color = color;
+  if (pixelWidth < 1.0f)
+    shape.alpha = max(0.0f, pixelWidth);
+  return shape;
+}
+
+void AddSoftSegment(SoftShape &shape, Vector2 a, Vector2 b, float width,
+                    SoftPart::Kind kind, const Camera2D &camera) {
+  SoftPart part;
+  part.kind = kind;
+  part.a = GetWorldToScreen2D(a, camera);
+  part.b = GetWorldToScreen2D(b, camera);
+  part.halfWidth = max(0.5f, width * camera.zoom * 0.5f);
+  part.bounds = SoftPartBounds(part);
+  shape.parts.push_back(part);
+}
+
+void AddSoftArc(SoftShape &shape, Vector2 center, float radius, float width,
+                float angle0, float angle1, const Camera2D &camera) {
+  SoftPart part;
+  part.kind = SoftPart::ARC;
+  part.a = GetWorldToScreen2D(center, camera);
+  part.radius = radius * camera.zoom;
+  part.halfWidth = max(0.5f, width * camera.zoom * 0.5f);
+  part.angle0 = angle0;
+  part.angle1 = angle1;
+  part.bounds = SoftPartBounds(part);
+  shape.parts.push_back(part);
+}
+
+void AddSoftDashes(SoftShape &shape, Vector2 start, Vector2 end, float width,
+                   const Camera2D &camera) {
+  float totalLen = Vector2Distance(start, end);
+  if (totalLen < 1.0f)
+    return;
+  Vector2 dir = Vector2Normalize(Vector2Subtract(end, start));
+  float dashLen = max(width * 2.0f, 6.0f);
+  float gapLen = max(width * 1.2f, 4.0f);
+  for (float i = 0.0f; i < totalLen; i += (dashLen + gapLen)) {
+    float endDist = min(i + dashLen, totalLen);
+    AddSoftSegment(shape, Vector2Add(start, Vector2Scale(dir, i)),
+                   Vector2Add(start, Vector2Scale(dir, endDist)), width,
+                   SoftPart::BUTT, camera);
+  }
+}
+
+void PushSoftShape(vector<SoftShape> &shapes, SoftShape &shape) {
+  if (shape.parts.empty())
+    return;
+  shape.bounds = shape.parts[0].bounds;
+  for (const auto &part : shape.parts)
+    shape.bounds = UnionRect(shape.bounds, part.bounds);
+  shapes.push_back(std::move(shape));
+}
+
+void AppendSoftText(vector<SoftShape> &shapes, const Element &el,
+                    const SoftwareFont &soft, float textSize,
+                    const Camera2D &camera) {
+  const Font &font = soft.font;
+  if (!soft.atlas.data || !font.glyphs || font.baseSize <= 0)
+    return;
+  float size = (el.textSize > 0.0f) ? el.textSize : textSize;
+  float k = size / (float)font.baseSize;
+  float pad = (float)font.glyphPadding;
+  Vector2 center = ElementCenterLocal(el);
+  float c = cosf(el.rotation);
+  float s = sinf(el.rotation);
+  auto toPixel = [&](Vector2 q) {
+    Vector2 l = {q.x - (center.x - el.start.x), q.y - (center.y - el.start.y)};
+    return GetWorldToScreen2D(
+        {center.x + l.x * c - l.y * s, center.y + l.x * s + l.y * c}, camera);
+  };
+  float penX = 0.0f;
+  float penY = 0.0f;
+  const char *text = el.text.c_str();
+  for (size_t i = 0; text[i];) {
+    int bytes = 0;
+    int codepoint = GetCodepointNext(text + i, &bytes);
+    i += max(1, bytes);
+    if (codepoint == '\n') {
+      penX = 0.0f;
+      penY += size + 2.0f;
+      continue;
+    }
+    int index = GetGlyphIndex(font, codepoint);
+    const GlyphInfo &info = font.glyphs[index];
+    Rectangle rec = font.recs[index];
+    if (codepoint != ' ' && codepoint != '\t') {
+      Rectangle src = {rec.x - pad, rec.y - pad, rec.width + 2.0f * pad,
+                       rec.height + 2.0f * pad};
+      Vector2 dst = {penX + info.offsetX * k - pad * k,
+                     penY + info.offsetY * k - pad * k};
+      Vector2 base = {dst.x - src.x * k, dst.y - src.y * k};
+      Vector2 o = toPixel(base);
+      Vector2 ex = Vector2Subtract(toPixel({base.x + k, base.y}), o);
+      Vector2 ey = Vector2Subtract(toPixel({base.x, base.y + k}), o);
+      float det = ex.x * ey.y - ex.y * ey.x;
+      if (fabsf(det) > 1e-12f) {
+        SoftShape shape;
+        shape.glyph = true;
+        shape.color = el.color;
+        shape.source = src;
+        float *m = shape.inverse;
+        m[0] = ey.y / det;
+        m[1] = -ey.x / det;
+        m[3] = -ex.y / det;
+        m[4] = ex.x / det;
+        m[2] = -(m[0] * o.x + m[1] * o.y);
+        m[5] = -(m[3] * o.x + m[4] * o.y);
+        Vector2 corners[4] = {
+            {src.x, src.y},
+            {src.x + src.width, src.y},
+            {src.x, src.y + src.height},
+            {src.x + src.width, src.y + src.height}};
+        float x0 = 1e30f, y0 = 1e30f, x1 = -1e30f, y1 = -1e30f;
+        for (const auto &corner : corners) {
+          Vector2 p = Vector2Add(o, Vector2Add(Vector2Scale(ex, corner.x),
+                                               Vector2Scale(ey, corner.y)));
+          x0 = min(x0, p.x);
+          y0 = min(y0, p.y);
+          x1 = max(x1, p.x);
+          y1 = max(y1, p.y);
+        }
+        shape.bounds = {x0 - 1.0f, y0 - 1.0f, x1 - x0 + 2.0f, y1 - y0 + 2.0f};
+        shapes.push_back(shape);
+      }
+    }
+    penX += (info.advanceX == 0 ? rec.width * k : info.advanceX * k) + 2.0f;
   }
-  return out;
 }
 
-void WriteSvgElement(ofstream &out, const Element &el, const string &fontFamily,
-                     float textSize, const Camera2D &camera) {
-  string stroke = TextFormat("rgb(%d,%d,%d)", el.color.r, el.color.g, el.color.b);
+void AppendSoftElement(vector<SoftShape> &shapes, const Element &el,
+                       const SoftwareFont &soft, float textSize,
+                       const Camera2D &camera) {
+  if (el.type == GROUP_MODE) {
+    for (const auto &child : el.children)
+      AppendSoftElement(shapes, child, soft, textSize, camera);
+    return;
+  }
+  if (el.type == TEXT_MODE) {
+    AppendSoftText(shapes, el, soft, textSize, camera);
+    return;
+  }
+  float w = el.strokeWidth;
+  SoftShape shape = MakeSoftShape(el.color, w * camera.zoom);
   Vector2 s = el.start;
   Vector2 e = el.end;
   if (el.rotation != 0.0f &&
       (el.type == LINE_MODE || el.type == DOTTEDLINE_MODE ||
        el.type == ARROWLINE_MODE)) {
     Vector2 center = ElementCenterLocal(el);
-    s = RotatePoint(s, center, el.rotation);
-    e = RotatePoint(e, center, el.rotation);
+    s = RotatePoint(el.start, center, el.rotation);
+    e = RotatePoint(el.end, center, el.rotation);
   }
-  s = GetWorldToScreen2D(s, camera);
-  e = GetWorldToScreen2D(e, camera);
-  float scaledStroke = max(0.5f, el.strokeWidth * camera.zoom);
-  float effectiveTextSize = (el.textSize > 0.0f) ? el.textSize : textSize;
-  float scaledTextSize = max(6.0f, effectiveTextSize * camera.zoom);
-  if (el.type == LINE_MODE || el.type == DOTTEDLINE_MODE || el.type == ARROWLINE_MODE) {
-    out << "<line x1=\"" << s.x << "\" y1=\"" << s.y << "\" x2=\""
-        << e.x << "\" y2=\"" << e.y << "\" stroke=\"" << stroke
-        << "\" stroke-width=\"" << scaledStroke << "\"";
-    if (el.type == DOTTEDLINE_MODE)
-      out << " stroke-dasharray=\"8,6\"";
-    out << " fill=\"none\" stroke-linecap=\"round\" />\n";
-    if (el.type == ARROWLINE_MODE) {
-      float angle = atan2f(e.y - s.y, e.x - s.x);
-      float lineLen = Vector2Distance(s, e);
-      float headSize = max(12.0f, scaledStroke * 3.0f);
-      if (headSize > lineLen * 0.7f)
-        headSize = lineLen * 0.7f;
-      Vector2 p1 = {e.x - headSize * cosf(angle - PI / 6),
-                    e.y - headSize * sinf(angle - PI / 6)};
-      Vector2 p2 = {e.x - headSize * cosf(angle + PI / 6),
-                    e.y - headSize * sinf(angle + PI / 6)};
-      out << "<line x1=\"" << e.x << "\" y1=\"" << e.y << "\" x2=\"" << p1.x
-          << "\" y2=\"" << p1.y << "\" stroke=\"" << stroke
-          << "\" stroke-width=\"" << scaledStroke
-          << "\" fill=\"none\" stroke-linecap=\"round\" />\n";
-      out << "<line x1=\"" << e.x << "\" y1=\"" << e.y << "\" x2=\"" << p2.x
-          << "\" y2=\"" << p2.y << "\" stroke=\"" << stroke
-          << "\" stroke-width=\"" << scaledStroke
-          << "\" fill=\"none\" stroke-linecap=\"round\" />\n";
+  if (el.type == LINE_MODE) {
+    AddSoftSegment(shape, s, e, w, SoftPart::BUTT, camera);
+  } else if (el.type == DOTTEDLINE_MODE) {
+    AddSoftDashes(shape, s, e, w, camera);
+  } else if (el.type == ARROWLINE_MODE) {
+    AddSoftSegment(shape, s, e, w, SoftPart::BUTT, camera);
+    float angle = atan2f(e.y - s.y, e.x - s.x);
+    float headSize = min(max(15.0f, w * 3.0f), Vector2Distance(s, e) * 0.7f);
+    Vector2 p1 = {e.x - headSize * cosf(angle - PI / 6),
+                  e.y - headSize * sinf(angle - PI / 6)};
+    Vector2 p2 = {e.x - headSize * cosf(angle + PI / 6),
+                  e.y - headSize * sinf(angle + PI / 6)};
+    AddSoftSegment(shape, e, p1, w, SoftPart::BUTT, camera);
+    AddSoftSegment(shape, e, p2, w, SoftPart::BUTT, camera);
+  } else if (el.type == CIRCLE_MODE) {
+    AddSoftArc(shape, el.start, Vector2Distance(el.start, el.end), w, 0.0f,
+               2.0f * PI, camera);
+  } else if (el.type == DOTTEDCIRCLE_MODE) {
+    float radius = Vector2Distance(el.start, el.end);
+    if (radius > 0.5f) {
+      float circumference = 2.0f * PI * radius;
+      float dashDeg = (max(w * 2.0f, 6.0f) / circumference) * 360.0f;
+      float gapDeg = (max(w * 1.2f, 4.0f) / circumference) * 360.0f;
+      for (float a = 0.0f; a < 360.0f; a += (dashDeg + gapDeg))
+        AddSoftArc(shape, el.start, radius, w, a * DEG2RAD,
+                   min(a + dashDeg, 360.0f) * DEG2RAD, camera);
     }
   } else if (el.type == RECTANGLE_MODE || el.type == DOTTEDRECT_MODE) {
-    float x = min(s.x, e.x);
-    float y = min(s.y, e.y);
-    float w = fabsf(e.x - s.x);
-    float h = fabsf(e.y - s.y);
-    out << "<rect x=\"" << x << "\" y=\"" << y << "\" width=\"" << w
-        << "\" height=\"" << h << "\" stroke=\"" << stroke
-        << "\" stroke-width=\"" << scaledStroke << "\" fill=\"none\"";
-    if (el.rotation != 0.0f) {
+    Rectangle r = {min(el.start.x, el.end.x), min(el.start.y, el.end.y),
+                   fabsf(el.end.x - el.start.x), fabsf(el.end.y - el.start.y)};
+    if (el.type == RECTANGLE_MODE && el.rotation == 0.0f) {
+      // DrawRectangleLinesEx keeps the stroke inside the rectangle.
+      float h = w * 0.5f;
+      AddSoftSegment(shape, {r.x, r.y + h}, {r.x + r.width, r.y + h}, w,
+                     SoftPart::BUTT, camera);
+      AddSoftSegment(shape, {r.x, r.y + r.height - h},
+                     {r.x + r.width, r.y + r.height - h}, w, SoftPart::BUTT,
+                     camera);
+      AddSoftSegment(shape, {r.x + h, r.y}, {r.x + h, r.y + r.height}, w,
+                     SoftPart::BUTT, camera);
+      AddSoftSegment(shape, {r.x + r.width - h, r.y},
+                     {r.x + r.width - h, r.y + r.height}, w, SoftPart::BUTT,
+                     camera);
+    } else if (el.rotation == 0.0f) {
+      float overlap = w * 0.5f;
+      AddSoftDashes(shape, {r.x - overlap, r.y}, {r.x + r.width + overlap, r.y},
+                    w, camera);
+      AddSoftDashes(shape, {r.x + r.width, r.y - overlap},
+                    {r.x + r.width, r.y + r.height + overlap}, w, camera);
+      AddSoftDashes(shape, {r.x + r.width + overlap, r.y + r.height},
+                    {r.x - overlap, r.y + r.height}, w, camera);
+      AddSoftDashes(shape, {r.x, r.y + r.height + overlap},
+                    {r.x, r.y - overlap}, w, camera);
+    } else {
       Vector2 center = ElementCenterLocal(el);
-      Vector2 cs = GetWorldToScreen2D(center, camera);
-      out << " transform=\"rotate(" << (el.rotation * RAD2DEG) << " " << cs.x
-          << " " << cs.y << ")\"";
+      Vector2 hx = {cosf(el.rotation) * (r.width * 0.5f),
+                    sinf(el.rotation) * (r.width * 0.5f)};
+      Vector2 hy = {-sinf(el.rotation) * (r.height * 0.5f),
+                    cosf(el.rotation) * (r.height * 0.5f)};
+      Vector2 corners[4] = {
+          Vector2Subtract(Vector2Subtract(center, hx), hy),
+          Vector2Add(Vector2Subtract(center, hx), hy),
+          Vector2Add(Vector2Add(center, hx), hy),
+          Vector2Subtract(Vector2Add(center, hx), hy)};
+      for (int i = 0; i < 4; i++) {
+        if (el.type == DOTTEDRECT_MODE)
+          AddSoftDashes(shape, corners[i], corners[(i + 1) % 4], w, camera);
+        else
+          AddSoftSegment(shape, corners[i], corners[(i + 1) % 4], w,
+                         SoftPart::BUTT, camera);
+      }
     }
-    if (el.type == DOTTEDRECT_MODE)
-      out << " stroke-dasharray=\"8,6\"";
-    out << " />\n";
-  } else if (el.type == CIRCLE_MODE || el.type == DOTTEDCIRCLE_MODE) {
-    float r = Vector2Distance(s, e);
-    out << "<circle cx=\"" << s.x << "\" cy=\"" << s.y
-        << "\" r=\"" << r << "\" stroke=\"" << stroke << "\" stroke-width=\""
-        << scaledStroke << "\" fill=\"none\"";
-    if (el.type == DOTTEDCIRCLE_MODE)
-      out << " stroke-dasharray=\"8,6\"";
-    out << " />\n";
   } else if (el.type == TRIANGLE_MODE || el.type == DOTTEDTRIANGLE_MODE) {
-    Vector2 apex, left, right;
-    GetTriangleVerticesLocal(el, apex, left, right);
+    Vector2 v[3];
+    GetTriangleVerticesLocal(el, v[0], v[1], v[2]);
     if (el.rotation != 0.0f) {
       Vector2 center = ElementCenterLocal(el);
-      apex = RotatePoint(apex, center, el.rotation);
-      left = RotatePoint(left, center, el.rotation);
-      right = RotatePoint(right, center, el.rotation);
+      for (auto &p : v)
+        p = RotatePoint(p, center, el.rotation);
     }
-    Vector2 a = GetWorldToScreen2D(apex, camera);
-    Vector2 b = GetWorldToScreen2D(left, camera);
-    Vector2 c = GetWorldToScreen2D(right, camera);
-    out << "<polygon points=\"" << a.x << "," << a.y << " " << b.x << ","
-        << b.y << " " << c.x << "," << c.y << "\" stroke=\"" << stroke
-        << "\" stroke-width=\"" << scaledStroke
-        << "\" fill=\"none\" stroke-linejoin=\"round\"";
-    if (el.type == DOTTEDTRIANGLE_MODE)
-      out << " stroke-dasharray=\"8,6\"";
-    out << " />\n";
-  } else if (el.type == PEN_MODE) {
-    if (el.path.size() >= 2) {
-      out << "<polyline points=\"";
+    for (int i = 0; i < 3; i++) {
+      if (el.type == DOTTEDTRIANGLE_MODE)
+        AddSoftDashes(shape, v[i], v[(i + 1) % 3], w, camera);
+      else
+        AddSoftSegment(shape, v[i], v[(i + 1) % 3], w, SoftPart::BUTT, camera);
+    }
+  } else if (el.type == POINTS_MODE) {
+    Vector2 center = ElementCenterLocal(el);
+    for (Vector2 p : el.path) {
+      if (el.rotation != 0.0f)
+        p = RotatePoint(p, center, el.rotation);
+      AddSoftSegment(shape, p, p, w, SoftPart::ROUND, camera);
+    }
+  } else if (el.type == PEN_MODE && !el.path.empty()) {
+    vector<Vector2> points = el.path;
+    if (el.rotation != 0.0f) {
       Vector2 center = ElementCenterLocal(el);
-      for (const auto &p : el.path) {
-        Vector2 wp = p;
-        if (el.rotation != 0.0f)
-          wp = RotatePoint(wp, center, el.rotation);
-        Vector2 sp = GetWorldToScreen2D(wp, camera);
-        out << sp.x << "," << sp.y << " ";
+      for (auto &p : points)
+        p = RotatePoint(p, center, el.rotation);
+    }
+    if (points.size() == 1) {
+      AddSoftSegment(shape, points[0], points[0], w, SoftPart::ROUND, camera);
+    } else if (points.size() >= 4) {
+      const int divisions = 24;
+      for (size_t i = 0; i + 3 < points.size(); i++) {
+        Vector2 p1 = points[i], p2 = points[i + 1], p3 = points[i + 2],
+                p4 = points[i + 3];
+        Vector2 prev = p2;
+        for (int d = 1; d <= divisions; d++) {
+          float t = (float)d / divisions;
+          float t2 = t * t;
+          float t3 = t2 * t;
+          float q0 = (-t3 + 2.0f * t2 - t) * 0.5f;
+          float q1 = (3.0f * t3 - 5.0f * t2 + 2.0f) * 0.5f;
+          float q2 = (-3.0f * t3 + 4.0f * t2 + t) * 0.5f;
+          float q3 = (t3 - t2) * 0.5f;
+          Vector2 next = {p1.x * q0 + p2.x * q1 + p3.x * q2 + p4.x * q3,
+                          p1.y * q0 + p2.y * q1 + p3.y * q2 + p4.y * q3};
+          AddSoftSegment(shape, prev, next, w, SoftPart::ROUND, camera);
+          prev = next;
+        }
       }
-      out << "\" stroke=\"" << stroke << "\" stroke-width=\"" << scaledStroke
-          << "\" fill=\"none\" stroke-linecap=\"round\" stroke-linejoin=\"round\" />\n";
-    } else if (el.path.size() == 1) {
-      Vector2 wp = el.path[0];
-      if (el.rotation != 0.0f) {
-        Vector2 center = ElementCenterLocal(el);
-        wp = RotatePoint(wp, center, el.rotation);
+    } else {
+      // DrawLineStrip draws hairlines regardless of stroke width or zoom.
+      shape.alpha = 1.0f;
+      for (size_t i = 1; i < points.size(); i++)
+        AddSoftSegment(shape, points[i - 1], points[i], 1.0f / camera.zoom,
+                       SoftPart::ROUND, camera);
+    }
+  }
+  PushSoftShape(shapes, shape);
+}
+
+// Signed distance in pixels; negative inside.
+float SoftPartDistance(const SoftPart &part, float x, float y) {
+  if (part.kind == SoftPart::ARC) {
+    float dx = x - part.a.x;
+    float dy = y - part.a.y;
+    float dist = sqrtf(dx * dx + dy * dy);
+    float ring = fabsf(dist - part.radius) - part.halfWidth;
+    float range = part.angle1 - part.angle0;
+    if (range >= 2.0f * PI - 1e-4f)
+      return ring;
+    float rel = atan2f(dy, dx) - part.angle0;
+    rel = fmodf(rel, 2.0f * PI);
+    if (rel < 0.0f)
+      rel += 2.0f * PI;
+    float angular = rel <= range ? -min(rel, range - rel)
+                                 : min(rel - range, 2.0f * PI - rel);
+    return max(ring, angular * dist);
+  }
+  float ex = part.b.x - part.a.x;
+  float ey = part.b.y - part.a.y;
+  float px = x - part.a.x;
+  float py = y - part.a.y;
+  float len2 = ex * ex + ey * ey;
+  if (len2 < 1e-12f)
+    return part.kind == SoftPart::ROUND ? sqrtf(px * px + py * py) - part.halfWidth
+                                        : 1e30f;
+  if (part.kind == SoftPart::ROUND) {
+    float t = Clamp((px * ex + py * ey) / len2, 0.0f, 1.0f);
+    float qx = px - ex * t;
+    float qy = py - ey * t;
+    return sqrtf(qx * qx + qy * qy) - part.halfWidth;
+  }
+  float len = sqrtf(len2);
+  float along = (px * ex + py * ey) / len - len * 0.5f;
+  float across = (px * ey - py * ex) / len;
+  return max(fabsf(along) - len * 0.5f, fabsf(across) - part.halfWidth);
+}
+
+int SoftPartSpans(const SoftPart &part, float y0, float y1, float spans[4]) {
+  float reach = part.halfWidth + 1.0f;
+  if (part.kind == SoftPart::ARC) {
+    float outer = part.radius + reach;
+    float nearY = Clamp(part.a.y, y0, y1) - part.a.y;
+    if (fabsf(nearY) > outer)
+      return 0;
+    float half = sqrtf(outer * outer - nearY * nearY);
+    float left = max(part.a.x - half, part.bounds.x);
+    float right = min(part.a.x + half, part.bounds.x + part.bounds.width);
+    float inner = part.radius - reach;
+    float farY = max(fabsf(y0 - part.a.y), fabsf(y1 - part.a.y));
+    if (inner > 0.0f && farY < inner) {
+      float hole = sqrtf(inner * inner - farY * farY);
+      spans[0] = left;
+      spans[1] = part.a.x - hole;
+      spans[2] = part.a.x + hole;
+      spans[3] = right;
+      return 2;
+    }
+    spans[0] = left;
+    spans[1] = right;
+    return 1;
+  }
+  float dy = part.b.y - part.a.y;
+  float t0 = 0.0f;
+  float t1 = 1.0f;
+  if (fabsf(dy) > 1e-6f) {
+    float ta = (y0 - reach - part.a.y) / dy;
+    float tb = (y1 + reach - part.a.y) / dy;
+    t0 = max(0.0f, min(ta, tb));
+    t1 = min(1.0f, max(ta, tb));
+    if (t0 > t1)
+      return 0;
+  } else if (part.a.y + reach < y0 || part.a.y - reach > y1) {
+    return 0;
+  }
+  float xa = part.a.x + (part.b.x - part.a.x) * t0;
+  float xb = part.a.x + (part.b.x - part.a.x) * t1;
+  spans[0] = min(xa, xb) - reach;
+  spans[1] = max(xa, xb) + reach;
+  return 1;
+}
+
+void BlendSoftPixel(unsigned char *px, Color color, float coverage) {
+  float a = (color.a / 255.0f) * coverage;
+  if (a <= 0.0f)
+    return;
+  float keep = 1.0f - a;
+  px[0] = (unsigned char)(color.r * a + px[0] * keep + 0.5f);
+  px[1] = (unsigned char)(color.g * a + px[1] * keep + 0.5f);
+  px[2] = (unsigned char)(color.b * a + px[2] * keep + 0.5f);
+  px[3] = (unsigned char)(255.0f * a + px[3] * keep + 0.5f);
+}
+
+float SampleSoftGlyph(const Image &atlas, const Rectangle &src, float sx,
+                      float sy) {
+  if (sx < src.x || sy < src.y || sx >= src.x + src.width ||
+      sy >= src.y + src.height)
+    return 0.0f;
+  const unsigned char *pixels = (const unsigned char *)atlas.data;
+  float fx = sx - 0.5f;
+  float fy = sy - 0.5f;
+  int x0 = (int)floorf(fx);
+  int y0 = (int)floorf(fy);
+  float tx = fx - x0;
+  float ty = fy - y0;
+  int minX = max(0, (int)src.x);
+  int minY = max(0, (int)src.y);
+  int maxX = min(atlas.width - 1, (int)(src.x + src.width) - 1);
+  int maxY = min(atlas.height - 1, (int)(src.y + src.height) - 1);
+  auto at = [&](int x, int y) {
+    x = max(minX, min(maxX, x));
+    y = max(minY, min(maxY, y));
+    return (float)pixels[((size_t)y * atlas.width + x) * 4 + 3];
+  };
+  float top = at(x0, y0) + (at(x0 + 1, y0) - at(x0, y0)) * tx;
+  float bottom = at(x0, y0 + 1) + (at(x0 + 1, y0 + 1) - at(x0, y0 + 1)) * tx;
+  return (top + (bottom - top) * ty) / 255.0f;
+}
+
+const float kSoftFar = 1e30f;
+
+// `rowDist` is per-thread scratch, all kSoftFar between calls.
+void RasterSoftShape(const SoftShape &shape, const SoftwareFont &soft,
+                     int width, int y0, int y1, int rowBase,
+                     unsigned char *rows, vector<float> &rowDist) {
+  int top = max(y0, (int)floorf(shape.bounds.y));
+  int bottom = min(y1, (int)ceilf(shape.bounds.y + shape.bounds.height));
+  int left = max(0, (int)floorf(shape.bounds.x));
+  int right = min(width, (int)ceilf(shape.bounds.x + shape.bounds.width));
+  if (top >= bottom || left >= right)
+    return;
+  size_t stride = (size_t)width * 4;
+  if (shape.glyph) {
+    const float *m = shape.inverse;
+    for (int y = top; y < bottom; y++) {
+      unsigned char *row = rows + (size_t)(y - rowBase) * stride;
+      float py = y + 0.5f;
+      for (int x = left; x < right; x++) {
+        float px = x + 0.5f;
+        float coverage =
+            SampleSoftGlyph(soft.atlas, shape.source, m[0] * px + m[1] * py + m[2],
+                            m[3] * px + m[4] * py + m[5]);
+        if (coverage > 0.0f)
+          BlendSoftPixel(row + (size_t)x * 4, shape.color, coverage);
       }
-      Vector2 sp = GetWorldToScreen2D(wp, camera);
-      out << "<circle cx=\"" << sp.x << "\" cy=\"" << sp.y
-          << "\" r=\"" << max(0.5f, el.strokeWidth * 0.5f * camera.zoom)
-          << "\" fill=\""
-          << stroke << "\" />\n";
     }
-  } else if (el.type == TEXT_MODE) {
-    out << "<text x=\"" << s.x << "\" y=\"" << (s.y + scaledTextSize)
-        << "\" fill=\"" << stroke << "\" font-family=\"" << SvgEscape(fontFamily)
-        << "\" font-size=\"" << scaledTextSize << "\"";
-    if (el.rotation != 0.0f) {
-      Vector2 center = ElementCenterLocal(el);
-      Vector2 cs = GetWorldToScreen2D(center, camera);
-      out << " transform=\"rotate(" << (el.rotation * RAD2DEG) << " " << cs.x
-          << " " << cs.y << ")\"";
+    return;
+  }
+
+  vector<const SoftPart *> active;
+  for (const auto &part : shape.parts) {
+    if (part.bounds.y < bottom && part.bounds.y + part.bounds.height > top)
+      active.push_back(&part);
+  }
+  for (int y = top; y < bottom; y++) {
+    float py = y + 0.5f;
+    int minX = right;
+    int maxX = left - 1;
+    for (const SoftPart *part : active) {
+      float spans[4];
+      int count = SoftPartSpans(*part, (float)y, (float)(y + 1), spans);
+      for (int i = 0; i < count; i++) {
+        int sx0 = max(left, (int)floorf(spans[i * 2]));
+        int sx1 = min(right - 1, (int)ceilf(spans[i * 2 + 1]));
+        if (sx0 > sx1)
+          continue;
+        minX = min(minX, sx0);
+        maxX = max(maxX, sx1);
+        for (int x = sx0; x <= sx1; x++)
+          rowDist[x] = min(rowDist[x], SoftPartDistance(*part, x + 0.5f, py));
+      }
+    }
+    unsigned char *row = rows + (size_t)(y - rowBase) * stride;
+    for (int x = minX; x <= maxX; x++) {
+      float coverage = Clamp(0.5f - rowDist[x], 0.0f, 1.0f) * shape.alpha;
+      if (coverage > 0.0f)
+        BlendSoftPixel(row + (size_t)x * 4, shape.color, coverage);
+      rowDist[x] = kSoftFar;
     }
-    out << ">" << SvgEscape(el.text) << "</text>\n";
-  } else if (el.type == GROUP_MODE) {
-    for (const auto &child : el.children)
-      WriteSvgElement(out, child, fontFamily, textSize, camera);
   }
 }
 
-bool ExportCanvasSvg(const Canvas &canvas, const string &filename,
-                     const vector<Element> &elements, const Camera2D &camera,
-                     int outWidth, int outHeight) {
-  ofstream out(filename);
-  if (!out.is_open())
+void RenderSoftwareRows(const vector<SoftShape> &shapes,
+                        const SoftwareFont &soft, Color background, int width,
+                        int y0, int rows, unsigned char *out) {
+  size_t pixels = (size_t)width * rows;
+  for (size_t i = 0; i < pixels; i++) {
+    out[i * 4 + 0] = background.r;
+    out[i * 4 + 1] = background.g;
+    out[i * 4 + 2] = background.b;
+    out[i * 4 + 3] = background.a;
+  }
+  const int bandRows = 32;
+  int bands = (rows + bandRows - 1) / bandRows;
+  atomic<int> nextBand{0};
+  auto work = [&] {
+    vector<float> rowDist(width, kSoftFar);
+    int band;
+    while ((band = nextBand++) < bands) {
+      int by0 = y0 + band * bandRows;
+      int by1 = min(y0 + rows, by0 + bandRows);
+      for (const auto &shape : shapes) {
+        if (shape.bounds.y < by1 && shape.bounds.y + shape.bounds.height > by0)
+          RasterSoftShape(shape, soft, width, by0, by1, y0, out, rowDist);
+      }
+    }
+  };
+  int threads = (int)min<unsigned>(max(1u, thread::hardware_concurrency()),
+                                   (unsigned)max(1, bands));
+  vector<thread> pool;
+  for (int i = 1; i < threads; i++)
+    pool.emplace_back(work);
+  work();
+  for (auto &t : pool)
+    t.join();
+}
+
+bool ExportCanvasSoftware(const Canvas &canvas, const string &filename,
+                          const vector<Element> &elements,
+                          const Camera2D &camera, int outWidth, int outHeight,
+                          int tileSize, int pngLevel,
+                          const SoftwareFont &soft) {
+  vector<SoftShape> shapes;
+  for (const auto &el : elements) {
+    if (ContainsInstance(el))
+      AppendSoftElement(shapes,
+                        ResolveInstances(canvas.symbols, el, canvas.font,
+                                         canvas.textSize),
+                        soft, canvas.textSize, camera);
+    else
+      AppendSoftElement(shapes, el, soft, canvas.textSize, camera);
+  }
+  if (NeedsTiledPng(filename, outWidth, outHeight, tileSize)) {
+    vector<unsigned char> strip;
+    PngStream png;
+    bool ok = BeginPngStream(png, filename, outWidth, outHeight, pngLevel);
+    int band = min(tileSize, kExportBandRows);
+    for (int y0 = 0; ok && y0 < outHeight; y0 += band) {
+      int rows = min(band, outHeight - y0);
+      strip.resize((size_t)outWidth * 4 * rows);
+      RenderSoftwareRows(shapes, soft, canvas.backgroundColor, outWidth, y0,
+                         rows, strip.data());
+      ok = WritePngRows(png, strip.data(), rows);
+    }
+    return EndPngStream(png) && ok;
+  }
+  Image img = GenImageColor(outWidth, outHeight, canvas.backgroundColor);
+  if (!img.data)
     return false;
-  int w = outWidth;
-  int h = outHeight;
-  out << fixed << setprecision(3);
-  out << "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"" << w
-      << "\" height=\"" << h << "\" viewBox=\"0 0 " << w << " " << h << "\">\n";
-  out << "<rect width=\"100%\" height=\"100%\" fill=\"rgb("
-      << (int)canvas.backgroundColor.r << "," << (int)canvas.backgroundColor.g << ","
-      << (int)canvas.backgroundColor.b << ")\" />\n";
-  for (const auto &el : elements)
-    WriteSvgElement(out, el, canvas.fontFamilyPath, canvas.textSize, camera);
-  out << "</svg>\n";
+  RenderSoftwareRows(shapes, soft, canvas.backgroundColor, outWidth, 0,
+                     outHeight, (unsigned char *)img.data);
+  bool ok = SaveRasterImage(img, filename, pngLevel);
+  UnloadImage(img);
+  return ok;
+}
+
+void ExportWorkerLoop(ExportQueue *queue) {
+  while (true) {
+    ExportJob job;
+    {
+      unique_lock<mutex> guard(queue->lock);
+      queue->wake.wait(guard, [&] { return queue->stop || !queue->jobs.empty(); });
+      if (queue->jobs.empty())
+        break;
+      job = std::move(queue->jobs.front());
+      queue->jobs.pop_front();
+      queue->active = job.path;
+    }
+    auto started = chrono::steady_clock::now();
+    bool ok = WriteExportJob(job);
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() -
+                                                started)
+                    .count();
+    lock_guard<mutex> guard(queue->lock);
+    queue->active.clear();
+    queue->finished.push_back({job.path, ok, ms});
+  }
+}
+
+void QueueExport(Canvas &canvas, ExportJob job) {
+  ExportQueue &queue = canvas.exports;
+  if (!queue.worker.joinable())
+    queue.worker = thread(ExportWorkerLoop, &queue);
+  {
+    lock_guard<mutex> guard(queue.lock);
+    queue.jobs.push_back(std::move(job));
+  }
+  queue.wake.notify_one();
+}
+
+int PendingExports(Canvas &canvas) {
+  lock_guard<mutex> guard(canvas.exports.lock);
+  return (int)canvas.exports.jobs.size() +
+         (canvas.exports.active.empty() ? 0 : 1);
+}
+
+void TickExports(Canvas &canvas, const AppConfig &cfg) {
+  ExportQueue &queue = canvas.exports;
+  vector<ExportResult> finished;
+  {
+    lock_guard<mutex> guard(queue.lock);
+    finished.swap(queue.finished);
+  }
+  for (const auto &result : finished) {
+    if (!canvas.artboardExports.empty() &&
+        canvas.artboardExports.front().queued.erase(result.path) > 0) {
+      ArtboardExport &batch = canvas.artboardExports.front();
+      (result.ok ? batch.written : batch.failed)++;
+      continue;
+    }
+    if (result.ok)
+      SetStatus(canvas, cfg,
+                "Exported " + result.path +
+                    TextFormat(" (%.0f ms)", result.durationMs));
+    else
+      SetStatus(canvas, cfg, "Export failed: " + result.path);
+  }
+}
+
+void CloseExports(Canvas &canvas) {
+  ExportQueue &queue = canvas.exports;
+  if (!queue.worker.joinable())
+    return;
+  {
+    lock_guard<mutex> guard(queue.lock);
+    queue.stop = true;
+  }
+  queue.wake.notify_one();
+  queue.worker.join();
+}
+
+bool StartTiledExport(Canvas &canvas, ExportJob job, vector<Element> elements,
+                      int tileSize) {
+  TiledExport tiled;
+  tiled.target = LoadRenderTexture(tileSize, min(tileSize, kExportBandRows));
+  if (tiled.target.id == 0)
+    return false;
+  tiled.bands = make_shared<ExportBands>();
+  tiled.pixelBounds = ExportPixelBounds(elements, job.camera);
+  tiled.elements = std::move(elements);
+  tiled.camera = job.camera;
+  tiled.width = job.width;
+  tiled.height = job.height;
+  job.bands = tiled.bands;
+  QueueExport(canvas, std::move(job));
+  canvas.tiledExports.push_back(std::move(tiled));
   return true;
 }
 
-bool ExportCanvasRaster(const Canvas &canvas, const string &filename,
-                        const vector<Element> &elements, const Camera2D &camera,
-                        int outWidth, int outHeight) {
-  RenderTexture2D target = LoadRenderTexture(outWidth, outHeight);
-  BeginTextureMode(target);
-  ClearBackground(canvas.backgroundColor);
-  BeginMode2D(camera);
-  for (const auto &el : elements)
-    DrawElement(el, canvas.font, canvas.textSize);
-  EndMode2D();
-  EndTextureMode();
+bool AdvanceTiledExport(const Canvas &canvas, TiledExport &tiled, bool wait) {
+  ExportBands &bands = *tiled.bands;
+  {
+    unique_lock<mutex> guard(bands.lock);
+    auto hasRoom = [&] { return bands.strips.size() < 2 || bands.failed; };
+    if (wait)
+      bands.ready.wait(guard, hasRoom);
+    else if (!hasRoom())
+      return false;
+    if (bands.failed)
+      return true;
+  }
+  int rows = min(tiled.target.texture.height, tiled.height - tiled.nextRow);
+  vector<unsigned char> strip((size_t)tiled.width * 4 * rows);
+  RenderExportStrip(canvas, tiled.elements, tiled.pixelBounds, tiled.camera,
+                    tiled.width, tiled.nextRow, rows, tiled.target,
+                    strip.data());
+  tiled.nextRow += rows;
+  bool done = tiled.nextRow >= tiled.height;
+  {
+    lock_guard<mutex> guard(bands.lock);
+    bands.strips.push_back(std::move(strip));
+    bands.finished = done;
+  }
+  bands.ready.notify_all();
+  return done;
+}
+
+void TickTiledExports(Canvas &canvas) {
+  if (canvas.tiledExports.empty())
+    return;
+  TiledExport &tiled = canvas.tiledExports.front();
+  if (!AdvanceTiledExport(canvas, tiled, false))
+    return;
+  UnloadRenderTexture(tiled.target);
+  canvas.tiledExports.pop_front();
+}
+
+void FinishTiledExports(Canvas &canvas) {
+  while (!canvas.tiledExports.empty()) {
+    TiledExport &tiled = canvas.tiledExports.front();
+    while (!AdvanceTiledExport(canvas, tiled, true)) {
+    }
+    UnloadRenderTexture(tiled.target);
+    canvas.tiledExports.pop_front();
+  }
+}
+
+int TiledExportPercent(const Canvas &canvas) {
+  if (canvas.tiledExports.empty())
+    return -1;
+  const TiledExport &tiled = canvas.tiledExports.front();
+  return (int)(100LL * tiled.nextRow / max(1, tiled.height));
+}
+
+bool ScanHistory(const string &path, int &batches, long long &end,
+                 Rectangle &bounds, double &boundsX, double &boundsY) {
+  ifstream in(path);
+  string header;
+  if (!in.is_open() || !getline(in, header) || Trim(header) != "TOGGLE_HISTORY_V1")
+    return false;
+  batches = 0;
+  end = (long long)in.tellg();
+  double minX = 0.0, minY = 0.0, maxX = 0.0, maxY = 0.0;
+  bool any = false;
+  vector<SceneOp> ops;
+  string tag;
+  while (in >> tag && tag == "BATCH" && ReadSceneBatch(in, ops)) {
+    for (const auto &op : ops) {
+      if (op.kind != SceneOp::PUT)
+        continue;
+      Rectangle b = ExpandRect(op.el.GetBounds(), op.el.strokeWidth);
+      double x0 = op.el.frameX + b.x;
+      double y0 = op.el.frameY + b.y;
+      minX = any ? min(minX, x0) : x0;
+      minY = any ? min(minY, y0) : y0;
+      maxX = any ? max(maxX, x0 + b.width) : x0 + b.width;
+      maxY = any ? max(maxY, y0 + b.height) : y0 + b.height;
+      any = true;
+    }
+    batches++;
+    end = (long long)in.tellg();
+  }
+  if (!any)
+    return false;
+  boundsX = minX;
+  boundsY = minY;
+  bounds = {0.0f, 0.0f, (float)(maxX - minX), (float)(maxY - minY)};
+  return batches > 0;
+}
+
+bool StartTimelapse(Canvas &canvas, const AppConfig &cfg, const string &out,
+                    bool sequence, int fps, string &error) {
+  RecordUndoState(canvas);
+  HistoryRecorder &recorder = canvas.recorder;
+  if (recorder.path.empty()) {
+    error = "no drawing history recorded";
+    return false;
+  }
+  int batches = 0;
+  long long end = 0;
+  Rectangle bounds{};
+  double left = 0.0, top = 0.0;
+  if (!ScanHistory(recorder.path, batches, end, bounds, left, top)) {
+    error = "history is empty";
+    return false;
+  }
+  TimelapseExport tl;
+  tl.history.open(recorder.path);
+  string header;
+  getline(tl.history, header);
+  float pad = 24.0f;
+  tl.left = left - pad;
+  tl.top = top - pad;
+  float span = max(bounds.width, bounds.height) + pad * 2.0f;
+  tl.scale = min(1.0f, (float)cfg.exportTileSize / span);
+  tl.width = max(1, (int)ceilf((bounds.width + pad * 2.0f) * tl.scale));
+  tl.height = max(1, (int)ceilf((bounds.height + pad * 2.0f) * tl.scale));
+  tl.end = end;
+  tl.step = (batches + cfg.timelapseMaxFrames - 1) / cfg.timelapseMaxFrames;
+  tl.frames = (batches + tl.step - 1) / tl.step;
+  tl.bands = make_shared<ExportBands>();
+
+  ExportJob job = MakeExportJob(canvas, out, {}, tl.width, tl.height);
+  job.bands = tl.bands;
+  job.frames = true;
+  job.sequence = sequence;
+  job.fps = fps;
+  job.frameCount = tl.frames;
+  job.pngLevel = cfg.exportPngLevel;
+  QueueExport(canvas, std::move(job));
+  canvas.timelapses.push_back(std::move(tl));
+  return true;
+}
+
+bool AdvanceTimelapse(const Canvas &canvas, TimelapseExport &tl, bool wait) {
+  ExportBands &bands = *tl.bands;
+  {
+    unique_lock<mutex> guard(bands.lock);
+    auto hasRoom = [&] { return bands.strips.size() < 2 || bands.failed; };
+    if (wait)
+      bands.ready.wait(guard, hasRoom);
+    else if (!hasRoom())
+      return false;
+    if (bands.failed)
+      return true;
+  }
+  int applied = 0;
+  vector<SceneOp> ops;
+  string tag;
+  while (applied < tl.step && (long long)tl.history.tellg() < tl.end &&
+         tl.history >> tag && tag == "BATCH" &&
+         ReadSceneBatch(tl.history, ops)) {
+    ApplySceneOps(tl.scene, ops, tl.settings);
+    applied++;
+  }
+  bool done = applied < tl.step || (long long)tl.history.tellg() >= tl.end;
+  vector<unsigned char> pixels;
+  if (applied > 0) {
+    Camera2D camera{};
+    camera.zoom = tl.scale;
+    CompactSceneReplay(tl.scene);
+    for (auto &el : tl.scene.elements)
+      RehomeElement(el, tl.left, tl.top);
+    Image image =
+        RenderExportImage(canvas, tl.scene.elements, camera, tl.width,
+                          tl.height, max(tl.width, tl.height));
+    if (image.data) {
+      const unsigned char *data = (const unsigned char *)image.data;
+      pixels.assign(data, data + (size_t)tl.width * tl.height * 4);
+    }
+    UnloadImage(image);
+    tl.frame++;
+  }
+  {
+    lock_guard<mutex> guard(bands.lock);
+    if (!pixels.empty())
+      bands.strips.push_back(std::move(pixels));
+    bands.finished = done;
+  }
+  bands.ready.notify_all();
+  return done;
+}
+
+void TickTimelapses(Canvas &canvas) {
+  if (canvas.timelapses.empty())
+    return;
+  if (AdvanceTimelapse(canvas, canvas.timelapses.front(), false))
+    canvas.timelapses.pop_front();
+}
+
+void FinishTimelapses(Canvas &canvas) {
+  while (!canvas.timelapses.empty()) {
+    while (!AdvanceTimelapse(canvas, canvas.timelapses.front(), true)) {
+    }
+    canvas.timelapses.pop_front();
+  }
+}
 
-  Image img = LoadImageFromTexture(target.texture);
-  ImageFlipVertical(&img);
-  bool ok = ExportImage(img, filename.c_str());
-  UnloadImage(img);
-  UnloadRenderTexture(target);
-  return ok;
+int TimelapsePercent(const Canvas &canvas) {
+  if (canvas.timelapses.empty())
+    return -1;
+  const TimelapseExport &tl = canvas.timelapses.front();
+  return (int)(100LL * tl.frame / max(1, tl.frames));
 }
 
 bool TryLoadFont(Canvas &canvas, const AppConfig &cfg, const string &nameOrPath) {
@@ -2544,9 +10614,30 @@ bool TryLoadFont(Canvas &canvas, const AppConfig &cfg, const string &nameOrPath)
   return true;
 }
 
-bool BuildExportScene(const Canvas &canvas, ExportScope scope, float rasterScale,
-                      vector<Element> &elementsOut, Camera2D &cameraOut,
-                      int &widthOut, int &heightOut, string &errorOut) {
+Rectangle ArtboardRect(const Canvas &canvas, const Artboard &board) {
+  return {(float)(board.x - canvas.originX), (float)(board.y - canvas.originY),
+          board.width, board.height};
+}
+
+int FindArtboard(const Canvas &canvas, const string &name) {
+  for (size_t i = 0; i < canvas.artboards.size(); i++)
+    if (canvas.artboards[i].name == name)
+      return (int)i;
+  return -1;
+}
+
+string ArtboardFileName(const string &name) {
+  string out = name;
+  for (char &c : out)
+    if (c == '/' || c == '\\' || c == ':' || isspace((unsigned char)c))
+      c = '_';
+  return out.empty() ? "artboard" : out;
+}
+
+bool BuildExportScene(Canvas &canvas, ExportScope scope, float rasterScale,
+                      Vector2 viewSize, vector<Element> &elementsOut,
+                      Camera2D &cameraOut, int &widthOut, int &heightOut,
+                      string &errorOut) {
   elementsOut.clear();
   if (scope == EXPORT_SELECTED) {
     vector<int> ids = GetSelectedIDs(canvas);
@@ -2559,9 +10650,12 @@ bool BuildExportScene(const Canvas &canvas, ExportScope scope, float rasterScale
       errorOut = "No selected elements to export";
       return false;
     }
+  } else if (scope == EXPORT_ALL && canvas.chunks.active) {
+    CollectChunkedScene(canvas, elementsOut);
   } else {
     elementsOut = canvas.elements;
   }
+  ApplyExportLayers(canvas, elementsOut);
 
   if (scope == EXPORT_FRAME) {
     float scale = max(1.0f, rasterScale);
@@ -2569,8 +10663,8 @@ bool BuildExportScene(const Canvas &canvas, ExportScope scope, float rasterScale
     cameraOut.zoom *= scale;
     cameraOut.offset = {canvas.camera.offset.x * scale,
                         canvas.camera.offset.y * scale};
-    widthOut = max(1, (int)roundf((float)GetScreenWidth() * scale));
-    heightOut = max(1, (int)roundf((float)GetScreenHeight() * scale));
+    widthOut = max(1, (int)roundf(viewSize.x * scale));
+    heightOut = max(1, (int)roundf(viewSize.y * scale));
     return true;
   }
 
@@ -2594,6 +10688,202 @@ bool BuildExportScene(const Canvas &canvas, ExportScope scope, float rasterScale
   return true;
 }
 
+string BuildExportStamp(const Canvas &canvas, const AppConfig &cfg,
+                        const string &type, ExportScope scope,
+                        const vector<Element> &elements,
+                        const Camera2D &camera, int width, int height,
+                        float scale) {
+  Rectangle frame{};
+  if (scope == EXPORT_FRAME) {
+    Vector2 a = GetScreenToWorld2D({0.0f, 0.0f}, camera);
+    Vector2 b = GetScreenToWorld2D({(float)width, (float)height}, camera);
+    frame = {min(a.x, b.x), min(a.y, b.y), fabsf(b.x - a.x), fabsf(b.y - a.y)};
+  }
+  unsigned long long scene = kFnvOffset;
+  size_t count = 0;
+  for (const auto &el : elements) {
+    if (scope == EXPORT_FRAME &&
+        !CheckCollisionRecs(ExpandRect(el.GetBounds(), el.strokeWidth), frame))
+      continue;
+    scene = HashValue(scene, HashElement(el));
+    count++;
+  }
+  for (const auto &sym : canvas.symbols) {
+    scene = HashBytes(scene, sym.name.data(), sym.name.size());
+    scene = HashBytes(scene, &sym.frame, sizeof(sym.frame));
+    for (const auto &el : sym.elements)
+      scene = HashValue(scene, HashElement(el));
+  }
+  stringstream out;
+  out << setprecision(9);
+  out << "scene=" << hex << setw(16) << setfill('0') << scene << dec << "\n";
+  out << "elements=" << count << "\n";
+  out << "scope="
+      << (scope == EXPORT_FRAME ? "frame"
+                                : scope == EXPORT_SELECTED ? "selected" : "all")
+      << "\n";
+  out << "camera=" << camera.target.x << "," << camera.target.y << ","
+      << camera.offset.x << "," << camera.offset.y << "," << camera.rotation
+      << "," << camera.zoom << "\n";
+  out << "scale=" << scale << "\n";
+  out << "size=" << width << "x" << height << "\n";
+  out << "type=" << type << "\n";
+  Color bg = canvas.backgroundColor;
+  out << "background=" << (int)bg.r << "," << (int)bg.g << "," << (int)bg.b
+      << "," << (int)bg.a << "\n";
+  out << "font=" << canvas.fontFamilyPath << "\n";
+  out << "text_size=" << canvas.textSize << "\n";
+  if (type == "svg")
+    out << "svg=" << (cfg.exportSvgCompact ? "compact" : "plain") << ","
+        << cfg.exportSvgPrecision << "\n";
+  else if (type == "png")
+    out << "png_level=" << cfg.exportPngLevel << "\n";
+  return out.str();
+}
+
+vector<string> ArtboardPaths(const Canvas &canvas, const string &type,
+                             const string &dir, const string &prefix) {
+  vector<string> paths;
+  unordered_set<string> used;
+  for (const auto &board : canvas.artboards) {
+    string base = prefix + ArtboardFileName(board.name);
+    string name = base;
+    for (int n = 2; !used.insert(ToLower(name)).second; n++)
+      name = base + "-" + to_string(n);
+    paths.push_back(JoinPath(dir, EnsureExt(name, type)));
+  }
+  return paths;
+}
+
+void StartArtboardExport(Canvas &canvas, const string &type, const string &dir,
+                         const string &prefix, bool force) {
+  ArtboardExport batch;
+  if (canvas.chunks.active)
+    CollectChunkedScene(canvas, batch.elements);
+  else
+    batch.elements = canvas.elements;
+  ApplyExportLayers(canvas, batch.elements);
+  batch.bounds.resize(batch.elements.size());
+  for (size_t i = 0; i < batch.elements.size(); i++)
+    batch.bounds[i] =
+        ExpandRect(batch.elements[i].GetBounds(), batch.elements[i].strokeWidth);
+  batch.boards = canvas.artboards;
+  batch.paths = ArtboardPaths(canvas, type, dir, prefix);
+  batch.originX = canvas.originX;
+  batch.originY = canvas.originY;
+  batch.type = type;
+  batch.dir = dir;
+  batch.force = force;
+  batch.started = GetTime();
+  canvas.artboardExports.push_back(std::move(batch));
+}
+
+bool AdvanceArtboardExport(Canvas &canvas, const AppConfig &cfg,
+                           ArtboardExport &batch, bool wait) {
+  while (batch.next < batch.boards.size()) {
+    if (PendingExports(canvas) >= 2) {
+      if (!wait)
+        return false;
+      while (PendingExports(canvas) >= 2)
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    const Artboard &board = batch.boards[batch.next];
+    const string &path = batch.paths[batch.next];
+    batch.next++;
+    Rectangle rect = {(float)(board.x - batch.originX),
+                      (float)(board.y - batch.originY), board.width,
+                      board.height};
+    vector<Element> culled;
+    for (size_t i = 0; i < batch.elements.size(); i++)
+      if (CheckCollisionRecs(batch.bounds[i], rect))
+        culled.push_back(batch.elements[i]);
+    float scale = batch.type == "svg" ? 1.0f : max(1.0f, cfg.exportRasterScale);
+    Camera2D camera{};
+    camera.zoom = scale;
+    camera.target = {rect.x, rect.y};
+    int width = max(1, (int)ceilf(rect.width * scale));
+    int height = max(1, (int)ceilf(rect.height * scale));
+
+    string stamp;
+    if (cfg.exportSkipUnchanged) {
+      stamp = BuildExportStamp(canvas, cfg, batch.type, EXPORT_ALL, culled,
+                               camera, width, height, scale);
+      if (!batch.force && ExportIsCurrent(path, stamp)) {
+        batch.skipped++;
+        continue;
+      }
+    }
+    error_code ec;
+    filesystem::remove(ExportStampPath(path), ec);
+
+    ExportJob job = MakeExportJob(canvas, path, camera, width, height);
+    job.pngLevel = cfg.exportPngLevel;
+    job.svgCompact = cfg.exportSvgCompact;
+    job.svgPrecision = cfg.exportSvgPrecision;
+    job.stamp = stamp;
+    if (batch.type == "svg") {
+      job.svg = true;
+      job.elements = std::move(culled);
+    } else if (NeedsTiledPng(path, width, height, cfg.exportTileSize)) {
+      if (StartTiledExport(canvas, std::move(job), std::move(culled),
+                           cfg.exportTileSize))
+        batch.queued.insert(path);
+      else
+        batch.failed++;
+      break;
+    } else {
+      job.image = RenderExportImage(canvas, culled, camera, width, height,
+                                    cfg.exportTileSize);
+      if (!job.image.data) {
+        batch.failed++;
+        break;
+      }
+    }
+    batch.queued.insert(path);
+    QueueExport(canvas, std::move(job));
+    break;
+  }
+  return batch.next >= batch.boards.size();
+}
+
+void TickArtboardExports(Canvas &canvas, const AppConfig &cfg) {
+  if (canvas.artboardExports.empty())
+    return;
+  ArtboardExport &batch = canvas.artboardExports.front();
+  if (!AdvanceArtboardExport(canvas, cfg, batch, false) || !batch.queued.empty())
+    return;
+  string message =
+      TextFormat("Exported %d artboards to ", batch.written) + batch.dir;
+  if (batch.skipped > 0)
+    message += TextFormat(", %d unchanged", batch.skipped);
+  if (batch.failed > 0)
+    message += TextFormat(", %d failed", batch.failed);
+  SetStatus(canvas, cfg,
+            message +
+                TextFormat(" (%.0f ms)", (GetTime() - batch.started) * 1000.0));
+  canvas.artboardExports.pop_front();
+}
+
+void FinishArtboardExports(Canvas &canvas, const AppConfig &cfg) {
+  FinishTiledExports(canvas);
+  while (!canvas.artboardExports.empty()) {
+    ArtboardExport &batch = canvas.artboardExports.front();
+    bool done = false;
+    while (!done) {
+      done = AdvanceArtboardExport(canvas, cfg, batch, true);
+      FinishTiledExports(canvas);
+    }
+    canvas.artboardExports.pop_front();
+  }
+}
+
+int ArtboardExportPercent(const Canvas &canvas) {
+  if (canvas.artboardExports.empty())
+    return -1;
+  const ArtboardExport &batch = canvas.artboardExports.front();
+  return (int)(100 * batch.next / max<size_t>(1, batch.boards.size()));
+}
+
 void ExecuteCommand(Canvas &canvas, AppConfig &cfg, string command) {
   command = Trim(command);
   if (command.empty())
@@ -2614,6 +10904,17 @@ void ExecuteCommand(Canvas &canvas, AppConfig &cfg, string command) {
     canvas.shouldQuit = true;
     return;
   }
+  if ((opLower == "w" || opLower == "wq") && canvas.chunks.active &&
+      args.empty()) {
+    if (FlushChunks(canvas)) {
+      SetStatus(canvas, cfg, "Saved chunks to " + canvas.chunks.dir);
+      if (opLower == "wq")
+        canvas.shouldQuit = true;
+    } else {
+      SetStatus(canvas, cfg, "Save failed: " + canvas.chunks.dir);
+    }
+    return;
+  }
   if (opLower == "w" || opLower == "wq") {
     string targetPath;
     if (args.empty()) {
@@ -2647,8 +10948,23 @@ void ExecuteCommand(Canvas &canvas, AppConfig &cfg, string command) {
       return;
     }
     targetPath = target.string();
+    FinishAutosave(canvas, true);
+    if (canvas.chunks.active) {
+      vector<Element> flat;
+      CollectChunkedScene(canvas, flat);
+      if (SaveSceneFile(targetPath, CaptureSceneSettings(canvas), flat))
+        SetStatus(canvas, cfg, "Wrote flat copy to " + targetPath);
+      else
+        SetStatus(canvas, cfg, "Save failed: " + targetPath);
+      return;
+    }
     if (SaveCanvasToFile(canvas, targetPath)) {
+      RemoveAutosave(canvas.savePath);
+      RemoveAutosave(targetPath);
       canvas.savePath = targetPath;
+      CompactJournal(canvas, targetPath);
+      MoveHistory(canvas, targetPath);
+      ResetAutosave(canvas);
       SetStatus(canvas, cfg, "Saved to " + targetPath);
       if (opLower == "wq")
         canvas.shouldQuit = true;
@@ -2684,13 +11000,67 @@ void ExecuteCommand(Canvas &canvas, AppConfig &cfg, string command) {
       sourcePath = JoinPath(ResolveDefaultDir(args[1], cfg.defaultOpenDir), filename);
     }
 
-    if (LoadCanvasFromFile(canvas, sourcePath)) {
-      canvas.savePath = sourcePath;
-      NormalizeCanvasIDs(canvas);
-      SetStatus(canvas, cfg, "Opened " + sourcePath);
-    } else {
-      SetStatus(canvas, cfg, "Open failed: " + sourcePath);
+    StartOpen(canvas, cfg, sourcePath);
+    return;
+  }
+  if (opLower == "chunked") {
+    if (args.empty()) {
+      if (!canvas.chunks.active) {
+        SetStatus(canvas, cfg, "Usage: :chunked <dir>");
+        return;
+      }
+      int resident = 0;
+      for (const auto &kv : canvas.chunks.tiles)
+        resident += kv.second.resident ? 1 : 0;
+      SetStatus(canvas, cfg,
+                "Chunked " + canvas.chunks.dir + ": " + to_string(resident) + "/" +
+                    to_string(canvas.chunks.tiles.size()) + " tiles resident");
+      return;
+    }
+    canvas.chunks.tileSize = cfg.chunkTileSize;
+    canvas.chunks.maxBytes = cfg.chunkMaxBytes;
+    string dir = ExpandUserPath(args[0]);
+    bool created = false;
+    FinishAutosave(canvas, true);
+    if (OpenChunks(canvas, dir, created))
+      SetStatus(canvas, cfg,
+                (created ? "Converted scene to chunks in " : "Opened chunks ") + dir);
+    else
+      SetStatus(canvas, cfg, "Chunked open failed: " + dir);
+    return;
+  }
+  if (opLower == "checkpoint") {
+    UndoTree &tree = canvas.undoTree;
+    if (args.empty()) {
+      string names;
+      for (const auto &kv : tree.checkpoints)
+        names += (names.empty() ? "" : ", ") + kv.first;
+      SetStatus(canvas, cfg,
+                names.empty() ? "No checkpoints" : "Checkpoints: " + names);
+      return;
+    }
+    RecordUndoState(canvas);
+    tree.pendingDrop = -1;
+    tree.checkpoints[args[0]] = tree.current;
+    SetStatus(canvas, cfg, "Checkpoint saved: " + args[0]);
+    return;
+  }
+  if (opLower == "restore") {
+    if (args.empty()) {
+      SetStatus(canvas, cfg, "Usage: :restore <checkpoint>");
+      return;
+    }
+    auto it = canvas.undoTree.checkpoints.find(args[0]);
+    if (it == canvas.undoTree.checkpoints.end()) {
+      SetStatus(canvas, cfg, "No checkpoint named " + args[0]);
+      return;
     }
+    canvas.isTextEditing = false;
+    canvas.selectedIndices.clear();
+    if (JumpToUndoNode(canvas, it->second))
+      SetStatus(canvas, cfg, "Restored checkpoint " + args[0]);
+    else
+      SetStatus(canvas, cfg, "Restore failed: " + args[0]);
     return;
   }
   if (opLower == "theme") {
@@ -2808,7 +11178,7 @@ void ExecuteCommand(Canvas &canvas, AppConfig &cfg, string command) {
     string v = args.empty() ? "toggle" : ToLower(args[0]);
     if (v == "on" || v == "graph") {
       canvas.bgType = BG_GRAPH;
-      canvas.camera.target = {0.0f, 0.0f};
+      canvas.camera.target = WorldZeroLocal(canvas);
       SetStatus(canvas, cfg, "Graph mode on");
     } else if (v == "off" || v == "blank") {
       canvas.bgType = BG_BLANK;
@@ -2819,7 +11189,7 @@ void ExecuteCommand(Canvas &canvas, AppConfig &cfg, string command) {
         SetStatus(canvas, cfg, "Graph mode off");
       } else {
         canvas.bgType = BG_GRAPH;
-        canvas.camera.target = {0.0f, 0.0f};
+        canvas.camera.target = WorldZeroLocal(canvas);
         SetStatus(canvas, cfg, "Graph mode on");
       }
     } else {
@@ -2889,7 +11259,7 @@ void ExecuteCommand(Canvas &canvas, AppConfig &cfg, string command) {
       SetStatus(canvas, cfg, "Canvas type: dotted");
     } else if (v == "graph") {
       canvas.bgType = BG_GRAPH;
-      canvas.camera.target = {0.0f, 0.0f};
+      canvas.camera.target = WorldZeroLocal(canvas);
       SetStatus(canvas, cfg, "Canvas type: graph");
     } else {
       SetStatus(canvas, cfg, "Usage: :type blank|grid|dotted|graph");
@@ -2927,7 +11297,8 @@ void ExecuteCommand(Canvas &canvas, AppConfig &cfg, string command) {
     SetStatus(canvas, cfg, "Window resized");
     return;
   }
-  if (opLower == "export") {
+  if (opLower == "export" || opLower == "export!") {
+    bool force = opLower == "export!";
     vector<string> normalized;
     normalized.reserve(args.size());
     for (const auto &a : args)
@@ -2943,80 +11314,897 @@ void ExecuteCommand(Canvas &canvas, AppConfig &cfg, string command) {
         type = NormalizeExportType(normalized[i]);
         continue;
       }
-      if (IsExportScopeToken(normalized[i])) {
-        scope = ParseExportScope(normalized[i]);
-        scopeSet = true;
+      if (IsExportScopeToken(normalized[i])) {
+        scope = ParseExportScope(normalized[i]);
+        scopeSet = true;
+      }
+    }
+
+    vector<string> rest;
+    for (int i = 0; i < (int)normalized.size(); i++) {
+      bool isType = (i == typeIdx) && IsExportType(normalized[i]);
+      bool isScope = IsExportScopeToken(normalized[i]);
+      if (!isType && !isScope)
+        rest.push_back(normalized[i]);
+    }
+
+    filesystem::path basePath =
+        canvas.savePath.empty() ? filesystem::path("untitled")
+                                : filesystem::path(canvas.savePath).stem();
+    string filename = basePath.filename().string();
+    if (filename.empty())
+      filename = "untitled";
+    string outDir =
+        ResolveDefaultDir(cfg.defaultExportDir, ResolveDefaultDir(cfg.defaultSaveDir,
+                                                                  DefaultDownloadsDir()));
+
+    if (rest.size() == 1) {
+      if (LooksLikeDirPath(rest[0]))
+        outDir = ExpandUserPath(rest[0]);
+      else
+        filename = filesystem::path(rest[0]).stem().string();
+    } else if (rest.size() >= 2) {
+      bool firstLooksDir = LooksLikeDirPath(rest[0]) || HasDirectoryPart(rest[0]);
+      bool secondLooksDir = LooksLikeDirPath(rest[1]) || HasDirectoryPart(rest[1]);
+      if (firstLooksDir && !secondLooksDir) {
+        outDir = ExpandUserPath(rest[0]);
+        filename = filesystem::path(rest[1]).stem().string();
+      } else {
+        filename = filesystem::path(rest[0]).stem().string();
+        outDir = ExpandUserPath(rest[1]);
+      }
+    }
+
+    if (filename.empty())
+      filename = "untitled";
+    string outName = EnsureExt(filename, type);
+    if (!EnsureDirectory(outDir)) {
+      SetStatus(canvas, cfg, "Export failed: could not create directory");
+      return;
+    }
+    string fullPath = JoinPath(outDir, outName);
+
+    vector<Element> exportElements;
+    Camera2D exportCamera{};
+    int exportW = 0;
+    int exportH = 0;
+    string exportErr;
+    float sceneScale = (type == "svg") ? 1.0f : cfg.exportRasterScale;
+    Vector2 viewSize = {(float)GetScreenWidth(), (float)GetScreenHeight()};
+    if (!BuildExportScene(canvas, scope, sceneScale, viewSize, exportElements,
+                          exportCamera, exportW, exportH, exportErr)) {
+      SetStatus(canvas, cfg, "Export failed: " + exportErr);
+      return;
+    }
+    string stamp;
+    if (cfg.exportSkipUnchanged) {
+      stamp = BuildExportStamp(canvas, cfg, type, scope, exportElements,
+                               exportCamera, exportW, exportH, sceneScale);
+      if (!force && ExportIsCurrent(fullPath, stamp)) {
+        SetStatus(canvas, cfg, "Export unchanged: " + fullPath);
+        return;
+      }
+    }
+    // The old sidecar goes first so a failed export never looks current.
+    error_code stampErr;
+    filesystem::remove(ExportStampPath(fullPath), stampErr);
+
+    ExportJob job =
+        MakeExportJob(canvas, fullPath, exportCamera, exportW, exportH);
+    job.pngLevel = cfg.exportPngLevel;
+    job.svgCompact = cfg.exportSvgCompact;
+    job.svgPrecision = cfg.exportSvgPrecision;
+    job.stamp = stamp;
+    if (type == "svg") {
+      job.svg = true;
+      job.elements = std::move(exportElements);
+    } else if (NeedsTiledPng(fullPath, exportW, exportH, cfg.exportTileSize)) {
+      if (!StartTiledExport(canvas, std::move(job), std::move(exportElements),
+                            cfg.exportTileSize)) {
+        SetStatus(canvas, cfg, "Export failed: could not render");
+        return;
+      }
+      SetStatus(canvas, cfg,
+                "Exporting " + fullPath +
+                    TextFormat(" (%dx%d, tiled)...", exportW, exportH));
+      return;
+    } else {
+      job.image = RenderExportImage(canvas, exportElements, exportCamera,
+                                    exportW, exportH, cfg.exportTileSize);
+      if (!job.image.data) {
+        SetStatus(canvas, cfg, "Export failed: could not render");
+        return;
+      }
+    }
+    QueueExport(canvas, std::move(job));
+    SetStatus(canvas, cfg, "Exporting " + fullPath + "...");
+    return;
+  }
+
+  if (opLower == "artboard") {
+    if (args.empty()) {
+      SetStatus(canvas, cfg, "Usage: :artboard <name> [x y w h]");
+      return;
+    }
+    Rectangle rect{};
+    // Typed coordinates are absolute; selection and view are origin-relative.
+    double baseX = canvas.originX;
+    double baseY = canvas.originY;
+    auto parseCoord = [](const string &s, double &value) {
+      char *endPtr = nullptr;
+      value = strtod(s.c_str(), &endPtr);
+      return !s.empty() && *endPtr == '\0';
+    };
+    if (args.size() >= 5) {
+      if (!parseCoord(args[1], baseX) || !parseCoord(args[2], baseY) ||
+          !ParsePositiveFloat(args[3], rect.width) ||
+          !ParsePositiveFloat(args[4], rect.height) || rect.width <= 0.0f ||
+          rect.height <= 0.0f) {
+        SetStatus(canvas, cfg, "Usage: :artboard <name> [x y w h]");
+        return;
+      }
+    } else if (!canvas.selectedIndices.empty()) {
+      vector<Element> selected;
+      for (int idx : canvas.selectedIndices)
+        if (idx >= 0 && idx < (int)canvas.elements.size())
+          selected.push_back(canvas.elements[idx]);
+      UnionBounds(selected, rect);
+    } else {
+      Vector2 a = GetScreenToWorld2D({0.0f, 0.0f}, canvas.camera);
+      Vector2 b = GetScreenToWorld2D(
+          {(float)GetScreenWidth(), (float)GetScreenHeight()}, canvas.camera);
+      rect = {min(a.x, b.x), min(a.y, b.y), fabsf(b.x - a.x), fabsf(b.y - a.y)};
+    }
+    if (rect.width <= 0.0f || rect.height <= 0.0f) {
+      SetStatus(canvas, cfg, "Artboard would be empty");
+      return;
+    }
+    Artboard board;
+    board.name = args[0];
+    board.x = baseX + rect.x;
+    board.y = baseY + rect.y;
+    board.width = rect.width;
+    board.height = rect.height;
+    int existing = FindArtboard(canvas, board.name);
+    if (existing >= 0)
+      canvas.artboards[existing] = board;
+    else
+      canvas.artboards.push_back(board);
+    SetStatus(canvas, cfg,
+              "Artboard " + board.name +
+                  TextFormat(" (%.0fx%.0f)", rect.width, rect.height));
+    return;
+  }
+
+  if (opLower == "artboard-rm") {
+    int idx = args.empty() ? -1 : FindArtboard(canvas, args[0]);
+    if (idx < 0) {
+      SetStatus(canvas, cfg, "No such artboard");
+      return;
+    }
+    canvas.artboards.erase(canvas.artboards.begin() + idx);
+    SetStatus(canvas, cfg, "Removed artboard " + args[0]);
+    return;
+  }
+
+  if (opLower == "artboards") {
+    if (canvas.artboards.empty()) {
+      SetStatus(canvas, cfg, "No artboards");
+      return;
+    }
+    string names;
+    for (const auto &board : canvas.artboards)
+      names += (names.empty() ? "" : ", ") + board.name;
+    SetStatus(canvas, cfg, "Artboards: " + names);
+    return;
+  }
+
+  if (opLower == "export-artboards" || opLower == "export-artboards!") {
+    if (canvas.artboards.empty()) {
+      SetStatus(canvas, cfg, "No artboards to export");
+      return;
+    }
+    if (!canvas.artboardExports.empty()) {
+      SetStatus(canvas, cfg, "Artboards are already being exported");
+      return;
+    }
+    string type = "png";
+    string outDir;
+    for (const auto &a : args) {
+      if (IsExportType(a))
+        type = NormalizeExportType(a);
+      else
+        outDir = ExpandUserPath(a);
+    }
+    string prefix;
+    if (outDir.empty()) {
+      outDir = ResolveDefaultDir(
+          cfg.defaultExportDir,
+          ResolveDefaultDir(cfg.defaultSaveDir, DefaultDownloadsDir()));
+      prefix = canvas.savePath.empty()
+                   ? "untitled-"
+                   : filesystem::path(canvas.savePath).stem().string() + "-";
+    }
+    if (!EnsureDirectory(outDir)) {
+      SetStatus(canvas, cfg, "Export failed: could not create directory");
+      return;
+    }
+    StartArtboardExport(canvas, type, outDir, prefix,
+                        opLower == "export-artboards!");
+    SetStatus(canvas, cfg,
+              TextFormat("Exporting %d artboards to ",
+                         (int)canvas.artboards.size()) +
+                  outDir + "...");
+    return;
+  }
+
+  if (opLower == "timelapse") {
+    if (!canvas.timelapses.empty()) {
+      SetStatus(canvas, cfg, "A time-lapse is already being written");
+      return;
+    }
+    int fps = cfg.timelapseFps;
+    string target;
+    for (const auto &a : args) {
+      int iv = 0;
+      if (ParseIntValue(a, iv) && iv > 0)
+        fps = min(60, iv);
+      else
+        target = ExpandUserPath(a);
+    }
+    string outDir = ResolveDefaultDir(
+        cfg.defaultExportDir,
+        ResolveDefaultDir(cfg.defaultSaveDir, DefaultDownloadsDir()));
+    string stem = canvas.savePath.empty()
+                      ? "untitled"
+                      : filesystem::path(canvas.savePath).stem().string();
+    bool sequence = false;
+    string out = JoinPath(outDir, stem + "-timelapse.png");
+    if (!target.empty()) {
+      sequence = ToLower(filesystem::path(target).extension().string()) != ".png";
+      out = HasDirectoryPart(target) ? target : JoinPath(outDir, target);
+    }
+    string parent = sequence ? out : filesystem::path(out).parent_path().string();
+    if (!parent.empty() && !EnsureDirectory(parent)) {
+      SetStatus(canvas, cfg, "Time-lapse failed: could not create directory");
+      return;
+    }
+    string error;
+    if (!StartTimelapse(canvas, cfg, out, sequence, fps, error)) {
+      SetStatus(canvas, cfg, "Time-lapse failed: " + error);
+      return;
+    }
+    SetStatus(canvas, cfg,
+              "Writing time-lapse " + out +
+                  TextFormat(" (%d frames)", canvas.timelapses.back().frames));
+    return;
+  }
+
+  if (opLower == "import") {
+    if (args.size() != 1) {
+      SetStatus(canvas, cfg, "Usage: :import file.svg");
+      return;
+    }
+    string path = ExpandUserPath(args[0]);
+    if (!HasDirectoryPart(path) && !filesystem::exists(path))
+      path = JoinPath(ResolveDefaultDir(cfg.defaultOpenDir,
+                                        DefaultDownloadsDir()),
+                      path);
+    vector<Element> imported;
+    string error;
+    if (!ImportSvgFile(path, cfg.penSampleDistance * 0.25f, imported, error)) {
+      SetStatus(canvas, cfg, "Import failed: " + error);
+      return;
+    }
+    if (imported.empty()) {
+      SetStatus(canvas, cfg, "Nothing to import in " + path);
+      return;
+    }
+    for (auto &el : imported)
+      RecomputeTextBoundsRecursive(el, canvas.font, canvas.textSize);
+    Rectangle bounds;
+    UnionBounds(imported, bounds);
+    Vector2 center = GetScreenToWorld2D(
+        {GetScreenWidth() * 0.5f, GetScreenHeight() * 0.5f}, canvas.camera);
+    Vector2 delta = {center.x - (bounds.x + bounds.width * 0.5f),
+                     center.y - (bounds.y + bounds.height * 0.5f)};
+
+    SaveBackup(canvas);
+    RestoreZOrder(canvas);
+    canvas.selectedIndices.clear();
+    int count = (int)imported.size();
+    for (auto &el : imported) {
+      MoveElement(el, delta);
+      el.layer = canvas.activeLayer;
+      EnsureUniqueIDRecursive(el, canvas);
+      canvas.elements.push_back(move(el));
+      canvas.selectedIndices.push_back((int)canvas.elements.size() - 1);
+    }
+    SetStatus(canvas, cfg,
+              TextFormat("Imported %d elements from ", count) +
+                  filesystem::path(path).filename().string());
+    return;
+  }
+
+  if (opLower == "plot") {
+    if (args.empty() || args.size() > 3) {
+      SetStatus(canvas, cfg, "Usage: :plot file.csv [xcol ycol]");
+      return;
+    }
+    string path = ExpandUserPath(args[0]);
+    if (!HasDirectoryPart(path) && !filesystem::exists(path))
+      path = JoinPath(ResolveDefaultDir(cfg.defaultOpenDir,
+                                        DefaultDownloadsDir()),
+                      path);
+    string xcol = args.size() == 3 ? args[1] : "";
+    string ycol = args.size() == 3 ? args[2] : (args.size() == 2 ? args[1] : "");
+    PlotDecimator dec;
+    dec.column = PlotPixelColumn(canvas);
+    long long rows = 0;
+    string error;
+    if (!PlotCsvFile(path, xcol, ycol, dec, rows, error)) {
+      SetStatus(canvas, cfg, "Plot failed: " + error);
+      return;
+    }
+    if (dec.segments.empty()) {
+      SetStatus(canvas, cfg, "No numeric rows in " + path);
+      return;
+    }
+    SaveBackup(canvas);
+    RestoreZOrder(canvas);
+    Element plot = PlotElement(canvas, dec, canvas.drawColor,
+                               canvas.strokeWidth,
+                               cfg.penSampleDistance * 0.25f);
+    EnsureUniqueIDRecursive(plot, canvas);
+    plot.layer = canvas.activeLayer;
+    canvas.elements.push_back(move(plot));
+    canvas.selectedIndices = {(int)canvas.elements.size() - 1};
+    canvas.bgType = BG_GRAPH;
+    size_t kept = 0;
+    for (const auto &seg : dec.segments)
+      kept += seg.size();
+    SetStatus(canvas, cfg,
+              TextFormat("Plotted %lld rows (%d points) from ", rows,
+                         (int)kept) +
+                  filesystem::path(path).filename().string());
+    return;
+  }
+
+  if (opLower == "points") {
+    if (args.empty() || args.size() > 3) {
+      SetStatus(canvas, cfg, "Usage: :points file.csv [xcol ycol]");
+      return;
+    }
+    string path = ExpandUserPath(args[0]);
+    if (!HasDirectoryPart(path) && !filesystem::exists(path))
+      path = JoinPath(ResolveDefaultDir(cfg.defaultOpenDir,
+                                        DefaultDownloadsDir()),
+                      path);
+    string xcol = args.size() == 3 ? args[1] : "";
+    string ycol = args.size() == 3 ? args[2] : (args.size() == 2 ? args[1] : "");
+    CloudCollector rows;
+    long long count = 0;
+    string error;
+    if (!PlotCsvFile(path, xcol, ycol, rows, count, error)) {
+      SetStatus(canvas, cfg, "Points failed: " + error);
+      return;
+    }
+    if (rows.points.empty()) {
+      SetStatus(canvas, cfg, "No numeric rows in " + path);
+      return;
+    }
+    SaveBackup(canvas);
+    RestoreZOrder(canvas);
+    Element cloud = SvgShape(POINTS_MODE, canvas.drawColor, canvas.strokeWidth);
+    cloud.path.reserve(rows.points.size());
+    for (const auto &p : rows.points)
+      cloud.path.push_back(PlotToWorld(canvas, p));
+    cloud.start = cloud.end = cloud.path[0];
+    EnsureUniqueIDRecursive(cloud, canvas);
+    cloud.layer = canvas.activeLayer;
+    canvas.elements.push_back(move(cloud));
+    canvas.selectedIndices = {(int)canvas.elements.size() - 1};
+    canvas.bgType = BG_GRAPH;
+    SetStatus(canvas, cfg,
+              TextFormat("Loaded %d points from ", (int)rows.points.size()) +
+                  filesystem::path(path).filename().string());
+    return;
+  }
+
+  if (opLower == "stream") {
+    LiveStream &stream = canvas.stream;
+    string sub = args.size() == 1 ? ToLower(args[0]) : "";
+    if (args.size() != 1) {
+      SetStatus(canvas, cfg,
+                "Usage: :stream <file|fifo|unix:socket> | off | follow | keep");
+    } else if (sub == "off") {
+      CloseLiveStream(stream);
+      SetStatus(canvas, cfg, "Stream stopped");
+    } else if (sub == "follow") {
+      stream.follow = true;
+      stream.followX = canvas.camera.target.x + canvas.originX;
+      stream.followY = canvas.camera.target.y + canvas.originY;
+      SetStatus(canvas, cfg, "Following stream");
+    } else if (sub == "keep") {
+      if (stream.count == 0) {
+        SetStatus(canvas, cfg, "Stream has no samples");
+        return;
+      }
+      PlotDecimator dec;
+      dec.column = PlotPixelColumn(canvas);
+      for (size_t i = 0; i < stream.count; i++)
+        dec.Push(StreamSample(stream, i));
+      dec.Finish();
+      SaveBackup(canvas);
+      RestoreZOrder(canvas);
+      Element plot = PlotElement(canvas, dec, stream.color, stream.strokeWidth,
+                                 cfg.penSampleDistance * 0.25f);
+      EnsureUniqueIDRecursive(plot, canvas);
+      plot.layer = canvas.activeLayer;
+      canvas.elements.push_back(move(plot));
+      canvas.selectedIndices = {(int)canvas.elements.size() - 1};
+      SetStatus(canvas, cfg,
+                TextFormat("Kept %d stream samples", (int)stream.count));
+    } else {
+      string error;
+      if (!OpenLiveStream(stream, args[0], cfg.streamCapacity, error)) {
+        SetStatus(canvas, cfg, "Stream failed: " + error);
+        return;
+      }
+      stream.color = canvas.drawColor;
+      stream.strokeWidth = canvas.strokeWidth;
+      stream.followX = canvas.camera.target.x + canvas.originX;
+      stream.followY = canvas.camera.target.y + canvas.originY;
+      canvas.bgType = BG_GRAPH;
+      SetStatus(canvas, cfg, "Streaming " + args[0]);
+    }
+    return;
+  }
+
+  if (opLower == "fn") {
+    string rest = Trim(command.substr(op.size()));
+    string sub = ToLower(rest);
+    if (rest.empty()) {
+      if (canvas.functions.empty()) {
+        SetStatus(canvas, cfg, "Usage: :fn y = <expr> | rm [n] | clear");
+        return;
+      }
+      string list;
+      for (size_t i = 0; i < canvas.functions.size(); i++)
+        list += TextFormat("%s%d: y = ", i ? "  " : "", (int)i + 1) +
+                canvas.functions[i].expr;
+      SetStatus(canvas, cfg, list, 6.0);
+    } else if (sub == "clear") {
+      canvas.functions.clear();
+      SetStatus(canvas, cfg, "Functions cleared");
+    } else if (sub == "rm" || sub.rfind("rm ", 0) == 0) {
+      int n = (int)canvas.functions.size();
+      if (sub != "rm" && !ParseIntValue(Trim(rest.substr(3)), n)) {
+        SetStatus(canvas, cfg, "Usage: :fn rm [n]");
+        return;
+      }
+      if (n < 1 || n > (int)canvas.functions.size()) {
+        SetStatus(canvas, cfg, "No such function");
+        return;
+      }
+      canvas.functions.erase(canvas.functions.begin() + (n - 1));
+      SetStatus(canvas, cfg, TextFormat("Removed function %d", n));
+    } else {
+      FnProgram program;
+      string error;
+      if (!CompileFn(rest, program, error)) {
+        SetStatus(canvas, cfg, "Function error: " + error);
+        return;
       }
+      GraphFunction fn;
+      fn.expr = Trim(rest);
+      if (fn.expr.size() > 1 && tolower((unsigned char)fn.expr[0]) == 'y') {
+        size_t eq = fn.expr.find_first_not_of(" \t", 1);
+        if (eq != string::npos && fn.expr[eq] == '=')
+          fn.expr = Trim(fn.expr.substr(eq + 1));
+      }
+      fn.color = canvas.drawColor;
+      fn.strokeWidth = canvas.strokeWidth;
+      canvas.functions.push_back(fn);
+      canvas.bgType = BG_GRAPH;
+      SetStatus(canvas, cfg, "y = " + fn.expr);
     }
+    return;
+  }
 
-    vector<string> rest;
-    for (int i = 0; i < (int)normalized.size(); i++) {
-      bool isType = (i == typeIdx) && IsExportType(normalized[i]);
-      bool isScope = IsExportScopeToken(normalized[i]);
-      if (!isType && !isScope)
-        rest.push_back(normalized[i]);
-    }
-
-    filesystem::path basePath =
-        canvas.savePath.empty() ? filesystem::path("untitled")
-                                : filesystem::path(canvas.savePath).stem();
-    string filename = basePath.filename().string();
-    if (filename.empty())
-      filename = "untitled";
-    string outDir =
-        ResolveDefaultDir(cfg.defaultExportDir, ResolveDefaultDir(cfg.defaultSaveDir,
-                                                                  DefaultDownloadsDir()));
-
-    if (rest.size() == 1) {
-      if (LooksLikeDirPath(rest[0]))
-        outDir = ExpandUserPath(rest[0]);
+  if (opLower == "layer") {
+    string sub = args.empty() ? "" : ToLower(args[0]);
+    const char *usage = "Usage: :layer [<layer> | add [name] | hide | show | "
+                        "lock | unlock | opacity <v> | rm | send <layer>]";
+    auto findLayer = [&](const string &token) -> int {
+      int number = 0;
+      if (ParseIntValue(token, number))
+        return number >= 1 && number <= (int)canvas.layers.size() ? number - 1
+                                                                   : -1;
+      for (size_t i = 0; i < canvas.layers.size(); i++)
+        if (canvas.layers[i].name == token)
+          return (int)i;
+      return -1;
+    };
+    auto targetLayer = [&](size_t pos) -> int {
+      if (args.size() <= pos)
+        return canvas.layers.empty() ? -1 : canvas.activeLayer;
+      return findLayer(args[pos]);
+    };
+    if (args.empty()) {
+      if (canvas.layers.empty()) {
+        SetStatus(canvas, cfg, "No layers; :layer add <name> creates one");
+        return;
+      }
+      string list;
+      for (size_t i = 0; i < canvas.layers.size(); i++) {
+        const Layer &layer = canvas.layers[i];
+        list += (list.empty() ? "" : "  ") +
+                string((int)i == canvas.activeLayer ? "*" : "") +
+                to_string(i + 1) + " " + layer.name;
+        if (!layer.visible)
+          list += " (hidden)";
+        if (layer.locked)
+          list += " (locked)";
+        if (layer.opacity < 1.0f)
+          list += TextFormat(" %d%%", (int)roundf(layer.opacity * 100));
+      }
+      SetStatus(canvas, cfg, list, 6.0);
+    } else if (sub == "add" && args.size() <= 2) {
+      if (canvas.layers.empty())
+        canvas.layers.push_back({"Layer 1"});
+      Layer layer;
+      layer.name = args.size() == 2
+                       ? args[1]
+                       : "Layer " + to_string(canvas.layers.size() + 1);
+      if (findLayer(layer.name) >= 0) {
+        SetStatus(canvas, cfg, "Layer " + layer.name + " already exists");
+        return;
+      }
+      canvas.layers.push_back(layer);
+      canvas.activeLayer = (int)canvas.layers.size() - 1;
+      SetStatus(canvas, cfg, "Drawing on new layer " + layer.name);
+    } else if ((sub == "hide" || sub == "show" || sub == "lock" ||
+                sub == "unlock") &&
+               args.size() <= 2) {
+      int index = targetLayer(1);
+      if (index < 0) {
+        SetStatus(canvas, cfg, "Unknown layer");
+        return;
+      }
+      Layer &layer = canvas.layers[index];
+      if (sub == "hide" || sub == "show")
+        layer.visible = sub == "show";
       else
-        filename = filesystem::path(rest[0]).stem().string();
-    } else if (rest.size() >= 2) {
-      bool firstLooksDir = LooksLikeDirPath(rest[0]) || HasDirectoryPart(rest[0]);
-      bool secondLooksDir = LooksLikeDirPath(rest[1]) || HasDirectoryPart(rest[1]);
-      if (firstLooksDir && !secondLooksDir) {
-        outDir = ExpandUserPath(rest[0]);
-        filename = filesystem::path(rest[1]).stem().string();
-      } else {
-        filename = filesystem::path(rest[0]).stem().string();
-        outDir = ExpandUserPath(rest[1]);
+        layer.locked = sub == "lock";
+      if (sub == "hide" || sub == "lock") {
+        RestoreZOrder(canvas);
+        canvas.selectedIndices.clear();
+      }
+      SetStatus(canvas, cfg,
+                "Layer " + layer.name +
+                    (sub == "hide"   ? " hidden"
+                     : sub == "show" ? " shown"
+                     : sub == "lock" ? " locked"
+                                     : " unlocked"));
+    } else if (sub == "opacity" && (args.size() == 2 || args.size() == 3)) {
+      int index = targetLayer(2);
+      float value = 0.0f;
+      if (index < 0 || !ParsePositiveFloat(args[1], value) || value < 0.0f) {
+        SetStatus(canvas, cfg, "Usage: :layer opacity <0-1 or percent> [layer]");
+        return;
+      }
+      if (value > 1.0f)
+        value /= 100.0f;
+      canvas.layers[index].opacity = Clamp(value, 0.0f, 1.0f);
+      SetStatus(canvas, cfg,
+                TextFormat("Layer %s at %d%%",
+                           canvas.layers[index].name.c_str(),
+                           (int)roundf(canvas.layers[index].opacity * 100)));
+    } else if (sub == "rm" && args.size() <= 2) {
+      int index = targetLayer(1);
+      if (index < 0 || canvas.layers.size() < 2) {
+        SetStatus(canvas, cfg,
+                  index < 0 ? "Unknown layer" : "Cannot remove the last layer");
+        return;
+      }
+      // The layer folds into a neighbour, so removing it never deletes drawing.
+      int into = index > 0 ? index - 1 : 0;
+      SaveBackup(canvas);
+      RestoreZOrder(canvas);
+      canvas.selectedIndices.clear();
+      for (auto &el : canvas.elements) {
+        int layer = ElementLayer(canvas, el);
+        el.layer = layer == index ? into : layer > index ? layer - 1 : layer;
+      }
+      string name = canvas.layers[index].name;
+      canvas.layers.erase(canvas.layers.begin() + index);
+      if (canvas.activeLayer > index ||
+          canvas.activeLayer >= (int)canvas.layers.size())
+        canvas.activeLayer--;
+      SetStatus(canvas, cfg,
+                "Removed layer " + name + "; its elements are on " +
+                    canvas.layers[into].name);
+    } else if (sub == "send" && args.size() == 2) {
+      int index = findLayer(args[1]);
+      if (index < 0) {
+        SetStatus(canvas, cfg, "Unknown layer " + args[1]);
+        return;
+      }
+      if (canvas.selectedIndices.empty()) {
+        SetStatus(canvas, cfg, "Select elements to send first");
+        return;
+      }
+      SaveBackup(canvas);
+      for (int idx : canvas.selectedIndices)
+        if (idx >= 0 && idx < (int)canvas.elements.size())
+          canvas.elements[idx].layer = index;
+      SetStatus(canvas, cfg, "Sent selection to " + canvas.layers[index].name);
+    } else if (args.size() == 1) {
+      int index = findLayer(args[0]);
+      if (index < 0) {
+        SetStatus(canvas, cfg, "Unknown layer " + args[0]);
+        return;
       }
+      canvas.activeLayer = index;
+      SetStatus(canvas, cfg, "Drawing on layer " + canvas.layers[index].name);
+    } else {
+      SetStatus(canvas, cfg, usage);
     }
+    return;
+  }
 
-    if (filename.empty())
-      filename = "untitled";
-    string outName = EnsureExt(filename, type);
-    if (!EnsureDirectory(outDir)) {
-      SetStatus(canvas, cfg, "Export failed: could not create directory");
+  if (opLower == "array") {
+    bool radial = !args.empty() && ToLower(args[0]) == "radial";
+    const char *usage =
+        "Usage: :array <nx> <ny> <dx> <dy> | radial <n> <dx> <dy> [degrees]";
+    int nx = 0;
+    int ny = 1;
+    float dx = 0.0f;
+    float dy = 0.0f;
+    float degrees = 360.0f;
+    bool parsed =
+        radial ? (args.size() == 4 || args.size() == 5) &&
+                     ParseIntValue(args[1], nx) &&
+                     ParsePositiveFloat(args[2], dx) &&
+                     ParsePositiveFloat(args[3], dy) &&
+                     (args.size() == 4 || ParsePositiveFloat(args[4], degrees))
+               : args.size() == 4 && ParseIntValue(args[0], nx) &&
+                     ParseIntValue(args[1], ny) &&
+                     ParsePositiveFloat(args[2], dx) &&
+                     ParsePositiveFloat(args[3], dy);
+    if (!parsed || nx < 1 || ny < 1 || (long long)nx * ny < 2 ||
+        !isfinite(dx) || !isfinite(dy) || !isfinite(degrees)) {
+      SetStatus(canvas, cfg, usage);
       return;
     }
-    string fullPath = JoinPath(outDir, outName);
-
-    vector<Element> exportElements;
-    Camera2D exportCamera{};
-    int exportW = 0;
-    int exportH = 0;
-    string exportErr;
-    float sceneScale = (type == "svg") ? 1.0f : cfg.exportRasterScale;
-    if (!BuildExportScene(canvas, scope, sceneScale, exportElements,
-                          exportCamera, exportW, exportH, exportErr)) {
-      SetStatus(canvas, cfg, "Export failed: " + exportErr);
+    vector<int> sorted;
+    for (int idx : canvas.selectedIndices)
+      if (idx >= 0 && idx < (int)canvas.elements.size())
+        sorted.push_back(idx);
+    sort(sorted.begin(), sorted.end());
+    sorted.erase(unique(sorted.begin(), sorted.end()), sorted.end());
+    if (sorted.empty()) {
+      SetStatus(canvas, cfg, "Select elements to array first");
       return;
     }
+    vector<Element> items;
+    items.reserve(sorted.size());
+    long long idsPerCopy = 0;
+    for (int idx : sorted) {
+      items.push_back(canvas.elements[idx]);
+      idsPerCopy += CountElementIDs(items.back());
+    }
+    // Checked in 64 bits before allocating, so the id counter cannot wrap.
+    const long long kMaxArrayElements = 1000000;
+    long long copyCount = (long long)nx * ny - 1;
+    long long totalElements = copyCount * (long long)items.size();
+    long long totalIds = copyCount * idsPerCopy;
+    if (totalElements > kMaxArrayElements ||
+        totalIds > kMaxArrayElements * 16) {
+      SetStatus(canvas, cfg,
+                TextFormat("Array too large (%lld elements, %lld at most)",
+                           totalElements, kMaxArrayElements));
+      return;
+    }
+    if ((long long)canvas.nextElementId + totalIds >
+        (long long)numeric_limits<int>::max()) {
+      SetStatus(canvas, cfg, "Array would run out of element ids");
+      return;
+    }
+    Rectangle bounds;
+    UnionBounds(items, bounds);
+    Vector2 pivot = Vector2Add(RectCenter(bounds), {dx, dy});
+    int copies = (int)copyCount;
+    float step = degrees * DEG2RAD /
+                 (fabsf(degrees) >= 360.0f ? (float)nx : (float)(nx - 1));
+
+    SaveBackup(canvas);
+    RestoreZOrder(canvas);
+    int nextId = canvas.nextElementId;
+    canvas.nextElementId += (int)totalIds;
+    canvas.elements.reserve(canvas.elements.size() +
+                            (size_t)copies * items.size());
+    canvas.selectedIndices.reserve((size_t)copies * items.size());
+    for (int c = 1; c <= copies; c++) {
+      Vector2 offset = {(c % nx) * dx, (c / nx) * dy};
+      for (const auto &item : items) {
+        Element copy = item;
+        AssignElementIDs(copy, nextId);
+        if (radial)
+          RotateAboutPivot(copy, pivot, step * c);
+        else
+          MoveElement(copy, offset);
+        canvas.elements.push_back(move(copy));
+        canvas.selectedIndices.push_back((int)canvas.elements.size() - 1);
+      }
+    }
+    SetStatus(canvas, cfg, TextFormat("Arrayed %d copies", copies));
+    return;
+  }
 
-    bool ok = false;
-    if (type == "svg")
-      ok = ExportCanvasSvg(canvas, fullPath, exportElements, exportCamera, exportW,
-                           exportH);
-    else
-      ok = ExportCanvasRaster(canvas, fullPath, exportElements, exportCamera,
-                              exportW, exportH);
-
-    if (ok)
-      SetStatus(canvas, cfg, "Exported " + fullPath);
-    else
-      SetStatus(canvas, cfg, "Export failed");
+  if (opLower == "symbol") {
+    string sub = args.empty() ? "" : ToLower(args[0]);
+    auto usesInScene = [&](const string &name) {
+      int count = 0;
+      for (const auto &el : canvas.elements)
+        count += CountInstances(el, name);
+      return count;
+    };
+    if (args.empty()) {
+      if (canvas.symbols.empty()) {
+        SetStatus(canvas, cfg,
+                  "Usage: :symbol <name> | edit | place <name> | rm <name>");
+        return;
+      }
+      string list;
+      for (const auto &sym : canvas.symbols)
+        list += (list.empty() ? "" : "  ") + sym.name +
+                TextFormat(" (%d)", usesInScene(sym.name));
+      SetStatus(canvas, cfg, list, 6.0);
+    } else if (sub == "edit" && args.size() == 1) {
+      int idx = canvas.selectedIndices.size() == 1 ? canvas.selectedIndices[0]
+                                                   : -1;
+      if (idx < 0 || idx >= (int)canvas.elements.size() ||
+          canvas.elements[idx].type != INSTANCE_MODE) {
+        SetStatus(canvas, cfg, "Select one symbol instance to edit");
+        return;
+      }
+      int index = FindSymbol(canvas.symbols, canvas.elements[idx].text);
+      if (index < 0) {
+        SetStatus(canvas, cfg, "Unknown symbol " + canvas.elements[idx].text);
+        return;
+      }
+      SaveBackup(canvas);
+      Element inst = canvas.elements[idx];
+      canvas.elements.erase(canvas.elements.begin() + idx);
+      vector<Element> parts = BakeInstance(canvas.symbols[index], inst,
+                                           canvas.font, canvas.textSize);
+      canvas.selectedIndices.clear();
+      for (auto &part : parts) {
+        ClearElementIDs(part);
+        EnsureUniqueIDRecursive(part, canvas);
+        part.layer = inst.layer;
+        canvas.elements.push_back(move(part));
+        canvas.selectedIndices.push_back((int)canvas.elements.size() - 1);
+      }
+      canvas.symbolEdit = inst;
+      SetStatus(canvas, cfg,
+                "Editing " + inst.text + "; :symbol " + inst.text +
+                    " applies it to every instance");
+    } else if (sub == "place" && args.size() == 2) {
+      int index = FindSymbol(canvas.symbols, args[1]);
+      if (index < 0) {
+        SetStatus(canvas, cfg, "Unknown symbol " + args[1]);
+        return;
+      }
+      const Rectangle &frame = canvas.symbols[index].frame;
+      Vector2 center = GetScreenToWorld2D(
+          {GetScreenWidth() * 0.5f, GetScreenHeight() * 0.5f}, canvas.camera);
+      SaveBackup(canvas);
+      RestoreZOrder(canvas);
+      Element inst =
+          SvgShape(INSTANCE_MODE, canvas.drawColor, canvas.strokeWidth);
+      inst.text = args[1];
+      inst.start = {center.x - frame.width * 0.5f,
+                    center.y - frame.height * 0.5f};
+      inst.end = {center.x + frame.width * 0.5f,
+                  center.y + frame.height * 0.5f};
+      EnsureUniqueIDRecursive(inst, canvas);
+      inst.layer = canvas.activeLayer;
+      canvas.elements.push_back(move(inst));
+      canvas.selectedIndices = {(int)canvas.elements.size() - 1};
+      SetStatus(canvas, cfg, "Placed " + args[1]);
+    } else if (sub == "rm" && args.size() == 2) {
+      int index = FindSymbol(canvas.symbols, args[1]);
+      if (index < 0) {
+        SetStatus(canvas, cfg, "Unknown symbol " + args[1]);
+        return;
+      }
+      int count = usesInScene(args[1]);
+      if (count > 0) {
+        SetStatus(canvas, cfg,
+                  args[1] + TextFormat(" is used by %d instances", count));
+        return;
+      }
+      SaveBackup(canvas);
+      canvas.symbols.erase(canvas.symbols.begin() + index);
+      TouchSymbol(canvas, args[1]);
+      if (canvas.symbolEdit.text == args[1])
+        canvas.symbolEdit.text.clear();
+      SetStatus(canvas, cfg, "Removed symbol " + args[1]);
+    } else if (args.size() == 1) {
+      const string &name = args[0];
+      vector<int> sorted;
+      for (int idx : canvas.selectedIndices)
+        if (idx >= 0 && idx < (int)canvas.elements.size())
+          sorted.push_back(idx);
+      sort(sorted.begin(), sorted.end());
+      sorted.erase(unique(sorted.begin(), sorted.end()), sorted.end());
+      if (sorted.empty()) {
+        SetStatus(canvas, cfg, "Select the elements of the symbol first");
+        return;
+      }
+      int index = FindSymbol(canvas.symbols, name);
+      if (index >= 0 && canvas.symbolEdit.text != name) {
+        SetStatus(canvas, cfg,
+                  "Symbol " + name + " exists; use :symbol edit on an instance");
+        return;
+      }
+      for (int idx : sorted) {
+        if (CountInstances(canvas.elements[idx], name) > 0) {
+          SetStatus(canvas, cfg, "A symbol cannot contain itself");
+          return;
+        }
+      }
+      SaveBackup(canvas);
+      vector<Element> picked;
+      for (int idx : sorted)
+        picked.push_back(canvas.elements[idx]);
+      for (auto it = sorted.rbegin(); it != sorted.rend(); ++it)
+        canvas.elements.erase(canvas.elements.begin() + *it);
+      int layer = 0;
+      for (auto &el : picked) {
+        ClearElementIDs(el);
+        layer = max(layer, el.layer);
+      }
+      Element inst;
+      if (index >= 0) {
+        SymbolDef &sym = canvas.symbols[index];
+        inst = canvas.symbolEdit;
+        UnbakeInstance(sym, inst, picked, canvas.font, canvas.textSize);
+        sym.elements = move(picked);
+        TouchSymbol(canvas, sym.name);
+        canvas.symbolEdit.text.clear();
+      } else {
+        SymbolDef sym;
+        sym.name = name;
+        UnionBounds(picked, sym.frame);
+        sym.elements = move(picked);
+        inst = SvgShape(INSTANCE_MODE, canvas.drawColor, canvas.strokeWidth);
+        inst.text = name;
+        inst.layer = layer;
+        inst.start = {sym.frame.x, sym.frame.y};
+        inst.end = {sym.frame.x + sym.frame.width,
+                    sym.frame.y + sym.frame.height};
+        canvas.symbols.push_back(move(sym));
+        TouchSymbol(canvas, name);
+      }
+      inst.uniqueID = -1;
+      inst.originalIndex = -1;
+      EnsureUniqueIDRecursive(inst, canvas);
+      canvas.elements.push_back(move(inst));
+      canvas.selectedIndices = {(int)canvas.elements.size() - 1};
+      if (index >= 0)
+        SetStatus(canvas, cfg,
+                  TextFormat("Updated %s (%d instances)", name.c_str(),
+                             usesInScene(name)));
+      else
+        SetStatus(canvas, cfg, "Defined symbol " + name);
+    } else {
+      SetStatus(canvas, cfg,
+                "Usage: :symbol <name> | edit | place <name> | rm <name>");
+    }
     return;
   }
 
@@ -3024,6 +12212,14 @@ void ExecuteCommand(Canvas &canvas, AppConfig &cfg, string command) {
     SetDefaultKeymap(cfg);
     LoadConfig(cfg);
     SetTheme(canvas, cfg, canvas.darkTheme);
+    ApplyUndoConfig(canvas, cfg);
+    canvas.journal.flushSeconds = cfg.journalFlushSeconds;
+    canvas.autosave.intervalSeconds = cfg.autosaveSeconds;
+    if (canvas.journal.enabled != cfg.journalEnabled) {
+      canvas.journal.enabled = cfg.journalEnabled;
+      AttachJournal(canvas, canvas.savePath.empty() ? UnsavedJournalBase(cfg)
+                                                    : canvas.savePath);
+    }
     SetStatus(canvas, cfg, "Config reloaded");
     return;
   }
@@ -3037,10 +12233,283 @@ void ExecuteCommand(Canvas &canvas, AppConfig &cfg, string command) {
   SetStatus(canvas, cfg, "Unknown command: " + op);
 }
 
-int main() {
+void LoadStartupFont(Canvas &canvas, const AppConfig &cfg) {
+  canvas.font =
+      LoadFontEx(cfg.defaultFontPath.c_str(), max(16, cfg.fontAtlasSize), nullptr, 0);
+  if (canvas.font.texture.id == 0) {
+    canvas.font = GetFontDefault();
+    canvas.ownsFont = false;
+    canvas.fontFamilyPath = "default";
+  } else {
+    canvas.ownsFont = true;
+    canvas.fontFamilyPath = cfg.defaultFontPath;
+  }
+  SetTextureFilter(canvas.font.texture, TEXTURE_FILTER_BILINEAR);
+}
+
+struct RenderOptions {
+  vector<string> inputs;
+  string out;
+  string type;
+  ExportScope scope = EXPORT_ALL;
+  float scale = 0.0f;
+  int dark = -1;
+  bool software = false;
+  bool force = false;
+};
+
+bool IsRenderInvocation(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg == "--render" || arg == "--help" || arg == "-h")
+      return true;
+  }
+  return false;
+}
+
+void PrintRenderUsage() {
+  fprintf(stderr,
+          "usage: toggle --render <file.toggle|dir>... [--out <file|dir>]\n"
+          "              [--type png|jpg|svg] [--scope all|frame] [--scale n]\n"
+          "              [--theme light|dark] [--software] [--force]\n");
+}
+
+bool ParseRenderArgs(int argc, char **argv, RenderOptions &opts, string &error) {
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    string value = hasValue ? argv[i + 1] : "";
+    if (arg == "--render") {
+      if (!hasValue) {
+        error = "--render needs a file";
+        return false;
+      }
+      opts.inputs.push_back(ExpandUserPath(value));
+      i++;
+    } else if (arg == "--out") {
+      if (!hasValue) {
+        error = "--out needs a path";
+        return false;
+      }
+      opts.out = ExpandUserPath(value);
+      i++;
+    } else if (arg == "--type") {
+      if (!IsExportType(value)) {
+        error = "--type must be png, jpg or svg";
+        return false;
+      }
+      opts.type = NormalizeExportType(value);
+      i++;
+    } else if (arg == "--scope") {
+      if (!IsExportScopeToken(value)) {
+        error = "--scope must be all or frame";
+        return false;
+      }
+      opts.scope = ParseExportScope(value);
+      if (opts.scope == EXPORT_SELECTED) {
+        error = "--scope selected needs an interactive session";
+        return false;
+      }
+      i++;
+    } else if (arg == "--scale") {
+      float fv = 0.0f;
+      if (!ParsePositiveFloat(value, fv) || fv <= 0.0f) {
+        error = "--scale must be a positive number";
+        return false;
+      }
+      opts.scale = min(64.0f, fv);
+      i++;
+    } else if (arg == "--theme") {
+      string theme = ToLower(value);
+      if (theme != "light" && theme != "dark") {
+        error = "--theme must be light or dark";
+        return false;
+      }
+      opts.dark = theme == "dark" ? 1 : 0;
+      i++;
+    } else if (arg == "--software") {
+      opts.software = true;
+    } else if (arg == "--force") {
+      opts.force = true;
+    } else if (arg == "--help" || arg == "-h") {
+      return false;
+    } else if (!arg.empty() && arg[0] != '-') {
+      opts.inputs.push_back(ExpandUserPath(arg));
+    } else {
+      error = "unknown option " + arg;
+      return false;
+    }
+  }
+  if (opts.inputs.empty()) {
+    error = "nothing to render";
+    return false;
+  }
+  return true;
+}
+
+vector<string> ExpandRenderInputs(const vector<string> &inputs) {
+  vector<string> files;
+  for (const auto &input : inputs) {
+    error_code ec;
+    if (!filesystem::is_directory(input, ec)) {
+      files.push_back(input);
+      continue;
+    }
+    vector<string> found;
+    for (const auto &entry : filesystem::directory_iterator(input, ec)) {
+      if (entry.is_regular_file(ec) &&
+          ToLower(entry.path().extension().string()) == ".toggle")
+        found.push_back(entry.path().string());
+    }
+    sort(found.begin(), found.end());
+    files.insert(files.end(), found.begin(), found.end());
+  }
+  return files;
+}
+
+int RunHeadlessRender(AppConfig &cfg, int argc, char **argv) {
+  RenderOptions opts;
+  string error;
+  if (!ParseRenderArgs(argc, argv, opts, error)) {
+    if (!error.empty())
+      fprintf(stderr, "toggle: %s\n", error.c_str());
+    PrintRenderUsage();
+    return error.empty() ? 0 : 2;
+  }
+  vector<string> files = ExpandRenderInputs(opts.inputs);
+  if (files.empty()) {
+    fprintf(stderr, "toggle: no .toggle files found\n");
+    return 2;
+  }
+  error_code ec;
+  bool outIsDir = files.size() > 1 || LooksLikeDirPath(opts.out) ||
+                  filesystem::is_directory(opts.out, ec);
+  string type = opts.type;
+  if (type.empty() && !outIsDir) {
+    string ext = filesystem::path(opts.out).extension().string();
+    type = IsExportType(ext.empty() ? "" : ext.substr(1))
+               ? NormalizeExportType(ext.substr(1))
+               : "png";
+  }
+  if (type.empty())
+    type = "png";
+  if (outIsDir && !opts.out.empty() && !EnsureDirectory(opts.out)) {
+    fprintf(stderr, "toggle: could not create %s\n", opts.out.c_str());
+    return 1;
+  }
+
+  SetTraceLogLevel(LOG_WARNING);
+  bool software = opts.software;
+  if (!software) {
+    SetConfigFlags(FLAG_WINDOW_HIDDEN);
+    InitWindow(cfg.windowWidth, cfg.windowHeight, cfg.windowTitle.c_str());
+    if (!IsWindowReady()) {
+      fprintf(stderr, "toggle: no GL context, using the software renderer\n");
+      software = true;
+    }
+  }
+  Canvas canvas;
+  SoftwareFont softFont;
+  if (software) {
+    if (LoadSoftwareFont(softFont, cfg.defaultFontPath, cfg.fontAtlasSize)) {
+      canvas.font = softFont.font;
+      canvas.fontFamilyPath = cfg.defaultFontPath;
+    } else {
+      fprintf(stderr, "toggle: could not load %s, text will be skipped\n",
+              cfg.defaultFontPath.c_str());
+    }
+    canvas.ownsFont = false;
+  } else {
+    LoadStartupFont(canvas, cfg);
+  }
+  Vector2 viewSize = {(float)cfg.windowWidth, (float)cfg.windowHeight};
+  if (!software)
+    viewSize = {(float)GetScreenWidth(), (float)GetScreenHeight()};
+  SetTheme(canvas, cfg, opts.dark < 0 ? cfg.defaultDarkTheme : opts.dark == 1);
+  canvas.camera.zoom = 1.0f;
+  float scale = opts.scale > 0.0f ? opts.scale : cfg.exportRasterScale;
+
+  int failures = 0;
+  for (const auto &file : files) {
+    SceneDocument doc;
+    if (!ParseSceneFile(file, doc)) {
+      fprintf(stderr, "toggle: could not read %s\n", file.c_str());
+      failures++;
+      continue;
+    }
+    ApplySceneDocument(canvas, doc);
+    canvas.camera.offset =
+        canvas.bgType == BG_GRAPH
+            ? Vector2{viewSize.x * 0.5f, viewSize.y * 0.5f}
+            : Vector2{0.0f, 0.0f};
+
+    string stem = filesystem::path(file).stem().string();
+    string outPath;
+    if (outIsDir)
+      outPath = JoinPath(opts.out.empty() ? filesystem::path(file).parent_path().string()
+                                          : opts.out,
+                         EnsureExt(stem, type));
+    else if (!opts.out.empty())
+      outPath = EnsureExt(opts.out, type);
+    else
+      outPath = filesystem::path(file).replace_extension("." + type).string();
+
+    vector<Element> elements;
+    Camera2D camera{};
+    int width = 0;
+    int height = 0;
+    string sceneErr;
+    if (!BuildExportScene(canvas, opts.scope, type == "svg" ? 1.0f : scale,
+                          viewSize, elements, camera, width, height,
+                          sceneErr)) {
+      fprintf(stderr, "toggle: %s: %s\n", file.c_str(), sceneErr.c_str());
+      failures++;
+      continue;
+    }
+    float sceneScale = type == "svg" ? 1.0f : scale;
+    string stamp = BuildExportStamp(canvas, cfg, type, opts.scope, elements,
+                                    camera, width, height, sceneScale);
+    if (cfg.exportSkipUnchanged && !opts.force &&
+        ExportIsCurrent(outPath, stamp)) {
+      printf("%s -> %s (unchanged)\n", file.c_str(), outPath.c_str());
+      continue;
+    }
+    filesystem::remove(ExportStampPath(outPath), ec);
+    bool ok = false;
+    if (type == "svg")
+      ok = ExportCanvasSvg(canvas, outPath, elements, camera, width, height,
+                           cfg.exportSvgCompact, cfg.exportSvgPrecision);
+    else if (software)
+      ok = ExportCanvasSoftware(canvas, outPath, elements, camera, width,
+                                height, cfg.exportTileSize, cfg.exportPngLevel,
+                                softFont);
+    else
+      ok = ExportCanvasRaster(canvas, outPath, elements, camera, width, height,
+                              cfg.exportTileSize, cfg.exportPngLevel);
+    if (ok) {
+      if (cfg.exportSkipUnchanged)
+        WriteExportStamp(outPath, stamp);
+      printf("%s -> %s (%dx%d)\n", file.c_str(), outPath.c_str(), width, height);
+    } else {
+      fprintf(stderr, "toggle: could not write %s\n", outPath.c_str());
+      failures++;
+    }
+  }
+
+  if (canvas.ownsFont)
+    UnloadFont(canvas.font);
+  UnloadSoftwareFont(softFont);
+  if (!software)
+    CloseWindow();
+  return failures > 0 ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
   AppConfig cfg;
   SetDefaultKeymap(cfg);
   LoadConfig(cfg);
+  if (IsRenderInvocation(argc, argv))
+    return RunHeadlessRender(cfg, argc, argv);
 
   int screenWidth = cfg.windowWidth;
   int screenHeight = cfg.windowHeight;
@@ -3059,17 +12528,7 @@ int main() {
   canvas.camera.target = {0.0f, 0.0f};
   canvas.camera.rotation = 0.0f;
   canvas.camera.zoom = 1.0f;
-  canvas.font =
-      LoadFontEx(cfg.defaultFontPath.c_str(), max(16, cfg.fontAtlasSize), nullptr, 0);
-  if (canvas.font.texture.id == 0) {
-    canvas.font = GetFontDefault();
-    canvas.ownsFont = false;
-    canvas.fontFamilyPath = "default";
-  } else {
-    canvas.ownsFont = true;
-    canvas.fontFamilyPath = cfg.defaultFontPath;
-  }
-  SetTextureFilter(canvas.font.texture, TEXTURE_FILTER_BILINEAR);
+  LoadStartupFont(canvas, cfg);
   canvas.strokeWidth = cfg.defaultStrokeWidth;
   canvas.textSize = cfg.defaultTextSize;
   canvas.gridWidth = cfg.defaultGridWidth;
@@ -3081,6 +12540,30 @@ int main() {
   canvas.drawColor = cfg.defaultDrawColor;
   canvas.showTags = cfg.defaultShowTags;
   canvas.bgType = cfg.defaultBgType;
+  canvas.journal.enabled = cfg.journalEnabled;
+  canvas.journal.flushSeconds = cfg.journalFlushSeconds;
+  canvas.autosave.intervalSeconds = cfg.autosaveSeconds;
+  {
+    string unsaved = UnsavedJournalBase(cfg);
+    SceneDocument recovered;
+    recovered.settings = CaptureSceneSettings(canvas);
+    recovered.recovered =
+        ReplayJournal(unsaved, unsaved, recovered.elements, recovered.settings);
+    if (recovered.recovered > 0) {
+      ApplySceneDocument(canvas, recovered);
+      SetStatus(canvas, cfg,
+                "Recovered " + to_string(canvas.journal.recovered) +
+                    " journal batches");
+    } else {
+      ResetUndoTree(canvas);
+    }
+    AttachJournal(canvas, unsaved);
+    if (canvas.journal.recovered == 0)
+      remove(HistoryPathFor(unsaved).c_str());
+    canvas.recorder.enabled = cfg.historyEnabled;
+    AttachHistory(canvas, unsaved, true);
+  }
+  ApplyUndoConfig(canvas, cfg);
   SetTheme(canvas, cfg, cfg.defaultDarkTheme);
   SetMode(canvas, cfg, PEN_MODE);
   canvas.lastMouseScreen = GetMousePosition();
@@ -3097,6 +12580,9 @@ int main() {
     bool shiftDown = IsKeyDown(KEY_LEFT_SHIFT) || IsKeyDown(KEY_RIGHT_SHIFT);
     bool ctrlDown = IsKeyDown(KEY_LEFT_CONTROL) || IsKeyDown(KEY_RIGHT_CONTROL);
     bool altDown = IsKeyDown(KEY_LEFT_ALT) || IsKeyDown(KEY_RIGHT_ALT);
+    if (TickPendingOpen(canvas, cfg, escPressed && !canvas.commandMode))
+      escPressed = false;
+    TickWorldOrigin(canvas, cfg);
     if (canvas.bgType == BG_GRAPH) {
       canvas.camera.offset = {(float)GetScreenWidth() * 0.5f,
                               (float)GetScreenHeight() * 0.5f};
@@ -3358,6 +12844,17 @@ int main() {
       canvas.lastKey = 0;
     }
     NormalizeCanvasIDs(canvas);
+    TickJournal(canvas, cfg);
+    TickAutosave(canvas);
+    TickChunks(canvas);
+    TickArtboardExports(canvas, cfg);
+    TickTiledExports(canvas);
+    TickTimelapses(canvas);
+    TickLiveStream(canvas, cfg);
+    TickFunctionPlots(canvas);
+    TickPointClouds(canvas);
+    TickSymbols(canvas);
+    TickExports(canvas, cfg);
     if (canvas.isTextEditing)
       key = 0;
 
@@ -3379,7 +12876,8 @@ int main() {
         canvas.clipboard.clear();
         for (int idx : canvas.selectedIndices) {
           if (idx >= 0 && idx < (int)canvas.elements.size())
-            canvas.clipboard.push_back(canvas.elements[idx]);
+            canvas.clipboard.push_back(StoredElement(
+                canvas.elements[idx], nullptr, canvas.originX, canvas.originY));
         }
         canvas.pasteOffsetIndex = 0;
       }
@@ -3396,6 +12894,7 @@ int main() {
         Vector2 pasteOffset = {step, step};
         for (const auto &item : canvas.clipboard) {
           Element cloned = item;
+          RehomeElement(cloned, canvas.originX, canvas.originY);
 
           cloned.uniqueID = canvas.nextElementId++;
           if (cloned.type == GROUP_MODE) {
@@ -3404,6 +12903,7 @@ int main() {
           }
 
           cloned.originalIndex = -1;
+          cloned.layer = canvas.activeLayer;
 
           MoveElement(cloned, pasteOffset);
           canvas.elements.push_back(cloned);
@@ -3500,6 +13000,7 @@ int main() {
               Element g = canvas.elements[idx];
               canvas.elements.erase(canvas.elements.begin() + idx);
               for (auto &child : g.children) {
+                child.layer = g.layer;
                 canvas.elements.push_back(child);
               }
               groupHandled = true;
@@ -3521,6 +13022,7 @@ int main() {
         for (int idx : sorted) {
           if (idx >= 0 && idx < (int)canvas.elements.size()) {
             group.children.push_back(canvas.elements[idx]);
+            group.layer = max(group.layer, canvas.elements[idx].layer);
             canvas.elements.erase(canvas.elements.begin() + idx);
           }
         }
@@ -3540,7 +13042,7 @@ int main() {
         SetStatus(canvas, cfg, "Graph mode off");
       } else {
         canvas.bgType = BG_GRAPH;
-        canvas.camera.target = {0.0f, 0.0f};
+        canvas.camera.target = WorldZeroLocal(canvas);
         SetStatus(canvas, cfg, "Graph mode on");
       }
     }
@@ -3559,16 +13061,9 @@ int main() {
           IsActionPressed(cfg, "undo", shiftDown, ctrlDown, altDown);
 
       if (redoPressed) {
-        if (!canvas.redoStack.empty()) {
-          canvas.undoStack.push_back(canvas.elements);
-          canvas.elements = canvas.redoStack.back();
-          canvas.redoStack.pop_back();
+        if (StepRedo(canvas))
           canvas.selectedIndices.clear();
-        }
-      } else if (undoPressed && !canvas.undoStack.empty()) {
-        canvas.redoStack.push_back(canvas.elements);
-        canvas.elements = canvas.undoStack.back();
-        canvas.undoStack.pop_back();
+      } else if (undoPressed && StepUndo(canvas)) {
         canvas.selectedIndices.clear();
       }
     }
@@ -3598,7 +13093,8 @@ int main() {
       RestoreZOrder(canvas);
       canvas.selectedIndices.clear();
       for (int i = 0; i < (int)canvas.elements.size(); ++i)
-        canvas.selectedIndices.push_back(i);
+        if (ElementPickable(canvas, canvas.elements[i]))
+          canvas.selectedIndices.push_back(i);
     }
     if (!canvas.isTextEditing &&
         IsActionPressed(cfg, "z_backward", shiftDown, ctrlDown, altDown)) {
@@ -3636,7 +13132,8 @@ int main() {
 
        RestoreZOrder(canvas);
         int foundIdx = FindElementIndexByID(canvas, canvas.inputNumber);
-        if (foundIdx != -1) {
+        if (foundIdx != -1 &&
+            ElementPickable(canvas, canvas.elements[foundIdx])) {
           SaveBackup(canvas);
           Element selected = canvas.elements[foundIdx];
           selected.originalIndex = foundIdx;
@@ -3654,7 +13151,7 @@ int main() {
         vector<int> ids;
         ids.reserve(canvas.elements.size());
         for (const auto &el : canvas.elements) {
-          if (el.uniqueID >= 0)
+          if (el.uniqueID >= 0 && ElementPickable(canvas, el))
             ids.push_back(el.uniqueID);
         }
         sort(ids.begin(), ids.end());
@@ -3729,8 +13226,9 @@ int main() {
           for (int i = (int)canvas.elements.size() - 1; i >= 0; i--) {
             Rectangle tagHit = {canvas.elements[i].start.x,
                                 canvas.elements[i].start.y - 20, 20, 20};
-            if (IsPointOnElement(canvas.elements[i], canvas.startPoint, hitTol) ||
-                CheckCollisionPointRec(canvas.startPoint, tagHit)) {
+            if (HitSceneElement(canvas, cfg, i, canvas.startPoint, hitTol) ||
+                (ElementPickable(canvas, canvas.elements[i]) &&
+                 CheckCollisionPointRec(canvas.startPoint, tagHit))) {
               hitIndex = i;
               hit = true;
               break;
@@ -3784,7 +13282,8 @@ int main() {
                 abs(canvas.currentMouse.x - canvas.startPoint.x),
                 abs(canvas.currentMouse.y - canvas.startPoint.y)};
             for (int i = 0; i < (int)canvas.elements.size(); i++) {
-              if (ElementIntersectsRect(canvas.elements[i], selectionBox,
+              if (ElementPickable(canvas, canvas.elements[i]) &&
+                  ElementIntersectsRect(canvas.elements[i], selectionBox,
                                         hitTol)) {
                 canvas.selectedIndices.push_back(i);
                 if (canvas.elements[i].originalIndex == -1)
@@ -3806,9 +13305,8 @@ int main() {
         }
       }
       if (mouseLeftReleased) {
-        if (!canvas.isBoxSelecting && !canvas.hasMoved &&
-            !canvas.undoStack.empty())
-          canvas.undoStack.pop_back();
+        if (!canvas.isBoxSelecting && !canvas.hasMoved)
+          DiscardPendingUndoState(canvas);
         canvas.isDragging = false;
         canvas.isBoxSelecting = false;
         canvas.boxSelectActive = false;
@@ -3820,7 +13318,7 @@ int main() {
 
       auto pickTopElement = [&]() -> int {
         for (int i = (int)canvas.elements.size() - 1; i >= 0; --i) {
-          if (IsPointOnElement(canvas.elements[i], mouseWorld, hitTol))
+          if (HitSceneElement(canvas, cfg, i, mouseWorld, hitTol))
             return i;
         }
         return -1;
@@ -4028,6 +13526,8 @@ int main() {
       if (mouseLeftDown && !mouseOnStatusBar) {
         Vector2 m = mouseWorld;
         for (int i = (int)canvas.elements.size() - 1; i >= 0; i--) {
+          if (!ElementPickable(canvas, canvas.elements[i]))
+            continue;
           Rectangle b = canvas.elements[i].GetBounds();
           if (CheckCollisionPointRec(
                   m, {b.x - 2, b.y - 2, b.width + 4, b.height + 4})) {
@@ -4043,7 +13543,8 @@ int main() {
         Vector2 m = mouseWorld;
         int hitIndex = -1;
         for (int i = (int)canvas.elements.size() - 1; i >= 0; i--) {
-          if (canvas.elements[i].type != TEXT_MODE)
+          if (canvas.elements[i].type != TEXT_MODE ||
+              !ElementPickable(canvas, canvas.elements[i]))
             continue;
           Rectangle b = canvas.elements[i].GetBounds();
           if (CheckCollisionPointRec(m, b)) {
@@ -4074,6 +13575,7 @@ int main() {
           newEl.color = canvas.drawColor;
           newEl.originalIndex = -1;
           newEl.uniqueID = canvas.nextElementId++;
+          newEl.layer = canvas.activeLayer;
           newEl.text = "";
           newEl.textSize = canvas.textSize;
           canvas.elements.push_back(newEl);
@@ -4165,6 +13667,7 @@ int main() {
           newEl.originalIndex = -1;
 
           newEl.uniqueID = canvas.nextElementId++;
+          newEl.layer = canvas.activeLayer;
 
           if (canvas.mode == PEN_MODE)
             newEl.path = canvas.currentPath;
@@ -4175,16 +13678,18 @@ int main() {
 
     }
 
+    TickLayers(canvas, cfg);
     BeginDrawing();
     ClearBackground(canvas.backgroundColor);
     BeginMode2D(canvas.camera);
     DrawBackgroundPattern(canvas);
+    EndMode2D();
+    DrawLayers(canvas);
+    BeginMode2D(canvas.camera);
 
     for (size_t i = 0; i < canvas.elements.size(); i++) {
-      if (canvas.mode == TEXT_MODE && canvas.isTextEditing &&
-          (int)i == canvas.editingIndex)
+      if (!LayerVisible(canvas, ElementLayer(canvas, canvas.elements[i])))
         continue;
-      DrawElement(canvas.elements[i], canvas.font, canvas.textSize);
       bool isSelected = false;
       for (int idx : canvas.selectedIndices)
         if (idx == (int)i)
@@ -4269,6 +13774,19 @@ int main() {
       }
     }
 
+    DrawFunctionPlots(canvas);
+    DrawLiveStream(canvas);
+
+    for (const auto &board : canvas.artboards) {
+      Rectangle rect = ArtboardRect(canvas, board);
+      Color color = Fade(canvas.uiTextColor, 0.55f);
+      float zoom = canvas.camera.zoom;
+      DrawRectangleLinesEx(rect, 1.5f / zoom, color);
+      DrawTextEx(canvas.font, board.name.c_str(),
+                 {rect.x, rect.y - 18.0f / zoom}, 14.0f / zoom, 1.0f / zoom,
+                 color);
+    }
+
     if (canvas.mode == RESIZE_ROTATE_MODE && !canvas.selectedIndices.empty()) {
       int idx = canvas.selectedIndices.back();
       if (idx >= 0 && idx < (int)canvas.elements.size()) {
@@ -4387,11 +13905,46 @@ int main() {
     string zm = TextFormat("%.2fx", canvas.camera.zoom);
     string sel = TextFormat("%d", (int)canvas.selectedIndices.size());
     string els = TextFormat("%d", (int)canvas.elements.size());
+    string und = FormatByteSize(canvas.undoStore.memoryBytes);
+    if (canvas.undoStore.diskBytes > 0)
+      und += "+" + FormatByteSize(canvas.undoStore.diskBytes) + " disk";
     vector<pair<string, string>> rightPairs = {{"SW: ", sw},
                                                {"  COL: ", col},
                                                {"  Z: ", zm},
                                                {"  SEL: ", sel},
-                                               {"  ELS: ", els}};
+                                               {"  ELS: ", els},
+                                               {"  UNDO: ", und}};
+    int pendingExports = PendingExports(canvas);
+    int tiledPercent = TiledExportPercent(canvas);
+    int timelapsePercent = TimelapsePercent(canvas);
+    int artboardPercent = ArtboardExportPercent(canvas);
+    if (timelapsePercent >= 0)
+      rightPairs.push_back(
+          {"  TIMELAPSE: ", to_string(timelapsePercent) + "%"});
+    else if (artboardPercent >= 0)
+      rightPairs.push_back({"  ARTBOARDS: ", to_string(artboardPercent) + "%"});
+    else if (tiledPercent >= 0)
+      rightPairs.push_back({"  EXPORT: ", to_string(tiledPercent) + "%"});
+    else if (pendingExports > 0)
+      rightPairs.push_back({"  EXPORT: ", to_string(pendingExports) + " queued"});
+    if (canvas.stream.active)
+      rightPairs.push_back(
+          {"  STREAM: ", TextFormat("%.1fk/s", canvas.stream.rate / 1000.0f)});
+    if (canvas.chunks.active) {
+      int resident = 0;
+      for (const auto &kv : canvas.chunks.tiles)
+        resident += kv.second.resident ? 1 : 0;
+      rightPairs.push_back({"  TILES: ", to_string(resident) + "/" +
+                                             to_string(canvas.chunks.tiles.size())});
+    }
+    if (canvas.autosave.lastSaved != 0) {
+      char clock[16];
+      strftime(clock, sizeof(clock), "%H:%M:%S",
+               localtime(&canvas.autosave.lastSaved));
+      rightPairs.push_back(
+          {"  AUTOSAVE: ",
+           string(clock) + TextFormat(" %.0fms", canvas.autosave.lastDurationMs)});
+    }
     float rightW = 0.0f;
     for (const auto &kv : rightPairs) {
       rightW += MeasureTextEx(canvas.font, kv.first.c_str(), 16, 1.5f).x;
@@ -4435,6 +13988,22 @@ int main() {
     EndDrawing();
     canvas.lastMouseScreen = mouseScreen;
   }
+  RecordUndoState(canvas);
+  CloseUndoSpill(canvas.undoStore);
+  if (canvas.pendingOpen.worker.joinable()) {
+    canvas.pendingOpen.cancel = true;
+    canvas.pendingOpen.worker.join();
+  }
+  FinishAutosave(canvas, true);
+  FinishArtboardExports(canvas, cfg);
+  FinishTiledExports(canvas);
+  FinishTimelapses(canvas);
+  CloseLiveStream(canvas.stream);
+  CloseExports(canvas);
+  CloseChunks(canvas);
+  RemoveAutosave(canvas.savePath);
+  CloseJournal(canvas, true);
+  DetachHistory(canvas);
   if (canvas.ownsFont)
     UnloadFont(canvas.font);
   CloseWindow();
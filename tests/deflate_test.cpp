@@ -0,0 +1,45 @@
+// Round-trips DeflateSegment through raylib's inflater. Build from the repo
+// root with sanitizers to catch reads past the input:
+//   g++ -std=c++17 -g -fsanitize=address,undefined -D_GLIBCXX_SANITIZE_VECTOR \
+//     tests/deflate_test.cpp -lraylib -lGL -lm -lpthread -ldl -lrt \
+//     -o deflate_test && ./deflate_test
+#define main toggle_main
+#include "../main.cpp"
+#undef main
+
+bool RoundTrip(const vector<unsigned char> &input, int level) {
+  vector<unsigned char> data(input); // exact-size buffer for the sanitizers
+  vector<unsigned char> packed;
+  DeflateSegment(data.data(), data.size(), level, packed);
+  packed.push_back(0x03); // final empty fixed-Huffman block
+  packed.push_back(0x00);
+  int size = 0;
+  unsigned char *raw = DecompressData(packed.data(), (int)packed.size(), &size);
+  bool ok = raw && size == (int)input.size() &&
+            memcmp(raw, input.data(), input.size()) == 0;
+  MemFree(raw);
+  return ok;
+}
+
+int main() {
+  mt19937 rng(1);
+  int failures = 0;
+  for (int level : {1, 6, 9}) {
+    for (size_t run : {3, 4, 257, 258, 259, 1000, 70000}) {
+      vector<unsigned char> input(1000);
+      for (auto &b : input)
+        b = (unsigned char)rng();
+      input.insert(input.end(), run, (unsigned char)0xAB);
+      if (!RoundTrip(input, level)) {
+        fprintf(stderr, "level %d run %zu: mismatch\n", level, run);
+        failures++;
+      }
+    }
+    if (!RoundTrip(vector<unsigned char>(100000, 0), level)) {
+      fprintf(stderr, "level %d all zero: mismatch\n", level);
+      failures++;
+    }
+  }
+  printf("%s\n", failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}